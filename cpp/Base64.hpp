@@ -0,0 +1,30 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace margelo::nitro::nitrotor {
+  // Standard base64 with padding (RFC 4648 section 4).
+  inline std::string base64Encode(const uint8_t *data, size_t length) {
+    static constexpr char kAlphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((length + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 3 <= length; i += 3) {
+      uint32_t group = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+      out.push_back(kAlphabet[(group >> 18) & 0x3f]);
+      out.push_back(kAlphabet[(group >> 12) & 0x3f]);
+      out.push_back(kAlphabet[(group >> 6) & 0x3f]);
+      out.push_back(kAlphabet[group & 0x3f]);
+    }
+    if (i < length) {
+      uint32_t group = data[i] << 16 | (i + 1 < length ? data[i + 1] << 8 : 0);
+      out.push_back(kAlphabet[(group >> 18) & 0x3f]);
+      out.push_back(kAlphabet[(group >> 12) & 0x3f]);
+      out.push_back(i + 1 < length ? kAlphabet[(group >> 6) & 0x3f] : '=');
+      out.push_back('=');
+    }
+    return out;
+  }
+} // namespace margelo::nitro::nitrotor
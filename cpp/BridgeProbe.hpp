@@ -0,0 +1,566 @@
+#pragma once
+#include "HybridTorSpec.hpp"
+#include "tor_ffi.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <optional>
+#include <poll.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // Parses an IP literal with port, "192.0.2.1:443" or "[2001:db8::1]:443". Host names are
+  // rejected, resolving them would leak which bridge we are about to use.
+  inline bool parseSocketAddress(std::string_view text, sockaddr_storage &address,
+                                 socklen_t &length) {
+    std::string host;
+    std::string_view port;
+    if (!text.empty() && text.front() == '[') {
+      auto close = text.find(']');
+      if (close == std::string_view::npos || close + 1 >= text.size() || text[close + 1] != ':') {
+        return false;
+      }
+      host = std::string(text.substr(1, close - 1));
+      port = text.substr(close + 2);
+    } else {
+      auto colon = text.rfind(':');
+      if (colon == std::string_view::npos) {
+        return false;
+      }
+      host = std::string(text.substr(0, colon));
+      port = text.substr(colon + 1);
+    }
+
+    addrinfo hints{};
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = nullptr;
+    if (port.empty() ||
+        getaddrinfo(host.c_str(), std::string(port).c_str(), &hints, &result) != 0) {
+      return false;
+    }
+    std::memcpy(&address, result->ai_addr, result->ai_addrlen);
+    length = static_cast<socklen_t>(result->ai_addrlen);
+    freeaddrinfo(result);
+    return true;
+  }
+
+  // A bridge line in torrc syntax, with or without the leading "Bridge" keyword:
+  //
+  //   [transport] address:port [fingerprint] [key=value ...]
+  struct BridgeLine {
+    std::string transport;
+    sockaddr_storage address{};
+    socklen_t address_length = 0;
+    // key=value arguments joined for the pluggable transport's SOCKS handshake.
+    std::string args;
+
+    // `line` without a leading "Bridge" keyword and whitespace, the form `configure_bridges`
+    // expects.
+    static std::string_view withoutKeyword(std::string_view line) {
+      auto start = line.find_first_not_of(" \t");
+      line = start == std::string_view::npos ? std::string_view() : line.substr(start);
+      if (line.compare(0, 7, "Bridge ") == 0 || line.compare(0, 7, "Bridge\t") == 0) {
+        line = withoutKeyword(line.substr(7));
+      }
+      return line;
+    }
+
+    static std::optional<BridgeLine> parse(std::string_view line, std::string &error) {
+      line = withoutKeyword(line);
+      std::vector<std::string_view> tokens;
+      size_t start = 0;
+      while (start < line.size()) {
+        auto end = line.find_first_of(" \t", start);
+        if (end == std::string_view::npos) {
+          end = line.size();
+        }
+        if (end > start) {
+          tokens.push_back(line.substr(start, end - start));
+        }
+        start = end + 1;
+      }
+      if (tokens.empty()) {
+        error = "Empty bridge line";
+        return std::nullopt;
+      }
+
+      BridgeLine bridge;
+      size_t index = 0;
+      if (!parseSocketAddress(tokens[0], bridge.address, bridge.address_length)) {
+        bridge.transport = std::string(tokens[0]);
+        index = 1;
+        if (tokens.size() < 2 ||
+            !parseSocketAddress(tokens[1], bridge.address, bridge.address_length)) {
+          error = "Bridge address must be an IP address with port";
+          return std::nullopt;
+        }
+      }
+      for (index++; index < tokens.size(); index++) {
+        auto token = tokens[index];
+        if (token.find('=') == std::string_view::npos) {
+          // The fingerprint, only Tor itself checks it.
+          continue;
+        }
+        if (!bridge.args.empty()) {
+          bridge.args.push_back(';');
+        }
+        // The pluggable transport spec escapes ';' and '\' inside arguments.
+        for (char c : token) {
+          if (c == ';' || c == '\\') {
+            bridge.args.push_back('\\');
+          }
+          bridge.args.push_back(c);
+        }
+      }
+      return bridge;
+    }
+  };
+
+  // Hands bridges and transports to the Rust side, see `configure_bridges` in tor_ffi.h.
+  inline bool configureBridges(const std::vector<std::string> &lines,
+                               const std::vector<PluggableTransport> &transports) {
+    std::vector<const char *> line_pointers;
+    line_pointers.reserve(lines.size());
+    for (const auto &line : lines) {
+      line_pointers.push_back(line.c_str());
+    }
+    std::vector<std::vector<const char *>> protocol_pointers;
+    std::vector<tor::TOR_PluggableTransport> ffi_transports;
+    protocol_pointers.reserve(transports.size());
+    for (const auto &transport : transports) {
+      auto &protocols = protocol_pointers.emplace_back();
+      for (const auto &protocol : transport.protocols) {
+        protocols.push_back(protocol.c_str());
+      }
+      ffi_transports.push_back(tor::TOR_PluggableTransport{protocols.data(), protocols.size(),
+                                                           transport.proxy_addr.c_str()});
+    }
+    return tor::configure_bridges(line_pointers.data(), line_pointers.size(),
+                                  ffi_transports.data(), ffi_transports.size());
+  }
+
+  // Probes bridges concurrently before a bootstrap, so it can go through whichever answers first
+  // instead of Tor trying them one by one with long timeouts. The first answer is held back for
+  // kFirstGraceMs so bridges answering right after it are there for Tor to fall back to.
+  //
+  // Plain bridges are probed with a TCP connect. Bridges of a pluggable transport are probed
+  // through the transport's SOCKS5 proxy, whose CONNECT only succeeds once the transport reached
+  // the bridge and completed its own handshake. All probes share one thread and poll().
+  class BridgeProber : public std::enable_shared_from_this<BridgeProber> {
+  public:
+    using Clock = std::chrono::steady_clock;
+    // Index of the first reachable bridge, or nullopt once every probe failed.
+    using FirstCallback = std::function<void(std::optional<size_t>)>;
+    using DoneCallback = std::function<void()>;
+
+    static constexpr double kDefaultTimeoutMs = 10000;
+    static constexpr double kDefaultMaxParallel = 16;
+    static constexpr std::chrono::milliseconds kFirstGraceMs{500};
+
+    explicit BridgeProber(const BridgeConfig &config)
+        : _transports(config.transports.value_or(std::vector<PluggableTransport>())),
+          _timeout(static_cast<int64_t>(config.probe_timeout_ms.value_or(kDefaultTimeoutMs))),
+          _maxParallel(static_cast<size_t>(
+              std::max(1.0, config.max_parallel_probes.value_or(kDefaultMaxParallel)))) {
+      _probes.reserve(config.bridges.size());
+      for (const auto &line : config.bridges) {
+        _probes.emplace_back(line);
+      }
+    }
+
+    const std::vector<PluggableTransport> &transports() const { return _transports; }
+
+    // Starts probing on a background thread. `on_first` fires once the outcome for the bootstrap
+    // is known: kFirstGraceMs after the first bridge answered, when every probe finished if that
+    // is earlier. `on_done` fires once every probe finished.
+    void start(FirstCallback on_first, DoneCallback on_done = nullptr) {
+      _onFirst = std::move(on_first);
+      _onDone = std::move(on_done);
+      std::thread([self = shared_from_this()]() { self->run(); }).detach();
+    }
+
+    std::vector<BridgeProbeResult> results() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::vector<BridgeProbeResult> results;
+      results.reserve(_probes.size());
+      for (const auto &probe : _probes) {
+        results.emplace_back(probe.line, probe.status, probe.connect_ms, probe.error);
+      }
+      return results;
+    }
+
+    // Reachable bridges so far, fastest first, for `configure_bridges`.
+    std::vector<std::string> reachableLines() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::vector<const Probe *> reachable;
+      for (const auto &probe : _probes) {
+        if (probe.status == BridgeProbeStatus::REACHABLE) {
+          reachable.push_back(&probe);
+        }
+      }
+      std::stable_sort(reachable.begin(), reachable.end(), [](const Probe *a, const Probe *b) {
+        return a->connect_ms < b->connect_ms;
+      });
+      std::vector<std::string> lines;
+      for (const auto *probe : reachable) {
+        lines.emplace_back(BridgeLine::withoutKeyword(probe->line));
+      }
+      return lines;
+    }
+
+    // "line: error" of every failed probe, for error messages.
+    std::string failureSummary() const {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::string summary;
+      for (const auto &probe : _probes) {
+        if (probe.status == BridgeProbeStatus::UNREACHABLE) {
+          summary += summary.empty() ? "" : "; ";
+          summary += probe.line + ": " + probe.error;
+        }
+      }
+      return summary;
+    }
+
+  private:
+    enum class Step { Queued, Connecting, Greeting, Authenticating, Requesting, Done };
+
+    struct Probe {
+      explicit Probe(std::string bridge_line) : line(std::move(bridge_line)) {}
+
+      std::string line;
+      int fd = -1;
+      Step step = Step::Queued;
+      // SOCKS bytes still to send and the size of the reply awaited.
+      std::string output;
+      size_t output_offset = 0;
+      uint8_t input[4];
+      size_t input_size = 0;
+      size_t expected = 0;
+      BridgeLine bridge;
+      bool socks = false;
+      Clock::time_point started;
+      // Guarded by _mutex, read by results().
+      BridgeProbeStatus status = BridgeProbeStatus::PENDING;
+      double connect_ms = 0;
+      std::string error;
+    };
+
+    void run() {
+      size_t next = 0;
+      size_t active = 0;
+      std::vector<pollfd> fds;
+      std::vector<Probe *> polled;
+      while (true) {
+        while (active < _maxParallel && next < _probes.size()) {
+          auto &probe = _probes[next++];
+          launch(probe);
+          if (probe.step != Step::Done) {
+            active++;
+          }
+        }
+        if (active == 0) {
+          break;
+        }
+
+        fds.clear();
+        polled.clear();
+        auto now = Clock::now();
+        auto wait = _timeout;
+        if (_first.has_value() && !_notified) {
+          auto grace = kFirstGraceMs - std::chrono::duration_cast<std::chrono::milliseconds>(
+                                           now - _firstAt);
+          if (grace.count() <= 0) {
+            notifyFirst(_first);
+          } else {
+            wait = std::min(wait, grace);
+          }
+        }
+        for (auto &probe : _probes) {
+          if (probe.step == Step::Queued || probe.step == Step::Done) {
+            continue;
+          }
+          auto remaining =
+              _timeout - std::chrono::duration_cast<std::chrono::milliseconds>(now - probe.started);
+          if (remaining.count() <= 0) {
+            fail(probe, "Timed out");
+            active--;
+            continue;
+          }
+          wait = std::min(wait, remaining);
+          bool writing =
+              probe.step == Step::Connecting || probe.output_offset < probe.output.size();
+          fds.push_back(pollfd{probe.fd, static_cast<short>(writing ? POLLOUT : POLLIN), 0});
+          polled.push_back(&probe);
+        }
+        if (fds.empty()) {
+          continue;
+        }
+
+        if (poll(fds.data(), fds.size(), static_cast<int>(wait.count())) < 0 && errno != EINTR) {
+          for (auto *probe : polled) {
+            fail(*probe, std::string("poll failed: ") + std::strerror(errno));
+          }
+          active -= polled.size();
+          continue;
+        }
+        for (size_t i = 0; i < fds.size(); i++) {
+          if (fds[i].revents != 0) {
+            advance(*polled[i], fds[i].revents);
+            if (polled[i]->step == Step::Done) {
+              active--;
+            }
+          }
+        }
+      }
+
+      notifyFirst(_first);
+      // The callbacks usually hold the owner of this prober, which may hold it in turn.
+      auto on_done = std::move(_onDone);
+      _onFirst = nullptr;
+      if (on_done) {
+        on_done();
+      }
+    }
+
+    const PluggableTransport *transportFor(const std::string &name) const {
+      for (const auto &transport : _transports) {
+        if (std::find(transport.protocols.begin(), transport.protocols.end(), name) !=
+            transport.protocols.end()) {
+          return &transport;
+        }
+      }
+      return nullptr;
+    }
+
+    void launch(Probe &probe) {
+      probe.started = Clock::now();
+      std::string error;
+      auto bridge = BridgeLine::parse(probe.line, error);
+      if (!bridge.has_value()) {
+        fail(probe, error);
+        return;
+      }
+      probe.bridge = std::move(bridge.value());
+
+      sockaddr_storage target = probe.bridge.address;
+      socklen_t target_length = probe.bridge.address_length;
+      if (!probe.bridge.transport.empty()) {
+        const auto *transport = transportFor(probe.bridge.transport);
+        if (transport == nullptr) {
+          fail(probe, "No transport configured for " + probe.bridge.transport);
+          return;
+        }
+        if (!parseSocketAddress(transport->proxy_addr, target, target_length)) {
+          fail(probe, "Invalid proxy_addr of transport " + probe.bridge.transport);
+          return;
+        }
+        probe.socks = true;
+      }
+
+      probe.fd = socket(target.ss_family, SOCK_STREAM, 0);
+      if (probe.fd < 0) {
+        fail(probe, std::string("socket failed: ") + std::strerror(errno));
+        return;
+      }
+      fcntl(probe.fd, F_SETFL, fcntl(probe.fd, F_GETFL) | O_NONBLOCK);
+      if (connect(probe.fd, reinterpret_cast<sockaddr *>(&target), target_length) == 0) {
+        onConnected(probe);
+      } else if (errno == EINPROGRESS) {
+        probe.step = Step::Connecting;
+      } else {
+        fail(probe, std::strerror(errno));
+      }
+    }
+
+    void onConnected(Probe &probe) {
+      if (!probe.socks) {
+        succeed(probe);
+        return;
+      }
+      // Greeting, with username/password authentication if there are transport arguments.
+      probe.output = {0x05, 0x01, static_cast<char>(probe.bridge.args.empty() ? 0x00 : 0x02)};
+      expect(probe, Step::Greeting, 2);
+    }
+
+    void expect(Probe &probe, Step step, size_t bytes) {
+      probe.step = step;
+      probe.output_offset = 0;
+      probe.input_size = 0;
+      probe.expected = bytes;
+    }
+
+    void advance(Probe &probe, short revents) {
+      if (probe.step == Step::Connecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(probe.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+          fail(probe, std::strerror(error));
+        } else {
+          onConnected(probe);
+        }
+        return;
+      }
+
+      if (probe.output_offset < probe.output.size()) {
+        auto sent = send(probe.fd, probe.output.data() + probe.output_offset,
+                         probe.output.size() - probe.output_offset, MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+          fail(probe, std::strerror(errno));
+        } else if (sent > 0) {
+          probe.output_offset += static_cast<size_t>(sent);
+        }
+        return;
+      }
+
+      if (revents & (POLLERR | POLLHUP)) {
+        fail(probe, "Transport closed the connection");
+        return;
+      }
+      auto received =
+          recv(probe.fd, probe.input + probe.input_size, probe.expected - probe.input_size, 0);
+      if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR)) {
+        fail(probe, "Transport closed the connection");
+        return;
+      }
+      if (received < 0) {
+        return;
+      }
+      probe.input_size += static_cast<size_t>(received);
+      if (probe.input_size == probe.expected) {
+        onReply(probe);
+      }
+    }
+
+    void onReply(Probe &probe) {
+      const auto *reply = probe.input;
+      switch (probe.step) {
+      case Step::Greeting:
+        if (reply[0] != 0x05 || reply[1] != probe.output[2]) {
+          fail(probe, "Transport rejected the SOCKS greeting");
+        } else if (reply[1] == 0x02) {
+          sendAuthentication(probe);
+        } else {
+          sendConnect(probe);
+        }
+        break;
+      case Step::Authenticating:
+        if (reply[1] != 0x00) {
+          fail(probe, "Transport rejected the bridge arguments");
+        } else {
+          sendConnect(probe);
+        }
+        break;
+      case Step::Requesting:
+        // The rest of the reply (the bound address) is not needed.
+        if (reply[0] != 0x05 || reply[1] != 0x00) {
+          fail(probe, "Transport could not reach the bridge (SOCKS error " +
+                          std::to_string(reply[1]) + ")");
+        } else {
+          succeed(probe);
+        }
+        break;
+      default:
+        break;
+      }
+    }
+
+    // Arguments go in username and password, split at 255 bytes. The password must not be
+    // empty, a single NUL stands in for it.
+    void sendAuthentication(Probe &probe) {
+      const auto &args = probe.bridge.args;
+      auto username = args.substr(0, 255);
+      auto password = args.size() > 255 ? args.substr(255, 255) : std::string(1, '\0');
+      probe.output.assign(1, 0x01);
+      probe.output.push_back(static_cast<char>(username.size()));
+      probe.output += username;
+      probe.output.push_back(static_cast<char>(password.size()));
+      probe.output += password;
+      expect(probe, Step::Authenticating, 2);
+    }
+
+    void sendConnect(Probe &probe) {
+      probe.output = {0x05, 0x01, 0x00};
+      const auto &address = probe.bridge.address;
+      uint16_t port;
+      if (address.ss_family == AF_INET6) {
+        const auto &ipv6 = reinterpret_cast<const sockaddr_in6 &>(address);
+        probe.output.push_back(0x04);
+        probe.output.append(reinterpret_cast<const char *>(&ipv6.sin6_addr), 16);
+        port = ipv6.sin6_port;
+      } else {
+        const auto &ipv4 = reinterpret_cast<const sockaddr_in &>(address);
+        probe.output.push_back(0x01);
+        probe.output.append(reinterpret_cast<const char *>(&ipv4.sin_addr), 4);
+        port = ipv4.sin_port;
+      }
+      // Already in network byte order.
+      probe.output.append(reinterpret_cast<const char *>(&port), 2);
+      expect(probe, Step::Requesting, 4);
+    }
+
+    void succeed(Probe &probe) {
+      size_t index = static_cast<size_t>(&probe - _probes.data());
+      finish(probe, BridgeProbeStatus::REACHABLE, "");
+      if (!_first.has_value()) {
+        _first = index;
+        _firstAt = Clock::now();
+      }
+    }
+
+    void fail(Probe &probe, const std::string &error) {
+      finish(probe, BridgeProbeStatus::UNREACHABLE, error);
+    }
+
+    void finish(Probe &probe, BridgeProbeStatus status, const std::string &error) {
+      if (probe.fd >= 0) {
+        close(probe.fd);
+        probe.fd = -1;
+      }
+      probe.step = Step::Done;
+      std::lock_guard<std::mutex> lock(_mutex);
+      probe.status = status;
+      probe.error = error;
+      probe.connect_ms = static_cast<double>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - probe.started)
+              .count());
+    }
+
+    void notifyFirst(std::optional<size_t> index) {
+      if (_notified) {
+        return;
+      }
+      _notified = true;
+      if (_onFirst) {
+        _onFirst(index);
+      }
+    }
+
+    mutable std::mutex _mutex;
+    std::vector<Probe> _probes;
+    const std::vector<PluggableTransport> _transports;
+    const std::chrono::milliseconds _timeout;
+    const size_t _maxParallel;
+    FirstCallback _onFirst;
+    DoneCallback _onDone;
+    // Only touched by the probing thread.
+    std::optional<size_t> _first;
+    Clock::time_point _firstAt;
+    bool _notified = false;
+  };
+} // namespace margelo::nitro::nitrotor
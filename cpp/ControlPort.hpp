@@ -0,0 +1,813 @@
+#pragma once
+#include "HybridTorControlSpec.hpp"
+#include "OnionCrypto.hpp"
+#include "Sha256.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <netdb.h>
+#include <optional>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  struct ControlOptions {
+    // "host:port", "[v6 host]:port" or "unix:/path", as in StartTorResponse.control.
+    std::string endpoint;
+    // Used for HASHEDPASSWORD. Without it NULL, SAFECOOKIE or COOKIE are tried in that order.
+    std::optional<std::string> password;
+    // Overrides the COOKIEFILE announced by PROTOCOLINFO.
+    std::optional<std::string> cookie_path;
+    // Deadline for connecting and authenticating.
+    uint64_t timeout_ms;
+    // Events are held back this long after the first one of a batch, or until max_event_batch
+    // of them are queued, and then delivered together.
+    uint64_t event_batch_ms;
+    size_t max_event_batch;
+  };
+
+  // Events of a ControlClient, called on the connection's I/O thread.
+  class ControlListener {
+  public:
+    virtual ~ControlListener() = default;
+    virtual void onConnected() = 0;
+    virtual void onConnectFailed(const std::string &error) = 0;
+    virtual void onEvents(std::vector<ControlEvent> &&events) = 0;
+    // Once per connection that reached onConnected. `error` is empty after close().
+    virtual void onClose(const std::string &error) = 0;
+  };
+
+  // Client of Tor's control protocol (control-spec.txt) on the endpoint reported as
+  // StartTorResponse.control.
+  //
+  // One I/O thread owns the socket. It authenticates once, then writes every queued command
+  // back to back without waiting for replies. Tor answers commands in order, so replies are
+  // matched to their batch by position; a batch of N commands costs one round trip instead of N.
+  // Asynchronous events (650 replies) are parsed on the same thread and coalesced into batches,
+  // so a busy circuit or bandwidth stream does not cross into JS one event at a time.
+  class ControlClient : public std::enable_shared_from_this<ControlClient> {
+  public:
+    enum class State { Connecting, Open, Closed };
+
+    // Replies of one submit() in command order, or an error if the connection failed first.
+    using Completion = std::function<void(std::vector<ControlReply> &&, const std::string &)>;
+
+    ControlClient(ControlOptions options, std::shared_ptr<ControlListener> listener)
+        : _options(std::move(options)), _listener(std::move(listener)) {
+      int wake[2];
+      if (pipe(wake) != 0) {
+        throw std::runtime_error("Failed to create control connection wake pipe");
+      }
+      _wakeRead = wake[0];
+      _wakeWrite = wake[1];
+      fcntl(_wakeRead, F_SETFL, O_NONBLOCK);
+      fcntl(_wakeWrite, F_SETFL, O_NONBLOCK);
+    }
+
+    ~ControlClient() {
+      ::close(_wakeRead);
+      ::close(_wakeWrite);
+    }
+
+    ControlClient(const ControlClient &) = delete;
+    ControlClient &operator=(const ControlClient &) = delete;
+
+    // Connects and authenticates on the I/O thread, reported through onConnected or
+    // onConnectFailed.
+    void connect() {
+      auto self = shared_from_this();
+      std::thread([self]() { self->run(); }).detach();
+    }
+
+    // Queues `commands` to be written in one go. Throws if a command spans lines or the
+    // connection is not open.
+    void submit(std::vector<std::string> commands, Completion completion) {
+      std::string wire;
+      for (const auto &command : commands) {
+        if (command.empty() || command.find_first_of("\r\n") != std::string::npos) {
+          throw std::invalid_argument("Control commands must be single, non-empty lines");
+        }
+        wire += command;
+        wire += "\r\n";
+      }
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_state.load() != State::Open || _closeRequested) {
+          throw std::runtime_error("Control connection is not open");
+        }
+        _queue.push_back(Batch{std::move(wire), commands.size(), {}, std::move(completion)});
+      }
+      wake();
+    }
+
+    // Replies still owed are failed, queued events are delivered first.
+    void close() {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closeRequested = true;
+      }
+      wake();
+    }
+
+    State state() const { return _state.load(); }
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    // Longest line accepted from Tor. Data replies (e.g. GETINFO ns/all) may be large in total
+    // but consist of short lines.
+    static constexpr size_t kMaxLineBytes = 1024 * 1024;
+    static constexpr size_t kCookieBytes = 32;
+    static constexpr size_t kNonceBytes = 32;
+
+    struct Batch {
+      std::string wire;
+      size_t count;
+      std::vector<ControlReply> replies;
+      Completion completion;
+    };
+
+    void wake() {
+      char byte = 1;
+      // A full pipe already guarantees a wake up.
+      (void)!write(_wakeWrite, &byte, 1);
+    }
+
+    void run() {
+      std::string error;
+      _deadline = Clock::now() + std::chrono::milliseconds(_options.timeout_ms);
+      if (!open(error) || !authenticate(error)) {
+        if (_fd >= 0) {
+          ::close(_fd);
+          _fd = -1;
+        }
+        _state.store(State::Closed);
+        _listener->onConnectFailed(error);
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _state.store(State::Open);
+      }
+      _listener->onConnected();
+
+      while (error.empty()) {
+        drainWakePipe();
+        if (!takeRequests()) {
+          break;
+        }
+        pollfd fds[2] = {{_fd, POLLIN, 0}, {_wakeRead, POLLIN, 0}};
+        if (_outOffset < _out.size()) {
+          fds[0].events |= POLLOUT;
+        }
+        if (poll(fds, 2, eventTimeout()) < 0 && errno != EINTR) {
+          error = "poll failed";
+          break;
+        }
+        if (fds[0].revents & POLLOUT) {
+          flush(error);
+        }
+        if (error.empty() && fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+          receive(error);
+        }
+        while (error.empty() && !_replies.empty()) {
+          dispatch(error);
+        }
+        if (error.empty() && _eof) {
+          error = "Control connection closed by Tor";
+        }
+        if (!_events.empty() && Clock::now() >= _firstEventAt + batchInterval()) {
+          deliverEvents();
+        }
+      }
+      terminate(error);
+    }
+
+    // Moves queued batches to the write buffer. Returns false once close() was called.
+    bool takeRequests() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_closeRequested) {
+        return false;
+      }
+      while (!_queue.empty()) {
+        _out += _queue.front().wire;
+        _queue.front().wire.clear();
+        _awaiting.push_back(std::move(_queue.front()));
+        _queue.pop_front();
+      }
+      return true;
+    }
+
+    void terminate(const std::string &error) {
+      ::close(_fd);
+      _fd = -1;
+      std::deque<Batch> failed;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _state.store(State::Closed);
+        failed.swap(_awaiting);
+        std::move(_queue.begin(), _queue.end(), std::back_inserter(failed));
+        _queue.clear();
+      }
+      if (!_events.empty()) {
+        deliverEvents();
+      }
+      for (auto &batch : failed) {
+        batch.completion({}, error.empty() ? "Control connection closed" : error);
+      }
+      _listener->onClose(error);
+    }
+
+    std::chrono::milliseconds batchInterval() const {
+      return std::chrono::milliseconds(_options.event_batch_ms);
+    }
+
+    int eventTimeout() const {
+      if (_events.empty()) {
+        return -1;
+      }
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          _firstEventAt + batchInterval() - Clock::now());
+      return static_cast<int>(std::max<int64_t>(0, left.count()));
+    }
+
+    void deliverEvents() {
+      std::vector<ControlEvent> events;
+      events.swap(_events);
+      _listener->onEvents(std::move(events));
+    }
+
+    void drainWakePipe() {
+      char buffer[64];
+      while (read(_wakeRead, buffer, sizeof(buffer)) > 0) {
+      }
+    }
+
+    void flush(std::string &error) {
+      while (_outOffset < _out.size()) {
+        ssize_t written = ::send(_fd, _out.data() + _outOffset, _out.size() - _outOffset,
+                                 MSG_NOSIGNAL);
+        if (written < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            error = "Control connection write failed: " + std::string(strerror(errno));
+          }
+          break;
+        }
+        _outOffset += static_cast<size_t>(written);
+      }
+      if (_outOffset == _out.size()) {
+        _out.clear();
+        _outOffset = 0;
+      }
+    }
+
+    // Reads what is available and parses complete replies into _replies. Sets _eof once Tor
+    // closed the connection, after parsing what it sent before, e.g. a failed authentication.
+    void receive(std::string &error) {
+      char buffer[16 * 1024];
+      while (true) {
+        ssize_t received = recv(_fd, buffer, sizeof(buffer), 0);
+        if (received == 0) {
+          _eof = true;
+          break;
+        }
+        if (received < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            error = "Control connection read failed: " + std::string(strerror(errno));
+          }
+          break;
+        }
+        _in.append(buffer, static_cast<size_t>(received));
+      }
+      parseLines(error);
+    }
+
+    // Reply syntax of control-spec section 2.3: "NNN-" continues a reply, "NNN+" is followed
+    // by a data block ending with a "." line, "NNN " ends the reply.
+    void parseLines(std::string &error) {
+      size_t start = 0;
+      while (true) {
+        size_t end = _in.find('\n', start);
+        if (end == std::string::npos) {
+          break;
+        }
+        std::string_view line(_in.data() + start, end - start);
+        if (!line.empty() && line.back() == '\r') {
+          line.remove_suffix(1);
+        }
+        start = end + 1;
+        if (!parseLine(line)) {
+          error = "Malformed control reply";
+          return;
+        }
+      }
+      _in.erase(0, start);
+      if (_in.size() > kMaxLineBytes) {
+        error = "Control reply line too long";
+      }
+    }
+
+    bool parseLine(std::string_view line) {
+      if (_inData) {
+        if (line == ".") {
+          _inData = false;
+          return true;
+        }
+        if (line.substr(0, 2) == "..") {
+          line.remove_prefix(1);
+        }
+        auto &data = _partial.lines.back();
+        data += '\n';
+        data.append(line);
+        return true;
+      }
+      auto digit = [](char c) { return c >= '0' && c <= '9'; };
+      if (line.size() < 4 || !std::all_of(line.begin(), line.begin() + 3, digit)) {
+        return false;
+      }
+      int status = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+      if (_partial.lines.empty()) {
+        _partial.status = status;
+      } else if (status != _partial.status) {
+        return false;
+      }
+      _partial.lines.emplace_back(line.substr(4));
+      switch (line[3]) {
+      case '-':
+        return true;
+      case '+':
+        _inData = true;
+        return true;
+      case ' ':
+        _replies.push_back(std::move(_partial));
+        _partial = ControlReply();
+        return true;
+      default:
+        return false;
+      }
+    }
+
+    // Hands the oldest complete reply to its batch, or parses it as an event.
+    void dispatch(std::string &error) {
+      auto reply = std::move(_replies.front());
+      _replies.pop_front();
+      if (reply.status >= 600 && reply.status < 700) {
+        if (auto event = parseEvent(reply.lines.front())) {
+          if (_events.empty()) {
+            _firstEventAt = Clock::now();
+          }
+          _events.push_back(std::move(*event));
+          if (_events.size() >= _options.max_event_batch) {
+            deliverEvents();
+          }
+        }
+        return;
+      }
+      if (_awaiting.empty()) {
+        error = "Unexpected control reply";
+        return;
+      }
+      auto &batch = _awaiting.front();
+      batch.replies.push_back(std::move(reply));
+      if (batch.replies.size() == batch.count) {
+        auto done = std::move(batch);
+        _awaiting.pop_front();
+        done.completion(std::move(done.replies), "");
+      }
+    }
+
+    // Splits an event or reply line into words, keeping quoted KEY="a b" values together.
+    static std::vector<std::string> splitWords(std::string_view line) {
+      std::vector<std::string> words;
+      size_t i = 0;
+      while (i < line.size()) {
+        while (i < line.size() && line[i] == ' ') {
+          i++;
+        }
+        if (i == line.size()) {
+          break;
+        }
+        std::string word;
+        bool quoted = false;
+        for (; i < line.size() && (quoted || line[i] != ' '); i++) {
+          if (quoted && line[i] == '\\' && i + 1 < line.size()) {
+            word.push_back(line[i]);
+            word.push_back(line[++i]);
+          } else {
+            quoted = line[i] == '"' ? !quoted : quoted;
+            word.push_back(line[i]);
+          }
+        }
+        words.push_back(std::move(word));
+      }
+      return words;
+    }
+
+    // Value of a QuotedString (control-spec section 2.1.1), or `value` itself if unquoted.
+    static std::string unquote(std::string_view value) {
+      if (value.size() < 2 || value.front() != '"' || value.back() != '"') {
+        return std::string(value);
+      }
+      std::string result;
+      for (size_t i = 1; i + 1 < value.size(); i++) {
+        if (value[i] == '\\' && i + 2 < value.size()) {
+          i++;
+        }
+        result.push_back(value[i]);
+      }
+      return result;
+    }
+
+    static std::string quote(std::string_view value) {
+      std::string result = "\"";
+      for (char c : value) {
+        if (c == '"' || c == '\\') {
+          result.push_back('\\');
+        }
+        result.push_back(c);
+      }
+      return result + "\"";
+    }
+
+    static std::unordered_map<std::string, std::string>
+    keywordArguments(const std::vector<std::string> &words, size_t first) {
+      std::unordered_map<std::string, std::string> arguments;
+      for (size_t i = first; i < words.size(); i++) {
+        auto equals = words[i].find('=');
+        if (equals != std::string::npos) {
+          arguments[words[i].substr(0, equals)] =
+              unquote(std::string_view(words[i]).substr(equals + 1));
+        }
+      }
+      return arguments;
+    }
+
+    static std::vector<std::string> splitPath(const std::string &path) {
+      std::vector<std::string> relays;
+      size_t start = 0;
+      while (start <= path.size()) {
+        size_t comma = std::min(path.find(',', start), path.size());
+        if (comma > start) {
+          relays.push_back(path.substr(start, comma - start));
+        }
+        start = comma + 1;
+      }
+      return relays;
+    }
+
+    static bool isPositional(const std::vector<std::string> &words, size_t index) {
+      return index < words.size() && words[index].find('=') == std::string::npos;
+    }
+
+    // Parses the first line of a 650 reply, nullopt for event types other than the four
+    // subscribe() offers.
+    static std::optional<ControlEvent> parseEvent(std::string_view line) {
+      auto words = splitWords(line);
+      if (words.empty()) {
+        return std::nullopt;
+      }
+      auto at = [&words](size_t index) {
+        return isPositional(words, index) ? words[index] : std::string();
+      };
+      const auto &type = words[0];
+      if (type == "CIRC") {
+        // CIRC CircuitID CircStatus [Path] [KEYWORD=value ...]
+        bool has_path = isPositional(words, 3);
+        return ControlEvent(ControlEventType::CIRC, at(1), at(2), at(1), "",
+                            has_path ? splitPath(words[3]) : std::vector<std::string>(), 0, 0,
+                            keywordArguments(words, has_path ? 4 : 3));
+      }
+      if (type == "STREAM") {
+        // STREAM StreamID StreamStatus CircuitID Target [KEYWORD=value ...]
+        return ControlEvent(ControlEventType::STREAM, at(1), at(2), at(3), at(4), {}, 0, 0,
+                            keywordArguments(words, 5));
+      }
+      if (type == "BW") {
+        // BW BytesRead BytesWritten [KEYWORD=value ...]
+        return ControlEvent(ControlEventType::BW, "", "", "", "", {}, toNumber(at(1)),
+                            toNumber(at(2)), keywordArguments(words, 3));
+      }
+      if (type == "HS_DESC") {
+        // HS_DESC Action HSAddress AuthType HsDir [DescriptorID] [KEYWORD=value ...]
+        auto arguments = keywordArguments(words, 5);
+        arguments["AUTH_TYPE"] = at(3);
+        if (isPositional(words, 5)) {
+          arguments["DESCRIPTOR_ID"] = words[5];
+        }
+        auto hs_dir = at(4);
+        return ControlEvent(ControlEventType::HS_DESC, "", at(1), "", at(2),
+                            hs_dir.empty() || hs_dir == "UNKNOWN" ? std::vector<std::string>()
+                                                                   : std::vector{hs_dir},
+                            0, 0, std::move(arguments));
+      }
+      return std::nullopt;
+    }
+
+    static double toNumber(const std::string &value) {
+      try {
+        return std::stod(value);
+      } catch (const std::exception &) {
+        return 0;
+      }
+    }
+
+    // --- Connecting and authenticating, blocking on the I/O thread until _deadline ---
+
+    int timeLeft() const {
+      auto left =
+          std::chrono::duration_cast<std::chrono::milliseconds>(_deadline - Clock::now());
+      return static_cast<int>(std::max<int64_t>(0, left.count()));
+    }
+
+    bool open(std::string &error) {
+      const auto &endpoint = _options.endpoint;
+      if (endpoint.rfind("unix:", 0) == 0) {
+        sockaddr_un address{};
+        auto path = endpoint.substr(5);
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+          error = "Invalid control socket path";
+          return false;
+        }
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.data(), path.size());
+        return connectTo(AF_UNIX, reinterpret_cast<sockaddr *>(&address), sizeof(address),
+                         error);
+      }
+
+      auto colon = endpoint.rfind(':');
+      std::string host = colon == std::string::npos ? "" : endpoint.substr(0, colon);
+      std::string port = colon == std::string::npos ? "" : endpoint.substr(colon + 1);
+      if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+      }
+      addrinfo hints{};
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = AI_NUMERICSERV;
+      addrinfo *addresses = nullptr;
+      if (host.empty() || port.empty() ||
+          getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+        error = "Invalid control endpoint \"" + endpoint + "\"";
+        return false;
+      }
+      // "localhost" usually yields ::1 before 127.0.0.1 while Tor listens on one of them only,
+      // the error of an address that failed must not outlive a later one that connects.
+      bool connected = false;
+      for (auto *address = addresses; address != nullptr && !connected;
+           address = address->ai_next) {
+        std::string attempt_error;
+        connected =
+            connectTo(address->ai_family, address->ai_addr, address->ai_addrlen, attempt_error);
+        if (!connected) {
+          error = std::move(attempt_error);
+        }
+      }
+      freeaddrinfo(addresses);
+      if (connected) {
+        error.clear();
+      }
+      return connected;
+    }
+
+    bool connectTo(int family, const sockaddr *address, socklen_t length, std::string &error) {
+      // No SOCK_CLOEXEC on Darwin.
+      _fd = socket(family, SOCK_STREAM, 0);
+      if (_fd < 0) {
+        error = "Failed to create control socket";
+        return false;
+      }
+      fcntl(_fd, F_SETFD, FD_CLOEXEC);
+      fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+      if (::connect(_fd, address, length) != 0 && errno != EINPROGRESS) {
+        error = "Failed to connect to the control port: " + std::string(strerror(errno));
+      } else {
+        pollfd writable{_fd, POLLOUT, 0};
+        int socket_error = 0;
+        socklen_t size = sizeof(socket_error);
+        if (poll(&writable, 1, timeLeft()) <= 0) {
+          error = "Timed out connecting to the control port";
+        } else if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &socket_error, &size) != 0 ||
+                   socket_error != 0) {
+          error = "Failed to connect to the control port: " + std::string(strerror(socket_error));
+        } else {
+          return true;
+        }
+      }
+      ::close(_fd);
+      _fd = -1;
+      return false;
+    }
+
+    // Sends one command and waits for its reply.
+    bool roundTrip(const std::string &command, ControlReply &reply, std::string &error) {
+      _out = command + "\r\n";
+      _outOffset = 0;
+      while (error.empty() && !_eof && (_outOffset < _out.size() || _replies.empty())) {
+        pollfd fds{_fd, static_cast<short>(_outOffset < _out.size() ? POLLOUT : POLLIN), 0};
+        if (poll(&fds, 1, timeLeft()) <= 0) {
+          error = "Timed out authenticating to the control port";
+          return false;
+        }
+        if (fds.revents & POLLOUT) {
+          flush(error);
+        } else {
+          receive(error);
+        }
+      }
+      if (error.empty() && _replies.empty()) {
+        error = "Control connection closed by Tor";
+      }
+      if (!error.empty()) {
+        return false;
+      }
+      reply = std::move(_replies.front());
+      _replies.pop_front();
+      return true;
+    }
+
+    static std::string joinLines(const ControlReply &reply) {
+      std::string text;
+      for (const auto &line : reply.lines) {
+        text += (text.empty() ? "" : " ") + line;
+      }
+      return text;
+    }
+
+    bool authenticate(std::string &error) {
+      ControlReply info;
+      if (!roundTrip("PROTOCOLINFO 1", info, error)) {
+        return false;
+      }
+      if (info.status != 250) {
+        error = "PROTOCOLINFO failed: " + joinLines(info);
+        return false;
+      }
+      std::vector<std::string> methods;
+      std::string cookie_file;
+      for (const auto &line : info.lines) {
+        if (line.rfind("AUTH ", 0) != 0) {
+          continue;
+        }
+        auto arguments = keywordArguments(splitWords(line), 1);
+        methods = splitPath(arguments["METHODS"]);
+        cookie_file = arguments["COOKIEFILE"];
+      }
+      auto offers = [&methods](const char *method) {
+        return std::find(methods.begin(), methods.end(), method) != methods.end();
+      };
+      std::string cookie_path = _options.cookie_path.value_or(cookie_file);
+
+      std::string command;
+      if (_options.password.has_value() && offers("HASHEDPASSWORD")) {
+        command = "AUTHENTICATE " + quote(*_options.password);
+      } else if (offers("NULL")) {
+        command = "AUTHENTICATE";
+      } else if ((offers("SAFECOOKIE") || offers("COOKIE")) && !cookie_path.empty()) {
+        std::string cookie;
+        if (!readCookie(cookie_path, cookie)) {
+          error = "Cannot read the control auth cookie at " + cookie_path;
+          return false;
+        }
+        if (offers("SAFECOOKIE")) {
+          if (!safeCookieResponse(cookie, command, error)) {
+            return false;
+          }
+        } else {
+          command = "AUTHENTICATE " + toHex(cookie);
+        }
+      } else {
+        error = "No supported control port authentication method (" + joinLines(info) + ")";
+        return false;
+      }
+
+      ControlReply reply;
+      if (!roundTrip(command, reply, error)) {
+        return false;
+      }
+      if (reply.status != 250) {
+        error = "Control port authentication failed: " + joinLines(reply);
+        return false;
+      }
+      return true;
+    }
+
+    // AUTHCHALLENGE exchange of control-spec section 3.24, proving knowledge of the cookie
+    // without sending it and checking that the port knows it too.
+    bool safeCookieResponse(const std::string &cookie, std::string &command, std::string &error) {
+      std::string client_nonce(kNonceBytes, '\0');
+      secureRandom(client_nonce.data(), client_nonce.size());
+      ControlReply reply;
+      if (!roundTrip("AUTHCHALLENGE SAFECOOKIE " + toHex(client_nonce), reply, error)) {
+        return false;
+      }
+      if (reply.status != 250 || reply.lines.empty()) {
+        error = "AUTHCHALLENGE failed: " + joinLines(reply);
+        return false;
+      }
+      auto arguments = keywordArguments(splitWords(reply.lines.front()), 1);
+      std::string server_hash;
+      std::string server_nonce;
+      if (!fromHex(arguments["SERVERHASH"], server_hash) ||
+          !fromHex(arguments["SERVERNONCE"], server_nonce)) {
+        error = "AUTHCHALLENGE failed: " + joinLines(reply);
+        return false;
+      }
+      auto message = cookie + client_nonce + server_nonce;
+      auto expected = Sha256::hmac(
+          "Tor safe cookie authentication server-to-controller hash", message);
+      if (server_hash.size() != expected.size() ||
+          std::memcmp(server_hash.data(), expected.data(), expected.size()) != 0) {
+        error = "Control port failed the safe cookie challenge";
+        return false;
+      }
+      auto response = Sha256::hmac(
+          "Tor safe cookie authentication controller-to-server hash", message);
+      command = "AUTHENTICATE " + Sha256::toHex(response);
+      return true;
+    }
+
+    static bool readCookie(const std::string &path, std::string &cookie) {
+      std::ifstream file(path, std::ios::binary);
+      if (!file) {
+        return false;
+      }
+      cookie.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+      return cookie.size() == kCookieBytes;
+    }
+
+    static std::string toHex(std::string_view bytes) {
+      static constexpr char kDigits[] = "0123456789ABCDEF";
+      std::string hex;
+      for (unsigned char byte : bytes) {
+        hex.push_back(kDigits[byte >> 4]);
+        hex.push_back(kDigits[byte & 0x0f]);
+      }
+      return hex;
+    }
+
+    static bool fromHex(std::string_view hex, std::string &bytes) {
+      auto digit = [](char c) {
+        return c >= '0' && c <= '9'   ? c - '0'
+               : c >= 'a' && c <= 'f' ? c - 'a' + 10
+               : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                      : -1;
+      };
+      if (hex.empty() || hex.size() % 2 != 0) {
+        return false;
+      }
+      bytes.clear();
+      for (size_t i = 0; i < hex.size(); i += 2) {
+        int high = digit(hex[i]);
+        int low = digit(hex[i + 1]);
+        if (high < 0 || low < 0) {
+          return false;
+        }
+        bytes.push_back(static_cast<char>(high << 4 | low));
+      }
+      return true;
+    }
+
+    ControlOptions _options;
+    std::shared_ptr<ControlListener> _listener;
+    std::atomic<State> _state{State::Connecting};
+    int _fd = -1;
+    int _wakeRead = -1;
+    int _wakeWrite = -1;
+    Clock::time_point _deadline;
+
+    // Shared with callers of submit() and close().
+    std::mutex _mutex;
+    std::deque<Batch> _queue;
+    bool _closeRequested = false;
+
+    // Owned by the I/O thread.
+    std::deque<Batch> _awaiting;
+    std::string _out;
+    size_t _outOffset = 0;
+    std::string _in;
+    ControlReply _partial;
+    bool _inData = false;
+    bool _eof = false;
+    std::deque<ControlReply> _replies;
+    std::vector<ControlEvent> _events;
+    Clock::time_point _firstEventAt;
+  };
+} // namespace margelo::nitro::nitrotor
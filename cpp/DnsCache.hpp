@@ -0,0 +1,249 @@
+#pragma once
+#include "HybridTorSpec.hpp"
+#include "ResponseArena.hpp"
+#include "tor_ffi.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // Addresses of clearnet hosts as resolved by Tor exits, kept for the TTL the exit reported.
+  //
+  // Filled by resolve() (a RESOLVE cell) and by HTTP responses (the address in the exit's
+  // CONNECTED cell). HTTP requests to a cached host connect to the address directly, so the exit
+  // skips its own lookup. Onion services and IP literals are never cached.
+  //
+  // Lookups and answers all belong to the default isolation token 0, requests on other tokens
+  // bypass the cache (see HttpExecutor::updateDns).
+  class DnsCache : public std::enable_shared_from_this<DnsCache> {
+  public:
+    using Callback = std::function<void(ResolveResult &&)>;
+
+    // Address to connect to for `host`, nullopt if there is no live entry.
+    std::optional<std::string> lookup(std::string_view host) {
+      auto name = normalize(host);
+      if (name.empty()) {
+        return std::nullopt;
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto it = _entries.find(name);
+      if (it == _entries.end() || it->second.expires <= Clock::now()) {
+        return std::nullopt;
+      }
+      return preferred(it->second.addresses);
+    }
+
+    void store(std::string_view host, std::vector<std::string> &&addresses, uint64_t ttl_s) {
+      auto name = normalize(host);
+      if (name.empty() || addresses.empty() || ttl_s == 0) {
+        return;
+      }
+      auto expires = Clock::now() + std::chrono::seconds(std::min(ttl_s, kMaxTtlSeconds));
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto it = _entries.find(name);
+      if (it == _entries.end()) {
+        evictIfFull();
+        it = _entries.emplace(std::move(name), Entry{}).first;
+      }
+      it->second.addresses = std::move(addresses);
+      it->second.expires = expires;
+    }
+
+    // Drops `host` after connecting to its cached address failed, the next request resolves it
+    // at the exit again.
+    void evict(std::string_view host) {
+      auto name = normalize(host);
+      std::lock_guard<std::mutex> lock(_mutex);
+      _entries.erase(name);
+    }
+
+    // Answers from the cache or with a RESOLVE cell. Concurrent calls for the same host share one
+    // lookup. `callback` runs on a Rust runtime thread, or right away on a cache hit.
+    void resolve(std::string_view host, uint64_t timeout_ms, Callback &&callback) {
+      auto name = normalize(host);
+      if (name.empty()) {
+        callback(ResolveResult(std::string(host), {}, 0, false,
+                               "Not a host name that can be resolved at an exit"));
+        return;
+      }
+      std::optional<ResolveResult> cached;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto now = Clock::now();
+        auto it = _entries.find(name);
+        if (it != _entries.end() && it->second.expires > now) {
+          auto remaining = std::chrono::ceil<std::chrono::seconds>(it->second.expires - now);
+          cached.emplace(name, it->second.addresses, static_cast<double>(remaining.count()), true,
+                         "");
+        } else {
+          auto &waiting = _inflight[name];
+          waiting.push_back(std::move(callback));
+          if (waiting.size() > 1) {
+            return;
+          }
+        }
+      }
+      if (cached.has_value()) {
+        callback(std::move(*cached));
+        return;
+      }
+      auto *context = new LookupContext{shared_from_this(), name};
+      tor::resolve_async(name.c_str(), 0, static_cast<unsigned long>(timeout_ms), &onResolved,
+                         context);
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _entries.clear();
+    }
+
+    // Drops expired entries, or everything when `all` is set.
+    void trim(bool all) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (all) {
+        _entries.clear();
+        return;
+      }
+      auto now = Clock::now();
+      for (auto it = _entries.begin(); it != _entries.end();) {
+        it = it->second.expires <= now ? _entries.erase(it) : std::next(it);
+      }
+    }
+
+    size_t memoryBytes() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      size_t bytes = sizeof(*this);
+      for (const auto &[name, entry] : _entries) {
+        bytes += sizeof(entry) + name.capacity() + kNodeOverhead;
+        for (const auto &address : entry.addresses) {
+          bytes += sizeof(address) + address.capacity();
+        }
+      }
+      return bytes;
+    }
+
+    // Lower case name without a trailing dot, empty for onion services, IP literals and anything
+    // else that is not a DNS name.
+    static std::string normalize(std::string_view host) {
+      if (!host.empty() && host.back() == '.') {
+        host.remove_suffix(1);
+      }
+      if (host.empty() || host.size() > 253) {
+        return "";
+      }
+      std::string name;
+      name.reserve(host.size());
+      bool has_letter = false;
+      for (char c : host) {
+        auto byte = static_cast<unsigned char>(c);
+        if (!std::isalnum(byte) && c != '-' && c != '.' && c != '_') {
+          return "";
+        }
+        has_letter = has_letter || std::isalpha(byte);
+        name.push_back(static_cast<char>(std::tolower(byte)));
+      }
+      constexpr std::string_view kOnion = ".onion";
+      bool onion = name.size() >= kOnion.size() &&
+                   name.compare(name.size() - kOnion.size(), kOnion.size(), kOnion) == 0;
+      // Without letters it is an IPv4 literal, IPv6 ones contain ':' and were rejected above.
+      return has_letter && !onion ? name : "";
+    }
+
+    // "1.2.3.4,2001:db8::1" -> {"1.2.3.4", "2001:db8::1"}.
+    static std::vector<std::string> splitAddresses(std::string_view list) {
+      std::vector<std::string> addresses;
+      while (!list.empty()) {
+        auto end = list.find(',');
+        auto address = list.substr(0, end);
+        if (!address.empty()) {
+          addresses.emplace_back(address);
+        }
+        list = end == std::string_view::npos ? std::string_view() : list.substr(end + 1);
+      }
+      return addresses;
+    }
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t kMaxEntries = 1024;
+    // Exits clip TTLs anyway, this bounds entries from exits that don't.
+    static constexpr uint64_t kMaxTtlSeconds = 3600;
+    // Per entry bookkeeping of std::unordered_map, roughly.
+    static constexpr size_t kNodeOverhead = 48;
+
+    struct Entry {
+      std::vector<std::string> addresses;
+      Clock::time_point expires;
+    };
+
+    // Owned by the FFI between resolve_async() and onResolved().
+    struct LookupContext {
+      std::shared_ptr<DnsCache> cache;
+      std::string name;
+    };
+
+    // Exits answer with IPv4 and IPv6 addresses but not every exit connects to IPv6, so IPv4
+    // addresses are preferred.
+    static std::string preferred(const std::vector<std::string> &addresses) {
+      auto ipv4 = std::find_if(addresses.begin(), addresses.end(), [](const std::string &address) {
+        return address.find(':') == std::string::npos;
+      });
+      return ipv4 != addresses.end() ? *ipv4 : addresses.front();
+    }
+
+    static void onResolved(void *context, tor::TOR_ResolveResult result) {
+      std::unique_ptr<LookupContext> lookup(static_cast<LookupContext *>(context));
+      auto addresses = splitAddresses(arenaString(result.arena, result.addresses));
+      std::string error(arenaString(result.arena, result.error));
+      auto ttl_s = std::min<uint64_t>(result.ttl_s, kMaxTtlSeconds);
+      tor::free_arena(result.arena);
+      if (error.empty() && addresses.empty()) {
+        error = "Exit returned no addresses";
+      }
+
+      auto &cache = *lookup->cache;
+      std::vector<Callback> waiting;
+      {
+        std::lock_guard<std::mutex> lock(cache._mutex);
+        auto it = cache._inflight.find(lookup->name);
+        if (it != cache._inflight.end()) {
+          waiting = std::move(it->second);
+          cache._inflight.erase(it);
+        }
+      }
+      if (error.empty()) {
+        cache.store(lookup->name, std::vector<std::string>(addresses), ttl_s);
+      }
+      for (auto &callback : waiting) {
+        callback(ResolveResult(lookup->name, addresses,
+                               error.empty() ? static_cast<double>(ttl_s) : 0, false, error));
+      }
+    }
+
+    // Makes room by dropping the entry that expires first.
+    void evictIfFull() {
+      if (_entries.size() < kMaxEntries) {
+        return;
+      }
+      auto soonest = std::min_element(_entries.begin(), _entries.end(), [](auto &a, auto &b) {
+        return a.second.expires < b.second.expires;
+      });
+      _entries.erase(soonest);
+    }
+
+    std::mutex _mutex;
+    std::unordered_map<std::string, Entry> _entries;
+    // Callbacks waiting for a RESOLVE in flight, by name.
+    std::unordered_map<std::string, std::vector<Callback>> _inflight;
+  };
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,360 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // The parts of ed25519 (RFC 8032) needed to derive onion service public keys: field arithmetic
+  // modulo 2^255 - 19 in radix 2^51, and the twisted Edwards group in extended coordinates.
+  // Nothing here signs or verifies, the keys are used by the Rust side.
+  //
+  // publicKey() runs in constant time, it handles secret scalars. The PointWalk used by the vanity
+  // search does not need to: the points it visits are public keys.
+  class Ed25519 {
+  private:
+    // Field element: value = sum of v[i] * 2^(51 i), limbs kept below 2^52 between operations.
+    struct Fe {
+      uint64_t v[5];
+    };
+
+    // Extended coordinates: x = X/Z, y = Y/Z, x * y = T/Z.
+    struct Point {
+      Fe x, y, z, t;
+    };
+
+    // A point with Z = 1, prepared for repeated additions.
+    struct Cached {
+      Fe y_plus_x, y_minus_x, t_2d;
+    };
+
+    struct Constants {
+      Fe d2;
+      Point base;
+      Point eight_base;
+    };
+
+  public:
+    static constexpr size_t kScalarLength = 32;
+    static constexpr size_t kPublicKeyLength = 32;
+    using PublicKey = std::array<uint8_t, kPublicKeyLength>;
+
+    // `scalar` * B for a little-endian 256-bit scalar.
+    static PublicKey publicKey(const uint8_t *scalar) {
+      const auto &base = constants().base;
+      Point result = identity();
+      for (int bit = 255; bit >= 0; bit--) {
+        result = dbl(result);
+        Point sum = add(result, base);
+        select(result, sum, (scalar[bit / 8] >> (bit % 8)) & 1);
+      }
+      return encode(result);
+    }
+
+    // Walks the public keys of scalar, scalar + 8, scalar + 16, ..., `batch` at a time. The
+    // points are converted to encodings with one shared field inversion per batch, and every step
+    // is one point addition, which makes this much faster than publicKey() per candidate.
+    class PointWalk {
+    public:
+      PointWalk(const uint8_t *scalar, size_t batch)
+          : _points(batch), _products(batch), _keys(batch) {
+        _next = toPoint(publicKey(scalar));
+        const auto &step = constants().eight_base;
+        _step = Cached{fadd(step.y, step.x), fsub(step.y, step.x), mul(step.t, constants().d2)};
+      }
+
+      // Encodings of the next `batch` points.
+      const std::vector<PublicKey> &next() {
+        for (size_t i = 0; i < _points.size(); i++) {
+          _points[i] = _next;
+          _products[i] = i == 0 ? _next.z : mul(_products[i - 1], _next.z);
+          _next = addCached(_next, _step);
+        }
+        // Montgomery's trick: one inversion for the whole batch.
+        Fe inverse = invert(_products.back());
+        for (size_t i = _points.size(); i-- > 0;) {
+          Fe z_inverse = i == 0 ? inverse : mul(inverse, _products[i - 1]);
+          inverse = mul(inverse, _points[i].z);
+          _keys[i] = encodeAffine(mul(_points[i].x, z_inverse), mul(_points[i].y, z_inverse));
+        }
+        return _keys;
+      }
+
+    private:
+      std::vector<Point> _points;
+      std::vector<Fe> _products;
+      std::vector<PublicKey> _keys;
+      Point _next;
+      Cached _step;
+    };
+
+  private:
+    static constexpr uint64_t kMask = (uint64_t(1) << 51) - 1;
+
+    static Fe fe(uint64_t value) { return Fe{{value, 0, 0, 0, 0}}; }
+
+    static Fe carry(Fe a) {
+      for (int i = 0; i < 4; i++) {
+        a.v[i + 1] += a.v[i] >> 51;
+        a.v[i] &= kMask;
+      }
+      a.v[0] += 19 * (a.v[4] >> 51);
+      a.v[4] &= kMask;
+      return a;
+    }
+
+    static Fe fadd(const Fe &a, const Fe &b) {
+      Fe r;
+      for (int i = 0; i < 5; i++) {
+        r.v[i] = a.v[i] + b.v[i];
+      }
+      return carry(r);
+    }
+
+    // Adds 4p before subtracting so limbs below 2^53 cannot underflow.
+    static Fe fsub(const Fe &a, const Fe &b) {
+      Fe r;
+      r.v[0] = a.v[0] + 0x1fffffffffffb4 - b.v[0];
+      for (int i = 1; i < 5; i++) {
+        r.v[i] = a.v[i] + 0x1ffffffffffffc - b.v[i];
+      }
+      return carry(r);
+    }
+
+    static Fe neg(const Fe &a) { return fsub(fe(0), a); }
+
+    static Fe mul(const Fe &a, const Fe &b) {
+      using u128 = unsigned __int128;
+      uint64_t b19[5];
+      for (int i = 1; i < 5; i++) {
+        b19[i] = 19 * b.v[i];
+      }
+      u128 r0 = (u128)a.v[0] * b.v[0] + (u128)a.v[1] * b19[4] + (u128)a.v[2] * b19[3] +
+                (u128)a.v[3] * b19[2] + (u128)a.v[4] * b19[1];
+      u128 r1 = (u128)a.v[0] * b.v[1] + (u128)a.v[1] * b.v[0] + (u128)a.v[2] * b19[4] +
+                (u128)a.v[3] * b19[3] + (u128)a.v[4] * b19[2];
+      u128 r2 = (u128)a.v[0] * b.v[2] + (u128)a.v[1] * b.v[1] + (u128)a.v[2] * b.v[0] +
+                (u128)a.v[3] * b19[4] + (u128)a.v[4] * b19[3];
+      u128 r3 = (u128)a.v[0] * b.v[3] + (u128)a.v[1] * b.v[2] + (u128)a.v[2] * b.v[1] +
+                (u128)a.v[3] * b.v[0] + (u128)a.v[4] * b19[4];
+      u128 r4 = (u128)a.v[0] * b.v[4] + (u128)a.v[1] * b.v[3] + (u128)a.v[2] * b.v[2] +
+                (u128)a.v[3] * b.v[1] + (u128)a.v[4] * b.v[0];
+      r1 += static_cast<uint64_t>(r0 >> 51);
+      r2 += static_cast<uint64_t>(r1 >> 51);
+      r3 += static_cast<uint64_t>(r2 >> 51);
+      r4 += static_cast<uint64_t>(r3 >> 51);
+      Fe r{{static_cast<uint64_t>(r0) & kMask, static_cast<uint64_t>(r1) & kMask,
+            static_cast<uint64_t>(r2) & kMask, static_cast<uint64_t>(r3) & kMask,
+            static_cast<uint64_t>(r4) & kMask}};
+      r.v[0] += 19 * static_cast<uint64_t>(r4 >> 51);
+      r.v[1] += r.v[0] >> 51;
+      r.v[0] &= kMask;
+      return r;
+    }
+
+    static Fe square(const Fe &a, int times = 1) {
+      Fe r = a;
+      for (int i = 0; i < times; i++) {
+        r = mul(r, r);
+      }
+      return r;
+    }
+
+    // a^(p - 2) with the usual addition chain: 254 squarings and 11 multiplications.
+    static Fe invert(const Fe &a) {
+      Fe z2 = square(a);
+      Fe z9 = mul(square(z2, 2), a);
+      Fe z11 = mul(z9, z2);
+      Fe z_5_0 = mul(square(z11), z9);
+      Fe z_10_0 = mul(square(z_5_0, 5), z_5_0);
+      Fe z_20_0 = mul(square(z_10_0, 10), z_10_0);
+      Fe z_40_0 = mul(square(z_20_0, 20), z_20_0);
+      Fe z_50_0 = mul(square(z_40_0, 10), z_10_0);
+      Fe z_100_0 = mul(square(z_50_0, 50), z_50_0);
+      Fe z_200_0 = mul(square(z_100_0, 100), z_100_0);
+      Fe z_250_0 = mul(square(z_200_0, 50), z_50_0);
+      return mul(square(z_250_0, 5), z11);
+    }
+
+    // a^e for a little-endian exponent, only used to set up the constants.
+    static Fe pow(const Fe &a, const std::array<uint8_t, 32> &exponent) {
+      Fe r = fe(1);
+      for (int bit = 255; bit >= 0; bit--) {
+        r = square(r);
+        if ((exponent[bit / 8] >> (bit % 8)) & 1) {
+          r = mul(r, a);
+        }
+      }
+      return r;
+    }
+
+    static std::array<uint8_t, 32> toBytes(Fe a) {
+      a = carry(carry(a));
+      // q is 1 iff a >= p, then a - p = a + 19 - 2^255.
+      uint64_t q = (a.v[0] + 19) >> 51;
+      for (int i = 1; i < 5; i++) {
+        q = (a.v[i] + q) >> 51;
+      }
+      a.v[0] += 19 * q;
+      for (int i = 0; i < 4; i++) {
+        a.v[i + 1] += a.v[i] >> 51;
+        a.v[i] &= kMask;
+      }
+      a.v[4] &= kMask;
+
+      uint64_t words[4] = {a.v[0] | a.v[1] << 51, a.v[1] >> 13 | a.v[2] << 38,
+                           a.v[2] >> 26 | a.v[3] << 25, a.v[3] >> 39 | a.v[4] << 12};
+      std::array<uint8_t, 32> bytes;
+      for (size_t i = 0; i < 32; i++) {
+        bytes[i] = static_cast<uint8_t>(words[i / 8] >> (8 * (i % 8)));
+      }
+      return bytes;
+    }
+
+    static bool equal(const Fe &a, const Fe &b) { return toBytes(a) == toBytes(b); }
+
+    static Point identity() { return Point{fe(0), fe(1), fe(1), fe(0)}; }
+
+    // add-2008-hwcd-3 for a = -1.
+    static Point add(const Point &p, const Point &q) {
+      Fe a = mul(fsub(p.y, p.x), fsub(q.y, q.x));
+      Fe b = mul(fadd(p.y, p.x), fadd(q.y, q.x));
+      Fe c = mul(mul(p.t, constants().d2), q.t);
+      Fe d = mul(fadd(p.z, p.z), q.z);
+      return finish(fsub(b, a), fsub(d, c), fadd(d, c), fadd(b, a));
+    }
+
+    // Same as add() with q.z = 1 and the q terms precomputed.
+    static Point addCached(const Point &p, const Cached &q) {
+      Fe a = mul(fsub(p.y, p.x), q.y_minus_x);
+      Fe b = mul(fadd(p.y, p.x), q.y_plus_x);
+      Fe c = mul(p.t, q.t_2d);
+      Fe d = fadd(p.z, p.z);
+      return finish(fsub(b, a), fsub(d, c), fadd(d, c), fadd(b, a));
+    }
+
+    // dbl-2008-hwcd for a = -1.
+    static Point dbl(const Point &p) {
+      Fe a = square(p.x);
+      Fe b = square(p.y);
+      Fe c = square(p.z);
+      c = fadd(c, c);
+      Fe h = fadd(a, b);
+      Fe e = fsub(h, square(fadd(p.x, p.y)));
+      Fe g = fsub(a, b);
+      Fe f = fadd(c, g);
+      return finish(e, f, g, h);
+    }
+
+    static Point finish(const Fe &e, const Fe &f, const Fe &g, const Fe &h) {
+      return Point{mul(e, f), mul(g, h), mul(f, g), mul(e, h)};
+    }
+
+    // p = q if `flag` is 1, without branching on it.
+    static void select(Point &p, const Point &q, uint8_t flag) {
+      uint64_t mask = 0 - static_cast<uint64_t>(flag);
+      Fe *targets[] = {&p.x, &p.y, &p.z, &p.t};
+      const Fe *sources[] = {&q.x, &q.y, &q.z, &q.t};
+      for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 5; j++) {
+          targets[i]->v[j] ^= mask & (targets[i]->v[j] ^ sources[i]->v[j]);
+        }
+      }
+    }
+
+    static PublicKey encodeAffine(const Fe &x, const Fe &y) {
+      auto bytes = toBytes(y);
+      bytes[31] |= static_cast<uint8_t>((toBytes(x)[0] & 1) << 7);
+      return bytes;
+    }
+
+    static PublicKey encode(const Point &p) {
+      Fe z_inverse = invert(p.z);
+      return encodeAffine(mul(p.x, z_inverse), mul(p.y, z_inverse));
+    }
+
+    // Decodes an encoding produced by encode(), which is always a valid point.
+    static Point toPoint(const PublicKey &key) {
+      uint64_t words[4] = {};
+      for (size_t i = 0; i < 32; i++) {
+        words[i / 8] |= uint64_t(key[i]) << (8 * (i % 8));
+      }
+      // The top bit is the sign of x.
+      Fe y{{words[0] & kMask, (words[0] >> 51 | words[1] << 13) & kMask,
+            (words[1] >> 38 | words[2] << 26) & kMask, (words[2] >> 25 | words[3] << 39) & kMask,
+            (words[3] >> 12) & kMask}};
+      Fe x = recoverX(y, key[31] >> 7);
+      return Point{x, y, fe(1), mul(x, y)};
+    }
+
+    // x for y on the curve with the given sign: x^2 = (y^2 - 1) / (d y^2 + 1).
+    static Fe recoverX(const Fe &y, int sign) {
+      const auto &c = rawConstants();
+      Fe y2 = square(y);
+      Fe u = fsub(y2, fe(1));
+      Fe v = fadd(mul(c.d, y2), fe(1));
+      Fe v3 = mul(square(v), v);
+      Fe x = mul(mul(u, v3), pow(mul(u, mul(square(v3), v)), c.p58));
+      if (!equal(mul(v, square(x)), u)) {
+        x = mul(x, c.sqrt_m1);
+      }
+      if ((toBytes(x)[0] & 1) != sign) {
+        x = neg(x);
+      }
+      return x;
+    }
+
+    struct RawConstants {
+      Fe d;
+      Fe sqrt_m1;
+      // (p - 5) / 8
+      std::array<uint8_t, 32> p58;
+    };
+
+    // Derived from p at first use instead of spelled out as limbs.
+    static const RawConstants &rawConstants() {
+      static const RawConstants constants = []() {
+        std::array<uint8_t, 32> p2, p14, p58;
+        p2.fill(0xff);
+        p14.fill(0xff);
+        p58.fill(0xff);
+        p2[0] = 0xeb; // p - 2
+        p2[31] = 0x7f;
+        p14[0] = 0xfb; // (p - 1) / 4
+        p14[31] = 0x1f;
+        p58[0] = 0xfd;
+        p58[31] = 0x0f;
+        RawConstants c;
+        c.d = mul(neg(fe(121665)), pow(fe(121666), p2));
+        c.sqrt_m1 = pow(fe(2), p14);
+        c.p58 = p58;
+        return c;
+      }();
+      return constants;
+    }
+
+    static const Constants &constants() {
+      static const Constants constants = []() {
+        const auto &raw = rawConstants();
+        Constants c;
+        c.d2 = fadd(raw.d, raw.d);
+        // y = 4/5, x even.
+        std::array<uint8_t, 32> p2;
+        p2.fill(0xff);
+        p2[0] = 0xeb;
+        p2[31] = 0x7f;
+        Fe y = mul(fe(4), pow(fe(5), p2));
+        Fe x = recoverX(y, 0);
+        c.base = Point{x, y, fe(1), mul(x, y)};
+        c.eight_base = dbl(dbl(dbl(c.base)));
+        Fe z_inverse = invert(c.eight_base.z);
+        Fe ex = mul(c.eight_base.x, z_inverse);
+        Fe ey = mul(c.eight_base.y, z_inverse);
+        c.eight_base = Point{ex, ey, fe(1), mul(ex, ey)};
+        return c;
+      }();
+      return constants;
+    }
+  };
+} // namespace margelo::nitro::nitrotor
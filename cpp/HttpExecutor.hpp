@@ -0,0 +1,457 @@
+#pragma once
+#include "DnsCache.hpp"
+#include "HttpRequest.hpp"
+#include "HttpTransport.hpp"
+#include "HybridTorSpec.hpp"
+#include "Interceptors.hpp"
+#include "JsonParser.hpp"
+#include "LatencyTracker.hpp"
+#include "RequestBody.hpp"
+#include "ResponseArena.hpp"
+#include "Scheduler.hpp"
+#include "Telemetry.hpp"
+#include "TrafficShaper.hpp"
+#include "Url.hpp"
+#include "tor_ffi.h"
+#include <NitroModules/ThreadPool.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // Runs requests through the single `http_request` FFI entry point and resolves their promises
+  // from the completion callback. Shared by all HTTP methods so cross-cutting behaviour only has
+  // to be implemented here.
+  //
+  // A request may take several attempts: retries after a retryable failure (see RetryPolicy) and
+  // hedged duplicates started while an attempt is slow. Every attempt after the first one runs on
+  // its own isolation token and therefore on a fresh circuit. The first acceptable response wins
+  // and cancels the attempts still in flight.
+  //
+  // Registered interceptors run once per request on a worker thread before the first attempt.
+  // Attempts are admitted through a TrafficShaper according to the request's priority class.
+  //
+  // Attempts go to the Rust client of this process unless another transport was set, see
+  // SharedTransportClient. Each attempt keeps the transport it was submitted to.
+  class HttpExecutor : public std::enable_shared_from_this<HttpExecutor> {
+  public:
+    std::shared_ptr<Promise<HttpResponse>> execute(HttpRequest &&request) {
+      auto promise = Promise<HttpResponse>::create();
+      if (_interceptors.empty()) {
+        start(std::move(request), promise);
+        return promise;
+      }
+
+      // Interceptors may hash and sign the body, keep that off the JS thread.
+      ThreadPool::shared().run([self = shared_from_this(), request = std::move(request),
+                                promise]() mutable {
+        std::string error;
+        if (!self->_interceptors.apply(request, error)) {
+          promise->resolve(
+              HttpResponse(0, "", std::move(error), 0, 0, std::nullopt, 0, "", false));
+          return;
+        }
+        self->start(std::move(request), promise);
+      });
+      return promise;
+    }
+
+    LatencyTracker &latency() { return *_latency; }
+
+    DnsCache &dns() { return *_dns; }
+
+    TrafficShaper &traffic() { return *_shaper; }
+
+    InterceptorChain &interceptors() { return _interceptors; }
+
+    // Routes attempts started from now on through `transport`, nullptr restores the FFI.
+    void setTransport(std::shared_ptr<HttpTransport> transport) {
+      std::lock_guard<std::mutex> lock(_transportMutex);
+      _transport = transport ? std::move(transport) : FfiHttpTransport::shared();
+    }
+
+  private:
+    struct Attempt {
+      // Written once http_request returned, 0 until then.
+      std::atomic<uint64_t> request_id{0};
+      bool hedge = false;
+      bool done = false;
+      uint64_t isolation_token = 0;
+      LatencyTracker::Timeouts timeouts{0, 0};
+      // Cached address of the URL's host the attempt connected to, empty if the exit resolved it.
+      std::string resolved_addr;
+      std::shared_ptr<HttpTransport> transport;
+    };
+
+    struct RequestState {
+      RequestState(std::shared_ptr<HttpExecutor> executor, HttpRequest &&request,
+                   std::shared_ptr<Promise<HttpResponse>> promise)
+          : executor(std::move(executor)), request(std::move(request)),
+            host(urlAuthority(this->request.url)), hostname(urlHost(this->request.url)),
+            promise(std::move(promise)) {}
+
+      // Keeps the executor alive for requests that outlive the HybridObject.
+      std::shared_ptr<HttpExecutor> executor;
+      // Immutable once the first attempt started.
+      const HttpRequest request;
+      // Key for the latency statistics, "host:port".
+      const std::string host;
+      // Key for the DNS cache.
+      const std::string hostname;
+      std::shared_ptr<Promise<HttpResponse>> promise;
+
+      std::mutex mutex;
+      std::vector<std::shared_ptr<Attempt>> attempts;
+      // Attempts started because of the retry policy, hedges are not counted.
+      uint32_t primary_attempts = 0;
+      uint32_t in_flight = 0;
+      bool settled = false;
+    };
+
+    // Owned by the FFI between http_request() and onComplete().
+    struct AttemptContext {
+      std::shared_ptr<RequestState> state;
+      std::shared_ptr<Attempt> attempt;
+    };
+
+    enum class Outcome { Success, Retryable, Fatal };
+
+    void start(HttpRequest &&request, const std::shared_ptr<Promise<HttpResponse>> &promise) {
+      auto state = std::make_shared<RequestState>(shared_from_this(), std::move(request), promise);
+      startAttempt(state, false);
+    }
+
+    uint64_t nextIsolationToken() { return _nextIsolationToken.fetch_add(1); }
+
+    static void startAttempt(const std::shared_ptr<RequestState> &state, bool hedge) {
+      auto attempt = std::make_shared<Attempt>();
+      attempt->hedge = hedge;
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->settled) {
+          return;
+        }
+        if (!state->attempts.empty()) {
+          attempt->isolation_token = state->executor->nextIsolationToken();
+        }
+        if (!hedge) {
+          state->primary_attempts++;
+        }
+        state->attempts.push_back(attempt);
+        state->in_flight++;
+      }
+
+      state->executor->_shaper->submit(state->request.priority, [state, attempt]() {
+        dispatchAttempt(state, attempt);
+      });
+    }
+
+    // Runs once the shaper admitted the attempt.
+    static void dispatchAttempt(const std::shared_ptr<RequestState> &state,
+                                const std::shared_ptr<Attempt> &attempt) {
+      const auto &request = state->request;
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->settled) {
+          // Another attempt won while this one was queued.
+          attempt->done = true;
+          state->in_flight--;
+        }
+      }
+      if (attempt->done) {
+        state->executor->_shaper->release(request.priority);
+        return;
+      }
+
+      if (request.adaptive_timeout) {
+        attempt->timeouts = state->executor->_latency->timeoutsFor(state->host, request.timeout_ms);
+      }
+      if (attempt->isolation_token == 0) {
+        attempt->resolved_addr = state->executor->_dns->lookup(state->hostname).value_or("");
+      }
+      // Every attempt reads a streamed body from the start. The transport releases the source.
+      tor::TOR_BodySource body_source{};
+      if (request.body_stream) {
+        body_source = request.body_stream->source();
+      }
+      tor::TOR_HttpRequest ffi_request{
+          methodName(request.method),
+          request.url.c_str(),
+          request.headers.c_str(),
+          request.body.has_value() ? request.body->c_str() : nullptr,
+          static_cast<unsigned long>(request.timeout_ms),
+          static_cast<unsigned long>(attempt->timeouts.connect_ms),
+          static_cast<unsigned long>(attempt->timeouts.first_byte_ms),
+          request.decompress,
+          attempt->isolation_token,
+          attempt->resolved_addr.empty() ? nullptr : attempt->resolved_addr.c_str(),
+          request.body_stream ? &body_source : nullptr,
+      };
+      {
+        std::lock_guard<std::mutex> lock(state->executor->_transportMutex);
+        attempt->transport = state->executor->_transport;
+      }
+      // The transport copies the request before returning, the context only travels to the
+      // callback.
+      auto request_id = attempt->transport->submit(ffi_request, &HttpExecutor::onComplete,
+                                                   new AttemptContext{state, attempt});
+      attempt->request_id.store(request_id);
+
+      bool cancel = false;
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        // Another attempt won before our id was known and could not cancel us.
+        cancel = state->settled && !attempt->done;
+      }
+      if (cancel) {
+        attempt->transport->cancel(request_id);
+        return;
+      }
+
+      if (!attempt->hedge && request.hedge_after_ms > 0) {
+        std::weak_ptr<Attempt> pending = attempt;
+        Scheduler::shared().schedule(std::chrono::milliseconds(request.hedge_after_ms),
+                                     [state, pending]() {
+                                       auto attempt = pending.lock();
+                                       {
+                                         std::lock_guard<std::mutex> lock(state->mutex);
+                                         if (!attempt || attempt->done || state->settled ||
+                                             state->in_flight != 1) {
+                                           return;
+                                         }
+                                       }
+                                       startAttempt(state, true);
+                                     });
+      }
+    }
+
+    static bool retriesOnError(const RetryPolicy &policy, tor::TOR_HttpErrorKind kind) {
+      RetryErrorClass error_class;
+      switch (kind) {
+      case tor::TOR_HttpErrorKind::Timeout:
+        error_class = RetryErrorClass::TIMEOUT;
+        break;
+      case tor::TOR_HttpErrorKind::Connect:
+        error_class = RetryErrorClass::CONNECT;
+        break;
+      case tor::TOR_HttpErrorKind::Circuit:
+        error_class = RetryErrorClass::CIRCUIT;
+        break;
+      case tor::TOR_HttpErrorKind::Protocol:
+        error_class = RetryErrorClass::PROTOCOL;
+        break;
+      default:
+        return false;
+      }
+
+      if (!policy.retry_on_errors.has_value()) {
+        // Network level failures are what a fresh circuit fixes, protocol errors usually are not.
+        return error_class != RetryErrorClass::PROTOCOL;
+      }
+      const auto &classes = policy.retry_on_errors.value();
+      return std::find(classes.begin(), classes.end(), error_class) != classes.end();
+    }
+
+    static Outcome classify(const HttpRequest &request, const tor::TOR_CHttpResponse &result) {
+      if (result.error_kind == tor::TOR_HttpErrorKind::None) {
+        if (request.retry.has_value() && request.retry->retry_on_status.has_value()) {
+          const auto &statuses = request.retry->retry_on_status.value();
+          auto status = static_cast<double>(result.status_code);
+          if (std::find(statuses.begin(), statuses.end(), status) != statuses.end()) {
+            return Outcome::Retryable;
+          }
+        }
+        return Outcome::Success;
+      }
+      if (request.retry.has_value() && retriesOnError(request.retry.value(), result.error_kind)) {
+        return Outcome::Retryable;
+      }
+      return Outcome::Fatal;
+    }
+
+    // Feeds every finished attempt into the latency statistics, adaptive or not. A phase that
+    // timed out counts with the timeout it hit.
+    static void recordLatency(const RequestState &state, const Attempt &attempt,
+                              const tor::TOR_CHttpResponse &result) {
+      auto &latency = *state.executor->_latency;
+      bool timed_out = result.error_kind == tor::TOR_HttpErrorKind::Timeout;
+      if (result.connect_ms > 0) {
+        latency.record(state.host, LatencyTracker::Phase::Connect,
+                       static_cast<uint32_t>(result.connect_ms));
+      } else if (timed_out && attempt.timeouts.connect_ms > 0) {
+        latency.record(state.host, LatencyTracker::Phase::Connect,
+                       static_cast<uint32_t>(attempt.timeouts.connect_ms));
+      }
+      if (result.first_byte_ms > 0) {
+        latency.record(state.host, LatencyTracker::Phase::FirstByte,
+                       static_cast<uint32_t>(result.first_byte_ms));
+      } else if (timed_out && result.connect_ms > 0 && attempt.timeouts.first_byte_ms > 0) {
+        latency.record(state.host, LatencyTracker::Phase::FirstByte,
+                       static_cast<uint32_t>(attempt.timeouts.first_byte_ms));
+      }
+    }
+
+    // Learns the address from the exit's CONNECTED cell, and forgets a cached address the exit
+    // could not connect to. A retry, if the policy allows one, has the exit resolve the host.
+    //
+    // The cache belongs to the default isolation token. Retries and hedges run on their own
+    // circuits to be unlinkable from the first attempt, an address learned on one circuit would
+    // tie them together, so they neither read nor fill it.
+    static void updateDns(const RequestState &state, const Attempt &attempt,
+                          const tor::TOR_CHttpResponse &result) {
+      if (attempt.isolation_token != 0) {
+        return;
+      }
+      auto &dns = *state.executor->_dns;
+      if (!attempt.resolved_addr.empty()) {
+        if (result.error_kind == tor::TOR_HttpErrorKind::Connect) {
+          dns.evict(state.hostname);
+        }
+        return;
+      }
+      auto address = arenaString(result.arena, result.remote_addr);
+      if (!address.empty()) {
+        dns.store(state.hostname, {std::string(address)}, result.remote_addr_ttl_s);
+      }
+    }
+
+    // Exponential backoff with jitter, the n-th retry waits between half and all of
+    // backoff_ms * 2^(n-1), capped at max_backoff_ms.
+    static std::chrono::milliseconds retryDelay(const RetryPolicy &policy, uint32_t retry) {
+      double delay = policy.backoff_ms;
+      for (uint32_t i = 1; i < retry && delay < policy.max_backoff_ms.value_or(30000); i++) {
+        delay *= 2;
+      }
+      delay = std::min(delay, policy.max_backoff_ms.value_or(30000));
+
+      thread_local std::minstd_rand random(std::random_device{}());
+      std::uniform_real_distribution<double> jitter(0.5, 1.0);
+      return std::chrono::milliseconds(static_cast<int64_t>(delay * jitter(random)));
+    }
+
+    static const char *httpVersionName(tor::TOR_HttpVersion version) {
+      switch (version) {
+      case tor::TOR_HttpVersion::Http10:
+        return "1.0";
+      case tor::TOR_HttpVersion::Http11:
+        return "1.1";
+      case tor::TOR_HttpVersion::Http2:
+        return "2";
+      default:
+        return "";
+      }
+    }
+
+    // Runs on a Rust runtime thread (or the shared transport's I/O thread), takes back ownership
+    // of the context and releases the response arena.
+    static void onComplete(void *context, tor::TOR_CHttpResponse result) {
+      std::unique_ptr<AttemptContext> attempt_context(static_cast<AttemptContext *>(context));
+      const auto &state = attempt_context->state;
+      const auto &request = state->request;
+      auto outcome = classify(request, result);
+      recordLatency(*state, *attempt_context->attempt, result);
+      uint64_t bytes_sent = request.url.size() + request.headers.size() +
+                            (request.body.has_value() ? request.body->size() : 0) +
+                            (request.body_stream ? request.body_stream->length() : 0);
+      state->executor->_shaper->finish(request.priority, bytes_sent, result.compressed_bytes);
+      Telemetry::shared().recordTransfer(state->host, bytes_sent, result.compressed_bytes);
+      updateDns(*state, *attempt_context->attempt, result);
+
+      std::string body(arenaString(result.arena, result.body));
+      std::string error(arenaString(result.arena, result.error));
+      auto status_code = result.status_code;
+      auto compressed_bytes = static_cast<double>(result.compressed_bytes);
+      auto decompressed_bytes = static_cast<double>(result.decompressed_bytes);
+      auto http_version = httpVersionName(result.http_version);
+      auto reused_connection = result.reused_connection;
+      attempt_context->attempt->transport->release(result);
+
+      bool retry = false;
+      uint32_t retry_number = 0;
+      std::vector<std::shared_ptr<Attempt>> losers;
+      size_t attempts = 0;
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        attempt_context->attempt->done = true;
+        state->in_flight--;
+        if (state->settled) {
+          return;
+        }
+
+        if (outcome != Outcome::Success && state->in_flight > 0) {
+          // A hedged attempt is still running on another circuit and may yet succeed.
+          return;
+        }
+        if (outcome == Outcome::Retryable) {
+          uint32_t max_attempts =
+              static_cast<uint32_t>(std::max(1.0, state->request.retry->max_attempts));
+          retry = state->primary_attempts < max_attempts;
+          retry_number = state->primary_attempts;
+        }
+
+        if (!retry) {
+          state->settled = true;
+          attempts = state->attempts.size();
+          for (const auto &attempt : state->attempts) {
+            if (!attempt->done && attempt->request_id.load() != 0) {
+              losers.push_back(attempt);
+            }
+          }
+        }
+      }
+
+      if (retry) {
+        Scheduler::shared().schedule(retryDelay(state->request.retry.value(), retry_number),
+                                     [state = state]() { startAttempt(state, false); });
+        return;
+      }
+
+      for (const auto &loser : losers) {
+        loser->transport->cancel(loser->request_id.load());
+      }
+      deliver(state, HttpResponse(status_code, std::move(body), std::move(error),
+                                  compressed_bytes, decompressed_bytes, std::nullopt,
+                                  static_cast<double>(attempts), http_version,
+                                  reused_connection));
+    }
+
+    static void deliver(const std::shared_ptr<RequestState> &state, HttpResponse &&response) {
+      if (state->request.response_type != ResponseType::JSON || !response.error.empty() ||
+          response.body.empty()) {
+        state->promise->resolve(std::move(response));
+        return;
+      }
+
+      // Large payloads take a while to parse, so keep that work off the Rust runtime thread. On
+      // success the body is dropped to avoid sending the payload to JS twice.
+      ThreadPool::shared().run([promise = state->promise,
+                                response = std::move(response)]() mutable {
+        std::string parse_error;
+        auto json = JsonParser::parseToMap(response.body, parse_error);
+        if (json) {
+          response.json = std::move(json);
+          response.body.clear();
+        } else {
+          response.error = std::move(parse_error);
+        }
+        promise->resolve(std::move(response));
+      });
+    }
+
+    // Token 0 is the shared default isolation, retries and hedges each get a fresh one.
+    std::atomic<uint64_t> _nextIsolationToken{1};
+    std::shared_ptr<LatencyTracker> _latency = std::make_shared<LatencyTracker>();
+    std::shared_ptr<DnsCache> _dns = std::make_shared<DnsCache>();
+    std::shared_ptr<TrafficShaper> _shaper = std::make_shared<TrafficShaper>();
+    InterceptorChain _interceptors;
+    std::mutex _transportMutex;
+    std::shared_ptr<HttpTransport> _transport = FfiHttpTransport::shared();
+  };
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,67 @@
+#pragma once
+#include "HybridTorSpec.hpp"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace margelo::nitro::nitrotor {
+  class RequestBody;
+
+  // Owned form of an HTTP request. Every HTTP entry point of HybridTor is translated into one of
+  // these once and then only moved around.
+  struct HttpRequest {
+    HttpMethod method;
+    std::string url;
+    std::string headers;
+    std::optional<std::string> body;
+    // Multipart form body streamed from its parts, replaces `body`. See RequestBody.hpp.
+    std::shared_ptr<const RequestBody> body_stream;
+    // Overall deadline, with adaptive_timeout the upper bound for the learned phase timeouts.
+    uint64_t timeout_ms;
+    bool adaptive_timeout;
+    bool decompress;
+    ResponseType response_type;
+    std::optional<RetryPolicy> retry;
+    // Start a duplicate attempt on a fresh circuit once an attempt has been pending this long,
+    // 0 disables hedging.
+    uint64_t hedge_after_ms;
+    PriorityClass priority;
+  };
+
+  // Builds an HttpRequest from any of the generated *Params structs, they share the field names.
+  template <typename Params>
+  HttpRequest makeHttpRequest(HttpMethod method, const Params &params,
+                              std::optional<std::string> body) {
+    return HttpRequest{method,
+                       params.url,
+                       params.headers,
+                       std::move(body),
+                       nullptr,
+                       static_cast<uint64_t>(params.timeout_ms),
+                       params.adaptive_timeout.value_or(false),
+                       params.decompress.value_or(false),
+                       params.response_type.value_or(ResponseType::TEXT),
+                       params.retry,
+                       static_cast<uint64_t>(params.hedge_after_ms.value_or(0)),
+                       params.priority.value_or(PriorityClass::NORMAL)};
+  }
+
+  inline const char *methodName(HttpMethod method) {
+    switch (method) {
+    case HttpMethod::GET:
+      return "GET";
+    case HttpMethod::POST:
+      return "POST";
+    case HttpMethod::PUT:
+      return "PUT";
+    case HttpMethod::DELETE:
+      return "DELETE";
+    case HttpMethod::HEAD:
+      return "HEAD";
+    case HttpMethod::OPTIONS:
+      return "OPTIONS";
+    }
+    return "GET";
+  }
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,38 @@
+#pragma once
+#include "tor_ffi.h"
+#include <cstdint>
+#include <memory>
+
+namespace margelo::nitro::nitrotor {
+  // Where HttpExecutor sends its attempts. Mirrors the `http_request` FFI contract: `callback`
+  // fires exactly once per submitted request, also after a cancel, and its response has to be
+  // handed back to release() of the same transport.
+  class HttpTransport {
+  public:
+    virtual ~HttpTransport() = default;
+    // Returns a non-zero id for cancel(). The request only has to stay valid during the call,
+    // its body source is released by the transport.
+    virtual uint64_t submit(const tor::TOR_HttpRequest &request, tor::TOR_HttpCallback callback,
+                            void *context) = 0;
+    virtual bool cancel(uint64_t request_id) = 0;
+    virtual void release(tor::TOR_CHttpResponse response) = 0;
+  };
+
+  // The Rust client running in this process.
+  class FfiHttpTransport : public HttpTransport {
+  public:
+    static std::shared_ptr<HttpTransport> shared() {
+      static auto instance = std::make_shared<FfiHttpTransport>();
+      return instance;
+    }
+
+    uint64_t submit(const tor::TOR_HttpRequest &request, tor::TOR_HttpCallback callback,
+                    void *context) override {
+      return tor::http_request(&request, callback, context);
+    }
+
+    bool cancel(uint64_t request_id) override { return tor::cancel_http_request(request_id); }
+
+    void release(tor::TOR_CHttpResponse response) override { tor::free_http_response(response); }
+  };
+} // namespace margelo::nitro::nitrotor
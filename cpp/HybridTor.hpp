@@ -1,6 +1,19 @@
 #pragma once
 #include "HybridTorSpec.hpp"
+#include "HttpExecutor.hpp"
+#include "HybridTorControl.hpp"
+#include "HybridTorWebSocket.hpp"
+#include "MemoryBudget.hpp"
+#include "OnionKey.hpp"
+#include "OnionKeyGenerator.hpp"
+#include "RelayStats.hpp"
+#include "RequestBody.hpp"
+#include "ResponseArena.hpp"
+#include "SharedTransport.hpp"
+#include "Telemetry.hpp"
+#include "TorLifecycle.hpp"
 #include "tor_ffi.h"
+#include <NitroModules/ThreadPool.hpp>
 #include <cstring> // For std::memcpy
 #include <memory>
 
@@ -10,90 +23,76 @@ namespace margelo::nitro::nitrotor {
     HybridTor() : HybridObject(TAG) {}
 
     std::shared_ptr<Promise<bool>> initTorService(const TorConfig &config) override {
-      return Promise<bool>::async([config]() {
+      return Promise<bool>::async([config, executor = _executor, lifecycle = _lifecycle]() {
+        executor->latency().load(config.data_dir);
+        RelayStats::shared().load(config.data_dir);
+        auto started_at = TorLifecycle::Clock::now();
+
         // First check if library is initialized
         if (!tor::initialize_tor_library()) {
           return false; // Failed to initialize library
         }
+        // Apply the memory caps before anything is allocated
+        if (!configureMemoryBudget(config.memory_budget)) {
+          return false;
+        }
+        // Pick the bridges to bootstrap through, if any
+        if (!lifecycle->prepareBridges(config.bridges)) {
+          return false;
+        }
         // Then proceed with service initialization
-        return tor::init_tor_service(static_cast<uint16_t>(config.socks_port),
-                                     config.data_dir.c_str(),
-                                     static_cast<uint64_t>(config.timeout_ms));
+        bool initialized = tor::init_tor_service(static_cast<uint16_t>(config.socks_port),
+                                                 config.data_dir.c_str(),
+                                                 static_cast<uint64_t>(config.timeout_ms));
+        if (initialized) {
+          lifecycle->recordColdStart(started_at);
+        }
+        return initialized;
       });
     }
 
     std::shared_ptr<Promise<HiddenServiceResponse>>
     createHiddenService(const HiddenServiceParams &params) override {
-      return Promise<HiddenServiceResponse>::async([params]() {
-        // Create a C array of bytes from the vector
-        const uint8_t *key_data_ptr = nullptr;
-        std::array<uint8_t, 64> key_data{};
-        bool has_key = params.key_data.has_value();
-
-        if (has_key) {
-          const auto &key_vec = params.key_data.value();
-          for (size_t i = 0; i < 64 && i < key_vec.size(); i++) {
-            key_data[i] = static_cast<uint8_t>(key_vec[i]);
-          }
-          key_data_ptr = key_data.data();
-        }
+      // Validate and copy the key while still on the JS thread, the buffer belongs to JS.
+      const uint8_t *key_bytes = nullptr;
+      try {
+        key_bytes = onionKeyBytes(params.key_data);
+      } catch (const std::exception &) {
+        return rejectedPromise<HiddenServiceResponse>(std::current_exception());
+      }
 
-        // Call the FFI function
-        auto result = tor::create_hidden_service(static_cast<uint16_t>(params.port),
-                                                 static_cast<uint16_t>(params.target_port),
-                                                 key_data_ptr, has_key);
-
-        // Create our response object and copy the strings
-        std::string onion_address = result.onion_address ? result.onion_address : "";
-        std::string control = result.control ? result.control : "";
+      auto key = shareOnionKey(key_bytes);
 
-        // Important: Free the C strings to avoid memory leaks
-        if (result.onion_address)
-          tor::free_string(result.onion_address);
-        if (result.control)
-          tor::free_string(result.control);
+      auto port = static_cast<uint16_t>(params.port);
+      auto target_port = static_cast<uint16_t>(params.target_port);
+      return Promise<HiddenServiceResponse>::async([port, target_port, key]() {
+        // Call the FFI function
+        auto result = tor::create_hidden_service(port, target_port, key ? key->data() : nullptr,
+                                                 key != nullptr);
 
-        return HiddenServiceResponse(result.is_success, onion_address, control);
+        // Copy the strings out of the Rust allocated arena, then free it
+        HiddenServiceResponse response(
+            result.is_success, std::string(arenaString(result.arena, result.onion_address)),
+            std::string(arenaString(result.arena, result.control)));
+        tor::free_arena(result.arena);
+        return response;
       });
     }
 
     std::shared_ptr<Promise<StartTorResponse>>
     startTorIfNotRunning(const StartTorParams &params) override {
-      return Promise<StartTorResponse>::async([params]() {
-        // Create a C array of bytes from the vector
-        const uint8_t *key_data_ptr = nullptr;
-        std::array<uint8_t, 64> key_data{};
-        bool has_key = params.key_data.has_value();
-
-        if (has_key) {
-          const auto &key_vec = params.key_data.value();
-          for (size_t i = 0; i < 64 && i < key_vec.size(); i++) {
-            key_data[i] = static_cast<uint8_t>(key_vec[i]);
-          }
-          key_data_ptr = key_data.data();
-        }
+      const uint8_t *key_data = nullptr;
+      try {
+        key_data = onionKeyBytes(params.key_data);
+      } catch (const std::exception &) {
+        return rejectedPromise<StartTorResponse>(std::current_exception());
+      }
 
-        // Call the Rust function
-        auto result = tor::start_tor_if_not_running(params.data_dir.c_str(), key_data_ptr, has_key,
-                                                    static_cast<uint16_t>(params.socks_port),
-                                                    static_cast<uint16_t>(params.target_port),
-                                                    static_cast<uint64_t>(params.timeout_ms));
-
-        // Create our response object and copy the strings
-        std::string onion_address = result.onion_address ? result.onion_address : "";
-        std::string control = result.control ? result.control : "";
-        std::string error_message = result.error_message ? result.error_message : "";
-
-        // Important: Free the C strings to avoid memory leaks
-        if (result.onion_address)
-          tor::free_string(result.onion_address);
-        if (result.control)
-          tor::free_string(result.control);
-        if (result.error_message)
-          tor::free_string(result.error_message);
-
-        return StartTorResponse(result.is_success, onion_address, control, error_message);
+      ThreadPool::shared().run([executor = _executor, data_dir = params.data_dir]() {
+        executor->latency().load(data_dir);
+        RelayStats::shared().load(data_dir);
       });
+      return _lifecycle->start(params, key_data);
     }
 
     std::shared_ptr<Promise<double>> getServiceStatus() override {
@@ -109,42 +108,348 @@ namespace margelo::nitro::nitrotor {
     }
 
     std::shared_ptr<Promise<bool>> shutdownService() override {
-      return Promise<bool>::async([]() { return tor::shutdown_service(); });
+      ThreadPool::shared().run([executor = _executor]() {
+        executor->latency().save();
+        RelayStats::shared().save();
+      });
+      return _lifecycle->shutdown();
     }
 
-    std::shared_ptr<Promise<HttpResponse>> httpGet(const HttpGetParams &params) override {
-      return Promise<HttpResponse>::async([params]() {
-        auto result = tor::http_get(params.url.c_str(), params.headers.c_str(), params.timeout_ms);
+    std::shared_ptr<Promise<std::vector<BridgeProbeResult>>>
+    probeBridges(const BridgeConfig &config) override {
+      auto promise = Promise<std::vector<BridgeProbeResult>>::create();
+      auto prober = std::make_shared<BridgeProber>(config);
+      prober->start(nullptr, [promise, weak_prober = std::weak_ptr<BridgeProber>(prober)]() {
+        promise->resolve(weak_prober.lock()->results());
+      });
+      return promise;
+    }
 
-        return HttpResponse(result.status_code, result.body, result.error);
+    std::vector<BridgeProbeResult> getBridgeProbeResults() override {
+      return _lifecycle->bridgeProbeResults();
+    }
+
+    std::shared_ptr<Promise<MemoryUsage>> trimMemory(TrimLevel level) override {
+      return Promise<MemoryUsage>::async([level, executor = _executor, shared = _shared]() {
+        tor::trim_memory(ffiTrimLevel(level));
+        executor->dns().trim(level == TrimLevel::CRITICAL);
+        if (level == TrimLevel::CRITICAL) {
+          // The OS may kill the process next, keep what was learned so far.
+          executor->latency().save();
+          RelayStats::shared().save();
+        }
+        return memoryUsage(nativeMemoryBytes(*executor, *shared));
       });
     }
 
-    std::shared_ptr<Promise<HttpResponse>> httpPost(const HttpPostParams &params) override {
-      return Promise<HttpResponse>::async([params]() {
-        auto result = tor::http_post(params.url.c_str(), params.body.c_str(),
-                                     params.headers.c_str(), params.timeout_ms);
+    MemoryUsage getMemoryUsage() override {
+      return memoryUsage(nativeMemoryBytes(*_executor, *_shared));
+    }
+
+    CircuitBuildStats getCircuitBuildStats() override { return RelayStats::shared().stats(); }
+
+    std::shared_ptr<Promise<ResolveResult>> resolve(const std::string &hostname,
+                                                    double timeout_ms) override {
+      auto promise = Promise<ResolveResult>::create();
+      _executor->dns().resolve(hostname, static_cast<uint64_t>(timeout_ms),
+                               [promise](ResolveResult &&result) {
+                                 promise->resolve(std::move(result));
+                               });
+      return promise;
+    }
 
-        return HttpResponse(result.status_code, result.body, result.error);
+    std::shared_ptr<Promise<std::vector<ResolveResult>>>
+    resolveBatch(const std::vector<std::string> &hostnames, double timeout_ms) override {
+      auto promise = Promise<std::vector<ResolveResult>>::create();
+      if (hostnames.empty()) {
+        promise->resolve(std::vector<ResolveResult>());
+        return promise;
+      }
+
+      // All lookups run concurrently, duplicates share one. Results keep the input order.
+      struct Batch {
+        std::mutex mutex;
+        std::vector<std::optional<ResolveResult>> results;
+        size_t remaining;
+      };
+      auto batch = std::make_shared<Batch>();
+      batch->results.resize(hostnames.size());
+      batch->remaining = hostnames.size();
+      for (size_t i = 0; i < hostnames.size(); i++) {
+        _executor->dns().resolve(
+            hostnames[i], static_cast<uint64_t>(timeout_ms),
+            [promise, batch, i](ResolveResult &&result) {
+              std::vector<ResolveResult> results;
+              {
+                std::lock_guard<std::mutex> lock(batch->mutex);
+                batch->results[i] = std::move(result);
+                if (--batch->remaining > 0) {
+                  return;
+                }
+                results.reserve(batch->results.size());
+                for (auto &entry : batch->results) {
+                  results.push_back(std::move(*entry));
+                }
+              }
+              promise->resolve(std::move(results));
+            });
+      }
+      return promise;
+    }
+
+    void clearDnsCache() override { _executor->dns().clear(); }
+
+    void startTelemetry(const TelemetryConfig &config,
+                        const std::function<void(const TelemetrySnapshot & /* snapshot */)>
+                            &onSnapshot) override {
+      Telemetry::shared().start(config, onSnapshot);
+    }
+
+    void stopTelemetry() override { Telemetry::shared().stop(); }
+
+    std::vector<TelemetrySample> getTelemetrySamples() override {
+      return Telemetry::shared().samples();
+    }
+
+    std::shared_ptr<Promise<std::vector<OnionKeyPair>>> generateKeys(double count) override {
+      if (!(count >= 0 && count <= kMaxGeneratedKeys)) {
+        return rejectedPromise<std::vector<OnionKeyPair>>(std::make_exception_ptr(
+            std::invalid_argument("count must be between 0 and " +
+                                  std::to_string(static_cast<int>(kMaxGeneratedKeys)))));
+      }
+      return Promise<std::vector<OnionKeyPair>>::async(
+          [count]() { return generateOnionKeys(static_cast<size_t>(count)); });
+    }
+
+    std::string deriveOnionAddress(const std::shared_ptr<ArrayBuffer> &key_data) override {
+      return onionAddress(onionPublicKey(onionKeyBytes(key_data)));
+    }
+
+    std::shared_ptr<Promise<std::vector<OnionKeyPair>>>
+    findVanityKeys(const VanitySearchParams &params,
+                   const std::function<void(const VanityProgress & /* progress */)> &onProgress)
+        override {
+      std::shared_ptr<VanitySearch> search;
+      try {
+        search = std::make_shared<VanitySearch>(params);
+      } catch (const std::exception &) {
+        return rejectedPromise<std::vector<OnionKeyPair>>(std::current_exception());
+      }
+
+      std::lock_guard<std::mutex> lock(_vanity->mutex);
+      if (_vanity->search && _vanity->search->running()) {
+        return rejectedPromise<std::vector<OnionKeyPair>>(std::make_exception_ptr(
+            std::runtime_error("A vanity search is already running")));
+      }
+      auto promise = Promise<std::vector<OnionKeyPair>>::create();
+      search->start(onProgress, [promise](std::vector<OnionKeyPair> &&pairs) {
+        promise->resolve(std::move(pairs));
       });
+      _vanity->search = search;
+      return promise;
     }
 
-    std::shared_ptr<Promise<HttpResponse>> httpPut(const HttpPutParams &params) override {
-      return Promise<HttpResponse>::async([params]() {
-        auto result = tor::http_put(params.url.c_str(), params.body.c_str(), params.headers.c_str(),
-                                    params.timeout_ms);
+    void cancelVanitySearch() override {
+      std::lock_guard<std::mutex> lock(_vanity->mutex);
+      if (_vanity->search) {
+        _vanity->search->cancel();
+      }
+    }
+
+    std::shared_ptr<Promise<bool>> suspend() override { return _lifecycle->suspend(); }
 
-        return HttpResponse(result.status_code, result.body, result.error);
+    std::shared_ptr<Promise<ResumeResponse>> resume(double timeout_ms) override {
+      return _lifecycle->resume(static_cast<uint64_t>(timeout_ms));
+    }
+
+    LifecycleTimings getLifecycleTimings() override { return _lifecycle->timings(); }
+
+    std::shared_ptr<Promise<HttpResponse>> httpRequest(const HttpRequestParams &params) override {
+      return executeWithForm(makeHttpRequest(params.method, params, params.body), params.form);
+    }
+
+    void setBandwidthLimits(const BandwidthLimits &limits) override {
+      _executor->traffic().setLimits(limits);
+    }
+
+    TrafficStats getTrafficStats() override { return _executor->traffic().stats(); }
+
+    double addInterceptor(const InterceptorConfig &config) override {
+      return static_cast<double>(
+          _executor->interceptors().add(makeInterceptor(config), config.host));
+    }
+
+    bool removeInterceptor(double id) override {
+      return _executor->interceptors().remove(static_cast<uint64_t>(id));
+    }
+
+    void clearInterceptors() override { _executor->interceptors().clear(); }
+
+    // Registers an interceptor implemented in C++, see RequestInterceptor.
+    uint64_t addNativeInterceptor(std::shared_ptr<RequestInterceptor> interceptor,
+                                  std::optional<std::string> host = std::nullopt) {
+      return _executor->interceptors().add(std::move(interceptor), std::move(host));
+    }
+
+    bool configureHttpClient(const HttpClientConfig &config) override {
+      tor::TOR_HttpClientConfig ffi_config{
+          config.http2,
+          config.http2_prior_knowledge_onion,
+          static_cast<unsigned int>(config.max_concurrent_streams),
+          static_cast<unsigned int>(config.max_connections_per_host),
+          static_cast<unsigned long>(config.idle_timeout_ms),
+      };
+      return tor::configure_http_client(&ffi_config);
+    }
+
+    void startSharedTransport(const SharedTransportConfig &config) override {
+      auto server = SharedTransportServer::listen(
+          config.socket_path, static_cast<uint64_t>(config.ring_bytes.value_or(kRingBytes)));
+      std::lock_guard<std::mutex> lock(_shared->mutex);
+      if (_shared->server) {
+        _shared->server->stop();
+      }
+      _shared->server = std::move(server);
+    }
+
+    void stopSharedTransport() override {
+      std::lock_guard<std::mutex> lock(_shared->mutex);
+      if (_shared->server) {
+        _shared->server->stop();
+        _shared->server.reset();
+      }
+    }
+
+    std::shared_ptr<Promise<void>>
+    connectSharedTransport(const SharedTransportConfig &config) override {
+      return Promise<void>::async([config, executor = _executor, shared = _shared]() {
+        auto client = SharedTransportClient::connect(
+            config.socket_path, static_cast<uint64_t>(config.connect_timeout_ms.value_or(5000)));
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        if (shared->client) {
+          shared->client->disconnect();
+        }
+        shared->client = client;
+        executor->setTransport(std::move(client));
       });
     }
 
+    void disconnectSharedTransport() override {
+      std::lock_guard<std::mutex> lock(_shared->mutex);
+      _executor->setTransport(nullptr);
+      if (_shared->client) {
+        _shared->client->disconnect();
+        _shared->client.reset();
+      }
+    }
+
+    std::shared_ptr<HybridTorWebSocketSpec> createWebSocket() override {
+      return std::make_shared<HybridTorWebSocket>();
+    }
+
+    std::shared_ptr<HybridTorControlSpec> createControlClient() override {
+      return std::make_shared<HybridTorControl>();
+    }
+
+    std::shared_ptr<Promise<HttpResponse>> httpGet(const HttpGetParams &params) override {
+      return _executor->execute(makeHttpRequest(HttpMethod::GET, params, std::nullopt));
+    }
+
+    std::shared_ptr<Promise<HttpResponse>> httpPost(const HttpPostParams &params) override {
+      return executeWithForm(
+          makeHttpRequest(HttpMethod::POST, params, params.body.value_or("")), params.form);
+    }
+
+    std::shared_ptr<Promise<HttpResponse>> httpPut(const HttpPutParams &params) override {
+      return executeWithForm(
+          makeHttpRequest(HttpMethod::PUT, params, params.body.value_or("")), params.form);
+    }
+
     std::shared_ptr<Promise<HttpResponse>> httpDelete(const HttpDeleteParams &params) override {
-      return Promise<HttpResponse>::async([params]() {
-        auto result =
-            tor::http_delete(params.url.c_str(), params.headers.c_str(), params.timeout_ms);
+      return _executor->execute(makeHttpRequest(HttpMethod::DELETE, params, std::nullopt));
+    }
 
-        return HttpResponse(result.status_code, result.body, result.error);
-      });
+  private:
+    template <typename T>
+    static std::shared_ptr<Promise<T>> rejectedPromise(const std::exception_ptr &error) {
+      auto promise = Promise<T>::create();
+      promise->reject(error);
+      return promise;
+    }
+
+    // Builds the body of `form` while still on the JS thread, which JS owned buffers require.
+    // Forms that can't be sent fail the request the way a failing interceptor does.
+    std::shared_ptr<Promise<HttpResponse>> executeWithForm(HttpRequest &&request,
+                                                           const std::optional<FormBody> &form) {
+      std::string error;
+      if (form.has_value() && !applyForm(request, form.value(), error)) {
+        auto promise = Promise<HttpResponse>::create();
+        promise->resolve(HttpResponse(0, "", std::move(error), 0, 0, std::nullopt, 0, "", false));
+        return promise;
+      }
+      return _executor->execute(std::move(request));
+    }
+
+    // Replaces the body of `request` with `form` and sets its Content-Type.
+    static bool applyForm(HttpRequest &request, const FormBody &form, std::string &error) {
+      auto headers = HttpHeaders::parse(request.headers, error);
+      if (!headers.has_value()) {
+        return false;
+      }
+      try {
+        if (form.encoding == FormEncoding::URLENCODED) {
+          request.body = RequestBody::urlencoded(form.fields);
+          if (headers->get("Content-Type") == nullptr) {
+            headers->set("Content-Type", "application/x-www-form-urlencoded");
+          }
+        } else {
+          auto body = RequestBody::multipart(form.fields);
+          // The boundary is ours, a Content-Type set by the caller can't name it.
+          headers->set("Content-Type", body->contentType());
+          request.body = std::nullopt;
+          request.body_stream = std::move(body);
+        }
+      } catch (const std::invalid_argument &e) {
+        error = e.what();
+        return false;
+      }
+      request.headers = headers->toJson();
+      return true;
     }
+
+    static constexpr double kRingBytes = 4 * 1024 * 1024;
+    static constexpr double kMaxGeneratedKeys = 100000;
+
+    // This process's side of a shared transport: the owner's server or another process's client.
+    struct SharedTransports {
+      std::mutex mutex;
+      std::shared_ptr<SharedTransportServer> server;
+      std::shared_ptr<SharedTransportClient> client;
+    };
+
+    // The running or last vanity search, kept to cancel it.
+    struct VanitySearches {
+      std::mutex mutex;
+      std::shared_ptr<VanitySearch> search;
+    };
+
+    // Memory held by this library outside of Rust.
+    static uint64_t nativeMemoryBytes(HttpExecutor &executor, SharedTransports &shared) {
+      uint64_t bytes = executor.latency().memoryBytes() + executor.dns().memoryBytes() +
+                       RelayStats::shared().memoryBytes() + Telemetry::shared().memoryBytes();
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      if (shared.server) {
+        bytes += shared.server->mappedBytes();
+      }
+      if (shared.client) {
+        bytes += shared.client->mappedBytes();
+      }
+      return bytes;
+    }
+
+    std::shared_ptr<HttpExecutor> _executor = std::make_shared<HttpExecutor>();
+    std::shared_ptr<TorLifecycle> _lifecycle = std::make_shared<TorLifecycle>();
+    std::shared_ptr<SharedTransports> _shared = std::make_shared<SharedTransports>();
+    std::shared_ptr<VanitySearches> _vanity = std::make_shared<VanitySearches>();
   };
 } // namespace margelo::nitro::nitrotor
\ No newline at end of file
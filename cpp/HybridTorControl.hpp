@@ -0,0 +1,195 @@
+#pragma once
+#include "ControlPort.hpp"
+#include "HybridTorControlSpec.hpp"
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+namespace margelo::nitro::nitrotor {
+  class HybridTorControl : public HybridTorControlSpec {
+  public:
+    HybridTorControl() : HybridObject(TAG) {}
+
+    ~HybridTorControl() override {
+      if (_client) {
+        _client->close();
+      }
+    }
+
+    bool getConnected() override {
+      return _client && _client->state() == ControlClient::State::Open;
+    }
+
+    std::function<void(const std::vector<ControlEvent> & /* events */)> getOnEvents() override {
+      return _events->get(&Events::on_events);
+    }
+    void setOnEvents(
+        const std::function<void(const std::vector<ControlEvent> & /* events */)> &onEvents)
+        override {
+      _events->set(&Events::on_events, onEvents);
+    }
+
+    std::function<void(const std::string & /* error */)> getOnClose() override {
+      return _events->get(&Events::on_close);
+    }
+    void setOnClose(const std::function<void(const std::string & /* error */)> &onClose) override {
+      _events->set(&Events::on_close, onClose);
+    }
+
+    std::shared_ptr<Promise<void>> connect(const ControlConnectParams &params) override {
+      auto promise = Promise<void>::create();
+      if (_client) {
+        promise->reject(std::make_exception_ptr(
+            std::runtime_error("connect() can only be called once per control client")));
+        return promise;
+      }
+
+      ControlOptions options{
+          params.control,
+          params.password,
+          params.cookie_path,
+          static_cast<uint64_t>(params.timeout_ms),
+          static_cast<uint64_t>(params.event_batch_ms.value_or(100)),
+          static_cast<size_t>(std::max(1.0, params.max_event_batch.value_or(256))),
+      };
+      _events->connect_promise = promise;
+      try {
+        _client = std::make_shared<ControlClient>(std::move(options), _events);
+      } catch (const std::exception &) {
+        _events->connect_promise.reset();
+        promise->reject(std::current_exception());
+        return promise;
+      }
+      _client->connect();
+      return promise;
+    }
+
+    std::shared_ptr<Promise<std::vector<ControlReply>>>
+    sendCommands(const std::vector<std::string> &commands) override {
+      auto promise = Promise<std::vector<ControlReply>>::create();
+      if (commands.empty()) {
+        promise->resolve(std::vector<ControlReply>());
+        return promise;
+      }
+      try {
+        openClient().submit(commands, [promise](std::vector<ControlReply> &&replies,
+                                                const std::string &error) {
+          if (!error.empty()) {
+            promise->reject(std::make_exception_ptr(std::runtime_error(error)));
+          } else {
+            promise->resolve(std::move(replies));
+          }
+        });
+      } catch (const std::exception &) {
+        promise->reject(std::current_exception());
+      }
+      return promise;
+    }
+
+    std::shared_ptr<Promise<void>> subscribe(const std::vector<ControlEventType> &events) override {
+      // SETEVENTS replaces the subscription, an empty list ends it.
+      std::string command = "SETEVENTS";
+      for (auto type : events) {
+        command += " ";
+        command += eventName(type);
+      }
+      auto promise = Promise<void>::create();
+      try {
+        openClient().submit({command}, [promise](std::vector<ControlReply> &&replies,
+                                                 const std::string &error) {
+          if (!error.empty()) {
+            promise->reject(std::make_exception_ptr(std::runtime_error(error)));
+          } else if (replies.front().status != 250) {
+            auto message = replies.front().lines.empty() ? "" : replies.front().lines.front();
+            promise->reject(
+                std::make_exception_ptr(std::runtime_error("SETEVENTS failed: " + message)));
+          } else {
+            promise->resolve();
+          }
+        });
+      } catch (const std::exception &) {
+        promise->reject(std::current_exception());
+      }
+      return promise;
+    }
+
+    void close() override {
+      if (_client) {
+        _client->close();
+      }
+    }
+
+  private:
+    // Forwards client events to the JS callbacks. Separate from the HybridObject so a running
+    // connection does not keep it alive.
+    struct Events : ControlListener {
+      template <typename Callback> Callback get(Callback Events::*member) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return this->*member;
+      }
+
+      template <typename Callback> void set(Callback Events::*member, const Callback &callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->*member = callback;
+      }
+
+      void onConnected() override {
+        if (auto promise = takePromise()) {
+          promise->resolve();
+        }
+      }
+
+      void onConnectFailed(const std::string &error) override {
+        if (auto promise = takePromise()) {
+          promise->reject(std::make_exception_ptr(std::runtime_error(error)));
+        }
+      }
+
+      void onEvents(std::vector<ControlEvent> &&events) override {
+        if (auto callback = get(&Events::on_events)) {
+          callback(events);
+        }
+      }
+
+      void onClose(const std::string &error) override {
+        if (auto callback = get(&Events::on_close)) {
+          callback(error);
+        }
+      }
+
+      std::shared_ptr<Promise<void>> takePromise() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::move(connect_promise);
+      }
+
+      std::mutex mutex;
+      std::shared_ptr<Promise<void>> connect_promise;
+      std::function<void(const std::vector<ControlEvent> &)> on_events;
+      std::function<void(const std::string &)> on_close;
+    };
+
+    static const char *eventName(ControlEventType type) {
+      switch (type) {
+      case ControlEventType::CIRC:
+        return "CIRC";
+      case ControlEventType::STREAM:
+        return "STREAM";
+      case ControlEventType::BW:
+        return "BW";
+      case ControlEventType::HS_DESC:
+        return "HS_DESC";
+      }
+      return "";
+    }
+
+    ControlClient &openClient() {
+      if (!_client) {
+        throw std::runtime_error("Control client is not connected");
+      }
+      return *_client;
+    }
+
+    std::shared_ptr<Events> _events = std::make_shared<Events>();
+    std::shared_ptr<ControlClient> _client;
+  };
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,198 @@
+#pragma once
+#include "HybridTorWebSocketSpec.hpp"
+#include "WebSocket.hpp"
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+namespace margelo::nitro::nitrotor {
+  class HybridTorWebSocket : public HybridTorWebSocketSpec {
+  public:
+    HybridTorWebSocket() : HybridObject(TAG) {}
+
+    ~HybridTorWebSocket() override {
+      if (_client) {
+        _client->close(1001, "Going away");
+      }
+    }
+
+    WebSocketState getState() override {
+      if (!_client) {
+        return WebSocketState::CLOSED;
+      }
+      switch (_client->state()) {
+      case WebSocketClient::State::Connecting:
+        return WebSocketState::CONNECTING;
+      case WebSocketClient::State::Open:
+        return WebSocketState::OPEN;
+      case WebSocketClient::State::Closing:
+        return WebSocketState::CLOSING;
+      case WebSocketClient::State::Closed:
+        return WebSocketState::CLOSED;
+      }
+      return WebSocketState::CLOSED;
+    }
+
+    double getBufferedAmount() override {
+      return _client ? static_cast<double>(_client->bufferedAmount()) : 0;
+    }
+
+    std::function<void(const std::string & /* message */)> getOnText() override {
+      return _events->get(&Events::on_text);
+    }
+    void setOnText(const std::function<void(const std::string & /* message */)> &onText) override {
+      _events->set(&Events::on_text, onText);
+    }
+
+    std::function<void(const std::shared_ptr<ArrayBuffer> & /* data */)> getOnBinary() override {
+      return _events->get(&Events::on_binary);
+    }
+    void setOnBinary(
+        const std::function<void(const std::shared_ptr<ArrayBuffer> & /* data */)> &onBinary)
+        override {
+      _events->set(&Events::on_binary, onBinary);
+    }
+
+    std::function<void()> getOnDrain() override { return _events->get(&Events::on_drain); }
+    void setOnDrain(const std::function<void()> &onDrain) override {
+      _events->set(&Events::on_drain, onDrain);
+    }
+
+    std::function<void(double /* code */, const std::string & /* reason */)> getOnClose() override {
+      return _events->get(&Events::on_close);
+    }
+    void setOnClose(
+        const std::function<void(double /* code */, const std::string & /* reason */)> &onClose)
+        override {
+      _events->set(&Events::on_close, onClose);
+    }
+
+    std::shared_ptr<Promise<WebSocketOpenInfo>> connect(const WebSocketParams &params) override {
+      if (_client) {
+        return rejected(std::make_exception_ptr(
+            std::runtime_error("connect() can only be called once per WebSocket")));
+      }
+
+      WebSocketOptions options{
+          params.url,
+          params.headers,
+          params.protocols.value_or(std::vector<std::string>()),
+          params.permessage_deflate.value_or(true),
+          static_cast<uint64_t>(params.timeout_ms),
+          static_cast<uint64_t>(params.ping_interval_ms.value_or(30000)),
+          static_cast<uint64_t>(params.pong_timeout_ms.value_or(10000)),
+          static_cast<size_t>(params.max_message_bytes.value_or(16 * 1024 * 1024)),
+          static_cast<size_t>(params.high_water_mark.value_or(1024 * 1024)),
+      };
+      auto promise = Promise<WebSocketOpenInfo>::create();
+      _events->open_promise = promise;
+      try {
+        _client = std::make_shared<WebSocketClient>(std::move(options), _events);
+      } catch (const std::exception &) {
+        _events->open_promise.reset();
+        return rejected(std::current_exception());
+      }
+      _client->connect();
+      return promise;
+    }
+
+    bool sendText(const std::string &message) override {
+      return openClient().send(false, std::string(message));
+    }
+
+    bool sendBinary(const std::shared_ptr<ArrayBuffer> &data) override {
+      // The buffer belongs to JS, copy it before it leaves the JS thread.
+      return openClient().send(true,
+                               std::string(reinterpret_cast<const char *>(data->data()),
+                                           data->size()));
+    }
+
+    void close(double code, const std::string &reason) override {
+      if (_client) {
+        _client->close(static_cast<uint16_t>(code), reason);
+      }
+    }
+
+  private:
+    // Forwards client events to the JS callbacks. Separate from the HybridObject so a running
+    // connection does not keep it alive.
+    struct Events : WebSocketListener {
+      template <typename Callback> Callback get(Callback Events::*member) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return this->*member;
+      }
+
+      template <typename Callback> void set(Callback Events::*member, const Callback &callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->*member = callback;
+      }
+
+      void onOpen(const std::string &protocol, const std::string &extensions) override {
+        if (auto promise = takePromise()) {
+          promise->resolve(WebSocketOpenInfo(protocol, extensions));
+        }
+      }
+
+      void onConnectFailed(const std::string &error) override {
+        if (auto promise = takePromise()) {
+          promise->reject(std::make_exception_ptr(std::runtime_error(error)));
+        }
+      }
+
+      void onText(std::string &&message) override {
+        if (auto callback = get(&Events::on_text)) {
+          callback(message);
+        }
+      }
+
+      void onBinary(std::string &&data) override {
+        if (auto callback = get(&Events::on_binary)) {
+          // Hand the received bytes to JS without another copy.
+          auto *bytes = new std::string(std::move(data));
+          callback(ArrayBuffer::wrap(reinterpret_cast<uint8_t *>(bytes->data()), bytes->size(),
+                                     [bytes]() { delete bytes; }));
+        }
+      }
+
+      void onDrain() override {
+        if (auto callback = get(&Events::on_drain)) {
+          callback();
+        }
+      }
+
+      void onClose(uint16_t code, const std::string &reason, bool) override {
+        if (auto callback = get(&Events::on_close)) {
+          callback(static_cast<double>(code), reason);
+        }
+      }
+
+      std::shared_ptr<Promise<WebSocketOpenInfo>> takePromise() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::move(open_promise);
+      }
+
+      std::mutex mutex;
+      std::shared_ptr<Promise<WebSocketOpenInfo>> open_promise;
+      std::function<void(const std::string &)> on_text;
+      std::function<void(const std::shared_ptr<ArrayBuffer> &)> on_binary;
+      std::function<void()> on_drain;
+      std::function<void(double, const std::string &)> on_close;
+    };
+
+    static std::shared_ptr<Promise<WebSocketOpenInfo>> rejected(std::exception_ptr error) {
+      auto promise = Promise<WebSocketOpenInfo>::create();
+      promise->reject(error);
+      return promise;
+    }
+
+    WebSocketClient &openClient() {
+      if (!_client) {
+        throw std::runtime_error("WebSocket is not open");
+      }
+      return *_client;
+    }
+
+    std::shared_ptr<Events> _events = std::make_shared<Events>();
+    std::shared_ptr<WebSocketClient> _client;
+  };
+} // namespace margelo::nitro::nitrotor
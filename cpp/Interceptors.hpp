@@ -0,0 +1,356 @@
+#pragma once
+#include "HttpRequest.hpp"
+#include "HybridTorSpec.hpp"
+#include "JsonParser.hpp"
+#include "RequestBody.hpp"
+#include "Sha256.hpp"
+#include "Url.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // Request headers as name/value pairs. Requests carry them as a JSON object string, which is
+  // parsed once per request for the whole interceptor chain and only serialized again if an
+  // interceptor changed something.
+  class HttpHeaders {
+  public:
+    // Accepts "" (no headers) or a JSON object with string values.
+    static std::optional<HttpHeaders> parse(std::string_view json, std::string &error) {
+      HttpHeaders headers;
+      if (json.empty()) {
+        return headers;
+      }
+      JsonParser parser(json);
+      AnyValue root;
+      if (!parser.parse(root)) {
+        error = "Invalid headers: " + parser.error();
+        return std::nullopt;
+      }
+      auto *object = std::get_if<AnyObject>(&root);
+      if (object == nullptr) {
+        error = "Invalid headers: expected a JSON object";
+        return std::nullopt;
+      }
+      for (auto &[name, value] : *object) {
+        auto *text = std::get_if<std::string>(&value);
+        if (text == nullptr) {
+          error = "Invalid headers: value of \"" + name + "\" is not a string";
+          return std::nullopt;
+        }
+        headers._entries.emplace_back(name, std::move(*text));
+      }
+      return headers;
+    }
+
+    // Header names compare case-insensitively.
+    const std::string *get(std::string_view name) const {
+      for (const auto &entry : _entries) {
+        if (equalsIgnoreCase(entry.first, name)) {
+          return &entry.second;
+        }
+      }
+      return nullptr;
+    }
+
+    void set(std::string_view name, std::string value) {
+      _modified = true;
+      for (auto &entry : _entries) {
+        if (equalsIgnoreCase(entry.first, name)) {
+          entry.second = std::move(value);
+          return;
+        }
+      }
+      _entries.emplace_back(std::string(name), std::move(value));
+    }
+
+    bool modified() const { return _modified; }
+
+    const std::vector<std::pair<std::string, std::string>> &entries() const { return _entries; }
+
+    std::string toJson() const {
+      std::string json = "{";
+      for (const auto &[name, value] : _entries) {
+        if (json.size() > 1) {
+          json.push_back(',');
+        }
+        appendJsonString(json, name);
+        json.push_back(':');
+        appendJsonString(json, value);
+      }
+      json.push_back('}');
+      return json;
+    }
+
+  private:
+    static bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+      if (a.size() != b.size()) {
+        return false;
+      }
+      for (size_t i = 0; i < a.size(); i++) {
+        char x = a[i] >= 'A' && a[i] <= 'Z' ? static_cast<char>(a[i] + 32) : a[i];
+        char y = b[i] >= 'A' && b[i] <= 'Z' ? static_cast<char>(b[i] + 32) : b[i];
+        if (x != y) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    static void appendJsonString(std::string &out, std::string_view value) {
+      out.push_back('"');
+      for (char c : value) {
+        switch (c) {
+        case '"':
+          out += "\\\"";
+          break;
+        case '\\':
+          out += "\\\\";
+          break;
+        case '\n':
+          out += "\\n";
+          break;
+        case '\r':
+          out += "\\r";
+          break;
+        case '\t':
+          out += "\\t";
+          break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[7];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+          } else {
+            out.push_back(c);
+          }
+        }
+      }
+      out.push_back('"');
+    }
+
+    std::vector<std::pair<std::string, std::string>> _entries;
+    bool _modified = false;
+  };
+
+  // Hook run on every outgoing request before it reaches the FFI, on a worker thread. Native
+  // code can register its own through HybridTor::addNativeInterceptor. Throwing fails the
+  // request with the exception's message as HttpResponse.error.
+  class RequestInterceptor {
+  public:
+    virtual ~RequestInterceptor() = default;
+    virtual void intercept(HttpRequest &request, HttpHeaders &headers) = 0;
+  };
+
+  // Sets a fixed set of headers, replacing values the request already had.
+  class StaticHeadersInterceptor : public RequestInterceptor {
+  public:
+    explicit StaticHeadersInterceptor(HttpHeaders headers) : _headers(std::move(headers)) {}
+
+    void intercept(HttpRequest &, HttpHeaders &headers) override {
+      for (const auto &[name, value] : _headers.entries()) {
+        headers.set(name, value);
+      }
+    }
+
+  private:
+    const HttpHeaders _headers;
+  };
+
+  // Replaces a URL prefix, e.g. to send requests for a clearnet API to its onion service.
+  class UrlRewriteInterceptor : public RequestInterceptor {
+  public:
+    UrlRewriteInterceptor(std::string from_prefix, std::string to_prefix)
+        : _fromPrefix(std::move(from_prefix)), _toPrefix(std::move(to_prefix)) {}
+
+    void intercept(HttpRequest &request, HttpHeaders &) override {
+      if (request.url.compare(0, _fromPrefix.size(), _fromPrefix) == 0) {
+        request.url.replace(0, _fromPrefix.size(), _toPrefix);
+      }
+    }
+
+  private:
+    const std::string _fromPrefix;
+    const std::string _toPrefix;
+  };
+
+  // Signs requests with HMAC-SHA256 over
+  //
+  //   METHOD "\n" path?query "\n" unix timestamp "\n" hex(SHA-256(body))
+  //
+  // and sends the lowercase hex signature and the timestamp in the configured headers.
+  class HmacSigningInterceptor : public RequestInterceptor {
+  public:
+    HmacSigningInterceptor(std::string secret, std::string signature_header,
+                           std::string timestamp_header)
+        : _secret(std::move(secret)), _signatureHeader(std::move(signature_header)),
+          _timestampHeader(std::move(timestamp_header)) {}
+
+    void intercept(HttpRequest &request, HttpHeaders &headers) override {
+      auto timestamp = std::to_string(
+          std::chrono::duration_cast<std::chrono::seconds>(
+              std::chrono::system_clock::now().time_since_epoch())
+              .count());
+      Sha256 body_sha;
+      if (request.body_stream) {
+        // Streamed bodies are read once more for the hash, files included.
+        std::string error;
+        if (!request.body_stream->forEach([&](std::string_view chunk) { body_sha.update(chunk); },
+                                          error)) {
+          throw std::runtime_error("Can't sign the request: " + error);
+        }
+      } else if (request.body.has_value()) {
+        body_sha.update(*request.body);
+      }
+      auto body_hash = body_sha.finish();
+
+      std::string canonical = methodName(request.method);
+      canonical += '\n';
+      canonical += urlPathAndQuery(request.url);
+      canonical += '\n';
+      canonical += timestamp;
+      canonical += '\n';
+      canonical += Sha256::toHex(body_hash);
+
+      headers.set(_signatureHeader, Sha256::toHex(Sha256::hmac(_secret, canonical)));
+      headers.set(_timestampHeader, std::move(timestamp));
+    }
+
+  private:
+    const std::string _secret;
+    const std::string _signatureHeader;
+    const std::string _timestampHeader;
+  };
+
+  // Builds one of the built-in interceptors from its JS configuration.
+  inline std::shared_ptr<RequestInterceptor> makeInterceptor(const InterceptorConfig &config) {
+    switch (config.kind) {
+    case InterceptorKind::HEADERS: {
+      std::string error;
+      auto headers = HttpHeaders::parse(config.headers.value_or(""), error);
+      if (!headers.has_value()) {
+        throw std::invalid_argument(error);
+      }
+      return std::make_shared<StaticHeadersInterceptor>(std::move(headers.value()));
+    }
+    case InterceptorKind::HMAC_SIGNATURE:
+      if (!config.secret.has_value() || config.secret->empty()) {
+        throw std::invalid_argument("hmac_signature interceptor requires a secret");
+      }
+      return std::make_shared<HmacSigningInterceptor>(
+          config.secret.value(), config.signature_header.value_or("X-Signature"),
+          config.timestamp_header.value_or("X-Timestamp"));
+    case InterceptorKind::REWRITE_URL:
+      if (!config.from_prefix.has_value() || !config.to_prefix.has_value()) {
+        throw std::invalid_argument("rewrite_url interceptor requires from_prefix and to_prefix");
+      }
+      return std::make_shared<UrlRewriteInterceptor>(config.from_prefix.value(),
+                                                     config.to_prefix.value());
+    }
+    throw std::invalid_argument("Unknown interceptor kind");
+  }
+
+  // Ordered list of interceptors. Registration copies the list, so requests work on an immutable
+  // snapshot without holding a lock while interceptors run, and an empty chain costs a single
+  // atomic load per request.
+  class InterceptorChain {
+  public:
+    // Adds `interceptor` at the end of the chain. With a `host` it only sees requests to that
+    // host (as it is after the interceptors before it ran). Returns an id for remove().
+    uint64_t add(std::shared_ptr<RequestInterceptor> interceptor, std::optional<std::string> host) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto entries = std::make_shared<Entries>(_entries ? *_entries : Entries());
+      auto id = _nextId++;
+      entries->push_back(Entry{id, std::move(host), std::move(interceptor)});
+      publish(std::move(entries));
+      return id;
+    }
+
+    bool remove(uint64_t id) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (!_entries) {
+        return false;
+      }
+      auto entries = std::make_shared<Entries>(*_entries);
+      auto it = std::find_if(entries->begin(), entries->end(),
+                             [id](const Entry &entry) { return entry.id == id; });
+      if (it == entries->end()) {
+        return false;
+      }
+      entries->erase(it);
+      publish(std::move(entries));
+      return true;
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      publish(nullptr);
+    }
+
+    bool empty() const { return !_active.load(std::memory_order_acquire); }
+
+    // Runs the chain over `request`. On failure returns false with the reason in `error`.
+    bool apply(HttpRequest &request, std::string &error) const {
+      std::shared_ptr<const Entries> entries;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        entries = _entries;
+      }
+      if (!entries) {
+        return true;
+      }
+
+      auto headers = HttpHeaders::parse(request.headers, error);
+      if (!headers.has_value()) {
+        return false;
+      }
+      try {
+        for (const auto &entry : *entries) {
+          if (entry.host.has_value() && urlHost(request.url) != entry.host.value()) {
+            continue;
+          }
+          entry.interceptor->intercept(request, headers.value());
+        }
+      } catch (const std::exception &exception) {
+        error = std::string("Interceptor failed: ") + exception.what();
+        return false;
+      }
+      if (headers->modified()) {
+        request.headers = headers->toJson();
+      }
+      return true;
+    }
+
+  private:
+    struct Entry {
+      uint64_t id;
+      std::optional<std::string> host;
+      std::shared_ptr<RequestInterceptor> interceptor;
+    };
+    using Entries = std::vector<Entry>;
+
+    void publish(std::shared_ptr<const Entries> entries) {
+      if (entries && entries->empty()) {
+        entries = nullptr;
+      }
+      _active.store(entries != nullptr, std::memory_order_release);
+      _entries = std::move(entries);
+    }
+
+    mutable std::mutex _mutex;
+    std::shared_ptr<const Entries> _entries;
+    std::atomic<bool> _active{false};
+    uint64_t _nextId = 1;
+  };
+} // namespace margelo::nitro::nitrotor
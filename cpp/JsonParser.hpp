@@ -0,0 +1,448 @@
+#pragma once
+#include <NitroModules/AnyMap.hpp>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <locale.h>
+#include <string>
+#include <string_view>
+#include <system_error>
+#if defined(__APPLE__)
+#include <xlocale.h>
+#endif
+
+namespace margelo::nitro::nitrotor {
+  // Single pass JSON parser that materializes straight into Nitro's AnyValue tree, so response
+  // bodies can be decoded on a worker thread instead of running JSON.parse on the JS thread.
+  class JsonParser {
+  public:
+    explicit JsonParser(std::string_view input)
+        : _begin(input.data()), _end(input.data() + input.size()), _pos(_begin) {}
+
+    // Parses the whole input into `out`. On failure returns false and error() describes the
+    // problem together with the byte offset it occurred at.
+    bool parse(AnyValue &out) {
+      skipWhitespace();
+      if (!parseValue(out, 0)) {
+        return false;
+      }
+      skipWhitespace();
+      if (_pos != _end) {
+        return fail("Unexpected trailing characters");
+      }
+      return true;
+    }
+
+    const std::string &error() const { return _error; }
+
+    // Convenience wrapper producing the AnyMap exposed to JS. Objects map one to one, any other
+    // root value (arrays, scalars) is stored under the "value" key.
+    static std::shared_ptr<AnyMap> parseToMap(std::string_view input, std::string &error) {
+      JsonParser parser(input);
+      AnyValue root;
+      if (!parser.parse(root)) {
+        error = parser.error();
+        return nullptr;
+      }
+
+      auto map = AnyMap::make();
+      if (auto *object = std::get_if<AnyObject>(&root)) {
+        for (auto &[key, value] : *object) {
+          map->setAny(key, value);
+        }
+      } else {
+        map->setAny("value", root);
+      }
+      return map;
+    }
+
+  private:
+    // Deeply nested documents are rejected instead of overflowing the worker thread's stack.
+    static constexpr int kMaxDepth = 512;
+
+    const char *_begin;
+    const char *_end;
+    const char *_pos;
+    std::string _error;
+
+    bool fail(const char *message) {
+      _error = std::string("JSON parse error at offset ") + std::to_string(_pos - _begin) + ": " +
+               message;
+      return false;
+    }
+
+    void skipWhitespace() {
+      while (_pos != _end && (*_pos == ' ' || *_pos == '\n' || *_pos == '\r' || *_pos == '\t')) {
+        ++_pos;
+      }
+    }
+
+    bool consumeLiteral(const char *literal, size_t length) {
+      if (static_cast<size_t>(_end - _pos) < length || std::memcmp(_pos, literal, length) != 0) {
+        return fail("Invalid literal");
+      }
+      _pos += length;
+      return true;
+    }
+
+    bool parseValue(AnyValue &out, int depth) {
+      if (_pos == _end) {
+        return fail("Unexpected end of input");
+      }
+
+      switch (*_pos) {
+      case '{':
+        return parseObject(out, depth + 1);
+      case '[':
+        return parseArray(out, depth + 1);
+      case '"': {
+        std::string value;
+        if (!parseString(value)) {
+          return false;
+        }
+        out = std::move(value);
+        return true;
+      }
+      case 't':
+        out = true;
+        return consumeLiteral("true", 4);
+      case 'f':
+        out = false;
+        return consumeLiteral("false", 5);
+      case 'n':
+        out = AnyValue();
+        return consumeLiteral("null", 4);
+      default: {
+        double value = 0;
+        if (!parseNumber(value)) {
+          return false;
+        }
+        out = value;
+        return true;
+      }
+      }
+    }
+
+    bool parseObject(AnyValue &out, int depth) {
+      if (depth > kMaxDepth) {
+        return fail("Maximum nesting depth exceeded");
+      }
+      ++_pos; // '{'
+
+      AnyObject object;
+      skipWhitespace();
+      if (_pos != _end && *_pos == '}') {
+        ++_pos;
+        out = std::move(object);
+        return true;
+      }
+
+      while (true) {
+        skipWhitespace();
+        if (_pos == _end || *_pos != '"') {
+          return fail("Expected object key");
+        }
+        std::string key;
+        if (!parseString(key)) {
+          return false;
+        }
+
+        skipWhitespace();
+        if (_pos == _end || *_pos != ':') {
+          return fail("Expected ':' after object key");
+        }
+        ++_pos;
+        skipWhitespace();
+
+        AnyValue value;
+        if (!parseValue(value, depth)) {
+          return false;
+        }
+        object.insert_or_assign(std::move(key), std::move(value));
+
+        skipWhitespace();
+        if (_pos == _end) {
+          return fail("Unterminated object");
+        }
+        if (*_pos == ',') {
+          ++_pos;
+          continue;
+        }
+        if (*_pos == '}') {
+          ++_pos;
+          out = std::move(object);
+          return true;
+        }
+        return fail("Expected ',' or '}' in object");
+      }
+    }
+
+    bool parseArray(AnyValue &out, int depth) {
+      if (depth > kMaxDepth) {
+        return fail("Maximum nesting depth exceeded");
+      }
+      ++_pos; // '['
+
+      AnyArray array;
+      skipWhitespace();
+      if (_pos != _end && *_pos == ']') {
+        ++_pos;
+        out = std::move(array);
+        return true;
+      }
+
+      while (true) {
+        skipWhitespace();
+        array.emplace_back();
+        if (!parseValue(array.back(), depth)) {
+          return false;
+        }
+
+        skipWhitespace();
+        if (_pos == _end) {
+          return fail("Unterminated array");
+        }
+        if (*_pos == ',') {
+          ++_pos;
+          continue;
+        }
+        if (*_pos == ']') {
+          ++_pos;
+          out = std::move(array);
+          return true;
+        }
+        return fail("Expected ',' or ']' in array");
+      }
+    }
+
+    static int hexValue(char c) {
+      if (c >= '0' && c <= '9')
+        return c - '0';
+      if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+      if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+      return -1;
+    }
+
+    bool parseHex4(uint32_t &out) {
+      if (_end - _pos < 4) {
+        return fail("Truncated unicode escape");
+      }
+      out = 0;
+      for (int i = 0; i < 4; i++) {
+        int digit = hexValue(_pos[i]);
+        if (digit < 0) {
+          return fail("Invalid unicode escape");
+        }
+        out = (out << 4) | static_cast<uint32_t>(digit);
+      }
+      _pos += 4;
+      return true;
+    }
+
+    static void appendUtf8(std::string &out, uint32_t codepoint) {
+      if (codepoint < 0x80) {
+        out.push_back(static_cast<char>(codepoint));
+      } else if (codepoint < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (codepoint >> 6)));
+        out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+      } else if (codepoint < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (codepoint >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+      } else {
+        out.push_back(static_cast<char>(0xF0 | (codepoint >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
+      }
+    }
+
+    bool parseString(std::string &out) {
+      ++_pos; // opening quote
+
+      while (true) {
+        // Copy unescaped runs in one go, only quotes, backslashes and control characters need
+        // per-character handling.
+        const char *run = _pos;
+        while (_pos != _end && *_pos != '"' && *_pos != '\\' &&
+               static_cast<unsigned char>(*_pos) >= 0x20) {
+          ++_pos;
+        }
+        out.append(run, _pos - run);
+
+        if (_pos == _end) {
+          return fail("Unterminated string");
+        }
+        if (*_pos == '"') {
+          ++_pos;
+          return true;
+        }
+        if (*_pos != '\\') {
+          return fail("Unescaped control character in string");
+        }
+
+        ++_pos; // backslash
+        if (_pos == _end) {
+          return fail("Unterminated escape sequence");
+        }
+        char escape = *_pos++;
+        switch (escape) {
+        case '"':
+          out.push_back('"');
+          break;
+        case '\\':
+          out.push_back('\\');
+          break;
+        case '/':
+          out.push_back('/');
+          break;
+        case 'b':
+          out.push_back('\b');
+          break;
+        case 'f':
+          out.push_back('\f');
+          break;
+        case 'n':
+          out.push_back('\n');
+          break;
+        case 'r':
+          out.push_back('\r');
+          break;
+        case 't':
+          out.push_back('\t');
+          break;
+        case 'u': {
+          uint32_t codepoint = 0;
+          if (!parseHex4(codepoint)) {
+            return false;
+          }
+          if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+            uint32_t low = 0;
+            if (_end - _pos < 2 || _pos[0] != '\\' || _pos[1] != 'u') {
+              return fail("Unpaired surrogate in unicode escape");
+            }
+            _pos += 2;
+            if (!parseHex4(low)) {
+              return false;
+            }
+            if (low < 0xDC00 || low > 0xDFFF) {
+              return fail("Invalid low surrogate in unicode escape");
+            }
+            codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+          } else if (codepoint >= 0xDC00 && codepoint <= 0xDFFF) {
+            return fail("Unpaired surrogate in unicode escape");
+          }
+          appendUtf8(out, codepoint);
+          break;
+        }
+        default:
+          return fail("Invalid escape sequence");
+        }
+      }
+    }
+
+    bool parseNumber(double &out) {
+      const char *start = _pos;
+      bool negative = false;
+      if (_pos != _end && *_pos == '-') {
+        negative = true;
+        ++_pos;
+      }
+
+      if (_pos == _end || *_pos < '0' || *_pos > '9') {
+        return fail("Invalid value");
+      }
+
+      // The accumulated mantissa is only used while it is exact (see the fast path below), longer
+      // literals are converted by the standard library.
+      uint64_t mantissa = 0;
+      int digits = 0;
+      if (*_pos == '0') {
+        ++_pos;
+      } else {
+        while (_pos != _end && *_pos >= '0' && *_pos <= '9') {
+          mantissa = mantissa * 10 + static_cast<uint64_t>(*_pos - '0');
+          ++digits;
+          ++_pos;
+        }
+      }
+
+      int exponent = 0;
+      if (_pos != _end && *_pos == '.') {
+        ++_pos;
+        if (_pos == _end || *_pos < '0' || *_pos > '9') {
+          return fail("Expected digit after decimal point");
+        }
+        while (_pos != _end && *_pos >= '0' && *_pos <= '9') {
+          mantissa = mantissa * 10 + static_cast<uint64_t>(*_pos - '0');
+          ++digits;
+          --exponent;
+          ++_pos;
+        }
+      }
+
+      if (_pos != _end && (*_pos == 'e' || *_pos == 'E')) {
+        ++_pos;
+        bool negativeExponent = false;
+        if (_pos != _end && (*_pos == '+' || *_pos == '-')) {
+          negativeExponent = *_pos == '-';
+          ++_pos;
+        }
+        if (_pos == _end || *_pos < '0' || *_pos > '9') {
+          return fail("Expected digit in exponent");
+        }
+        int explicitExponent = 0;
+        while (_pos != _end && *_pos >= '0' && *_pos <= '9') {
+          if (explicitExponent < 100000) {
+            explicitExponent = explicitExponent * 10 + (*_pos - '0');
+          }
+          ++_pos;
+        }
+        exponent += negativeExponent ? -explicitExponent : explicitExponent;
+      }
+
+      // Fast path: the mantissa fits a double exactly and the power of ten is exact as well, so a
+      // single multiplication or division is correctly rounded.
+      static constexpr double kPowersOfTen[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                                1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                                1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+      if (digits <= 15 && exponent >= -22 && exponent <= 22) {
+        double value = static_cast<double>(mantissa);
+        value = exponent < 0 ? value / kPowersOfTen[-exponent] : value * kPowersOfTen[exponent];
+        out = negative ? -value : value;
+        return true;
+      }
+
+      // Never plain strtod, which follows the process locale and stops at the '.' of a locale
+      // with a decimal comma.
+#if defined(__cpp_lib_to_chars)
+      if (std::from_chars(start, _pos, out).ec == std::errc::result_out_of_range) {
+        // strtod's answer: infinity on overflow, zero on underflow.
+        double magnitude = digits + exponent > 0 ? std::numeric_limits<double>::infinity() : 0.0;
+        out = negative ? -magnitude : magnitude;
+      }
+#else
+      std::string literal(start, _pos - start);
+      out = strtodC(literal.c_str());
+#endif
+      return true;
+    }
+
+#if !defined(__cpp_lib_to_chars)
+    // libc++ has no floating point from_chars yet.
+    static double strtodC(const char *literal) {
+#if defined(__ANDROID__)
+      // Bionic only implements the C locale for numbers, and strtod_l needs API 26.
+      return std::strtod(literal, nullptr);
+#else
+      static const locale_t c_locale = newlocale(LC_NUMERIC_MASK, "C", nullptr);
+      return strtod_l(literal, nullptr, c_locale);
+#endif
+    }
+#endif
+  };
+} // namespace margelo::nitro::nitrotor
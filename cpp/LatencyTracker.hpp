@@ -0,0 +1,265 @@
+#pragma once
+#include "OnionCrypto.hpp"
+#include "Scheduler.hpp"
+#include "Sha256.hpp"
+#include <NitroModules/ThreadPool.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace margelo::nitro::nitrotor {
+  // Rolling per-host latency distribution used to derive connect and first-byte timeouts for
+  // requests with `adaptive_timeout`. Estimates are persisted to `data_dir` so a restart does not
+  // have to relearn them. Hosts are only held as an HMAC keyed with a random per-install secret,
+  // so the file does not reveal which sites were visited.
+  class LatencyTracker : public std::enable_shared_from_this<LatencyTracker> {
+  public:
+    enum class Phase { Connect, FirstByte };
+
+    struct Timeouts {
+      uint64_t connect_ms;
+      uint64_t first_byte_ms;
+    };
+
+    // Derives timeouts for `host`, never exceeding `upper_bound_ms`. Hosts without enough history
+    // get the upper bound for both phases.
+    Timeouts timeoutsFor(const std::string &host, uint64_t upper_bound_ms) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto it = _hosts.find(hostKey(host));
+      if (it == _hosts.end()) {
+        return Timeouts{upper_bound_ms, upper_bound_ms};
+      }
+      return Timeouts{it->second.connect.timeout(upper_bound_ms),
+                      it->second.first_byte.timeout(upper_bound_ms)};
+    }
+
+    // Records an observed latency. Timed out attempts should be recorded with the timeout they
+    // hit, so a slowing host pushes its estimate up instead of failing repeatedly.
+    void record(const std::string &host, Phase phase, uint32_t latency_ms) {
+      if (host.empty()) {
+        return;
+      }
+      bool schedule_save = false;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto key = hostKey(host);
+        auto it = _hosts.find(key);
+        if (it == _hosts.end()) {
+          evictIfFull();
+          it = _hosts.emplace(std::move(key), HostStats{}).first;
+        }
+        (phase == Phase::Connect ? it->second.connect : it->second.first_byte).add(latency_ms);
+
+        schedule_save = !_path.empty() && !_saveScheduled;
+        _saveScheduled = _saveScheduled || schedule_save;
+      }
+
+      if (schedule_save) {
+        // Batch writes: persist at most once per kSaveDelay, off the scheduler thread.
+        std::weak_ptr<LatencyTracker> weak = weak_from_this();
+        Scheduler::shared().schedule(kSaveDelay, [weak]() {
+          ThreadPool::shared().run([weak]() {
+            if (auto tracker = weak.lock()) {
+              tracker->save();
+            }
+          });
+        });
+      }
+    }
+
+    // Loads estimates persisted under `data_dir` and remembers the location for later saves.
+    void load(const std::string &data_dir) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::string path = data_dir + "/" + kFileName;
+      if (path == _path) {
+        return;
+      }
+      _path = std::move(path);
+      if (!loadSecret(data_dir + "/" + kSecretFileName)) {
+        // A new secret cannot match anything already on disk, the next save replaces it.
+        return;
+      }
+
+      std::ifstream file(_path);
+      std::string line;
+      // Format: one "<host key> <phase> <sample>..." line per host and phase.
+      while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        char phase = 0;
+        if (!(fields >> key >> phase) || (phase != 'c' && phase != 'f')) {
+          continue;
+        }
+        auto it = _hosts.find(key);
+        if (it == _hosts.end()) {
+          if (_hosts.size() >= kMaxHosts) {
+            continue;
+          }
+          it = _hosts.emplace(std::move(key), HostStats{}).first;
+        }
+        auto &window = phase == 'c' ? it->second.connect : it->second.first_byte;
+        uint32_t sample = 0;
+        while (fields >> sample) {
+          window.add(sample);
+        }
+      }
+    }
+
+    // Writes the current estimates, atomically replacing the previous file.
+    void save() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _saveScheduled = false;
+      if (_path.empty()) {
+        return;
+      }
+
+      std::string temp_path = _path + ".tmp";
+      {
+        std::ofstream file(temp_path, std::ios::trunc);
+        for (const auto &[key, stats] : _hosts) {
+          stats.connect.write(file, key, 'c');
+          stats.first_byte.write(file, key, 'f');
+        }
+        if (!file) {
+          return;
+        }
+      }
+      std::rename(temp_path.c_str(), _path.c_str());
+    }
+
+    // Approximate heap use of the estimates.
+    size_t memoryBytes() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      size_t bytes = 0;
+      for (const auto &[key, stats] : _hosts) {
+        bytes += sizeof(stats) + key.capacity() + kNodeOverhead;
+      }
+      return bytes;
+    }
+
+  private:
+    static constexpr const char *kFileName = "nitrotor-latency.txt";
+    static constexpr const char *kSecretFileName = "nitrotor-latency.key";
+    static constexpr size_t kSecretLength = 32;
+    // Per entry bookkeeping of std::unordered_map, roughly.
+    static constexpr size_t kNodeOverhead = 48;
+    static constexpr size_t kWindowSize = 32;
+    static constexpr size_t kMaxHosts = 256;
+    // Below this many samples the estimate is not trusted and the caller's bound is used.
+    static constexpr uint32_t kMinSamples = 5;
+    // Timeout = p95 * multiplier, clamped to [kMinTimeoutMs, upper bound]. Tor latency is heavy
+    // tailed, so leave generous headroom above the observed p95.
+    static constexpr double kTimeoutMultiplier = 2.0;
+    static constexpr uint64_t kMinTimeoutMs = 1500;
+    static constexpr std::chrono::seconds kSaveDelay{30};
+
+    // Ring buffer over the most recent samples of one phase.
+    struct Window {
+      std::array<uint32_t, kWindowSize> samples{};
+      uint32_t count = 0;
+      uint32_t next = 0;
+
+      void add(uint32_t sample) {
+        samples[next] = sample;
+        next = (next + 1) % kWindowSize;
+        count = std::min<uint32_t>(count + 1, kWindowSize);
+      }
+
+      uint64_t timeout(uint64_t upper_bound_ms) const {
+        if (count < kMinSamples) {
+          return upper_bound_ms;
+        }
+        std::array<uint32_t, kWindowSize> sorted = samples;
+        auto p95 = sorted.begin() + (count * 95) / 100;
+        std::nth_element(sorted.begin(), p95, sorted.begin() + count);
+        auto timeout = static_cast<uint64_t>(*p95 * kTimeoutMultiplier);
+        return std::min(std::max(timeout, kMinTimeoutMs), upper_bound_ms);
+      }
+
+      void write(std::ostream &out, const std::string &key, char phase) const {
+        if (count == 0) {
+          return;
+        }
+        out << key << ' ' << phase;
+        // Oldest first, so reloading preserves the ring order.
+        for (uint32_t i = 0; i < count; i++) {
+          out << ' ' << samples[(next + kWindowSize - count + i) % kWindowSize];
+        }
+        out << '\n';
+      }
+    };
+
+    struct HostStats {
+      Window connect;
+      Window first_byte;
+    };
+
+    static std::string randomSecret() {
+      std::string secret(kSecretLength, '\0');
+      secureRandom(secret.data(), secret.size());
+      return secret;
+    }
+
+    std::string hostKey(const std::string &host) const {
+      return Sha256::toHex(Sha256::hmac(_secret, host));
+    }
+
+    // Adopts the secret stored at `path`, or stores the current one there if there is none yet.
+    // Returns whether an existing secret was adopted. Entries recorded before that were keyed
+    // with a throwaway secret and are dropped.
+    bool loadSecret(const std::string &path) {
+      std::ifstream in(path, std::ios::binary);
+      std::string stored(kSecretLength, '\0');
+      if (in.read(stored.data(), static_cast<std::streamsize>(stored.size())) &&
+          in.peek() == std::char_traits<char>::eof()) {
+        if (stored != _secret) {
+          _secret = std::move(stored);
+          _hosts.clear();
+        }
+        return true;
+      }
+
+      int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      if (fd >= 0) {
+        bool written = ::write(fd, _secret.data(), _secret.size()) ==
+                       static_cast<ssize_t>(_secret.size());
+        ::close(fd);
+        if (!written) {
+          ::unlink(path.c_str());
+        }
+      }
+      return false;
+    }
+
+    // Keeps the table bounded by dropping the host with the least history.
+    void evictIfFull() {
+      if (_hosts.size() < kMaxHosts) {
+        return;
+      }
+      auto history = [](const auto &entry) {
+        return entry.second.connect.count + entry.second.first_byte.count;
+      };
+      auto less_history = [&](const auto &a, const auto &b) { return history(a) < history(b); };
+      _hosts.erase(std::min_element(_hosts.begin(), _hosts.end(), less_history));
+    }
+
+    std::mutex _mutex;
+    // Keyed by hostKey(), never by the plain host name.
+    std::unordered_map<std::string, HostStats> _hosts;
+    // Replaced by the persisted one in load(), random until then.
+    std::string _secret = randomSecret();
+    std::string _path;
+    bool _saveScheduled = false;
+  };
+} // namespace margelo::nitro::nitrotor
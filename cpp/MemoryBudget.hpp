@@ -0,0 +1,44 @@
+#pragma once
+#include "HybridTorSpec.hpp"
+#include "tor_ffi.h"
+#include <cstdint>
+#include <optional>
+
+namespace margelo::nitro::nitrotor {
+  // Hands `budget` (memory_budget of TorConfig / StartTorParams) to Tor, or restores Tor's
+  // defaults without one so a previous bootstrap's budget does not linger. Returns false if Tor
+  // rejected a cap as too small.
+  inline bool configureMemoryBudget(const std::optional<MemoryBudget> &budget) {
+    tor::TOR_MemoryLimits limits{};
+    if (budget.has_value()) {
+      limits.total_bytes = static_cast<unsigned long long>(budget->total_bytes.value_or(0));
+      limits.dir_cache_bytes = static_cast<unsigned long long>(budget->dir_cache_bytes.value_or(0));
+      limits.stream_buffer_bytes =
+          static_cast<unsigned long long>(budget->stream_buffer_bytes.value_or(0));
+      limits.max_idle_circuits = static_cast<unsigned int>(budget->max_idle_circuits.value_or(0));
+      limits.max_idle_connections =
+          static_cast<unsigned int>(budget->max_idle_connections.value_or(0));
+    }
+    return tor::configure_memory_limits(&limits);
+  }
+
+  inline tor::TOR_TrimLevel ffiTrimLevel(TrimLevel level) {
+    return level == TrimLevel::CRITICAL ? tor::TOR_TrimLevel::Critical
+                                        : tor::TOR_TrimLevel::Moderate;
+  }
+
+  // Tor's usage by subsystem plus `native_bytes` held by this library outside of Rust.
+  inline MemoryUsage memoryUsage(uint64_t native_bytes) {
+    auto usage = tor::get_memory_usage();
+    uint64_t total = usage.dir_cache_bytes + usage.circuit_bytes + usage.stream_buffer_bytes +
+                     usage.connection_bytes + usage.other_bytes + native_bytes;
+    return MemoryUsage(static_cast<double>(usage.dir_cache_bytes),
+                       static_cast<double>(usage.circuit_bytes),
+                       static_cast<double>(usage.stream_buffer_bytes),
+                       static_cast<double>(usage.connection_bytes),
+                       static_cast<double>(usage.other_bytes), static_cast<double>(native_bytes),
+                       static_cast<double>(total), static_cast<double>(usage.open_circuits),
+                       static_cast<double>(usage.idle_circuits),
+                       static_cast<double>(usage.open_connections));
+  }
+} // namespace margelo::nitro::nitrotor
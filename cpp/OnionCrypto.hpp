@@ -0,0 +1,115 @@
+#pragma once
+#include "Ed25519.hpp"
+#include "Sha3.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#if defined(__APPLE__) || defined(__ANDROID__)
+#include <stdlib.h> // For arc4random_buf
+#else
+#include <cerrno>
+#include <sys/random.h>
+#endif
+
+// Onion service key material without Nitro types, so the Linux fake of tor_ffi can derive
+// addresses the way Tor does. OnionKey.hpp adds the conversions from JS values.
+namespace margelo::nitro::nitrotor {
+  // Expanded ed25519 secret key as consumed by the Rust side (`key_data` in tor_ffi.h).
+  static constexpr size_t kOnionKeyLength = 64;
+
+  using OnionKey = std::array<uint8_t, kOnionKeyLength>;
+
+  // Overwrites key material in a way the optimizer is not allowed to drop as a dead store.
+  inline void secureZero(void *data, size_t size) {
+    volatile uint8_t *bytes = static_cast<volatile uint8_t *>(data);
+    for (size_t i = 0; i < size; i++) {
+      bytes[i] = 0;
+    }
+  }
+
+  // Fills `data` from the OS's cryptographically secure generator.
+  inline void secureRandom(void *data, size_t size) {
+#if defined(__APPLE__) || defined(__ANDROID__)
+    arc4random_buf(data, size);
+#else
+    auto bytes = static_cast<uint8_t *>(data);
+    while (size > 0) {
+      auto n = getrandom(bytes, size, 0);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("getrandom failed: " + std::to_string(errno));
+      }
+      bytes += n;
+      size -= static_cast<size_t>(n);
+    }
+#endif
+  }
+
+  // The first half of an expanded key is the secret scalar, clamped as RFC 8032 clamps the hash
+  // of a seed: a multiple of the cofactor 8 with bit 254 set.
+  inline void clampScalar(uint8_t *scalar) {
+    scalar[0] &= 248;
+    scalar[31] &= 127;
+    scalar[31] |= 64;
+  }
+
+  inline bool isClamped(const uint8_t *scalar) {
+    return (scalar[0] & 7) == 0 && (scalar[31] & 0xc0) == 0x40;
+  }
+
+  // A fresh key. Tor derives both halves from a hashed seed, the seed is never stored, so
+  // drawing them at random directly gives keys of the same distribution.
+  inline OnionKey generateOnionKey() {
+    OnionKey key;
+    secureRandom(key.data(), key.size());
+    clampScalar(key.data());
+    return key;
+  }
+
+  // Public key of an expanded key. Keys with an unclamped scalar were not made by Tor or
+  // generateOnionKey() and are rejected: the Rust side would not derive the same public key.
+  inline Ed25519::PublicKey onionPublicKey(const uint8_t *key) {
+    if (!isClamped(key)) {
+      throw std::invalid_argument("key_data is not an expanded ed25519 key, its scalar is not "
+                                  "clamped");
+    }
+    return Ed25519::publicKey(key);
+  }
+
+  // v3 onion address of a public key (rend-spec-v3 section 6):
+  // base32(public key | SHA3-256(".onion checksum" | public key | version)[:2] | version).
+  inline std::string onionAddress(const Ed25519::PublicKey &public_key) {
+    static constexpr uint8_t kVersion = 3;
+    static constexpr char kAlphabet[] = "abcdefghijklmnopqrstuvwxyz234567";
+    Sha3_256 sha;
+    sha.update(".onion checksum");
+    sha.update(public_key.data(), public_key.size());
+    sha.update(&kVersion, 1);
+    auto checksum = sha.finish();
+
+    std::array<uint8_t, 35> bytes;
+    std::memcpy(bytes.data(), public_key.data(), public_key.size());
+    bytes[32] = checksum[0];
+    bytes[33] = checksum[1];
+    bytes[34] = kVersion;
+    // 35 bytes are exactly 56 base32 characters, no padding.
+    std::string address;
+    address.reserve(56 + 6);
+    uint32_t buffer = 0;
+    int bits = 0;
+    for (uint8_t byte : bytes) {
+      buffer = buffer << 8 | byte;
+      bits += 8;
+      while (bits >= 5) {
+        bits -= 5;
+        address.push_back(kAlphabet[(buffer >> bits) & 31]);
+      }
+    }
+    return address + ".onion";
+  }
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,41 @@
+#pragma once
+#include "OnionCrypto.hpp"
+#include <NitroModules/ArrayBuffer.hpp>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+namespace margelo::nitro::nitrotor {
+  // Returns the raw bytes of an optional `key_data` buffer, or nullptr when none was given.
+  // Buffers that are not exactly kOnionKeyLength bytes long are rejected instead of being
+  // truncated or zero padded. JS owned buffers may only be read on the JS thread, so this has to
+  // be called before work is handed to another thread.
+  inline const uint8_t *onionKeyBytes(const std::optional<std::shared_ptr<ArrayBuffer>> &key_data) {
+    if (!key_data.has_value() || key_data.value() == nullptr) {
+      return nullptr;
+    }
+    const auto &buffer = key_data.value();
+    if (buffer->size() != kOnionKeyLength) {
+      throw std::invalid_argument("key_data must be exactly " + std::to_string(kOnionKeyLength) +
+                                  " bytes, got " + std::to_string(buffer->size()));
+    }
+    return buffer->data();
+  }
+
+  // Heap copy of a key for work handed to another thread, nullptr for no key. Captures share the
+  // copy instead of duplicating the key, and it is zeroed when the last of them is gone.
+  inline std::shared_ptr<const OnionKey> shareOnionKey(const uint8_t *key_bytes) {
+    if (key_bytes == nullptr) {
+      return nullptr;
+    }
+    auto key = std::shared_ptr<OnionKey>(new OnionKey(), [](OnionKey *key) {
+      secureZero(key->data(), key->size());
+      delete key;
+    });
+    std::memcpy(key->data(), key_bytes, key->size());
+    return key;
+  }
+} // namespace margelo::nitro::nitrotor
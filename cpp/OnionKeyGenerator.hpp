@@ -0,0 +1,282 @@
+#pragma once
+#include "Ed25519.hpp"
+#include "HybridTorSpec.hpp"
+#include "OnionKey.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // Key, public key and address as handed to JS. The key buffer is zeroed when JS releases it.
+  inline OnionKeyPair onionKeyPair(const OnionKey &key) {
+    auto public_key = onionPublicKey(key.data());
+    auto *copy = new OnionKey(key);
+    auto key_data = ArrayBuffer::wrap(copy->data(), copy->size(), [copy]() {
+      secureZero(copy->data(), copy->size());
+      delete copy;
+    });
+    return OnionKeyPair(key_data, ArrayBuffer::copy(public_key.data(), public_key.size()),
+                        onionAddress(public_key));
+  }
+
+  inline std::vector<OnionKeyPair> generateOnionKeys(size_t count) {
+    std::vector<OnionKeyPair> pairs;
+    pairs.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+      auto key = generateOnionKey();
+      pairs.push_back(onionKeyPair(key));
+      secureZero(key.data(), key.size());
+    }
+    return pairs;
+  }
+
+  // Searches for keys whose onion address starts with a prefix.
+  //
+  // Every worker thread starts from a random clamped scalar a and walks a, a + 8, a + 16, ...
+  // which keeps the scalar clamped and makes each candidate one point addition instead of a
+  // scalar multiplication (Ed25519::PointWalk). A prefix of n characters is the first 5n bits of
+  // the public key, so candidates are compared before any address is encoded. Progress is
+  // reported from a coordinator thread, workers only bump an atomic counter per batch.
+  class VanitySearch : public std::enable_shared_from_this<VanitySearch> {
+  public:
+    using ProgressListener = std::function<void(const VanityProgress &)>;
+    using DoneCallback = std::function<void(std::vector<OnionKeyPair> &&)>;
+
+    // Characters past the 51st depend on the checksum, not only on the public key.
+    static constexpr size_t kMaxPrefixLength = 51;
+    static constexpr double kMaxCount = 1000;
+    static constexpr double kMaxThreads = 64;
+    static constexpr double kMinProgressIntervalMs = 50;
+
+    // Throws std::invalid_argument for prefixes no address can start with.
+    explicit VanitySearch(const VanitySearchParams &params)
+        : _prefixLength(params.prefix.size()),
+          _count(static_cast<size_t>(std::clamp(params.count.value_or(1), 1.0, kMaxCount))),
+          _threads(static_cast<size_t>(
+              std::clamp(params.threads.value_or(defaultThreads()), 1.0, kMaxThreads))),
+          _interval(static_cast<int64_t>(std::max(
+              kMinProgressIntervalMs, params.progress_interval_ms.value_or(1000)))) {
+      if (params.prefix.empty() || params.prefix.size() > kMaxPrefixLength) {
+        throw std::invalid_argument("prefix must be 1 to " + std::to_string(kMaxPrefixLength) +
+                                    " characters long");
+      }
+      for (size_t i = 0; i < params.prefix.size(); i++) {
+        auto value = base32Value(params.prefix[i]);
+        if (value < 0) {
+          throw std::invalid_argument("prefix may only contain a-z and 2-7, got '" +
+                                      params.prefix + "'");
+        }
+        for (int bit = 4; bit >= 0; bit--) {
+          size_t position = 5 * i + static_cast<size_t>(4 - bit);
+          auto mask = static_cast<uint8_t>(0x80 >> (position % 8));
+          _mask[position / 8] |= mask;
+          if ((value >> bit) & 1) {
+            _target[position / 8] |= mask;
+          }
+        }
+      }
+      _compareBytes = (5 * _prefixLength + 7) / 8;
+    }
+
+    ~VanitySearch() {
+      for (auto &key : _found) {
+        secureZero(key.data(), key.size());
+      }
+    }
+
+    // Starts the workers. `on_done` gets the keys once `count` were found, or the keys found so
+    // far after cancel().
+    void start(ProgressListener on_progress, DoneCallback on_done) {
+      _onProgress = std::move(on_progress);
+      _onDone = std::move(on_done);
+      _running = true;
+      _started = Clock::now();
+      std::thread([self = shared_from_this()]() { self->run(); }).detach();
+    }
+
+    void cancel() {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _cancelled = true;
+      }
+      _wakeup.notify_all();
+    }
+
+    bool running() const { return _running; }
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    // Candidates per field inversion. Larger batches save little and delay stopping.
+    static constexpr size_t kBatch = 256;
+    static constexpr uint64_t kMaxSteps = uint64_t(1) << 40;
+
+    static double defaultThreads() {
+      auto cores = std::thread::hardware_concurrency();
+      // Leave a core for the UI.
+      return cores > 1 ? static_cast<double>(cores - 1) : 1.0;
+    }
+
+    static int base32Value(char c) {
+      if (c >= 'a' && c <= 'z') {
+        return c - 'a';
+      }
+      if (c >= '2' && c <= '7') {
+        return c - '2' + 26;
+      }
+      return -1;
+    }
+
+    bool matches(const Ed25519::PublicKey &public_key) const {
+      for (size_t i = 0; i < _compareBytes; i++) {
+        if ((public_key[i] & _mask[i]) != _target[i]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    void run() {
+      std::vector<std::thread> workers;
+      workers.reserve(_threads);
+      for (size_t i = 0; i < _threads; i++) {
+        workers.emplace_back([this]() { work(); });
+      }
+
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (true) {
+        bool done = _wakeup.wait_for(lock, _interval, [this]() { return finished(); });
+        if (done) {
+          break;
+        }
+        auto progress = makeProgress();
+        lock.unlock();
+        if (_onProgress) {
+          _onProgress(progress);
+        }
+        lock.lock();
+      }
+      _stop = true;
+      lock.unlock();
+      for (auto &worker : workers) {
+        worker.join();
+      }
+
+      // A final report, so the UI ends on the real totals.
+      lock.lock();
+      auto progress = makeProgress();
+      std::vector<OnionKeyPair> pairs;
+      pairs.reserve(_found.size());
+      for (auto &key : _found) {
+        pairs.push_back(onionKeyPair(key));
+        secureZero(key.data(), key.size());
+      }
+      _found.clear();
+      lock.unlock();
+      if (_onProgress) {
+        _onProgress(progress);
+      }
+      _onProgress = nullptr;
+      _running = false;
+      auto on_done = std::move(_onDone);
+      on_done(std::move(pairs));
+    }
+
+    bool finished() const { return _cancelled || _found.size() >= _count; }
+
+    VanityProgress makeProgress() const {
+      double elapsed_ms =
+          std::chrono::duration<double, std::milli>(Clock::now() - _started).count();
+      auto attempts = static_cast<double>(_attempts.load());
+      return VanityProgress(attempts, elapsed_ms > 0 ? attempts * 1000 / elapsed_ms : 0,
+                            elapsed_ms, static_cast<double>(_found.size()),
+                            static_cast<double>(_count) *
+                                std::pow(32.0, static_cast<double>(_prefixLength)));
+    }
+
+    void work() {
+      try {
+        while (!_stop) {
+          walkFromRandomScalar();
+        }
+      } catch (const std::exception &) {
+        // Only the OS random generator can fail, there is no point in searching on.
+        cancel();
+      }
+    }
+
+    void walkFromRandomScalar() {
+      auto start = generateOnionKey();
+      Ed25519::PointWalk walk(start.data(), kBatch);
+      // The scalar of a candidate is that of `start` + 8 * step. 2^40 steps are far from
+      // overflowing the clamped scalar, and starting over costs one scalar multiplication.
+      uint64_t step = 0;
+      while (!_stop && step < kMaxSteps) {
+        const auto &keys = walk.next();
+        for (size_t i = 0; i < keys.size(); i++) {
+          if (matches(keys[i])) {
+            record(start, step + i, keys[i]);
+          }
+        }
+        step += keys.size();
+        _attempts += keys.size();
+      }
+      secureZero(start.data(), start.size());
+    }
+
+    // Records the key at `step` from `start`, after checking it against a full derivation.
+    void record(const OnionKey &start, uint64_t step, const Ed25519::PublicKey &public_key) {
+      OnionKey key = start;
+      uint64_t carry = step * 8;
+      for (size_t i = 0; i < Ed25519::kScalarLength; i++) {
+        uint64_t sum = key[i] + (carry & 0xff);
+        key[i] = static_cast<uint8_t>(sum);
+        carry = (carry >> 8) + (sum >> 8);
+      }
+      // The random second half is what signing derives nonces from, it has to differ per key.
+      secureRandom(key.data() + Ed25519::kScalarLength, kOnionKeyLength - Ed25519::kScalarLength);
+      if (isClamped(key.data()) && Ed25519::publicKey(key.data()) == public_key) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_found.size() < _count) {
+          _found.push_back(key);
+        }
+        if (finished()) {
+          _wakeup.notify_all();
+        }
+      }
+      secureZero(key.data(), key.size());
+    }
+
+    const size_t _prefixLength;
+    const size_t _count;
+    const size_t _threads;
+    const std::chrono::milliseconds _interval;
+    // Bits of the public key the prefix fixes, most significant bit of byte 0 first.
+    std::array<uint8_t, Ed25519::kPublicKeyLength> _target{};
+    std::array<uint8_t, Ed25519::kPublicKeyLength> _mask{};
+    size_t _compareBytes = 0;
+
+    ProgressListener _onProgress;
+    DoneCallback _onDone;
+    Clock::time_point _started;
+    std::atomic<bool> _running{false};
+    std::atomic<bool> _stop{false};
+    std::atomic<uint64_t> _attempts{0};
+
+    std::mutex _mutex;
+    std::condition_variable _wakeup;
+    bool _cancelled = false;
+    std::vector<OnionKey> _found;
+  };
+} // namespace margelo::nitro::nitrotor
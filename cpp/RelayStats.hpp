@@ -0,0 +1,309 @@
+#pragma once
+#include "HybridTorSpec.hpp"
+#include "Scheduler.hpp"
+#include "Telemetry.hpp"
+#include "tor_ffi.h"
+#include <NitroModules/ThreadPool.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // Per relay circuit build times and failure rates as observed from this device, persisted to
+  // `data_dir`, and the path selection bias derived from them.
+  //
+  // Relays that are consistently slow or failing for us get their consensus weight scaled down
+  // for the middle and exit positions. The scale never drops below kMinWeight and is never above
+  // 1, so no relay is excluded and path selection does not collapse onto a small set of fast
+  // relays. Guards are recorded but left to Tor's guard algorithm: replacing guards based on our
+  // own measurements would let anyone able to degrade relays steer us onto guards they pick.
+  class RelayStats {
+  public:
+    // Process wide, like the Tor client. Leaked so observer callbacks can still fire during
+    // static destruction.
+    static RelayStats &shared() {
+      static auto *instance = new RelayStats();
+      return *instance;
+    }
+
+    // Loads the store under `data_dir`, starts observing circuit builds and hands the resulting
+    // weights to Tor. Paths picked before this finished are not biased.
+    void load(const std::string &data_dir) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::string path = data_dir + "/" + kFileName;
+        if (path == _path) {
+          return;
+        }
+        _path = std::move(path);
+
+        std::ifstream file(_path);
+        std::string line;
+        uint32_t today = currentDay();
+        // Format: one "<fingerprint> <circuits> <build_ms> <failure_rate> <last_seen_day>" line
+        // per relay.
+        while (std::getline(file, line) && _relays.size() < kMaxRelays) {
+          std::istringstream fields(line);
+          std::string fingerprint;
+          Relay relay;
+          if (!(fields >> fingerprint >> relay.circuits >> relay.build_ms >> relay.failure_rate >>
+                relay.last_seen) ||
+              !validFingerprint(fingerprint)) {
+            continue;
+          }
+          // Relays churn, stale measurements say little about their current performance.
+          if (relay.last_seen + kExpiryDays < today) {
+            continue;
+          }
+          _relays.emplace(std::move(fingerprint), relay);
+        }
+      }
+
+      static std::once_flag observer;
+      std::call_once(observer, [this]() { tor::set_circuit_observer(&onCircuit, this); });
+      applyWeights();
+    }
+
+    void record(const tor::TOR_CircuitEvent &event) {
+      bool schedule_flush = false;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _circuits++;
+        if (event.success) {
+          _buildTimes[_nextBuildTime] = static_cast<uint32_t>(event.build_ms);
+          _nextBuildTime = (_nextBuildTime + 1) % kWindowSize;
+          _buildTimeCount = std::min<uint32_t>(_buildTimeCount + 1, kWindowSize);
+        } else {
+          _failures++;
+        }
+
+        uint32_t today = currentDay();
+        for (size_t hop = 0; hop < event.relay_count; hop++) {
+          // A failure with a known hop is that relay's fault, the others did their part.
+          bool failed = !event.success &&
+                        (event.failed_hop < 0 || static_cast<size_t>(event.failed_hop) == hop);
+          if (!event.success && !failed) {
+            continue;
+          }
+          Relay *relay = find(event.relays[hop], today);
+          if (relay == nullptr) {
+            continue;
+          }
+          relay->failure_rate += kAlpha * ((failed ? 1.0f : 0.0f) - relay->failure_rate);
+          if (!failed) {
+            auto sample = static_cast<float>(event.build_ms);
+            relay->build_ms = relay->build_ms == 0
+                                  ? sample
+                                  : relay->build_ms + kAlpha * (sample - relay->build_ms);
+          }
+          relay->circuits = std::min(relay->circuits + 1, kMaxCircuits);
+          relay->last_seen = today;
+        }
+
+        schedule_flush = !_path.empty() && !_flushScheduled;
+        _flushScheduled = _flushScheduled || schedule_flush;
+      }
+
+      if (schedule_flush) {
+        // Batch writes and weight updates: at most once per kFlushDelay, off the scheduler thread.
+        Scheduler::shared().schedule(kFlushDelay, [this]() {
+          ThreadPool::shared().run([this]() {
+            save();
+            applyWeights();
+          });
+        });
+      }
+    }
+
+    // Writes the store, atomically replacing the previous file.
+    void save() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _flushScheduled = false;
+      if (_path.empty()) {
+        return;
+      }
+
+      std::string temp_path = _path + ".tmp";
+      {
+        std::ofstream file(temp_path, std::ios::trunc);
+        for (const auto &[fingerprint, relay] : _relays) {
+          file << fingerprint << ' ' << relay.circuits << ' ' << relay.build_ms << ' '
+               << relay.failure_rate << ' ' << relay.last_seen << '\n';
+        }
+        if (!file) {
+          return;
+        }
+      }
+      std::rename(temp_path.c_str(), _path.c_str());
+    }
+
+    // Build time distribution over the last kWindowSize successful circuits.
+    CircuitBuildStats stats() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::vector<uint32_t> sorted(_buildTimes.begin(), _buildTimes.begin() + _buildTimeCount);
+      std::sort(sorted.begin(), sorted.end());
+      auto percentile = [&](size_t percent) {
+        return sorted.empty() ? 0.0 : static_cast<double>(sorted[sorted.size() * percent / 100]);
+      };
+
+      std::vector<CircuitBuildBucket> histogram;
+      histogram.reserve(kBucketLowerBounds.size());
+      auto begin = sorted.begin();
+      for (size_t i = 0; i < kBucketLowerBounds.size(); i++) {
+        auto end = i + 1 < kBucketLowerBounds.size()
+                       ? std::lower_bound(begin, sorted.end(), kBucketLowerBounds[i + 1])
+                       : sorted.end();
+        histogram.emplace_back(static_cast<double>(kBucketLowerBounds[i]),
+                               static_cast<double>(end - begin));
+        begin = end;
+      }
+
+      return CircuitBuildStats(static_cast<double>(_circuits), static_cast<double>(_failures),
+                               percentile(50), percentile(80), percentile(95),
+                               std::move(histogram), static_cast<double>(_relays.size()),
+                               static_cast<double>(_penalized));
+    }
+
+    // Approximate heap use of the store and the build time window.
+    size_t memoryBytes() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      size_t bytes = sizeof(*this);
+      for (const auto &[fingerprint, relay] : _relays) {
+        bytes += sizeof(relay) + fingerprint.capacity() + kNodeOverhead;
+      }
+      return bytes;
+    }
+
+    RelayStats(const RelayStats &) = delete;
+    RelayStats &operator=(const RelayStats &) = delete;
+
+  private:
+    static constexpr const char *kFileName = "nitrotor-relays.txt";
+    // Same window as Tor's own circuit build timeout estimate.
+    static constexpr uint32_t kWindowSize = 1000;
+    static constexpr size_t kMaxRelays = 2048;
+    static constexpr uint32_t kExpiryDays = 30;
+    static constexpr uint32_t kMaxCircuits = 1u << 16;
+    // EWMA factor for build times and failure rates, roughly the last 10 circuits.
+    static constexpr float kAlpha = 0.1f;
+    // Below this many circuits a relay keeps weight 1, and below this many samples in the window
+    // there is no reliable median to compare build times against.
+    static constexpr uint32_t kMinCircuits = 5;
+    static constexpr uint32_t kMinWindow = 20;
+    // Relays slower than kSlowFactor times the median get weight kSlowFactor * median / build_ms.
+    static constexpr double kSlowFactor = 1.5;
+    static constexpr double kMinWeight = 0.2;
+    static constexpr std::chrono::seconds kFlushDelay{30};
+    // Per entry bookkeeping of std::unordered_map, roughly.
+    static constexpr size_t kNodeOverhead = 48;
+    static constexpr std::array<uint32_t, 14> kBucketLowerBounds = {
+        0, 250, 500, 750, 1000, 1500, 2000, 3000, 4000, 6000, 8000, 12000, 16000, 30000};
+
+    struct Relay {
+      // EWMA of the build time of successful circuits through the relay, 0 before the first one.
+      float build_ms = 0;
+      // EWMA of failures (1) and successes (0).
+      float failure_rate = 0;
+      uint32_t circuits = 0;
+      uint32_t last_seen = 0;
+    };
+
+    RelayStats() = default;
+
+    static void onCircuit(void *context, const tor::TOR_CircuitEvent *event) {
+      Telemetry::shared().recordCircuit(event->build_ms, event->success);
+      static_cast<RelayStats *>(context)->record(*event);
+    }
+
+    static uint32_t currentDay() {
+      auto now = std::chrono::system_clock::now().time_since_epoch();
+      return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::hours>(now).count() /
+                                   24);
+    }
+
+    static bool validFingerprint(std::string_view fingerprint) {
+      return !fingerprint.empty() && fingerprint.size() <= 64 &&
+             std::all_of(fingerprint.begin(), fingerprint.end(),
+                         [](char c) { return c > ' ' && c < 0x7f; });
+    }
+
+    // Finds or inserts a relay, making room by dropping the one seen least recently.
+    Relay *find(const char *fingerprint, uint32_t today) {
+      if (fingerprint == nullptr || !validFingerprint(fingerprint)) {
+        return nullptr;
+      }
+      auto it = _relays.find(fingerprint);
+      if (it != _relays.end()) {
+        return &it->second;
+      }
+      if (_relays.size() >= kMaxRelays) {
+        auto oldest = std::min_element(_relays.begin(), _relays.end(), [](auto &a, auto &b) {
+          return a.second.last_seen < b.second.last_seen;
+        });
+        _relays.erase(oldest);
+      }
+      Relay relay;
+      relay.last_seen = today;
+      return &_relays.emplace(fingerprint, relay).first->second;
+    }
+
+    double weight(const Relay &relay, double median_ms) const {
+      if (relay.circuits < kMinCircuits) {
+        return 1;
+      }
+      double weight = 1.0 - relay.failure_rate;
+      if (median_ms > 0 && relay.build_ms > kSlowFactor * median_ms) {
+        weight *= kSlowFactor * median_ms / relay.build_ms;
+      }
+      return std::max(weight, kMinWeight);
+    }
+
+    void applyWeights() {
+      std::vector<std::string> fingerprints;
+      std::vector<tor::TOR_RelayWeight> weights;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        double median_ms = 0;
+        if (_buildTimeCount >= kMinWindow) {
+          std::vector<uint32_t> window(_buildTimes.begin(), _buildTimes.begin() + _buildTimeCount);
+          auto middle = window.begin() + window.size() / 2;
+          std::nth_element(window.begin(), middle, window.end());
+          median_ms = *middle;
+        }
+        for (const auto &[fingerprint, relay] : _relays) {
+          double value = weight(relay, median_ms);
+          if (value < 1) {
+            fingerprints.push_back(fingerprint);
+            weights.push_back(tor::TOR_RelayWeight{nullptr, value});
+          }
+        }
+        _penalized = weights.size();
+      }
+      // Point into the copies only once the vector stopped growing.
+      for (size_t i = 0; i < weights.size(); i++) {
+        weights[i].fingerprint = fingerprints[i].c_str();
+      }
+      tor::set_relay_weights(weights.data(), weights.size());
+    }
+
+    std::mutex _mutex;
+    std::unordered_map<std::string, Relay> _relays;
+    std::array<uint32_t, kWindowSize> _buildTimes{};
+    uint32_t _buildTimeCount = 0;
+    uint32_t _nextBuildTime = 0;
+    uint64_t _circuits = 0;
+    uint64_t _failures = 0;
+    size_t _penalized = 0;
+    std::string _path;
+    bool _flushScheduled = false;
+  };
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,354 @@
+#pragma once
+#include "HttpRequest.hpp"
+#include "HybridTorSpec.hpp"
+#include "tor_ffi.h"
+#include <NitroModules/ArrayBuffer.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // A multipart/form-data body streamed to Tor through a TOR_BodySource instead of being
+  // concatenated: part headers are small strings, field data stays in the ArrayBuffer it came in
+  // and files are read in chunks while the request is sent. Immutable once built, every attempt
+  // of a request reads it through its own Reader.
+  class RequestBody : public std::enable_shared_from_this<RequestBody> {
+  public:
+    // Throws std::invalid_argument for fields that can't be sent, including files that can't
+    // be opened. Has to run on the JS thread, JS owned buffers are copied here.
+    static std::shared_ptr<RequestBody> multipart(const std::vector<FormField> &fields) {
+      auto body = std::shared_ptr<RequestBody>(new RequestBody());
+      body->_boundary = randomBoundary();
+      std::string text;
+      for (const auto &field : fields) {
+        checkField(field);
+        text += "--" + body->_boundary + "\r\nContent-Disposition: form-data; name=\"" +
+                escapeQuoted(field.name) + "\"";
+        if (field.value.has_value()) {
+          text += "\r\n\r\n" + *field.value + "\r\n";
+          continue;
+        }
+
+        bool file = field.file_path.has_value();
+        auto filename = field.filename.value_or(file ? baseName(*field.file_path) : "blob");
+        text += "; filename=\"" + escapeQuoted(filename) + "\"\r\nContent-Type: " +
+                field.content_type.value_or("application/octet-stream") + "\r\n\r\n";
+        body->appendText(std::move(text));
+        text.clear();
+        if (file) {
+          body->appendFile(*field.file_path);
+        } else {
+          body->appendBuffer(*field.data);
+        }
+        text = "\r\n";
+      }
+      text += "--" + body->_boundary + "--\r\n";
+      body->appendText(std::move(text));
+      return body;
+    }
+
+    // application/x-www-form-urlencoded as browsers encode it, built as a string since forms
+    // like these are small. Files are rejected, buffers are sent as their bytes.
+    static std::string urlencoded(const std::vector<FormField> &fields) {
+      std::string encoded;
+      for (const auto &field : fields) {
+        checkField(field);
+        if (field.file_path.has_value()) {
+          throw std::invalid_argument("Field \"" + field.name +
+                                      "\": urlencoded forms can't contain files");
+        }
+        if (!encoded.empty()) {
+          encoded.push_back('&');
+        }
+        appendUrlencoded(encoded, field.name);
+        encoded.push_back('=');
+        if (field.value.has_value()) {
+          appendUrlencoded(encoded, *field.value);
+        } else {
+          const auto &data = *field.data;
+          appendUrlencoded(encoded, std::string_view(reinterpret_cast<const char *>(data->data()),
+                                                     data->size()));
+        }
+      }
+      return encoded;
+    }
+
+    uint64_t length() const { return _length; }
+
+    std::string contentType() const { return "multipart/form-data; boundary=" + _boundary; }
+
+    // A source reading the body from the start, owned by the FFI until its release().
+    tor::TOR_BodySource source() const {
+      return tor::TOR_BodySource{&Reader::onRead, &Reader::onRelease,
+                                 new Reader(shared_from_this()), _length};
+    }
+
+    // Reads the whole body in chunks, for interceptors that hash it. Returns false with `error`
+    // set if a file can't be read.
+    bool forEach(const std::function<void(std::string_view)> &chunk, std::string &error) const {
+      Reader reader(shared_from_this());
+      std::string buffer(kChunkBytes, '\0');
+      while (true) {
+        auto n = reader.read(reinterpret_cast<unsigned char *>(buffer.data()), buffer.size());
+        if (n < 0) {
+          error = reader.error();
+          return false;
+        }
+        if (n == 0) {
+          return true;
+        }
+        chunk(std::string_view(buffer.data(), static_cast<size_t>(n)));
+      }
+    }
+
+    // Source over a body received as bytes, e.g. by the owner of a shared transport.
+    static tor::TOR_BodySource stringSource(std::string &&body) {
+      struct Cursor {
+        std::string body;
+        size_t offset = 0;
+      };
+      auto length = body.size();
+      auto *cursor = new Cursor{std::move(body)};
+      return tor::TOR_BodySource{
+          [](void *context, unsigned char *buffer, size_t capacity) -> long long {
+            auto &cursor = *static_cast<Cursor *>(context);
+            size_t n = std::min(capacity, cursor.body.size() - cursor.offset);
+            std::memcpy(buffer, cursor.body.data() + cursor.offset, n);
+            cursor.offset += n;
+            return static_cast<long long>(n);
+          },
+          [](void *context) { delete static_cast<Cursor *>(context); }, cursor, length};
+    }
+
+  private:
+    static constexpr size_t kChunkBytes = 64 * 1024;
+
+    // One run of the body: text, a buffer or a file. Exactly one of them is set.
+    struct Segment {
+      std::string text;
+      std::shared_ptr<ArrayBuffer> buffer;
+      std::string path;
+      uint64_t size = 0;
+    };
+
+    // Position of one pass over the body. File descriptors are opened when their segment is
+    // reached and closed once it is done.
+    class Reader {
+    public:
+      explicit Reader(std::shared_ptr<const RequestBody> body) : _body(std::move(body)) {}
+
+      ~Reader() { closeFile(); }
+
+      long long read(unsigned char *buffer, size_t capacity) {
+        size_t total = 0;
+        while (total < capacity && _segment < _body->_segments.size()) {
+          const auto &segment = _body->_segments[_segment];
+          uint64_t left = segment.size - _offset;
+          size_t n = static_cast<size_t>(std::min<uint64_t>(left, capacity - total));
+          if (!segment.path.empty()) {
+            auto got = readFile(segment, buffer + total, n);
+            if (got < 0) {
+              return -1;
+            }
+            n = static_cast<size_t>(got);
+          } else {
+            const uint8_t *data = segment.buffer
+                                      ? segment.buffer->data()
+                                      : reinterpret_cast<const uint8_t *>(segment.text.data());
+            std::memcpy(buffer + total, data + _offset, n);
+          }
+          total += n;
+          _offset += n;
+          if (_offset == segment.size) {
+            closeFile();
+            _segment++;
+            _offset = 0;
+          }
+        }
+        return static_cast<long long>(total);
+      }
+
+      const std::string &error() const { return _error; }
+
+      static long long onRead(void *context, unsigned char *buffer, size_t capacity) {
+        return static_cast<Reader *>(context)->read(buffer, capacity);
+      }
+
+      static void onRelease(void *context) { delete static_cast<Reader *>(context); }
+
+    private:
+      long long readFile(const Segment &segment, unsigned char *buffer, size_t capacity) {
+        if (capacity == 0) {
+          // Empty file, read(2) could not tell it from one that shrank.
+          return 0;
+        }
+        if (_fd < 0) {
+          _fd = ::open(segment.path.c_str(), O_RDONLY | O_CLOEXEC);
+          if (_fd < 0) {
+            return fail("Can't open " + segment.path + ": " + std::strerror(errno));
+          }
+        }
+        while (true) {
+          auto n = ::read(_fd, buffer, capacity);
+          if (n > 0) {
+            return n;
+          }
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          if (n < 0) {
+            return fail("Can't read " + segment.path + ": " + std::strerror(errno));
+          }
+          // Content-Length is already on its way, a shrunk file can't be sent any more.
+          return fail(segment.path + " got shorter while it was sent");
+        }
+      }
+
+      long long fail(std::string error) {
+        _error = std::move(error);
+        closeFile();
+        return -1;
+      }
+
+      void closeFile() {
+        if (_fd >= 0) {
+          ::close(_fd);
+          _fd = -1;
+        }
+      }
+
+      std::shared_ptr<const RequestBody> _body;
+      size_t _segment = 0;
+      uint64_t _offset = 0;
+      int _fd = -1;
+      std::string _error;
+    };
+
+    RequestBody() = default;
+
+    static void checkField(const FormField &field) {
+      int sources = field.value.has_value() + (field.data.has_value() && *field.data) +
+                    field.file_path.has_value();
+      if (sources != 1) {
+        throw std::invalid_argument("Field \"" + field.name +
+                                    "\" needs exactly one of value, data and file_path");
+      }
+      if (field.content_type.has_value() &&
+          field.content_type->find_first_of("\r\n") != std::string::npos) {
+        throw std::invalid_argument("Field \"" + field.name + "\" has an invalid content_type");
+      }
+    }
+
+    void appendText(std::string &&text) {
+      if (text.empty()) {
+        return;
+      }
+      _length += text.size();
+      if (!_segments.empty() && _segments.back().path.empty() && !_segments.back().buffer) {
+        _segments.back().text += text;
+        _segments.back().size += text.size();
+        return;
+      }
+      Segment segment;
+      segment.size = text.size();
+      segment.text = std::move(text);
+      _segments.push_back(std::move(segment));
+    }
+
+    void appendBuffer(const std::shared_ptr<ArrayBuffer> &buffer) {
+      Segment segment;
+      // Native buffers can be read from any thread and are kept as they are.
+      segment.buffer = buffer->isOwner() ? buffer : ArrayBuffer::copy(buffer);
+      segment.size = segment.buffer->size();
+      _length += segment.size;
+      _segments.push_back(std::move(segment));
+    }
+
+    // The size is taken now and sent as part of Content-Length, the contents only while the
+    // request is sent.
+    void appendFile(const std::string &path) {
+      struct stat info;
+      if (::stat(path.c_str(), &info) != 0) {
+        throw std::invalid_argument("Can't read " + path + ": " + std::strerror(errno));
+      }
+      if (!S_ISREG(info.st_mode)) {
+        throw std::invalid_argument(path + " is not a regular file");
+      }
+      Segment segment;
+      segment.path = path;
+      segment.size = static_cast<uint64_t>(info.st_size);
+      _length += segment.size;
+      _segments.push_back(std::move(segment));
+    }
+
+    static std::string randomBoundary() {
+      static constexpr char kAlphabet[] =
+          "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+      std::random_device random;
+      std::string boundary = "----NitroTorFormBoundary";
+      for (int i = 0; i < 24; i++) {
+        boundary.push_back(kAlphabet[random() % (sizeof(kAlphabet) - 1)]);
+      }
+      return boundary;
+    }
+
+    static std::string baseName(std::string_view path) {
+      auto slash = path.find_last_of('/');
+      return std::string(slash == std::string_view::npos ? path : path.substr(slash + 1));
+    }
+
+    // Quoted parameters of Content-Disposition, escaped the way browsers do.
+    static std::string escapeQuoted(std::string_view value) {
+      std::string escaped;
+      escaped.reserve(value.size());
+      for (char c : value) {
+        switch (c) {
+        case '"':
+          escaped += "%22";
+          break;
+        case '\r':
+          escaped += "%0D";
+          break;
+        case '\n':
+          escaped += "%0A";
+          break;
+        default:
+          escaped.push_back(c);
+        }
+      }
+      return escaped;
+    }
+
+    static void appendUrlencoded(std::string &out, std::string_view value) {
+      static constexpr char kHex[] = "0123456789ABCDEF";
+      for (char c : value) {
+        auto byte = static_cast<unsigned char>(c);
+        if ((byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') ||
+            (byte >= '0' && byte <= '9') || c == '*' || c == '-' || c == '.' || c == '_') {
+          out.push_back(c);
+        } else if (c == ' ') {
+          out.push_back('+');
+        } else {
+          out.push_back('%');
+          out.push_back(kHex[byte >> 4]);
+          out.push_back(kHex[byte & 15]);
+        }
+      }
+    }
+
+    std::string _boundary;
+    std::vector<Segment> _segments;
+    uint64_t _length = 0;
+  };
+} // namespace margelo::nitro::nitrotor
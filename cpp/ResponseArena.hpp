@@ -0,0 +1,16 @@
+#pragma once
+#include "tor_ffi.h"
+#include <string_view>
+
+namespace margelo::nitro::nitrotor {
+  // View of a string in a response arena, valid until the arena is released. Out of range slices
+  // read as empty: the arena comes from another library, or another process for SharedTransport,
+  // and a malformed one must not make us read past it.
+  inline std::string_view arenaString(const tor::TOR_Arena &arena, tor::TOR_ArenaString string) {
+    if (arena.data == nullptr || string.offset > arena.size ||
+        string.length > arena.size - string.offset) {
+      return {};
+    }
+    return std::string_view(arena.data + string.offset, string.length);
+  }
+} // namespace margelo::nitro::nitrotor
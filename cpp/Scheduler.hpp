@@ -0,0 +1,85 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // One background thread running delayed tasks (retry backoff, hedging timers, ...). Tasks must
+  // be short and non-blocking, anything heavier should be handed to the ThreadPool.
+  class Scheduler {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    static Scheduler &shared() {
+      static Scheduler instance;
+      return instance;
+    }
+
+    void schedule(std::chrono::milliseconds delay, std::function<void()> &&task) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _tasks.push(Task{Clock::now() + delay, _sequence++, std::move(task)});
+      }
+      _condition.notify_one();
+    }
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+  private:
+    struct Task {
+      Clock::time_point deadline;
+      // Keeps tasks with the same deadline in submission order.
+      uint64_t sequence;
+      std::function<void()> run;
+
+      bool operator>(const Task &other) const {
+        return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+      }
+    };
+
+    Scheduler() : _thread([this]() { loop(); }) {}
+
+    ~Scheduler() {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopped = true;
+      }
+      _condition.notify_one();
+      _thread.join();
+    }
+
+    void loop() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (!_stopped) {
+        if (_tasks.empty()) {
+          _condition.wait(lock);
+          continue;
+        }
+        auto deadline = _tasks.top().deadline;
+        if (Clock::now() < deadline) {
+          _condition.wait_until(lock, deadline);
+          continue;
+        }
+
+        auto task = std::move(const_cast<Task &>(_tasks.top()).run);
+        _tasks.pop();
+        lock.unlock();
+        task();
+        lock.lock();
+      }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::priority_queue<Task, std::vector<Task>, std::greater<Task>> _tasks;
+    uint64_t _sequence = 0;
+    bool _stopped = false;
+    std::thread _thread;
+  };
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,84 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace margelo::nitro::nitrotor {
+  // SHA-1 (FIPS 180-4), only used for the Sec-WebSocket-Accept check of the WebSocket handshake
+  // (RFC 6455) where it is mandated. Not for anything security relevant.
+  inline std::array<uint8_t, 20> sha1(std::string_view message) {
+    std::array<uint32_t, 5> state{0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    auto rotateLeft = [](uint32_t value, int bits) {
+      return (value << bits) | (value >> (32 - bits));
+    };
+
+    auto compress = [&](const uint8_t *block) {
+      std::array<uint32_t, 80> w;
+      for (int i = 0; i < 16; i++) {
+        w[i] = static_cast<uint32_t>(block[i * 4]) << 24 |
+               static_cast<uint32_t>(block[i * 4 + 1]) << 16 |
+               static_cast<uint32_t>(block[i * 4 + 2]) << 8 |
+               static_cast<uint32_t>(block[i * 4 + 3]);
+      }
+      for (int i = 16; i < 80; i++) {
+        w[i] = rotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+      }
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+      for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+          f = (b & c) | (~b & d);
+          k = 0x5A827999;
+        } else if (i < 40) {
+          f = b ^ c ^ d;
+          k = 0x6ED9EBA1;
+        } else if (i < 60) {
+          f = (b & c) | (b & d) | (c & d);
+          k = 0x8F1BBCDC;
+        } else {
+          f = b ^ c ^ d;
+          k = 0xCA62C1D6;
+        }
+        uint32_t temp = rotateLeft(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotateLeft(b, 30);
+        b = a;
+        a = temp;
+      }
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+    };
+
+    size_t offset = 0;
+    for (; message.size() - offset >= 64; offset += 64) {
+      compress(reinterpret_cast<const uint8_t *>(message.data()) + offset);
+    }
+
+    // Final one or two blocks: remaining bytes, 0x80, zero padding and the bit length.
+    std::array<uint8_t, 128> tail{};
+    size_t remaining = message.size() - offset;
+    std::memcpy(tail.data(), message.data() + offset, remaining);
+    tail[remaining] = 0x80;
+    size_t tail_length = remaining + 9 <= 64 ? 64 : 128;
+    uint64_t bit_length = static_cast<uint64_t>(message.size()) * 8;
+    for (int i = 0; i < 8; i++) {
+      tail[tail_length - 1 - i] = static_cast<uint8_t>(bit_length >> (8 * i));
+    }
+    for (size_t block = 0; block < tail_length; block += 64) {
+      compress(tail.data() + block);
+    }
+
+    std::array<uint8_t, 20> digest;
+    for (int i = 0; i < 5; i++) {
+      for (int j = 0; j < 4; j++) {
+        digest[i * 4 + j] = static_cast<uint8_t>(state[i] >> (24 - 8 * j));
+      }
+    }
+    return digest;
+  }
+} // namespace margelo::nitro::nitrotor
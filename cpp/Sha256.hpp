@@ -0,0 +1,175 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace margelo::nitro::nitrotor {
+  // SHA-256 (FIPS 180-4) and HMAC-SHA256 (RFC 2104) for request signing. Small and dependency
+  // free, signing a request hashes at most its body once.
+  class Sha256 {
+  public:
+    static constexpr size_t kDigestLength = 32;
+    static constexpr size_t kBlockLength = 64;
+    using Digest = std::array<uint8_t, kDigestLength>;
+
+    void update(const void *data, size_t length) {
+      auto bytes = static_cast<const uint8_t *>(data);
+      _length += length;
+      if (_buffered > 0) {
+        size_t take = std::min(length, kBlockLength - _buffered);
+        std::memcpy(_buffer.data() + _buffered, bytes, take);
+        _buffered += take;
+        bytes += take;
+        length -= take;
+        if (_buffered < kBlockLength) {
+          return;
+        }
+        compress(_buffer.data());
+        _buffered = 0;
+      }
+      for (; length >= kBlockLength; bytes += kBlockLength, length -= kBlockLength) {
+        compress(bytes);
+      }
+      std::memcpy(_buffer.data(), bytes, length);
+      _buffered = length;
+    }
+
+    void update(std::string_view data) { update(data.data(), data.size()); }
+
+    Digest finish() {
+      uint64_t bit_length = _length * 8;
+      uint8_t padding = 0x80;
+      update(&padding, 1);
+      padding = 0;
+      while (_buffered != kBlockLength - 8) {
+        update(&padding, 1);
+      }
+      uint8_t length_bytes[8];
+      for (int i = 0; i < 8; i++) {
+        length_bytes[i] = static_cast<uint8_t>(bit_length >> (56 - 8 * i));
+      }
+      update(length_bytes, sizeof(length_bytes));
+
+      Digest digest;
+      for (size_t i = 0; i < _state.size(); i++) {
+        for (int j = 0; j < 4; j++) {
+          digest[i * 4 + j] = static_cast<uint8_t>(_state[i] >> (24 - 8 * j));
+        }
+      }
+      return digest;
+    }
+
+    static Digest hash(std::string_view data) {
+      Sha256 sha;
+      sha.update(data);
+      return sha.finish();
+    }
+
+    static Digest hmac(std::string_view key, std::string_view message) {
+      std::array<uint8_t, kBlockLength> block{};
+      if (key.size() > kBlockLength) {
+        auto key_digest = hash(key);
+        std::memcpy(block.data(), key_digest.data(), key_digest.size());
+      } else {
+        std::memcpy(block.data(), key.data(), key.size());
+      }
+
+      std::array<uint8_t, kBlockLength> pad;
+      for (size_t i = 0; i < kBlockLength; i++) {
+        pad[i] = block[i] ^ 0x36;
+      }
+      Sha256 inner;
+      inner.update(pad.data(), pad.size());
+      inner.update(message);
+      auto inner_digest = inner.finish();
+
+      for (size_t i = 0; i < kBlockLength; i++) {
+        pad[i] = block[i] ^ 0x5c;
+      }
+      Sha256 outer;
+      outer.update(pad.data(), pad.size());
+      outer.update(inner_digest.data(), inner_digest.size());
+      return outer.finish();
+    }
+
+    static std::string toHex(const Digest &digest) {
+      static constexpr char kDigits[] = "0123456789abcdef";
+      std::string hex;
+      hex.reserve(digest.size() * 2);
+      for (auto byte : digest) {
+        hex.push_back(kDigits[byte >> 4]);
+        hex.push_back(kDigits[byte & 0x0f]);
+      }
+      return hex;
+    }
+
+  private:
+    static constexpr std::array<uint32_t, 64> kRoundConstants{
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+        0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+        0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+        0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+        0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+        0xc67178f2};
+
+    static uint32_t rotateRight(uint32_t value, int bits) {
+      return (value >> bits) | (value << (32 - bits));
+    }
+
+    void compress(const uint8_t *block) {
+      std::array<uint32_t, 64> w;
+      for (int i = 0; i < 16; i++) {
+        w[i] = static_cast<uint32_t>(block[i * 4]) << 24 |
+               static_cast<uint32_t>(block[i * 4 + 1]) << 16 |
+               static_cast<uint32_t>(block[i * 4 + 2]) << 8 |
+               static_cast<uint32_t>(block[i * 4 + 3]);
+      }
+      for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+
+      uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+      uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+      for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + choice + kRoundConstants[i] + w[i];
+        uint32_t s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+      }
+      _state[0] += a;
+      _state[1] += b;
+      _state[2] += c;
+      _state[3] += d;
+      _state[4] += e;
+      _state[5] += f;
+      _state[6] += g;
+      _state[7] += h;
+    }
+
+    std::array<uint32_t, 8> _state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    std::array<uint8_t, kBlockLength> _buffer{};
+    size_t _buffered = 0;
+    uint64_t _length = 0;
+  };
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,105 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace margelo::nitro::nitrotor {
+  // SHA3-256 (FIPS 202) for the checksum of v3 onion addresses. Only short inputs are hashed, so
+  // this favours size over speed.
+  class Sha3_256 {
+  public:
+    static constexpr size_t kDigestLength = 32;
+    // Rate of SHA3-256 in bytes, 1600 - 2 * 256 bits.
+    static constexpr size_t kBlockLength = 136;
+    using Digest = std::array<uint8_t, kDigestLength>;
+
+    void update(const void *data, size_t length) {
+      auto bytes = static_cast<const uint8_t *>(data);
+      for (size_t i = 0; i < length; i++) {
+        absorb(bytes[i]);
+      }
+    }
+
+    void update(std::string_view data) { update(data.data(), data.size()); }
+
+    Digest finish() {
+      // Domain separation bits 01 followed by pad10*1.
+      _state[_position / 8] ^= uint64_t(0x06) << (8 * (_position % 8));
+      _state[(kBlockLength - 1) / 8] ^= uint64_t(0x80) << (8 * ((kBlockLength - 1) % 8));
+      permute();
+      Digest digest;
+      for (size_t i = 0; i < kDigestLength; i++) {
+        digest[i] = static_cast<uint8_t>(_state[i / 8] >> (8 * (i % 8)));
+      }
+      return digest;
+    }
+
+    static Digest hash(std::string_view data) {
+      Sha3_256 sha;
+      sha.update(data);
+      return sha.finish();
+    }
+
+  private:
+    void absorb(uint8_t byte) {
+      _state[_position / 8] ^= uint64_t(byte) << (8 * (_position % 8));
+      if (++_position == kBlockLength) {
+        permute();
+        _position = 0;
+      }
+    }
+
+    static uint64_t rotl(uint64_t value, unsigned shift) {
+      return shift == 0 ? value : (value << shift) | (value >> (64 - shift));
+    }
+
+    // Keccak-f[1600].
+    void permute() {
+      static constexpr std::array<uint64_t, 24> kRoundConstants = {
+          0x0000000000000001, 0x0000000000008082, 0x800000000000808a, 0x8000000080008000,
+          0x000000000000808b, 0x0000000080000001, 0x8000000080008081, 0x8000000000008009,
+          0x000000000000008a, 0x0000000000000088, 0x0000000080008009, 0x000000008000000a,
+          0x000000008000808b, 0x800000000000008b, 0x8000000000008089, 0x8000000000008003,
+          0x8000000000008002, 0x8000000000000080, 0x000000000000800a, 0x800000008000000a,
+          0x8000000080008081, 0x8000000000008080, 0x0000000080000001, 0x8000000080008008};
+      // Rotation of lane x + 5y.
+      static constexpr std::array<unsigned, 25> kRotations = {
+          0,  1,  62, 28, 27, 36, 44, 6,  55, 20, 3,  10, 43,
+          25, 39, 41, 45, 15, 21, 8,  18, 2,  61, 56, 14};
+
+      auto &a = _state;
+      for (uint64_t round_constant : kRoundConstants) {
+        // Theta
+        std::array<uint64_t, 5> c;
+        for (size_t x = 0; x < 5; x++) {
+          c[x] = a[x] ^ a[x + 5] ^ a[x + 10] ^ a[x + 15] ^ a[x + 20];
+        }
+        for (size_t x = 0; x < 5; x++) {
+          uint64_t d = c[(x + 4) % 5] ^ rotl(c[(x + 1) % 5], 1);
+          for (size_t y = 0; y < 25; y += 5) {
+            a[x + y] ^= d;
+          }
+        }
+        // Rho and pi: lane (x, y) moves to (y, 2x + 3y).
+        std::array<uint64_t, 25> b;
+        for (size_t x = 0; x < 5; x++) {
+          for (size_t y = 0; y < 5; y++) {
+            b[y + 5 * ((2 * x + 3 * y) % 5)] = rotl(a[x + 5 * y], kRotations[x + 5 * y]);
+          }
+        }
+        // Chi
+        for (size_t y = 0; y < 25; y += 5) {
+          for (size_t x = 0; x < 5; x++) {
+            a[x + y] = b[x + y] ^ (~b[(x + 1) % 5 + y] & b[(x + 2) % 5 + y]);
+          }
+        }
+        // Iota
+        a[0] ^= round_constant;
+      }
+    }
+
+    std::array<uint64_t, 25> _state{};
+    size_t _position = 0;
+  };
+} // namespace margelo::nitro::nitrotor
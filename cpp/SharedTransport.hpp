@@ -0,0 +1,1026 @@
+#pragma once
+#include "HttpTransport.hpp"
+#include "RequestBody.hpp"
+#include "ShmRing.hpp"
+#include "tor_ffi.h"
+#include <NitroModules/ThreadPool.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // One connection of a shared transport: a Unix socket as control channel and a ShmRegion with
+  // one ring per direction. The socket carries the region's descriptor during the handshake and
+  // afterwards only one byte doorbells, sent when the other side announced that it sleeps. While
+  // both sides are busy, messages flow through the rings without any system call.
+  //
+  // Every channel runs one I/O thread, the single producer of its outgoing ring and the single
+  // consumer of the incoming one. send() may be called from any thread and only queues.
+  class ShmChannel : public std::enable_shared_from_this<ShmChannel> {
+  public:
+    // A message to write, as views into memory kept alive by `owner` until it is written.
+    struct Outgoing {
+      std::vector<std::string_view> parts;
+      std::shared_ptr<void> owner;
+    };
+
+    // Called on the I/O thread. `message` points into shared memory (or a reassembly buffer for
+    // messages larger than one record) and is only valid during the call.
+    using MessageHandler = std::function<void(std::string_view message)>;
+    using CloseHandler = std::function<void()>;
+
+    ShmChannel(int socket, ShmRegion &&region, bool owner)
+        : _socket(socket), _region(std::move(region)),
+          _tx(owner ? _region.responses() : _region.requests()),
+          _rx(owner ? _region.requests() : _region.responses()) {
+      int wake[2];
+      if (pipe(wake) != 0) {
+        ::close(_socket);
+        throw std::runtime_error("Failed to create shared transport wake pipe");
+      }
+      _wakeRead = wake[0];
+      _wakeWrite = wake[1];
+      fcntl(_wakeRead, F_SETFL, O_NONBLOCK);
+      fcntl(_wakeWrite, F_SETFL, O_NONBLOCK);
+      fcntl(_wakeRead, F_SETFD, FD_CLOEXEC);
+      fcntl(_wakeWrite, F_SETFD, FD_CLOEXEC);
+      fcntl(_socket, F_SETFL, O_NONBLOCK);
+    }
+
+    ~ShmChannel() {
+      ::close(_socket);
+      ::close(_wakeRead);
+      ::close(_wakeWrite);
+    }
+
+    ShmChannel(const ShmChannel &) = delete;
+    ShmChannel &operator=(const ShmChannel &) = delete;
+
+    void start(MessageHandler on_message, CloseHandler on_close) {
+      _onMessage = std::move(on_message);
+      _onClose = std::move(on_close);
+      std::thread([self = shared_from_this()]() { self->run(); }).detach();
+    }
+
+    // Returns false once the channel is closed, the message is dropped then.
+    bool send(Outgoing &&message) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_closed) {
+          return false;
+        }
+        _queue.push_back(std::move(message));
+      }
+      wake();
+      return true;
+    }
+
+    void close() {
+      _closeRequested.store(true);
+      wake();
+    }
+
+    // Shared memory mapped for the channel, counted by both processes.
+    uint64_t mappedBytes() const { return _region.size(); }
+
+  private:
+    void run() {
+      try {
+        loop();
+      } catch (const std::exception &) {
+        // A corrupted ring, treated like a peer that went away.
+      }
+      std::deque<Outgoing> dropped;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        dropped.swap(_queue);
+      }
+      // Release the messages (and their owners) before reporting the close.
+      dropped.clear();
+      _writing.reset();
+      shutdown(_socket, SHUT_RDWR);
+      _onClose();
+      _onMessage = nullptr;
+      _onClose = nullptr;
+    }
+
+    void loop() {
+      while (!_closeRequested.load()) {
+        drainWakePipe();
+        bool ring = false;
+        bool progress = true;
+        while (progress) {
+          progress = write(ring);
+          progress = read(ring) || progress;
+        }
+        if (ring) {
+          doorbell();
+        }
+
+        bool sleep = !_writing.has_value() || _tx.sleepAsProducer(nextRecordLength());
+        sleep = sleep && _rx.sleepAsConsumer();
+        if (!sleep) {
+          continue;
+        }
+        pollfd fds[2] = {{_socket, POLLIN, 0}, {_wakeRead, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+          return;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR) && !drainDoorbells()) {
+          return;
+        }
+      }
+    }
+
+    // Writes queued messages until the ring is full, fragmenting large ones.
+    bool write(bool &ring) {
+      bool progress = false;
+      while (true) {
+        if (!_writing.has_value()) {
+          std::lock_guard<std::mutex> lock(_mutex);
+          if (_queue.empty()) {
+            return progress;
+          }
+          _writing.emplace(std::move(_queue.front()));
+          _queue.pop_front();
+          _part = 0;
+          _partOffset = 0;
+        }
+
+        uint32_t length = nextRecordLength();
+        char *out = _tx.reserve(length);
+        if (out == nullptr) {
+          return progress;
+        }
+        for (uint32_t copied = 0; copied < length;) {
+          auto part = _writing->parts[_part].substr(_partOffset);
+          auto chunk = std::min<size_t>(part.size(), length - copied);
+          std::memcpy(out + copied, part.data(), chunk);
+          copied += static_cast<uint32_t>(chunk);
+          _partOffset += chunk;
+          if (_partOffset == _writing->parts[_part].size()) {
+            _part++;
+            _partOffset = 0;
+          }
+        }
+        bool more = remaining() > 0;
+        ring = _tx.commit(more ? ShmRing::kFlagMore : 0) || ring;
+        if (!more) {
+          _writing.reset();
+        }
+        progress = true;
+      }
+    }
+
+    bool read(bool &ring) {
+      bool progress = false;
+      while (auto record = _rx.peek()) {
+        std::string_view data(record->data, record->length);
+        if (record->flags & ShmRing::kFlagMore) {
+          _partial.append(data);
+        } else if (_partial.empty()) {
+          _onMessage(data);
+        } else {
+          _partial.append(data);
+          _onMessage(_partial);
+          _partial.clear();
+          _partial.shrink_to_fit();
+        }
+        ring = _rx.release() || ring;
+        progress = true;
+      }
+      return progress;
+    }
+
+    size_t remaining() const {
+      size_t bytes = 0;
+      for (size_t i = _part; i < _writing->parts.size(); i++) {
+        bytes += _writing->parts[i].size();
+      }
+      return bytes - _partOffset;
+    }
+
+    uint32_t nextRecordLength() const {
+      return static_cast<uint32_t>(std::min<size_t>(remaining(), _tx.maxRecord()));
+    }
+
+    void doorbell() {
+      char byte = 1;
+      // A full socket buffer already holds a doorbell the peer has not consumed yet.
+      (void)!::send(_socket, &byte, 1, MSG_NOSIGNAL);
+    }
+
+    // Returns false once the peer closed its end.
+    bool drainDoorbells() {
+      char buffer[64];
+      while (true) {
+        auto count = ::recv(_socket, buffer, sizeof(buffer), 0);
+        if (count > 0) {
+          continue;
+        }
+        return count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+      }
+    }
+
+    void wake() {
+      char byte = 1;
+      (void)!::write(_wakeWrite, &byte, 1);
+    }
+
+    void drainWakePipe() {
+      char buffer[64];
+      while (::read(_wakeRead, buffer, sizeof(buffer)) > 0) {
+      }
+    }
+
+    int _socket;
+    int _wakeRead = -1;
+    int _wakeWrite = -1;
+    ShmRegion _region;
+    ShmRing _tx;
+    ShmRing _rx;
+    MessageHandler _onMessage;
+    CloseHandler _onClose;
+    std::atomic<bool> _closeRequested{false};
+
+    std::mutex _mutex;
+    std::deque<Outgoing> _queue;
+    bool _closed = false;
+
+    // I/O thread only.
+    std::optional<Outgoing> _writing;
+    size_t _part = 0;
+    size_t _partOffset = 0;
+    std::string _partial;
+  };
+
+  // Message layout on the rings. Both sides run the same build (ShmRegion::kVersion is checked
+  // during the handshake), so the fixed parts are copied as plain structs. Strings follow the
+  // fixed part, each with a terminating NUL so the owner can pass them to Rust in place.
+  namespace shared_transport {
+    enum class MessageType : uint32_t { Request = 1, Response = 2, Cancel = 3 };
+
+    struct RequestMessage {
+      MessageType type;
+      uint32_t method_length;
+      uint64_t id;
+      uint64_t timeout_ms;
+      uint64_t connect_timeout_ms;
+      uint64_t first_byte_timeout_ms;
+      uint64_t isolation_token;
+      uint32_t url_length;
+      uint32_t headers_length;
+      uint32_t body_length;
+      uint32_t resolved_addr_length;
+      uint8_t has_body;
+      uint8_t decompress;
+      uint8_t has_resolved_addr;
+      // The body came from a TOR_BodySource and may contain NUL bytes.
+      uint8_t streamed_body;
+    };
+
+    struct ResponseMessage {
+      MessageType type;
+      int32_t error_kind;
+      uint64_t id;
+      uint64_t connect_ms;
+      uint64_t first_byte_ms;
+      uint64_t compressed_bytes;
+      uint64_t decompressed_bytes;
+      // The response's arena follows verbatim, body and error keep their offsets into it.
+      uint64_t arena_size;
+      uint64_t body_offset;
+      uint64_t body_length;
+      uint64_t error_offset;
+      uint64_t error_length;
+      uint64_t remote_addr_offset;
+      uint64_t remote_addr_length;
+      uint64_t remote_addr_ttl_s;
+      int32_t http_version;
+      uint16_t status_code;
+      uint8_t reused_connection;
+    };
+
+    struct CancelMessage {
+      MessageType type;
+      uint32_t reserved;
+      uint64_t id;
+    };
+
+    // Sent over the socket together with the region's descriptor.
+    struct Hello {
+      uint32_t magic;
+      uint32_t version;
+    };
+
+    inline MessageType typeOf(std::string_view message) {
+      MessageType type{};
+      if (message.size() >= sizeof(type)) {
+        std::memcpy(&type, message.data(), sizeof(type));
+      }
+      return type;
+    }
+
+    // Copies the fixed part out of `message` and checks that the strings it announces fit.
+    template <typename Fixed>
+    bool parse(std::string_view message, Fixed &fixed, uint64_t string_bytes(const Fixed &)) {
+      if (message.size() < sizeof(Fixed)) {
+        return false;
+      }
+      std::memcpy(&fixed, message.data(), sizeof(Fixed));
+      return sizeof(Fixed) + string_bytes(fixed) == message.size();
+    }
+
+    // View of the NUL terminated string at `offset`, advancing it.
+    inline const char *takeString(std::string_view message, size_t &offset, uint32_t length) {
+      const char *string = message.data() + offset;
+      offset += static_cast<size_t>(length) + 1;
+      return string[length] == '\0' ? string : nullptr;
+    }
+  } // namespace shared_transport
+
+  // Owner side: accepts connections from other processes on a Unix socket and runs their HTTP
+  // requests through the Rust client of this process.
+  class SharedTransportServer : public std::enable_shared_from_this<SharedTransportServer> {
+  public:
+    // Listens on `socket_path`, replacing a stale socket file. Throws if another owner is
+    // listening there or the socket cannot be created.
+    static std::shared_ptr<SharedTransportServer> listen(const std::string &socket_path,
+                                                         uint64_t ring_bytes) {
+      sockaddr_un address = socketAddress(socket_path);
+      int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+      bool in_use = probe >= 0 && ::connect(probe, reinterpret_cast<sockaddr *>(&address),
+                                            sizeof(address)) == 0;
+      if (probe >= 0) {
+        ::close(probe);
+      }
+      if (in_use) {
+        throw std::runtime_error("Another process already owns " + socket_path);
+      }
+      unlink(socket_path.c_str());
+
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+          ::listen(fd, 16) != 0) {
+        std::string error = strerror(errno);
+        if (fd >= 0) {
+          ::close(fd);
+        }
+        throw std::runtime_error("Failed to listen on " + socket_path + ": " + error);
+      }
+      // Only processes of the same user (i.e. the same app) may connect.
+      chmod(socket_path.c_str(), 0600);
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+      auto server = std::shared_ptr<SharedTransportServer>(
+          new SharedTransportServer(fd, socket_path, ring_bytes));
+      std::thread([server]() { server->acceptLoop(); }).detach();
+      return server;
+    }
+
+    ~SharedTransportServer() {
+      ::close(_listenFd);
+      ::close(_wakeRead);
+      ::close(_wakeWrite);
+    }
+
+    // Stops accepting, closes every connection and cancels their requests.
+    void stop() {
+      std::vector<std::shared_ptr<ShmChannel>> channels;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stopped) {
+          return;
+        }
+        _stopped = true;
+        for (auto &session : _sessions) {
+          if (auto channel = session->channel.lock()) {
+            channels.push_back(std::move(channel));
+          }
+        }
+      }
+      char byte = 1;
+      (void)!::write(_wakeWrite, &byte, 1);
+      for (auto &channel : channels) {
+        channel->close();
+      }
+      unlink(_socketPath.c_str());
+    }
+
+    uint64_t mappedBytes() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      uint64_t bytes = 0;
+      for (const auto &session : _sessions) {
+        if (auto channel = session->channel.lock()) {
+          bytes += channel->mappedBytes();
+        }
+      }
+      return bytes;
+    }
+
+    static sockaddr_un socketAddress(const std::string &socket_path) {
+      sockaddr_un address{};
+      address.sun_family = AF_UNIX;
+      if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path must be 1 to " +
+                                 std::to_string(sizeof(address.sun_path) - 1) + " bytes long");
+      }
+      std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+      return address;
+    }
+
+  private:
+    // Requests of one connected process.
+    struct Session {
+      std::weak_ptr<ShmChannel> channel;
+      std::mutex mutex;
+      // Client request id to Rust request id, 0 while http_request has not returned yet.
+      std::unordered_map<uint64_t, uint64_t> requests;
+    };
+
+    // Owned by the FFI between http_request() and onServed().
+    struct ServedCall {
+      std::shared_ptr<Session> session;
+      uint64_t id;
+    };
+
+    SharedTransportServer(int fd, std::string socket_path, uint64_t ring_bytes)
+        : _listenFd(fd), _socketPath(std::move(socket_path)), _ringBytes(ring_bytes) {
+      int wake[2];
+      if (pipe(wake) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to create shared transport wake pipe");
+      }
+      _wakeRead = wake[0];
+      _wakeWrite = wake[1];
+      auto slash = _socketPath.rfind('/');
+      _tempDir =
+          slash == std::string::npos ? "." : _socketPath.substr(0, std::max<size_t>(slash, 1));
+    }
+
+    void acceptLoop() {
+      while (true) {
+        pollfd fds[2] = {{_listenFd, POLLIN, 0}, {_wakeRead, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+          return;
+        }
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          if (_stopped) {
+            return;
+          }
+        }
+        if (fds[0].revents & POLLIN) {
+          int fd = accept(_listenFd, nullptr, nullptr);
+          if (fd >= 0) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            serve(fd);
+          }
+        }
+      }
+    }
+
+    void serve(int fd) {
+      std::shared_ptr<ShmChannel> channel;
+      try {
+        auto region = ShmRegion::create(_ringBytes, _tempDir);
+        if (!sendHello(fd, region.fd())) {
+          ::close(fd);
+          return;
+        }
+        channel = std::make_shared<ShmChannel>(fd, std::move(region), true);
+      } catch (const std::exception &) {
+        ::close(fd);
+        return;
+      }
+
+      auto session = std::make_shared<Session>();
+      session->channel = channel;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // Sessions are only ever added, drop the ones whose process went away.
+        _sessions.erase(std::remove_if(_sessions.begin(), _sessions.end(),
+                                       [](const auto &entry) { return entry->channel.expired(); }),
+                        _sessions.end());
+        _sessions.push_back(session);
+      }
+      channel->start([session](std::string_view message) { handle(session, message); },
+                     [session]() { closeSession(*session); });
+    }
+
+    static bool sendHello(int fd, int region_fd) {
+      shared_transport::Hello hello{ShmRegion::kMagic, ShmRegion::kVersion};
+      iovec payload{&hello, sizeof(hello)};
+      alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+      msghdr message{};
+      message.msg_iov = &payload;
+      message.msg_iovlen = 1;
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      cmsghdr *header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(sizeof(int));
+      std::memcpy(CMSG_DATA(header), &region_fd, sizeof(int));
+      return sendmsg(fd, &message, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(hello));
+    }
+
+    static void handle(const std::shared_ptr<Session> &session, std::string_view message) {
+      using namespace shared_transport;
+      switch (typeOf(message)) {
+      case MessageType::Request:
+        handleRequest(session, message);
+        return;
+      case MessageType::Cancel: {
+        CancelMessage cancel{};
+        if (message.size() != sizeof(cancel)) {
+          return;
+        }
+        std::memcpy(&cancel, message.data(), sizeof(cancel));
+        uint64_t request_id = 0;
+        {
+          std::lock_guard<std::mutex> lock(session->mutex);
+          auto it = session->requests.find(cancel.id);
+          request_id = it == session->requests.end() ? 0 : it->second;
+        }
+        if (request_id != 0) {
+          tor::cancel_http_request(request_id);
+        }
+        return;
+      }
+      default:
+        return;
+      }
+    }
+
+    static void handleRequest(const std::shared_ptr<Session> &session, std::string_view message) {
+      using namespace shared_transport;
+      RequestMessage fixed{};
+      auto strings = [](const RequestMessage &m) -> uint64_t {
+        return uint64_t(m.method_length) + m.url_length + m.headers_length + 3 +
+               (m.has_body ? uint64_t(m.body_length) + 1 : 0) +
+               (m.has_resolved_addr ? uint64_t(m.resolved_addr_length) + 1 : 0);
+      };
+      if (!parse<RequestMessage>(message, fixed, strings)) {
+        return;
+      }
+      size_t offset = sizeof(fixed);
+      const char *method = takeString(message, offset, fixed.method_length);
+      const char *url = takeString(message, offset, fixed.url_length);
+      const char *headers = takeString(message, offset, fixed.headers_length);
+      const char *body = fixed.has_body ? takeString(message, offset, fixed.body_length) : nullptr;
+      const char *resolved_addr = fixed.has_resolved_addr
+                                      ? takeString(message, offset, fixed.resolved_addr_length)
+                                      : nullptr;
+      if (!method || !url || !headers || (fixed.has_body && !body) ||
+          (fixed.has_resolved_addr && !resolved_addr)) {
+        return;
+      }
+
+      // Rust reads a body source after http_request returned, so a streamed body is copied out
+      // of the ring. It is passed on as a source because it may contain NUL bytes.
+      tor::TOR_BodySource body_source{};
+      if (fixed.streamed_body) {
+        body_source = RequestBody::stringSource(std::string(body, fixed.body_length));
+        body = nullptr;
+      }
+      // The strings stay in shared memory, Rust copies them before http_request returns.
+      tor::TOR_HttpRequest request{
+          method,
+          url,
+          headers,
+          body,
+          static_cast<unsigned long>(fixed.timeout_ms),
+          static_cast<unsigned long>(fixed.connect_timeout_ms),
+          static_cast<unsigned long>(fixed.first_byte_timeout_ms),
+          fixed.decompress != 0,
+          fixed.isolation_token,
+          resolved_addr,
+          fixed.streamed_body ? &body_source : nullptr,
+      };
+      {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->requests.emplace(fixed.id, 0);
+      }
+      auto request_id =
+          tor::http_request(&request, &SharedTransportServer::onServed,
+                            new ServedCall{session, fixed.id});
+      std::lock_guard<std::mutex> lock(session->mutex);
+      auto it = session->requests.find(fixed.id);
+      if (it != session->requests.end()) {
+        it->second = request_id;
+      }
+    }
+
+    // Runs on a Rust runtime thread and hands the response to the session's I/O thread, which
+    // copies the Rust allocated arena straight into the ring before releasing it.
+    static void onServed(void *context, tor::TOR_CHttpResponse result) {
+      using namespace shared_transport;
+      std::unique_ptr<ServedCall> call(static_cast<ServedCall *>(context));
+      auto response = std::shared_ptr<tor::TOR_CHttpResponse>(
+          new tor::TOR_CHttpResponse(result), [](tor::TOR_CHttpResponse *response) {
+            tor::free_http_response(*response);
+            delete response;
+          });
+      std::shared_ptr<ShmChannel> channel;
+      {
+        std::lock_guard<std::mutex> lock(call->session->mutex);
+        call->session->requests.erase(call->id);
+        channel = call->session->channel.lock();
+      }
+      if (!channel) {
+        return;
+      }
+
+      struct Storage {
+        ResponseMessage fixed;
+        std::shared_ptr<tor::TOR_CHttpResponse> response;
+      };
+      auto storage = std::make_shared<Storage>();
+      auto &fixed = storage->fixed;
+      fixed.type = MessageType::Response;
+      fixed.id = call->id;
+      fixed.status_code = result.status_code;
+      fixed.error_kind = static_cast<int32_t>(result.error_kind);
+      fixed.http_version = static_cast<int32_t>(result.http_version);
+      fixed.reused_connection = result.reused_connection;
+      fixed.connect_ms = result.connect_ms;
+      fixed.first_byte_ms = result.first_byte_ms;
+      fixed.compressed_bytes = result.compressed_bytes;
+      fixed.decompressed_bytes = result.decompressed_bytes;
+      fixed.arena_size = result.arena.data != nullptr ? result.arena.size : 0;
+      fixed.body_offset = result.body.offset;
+      fixed.body_length = result.body.length;
+      fixed.error_offset = result.error.offset;
+      fixed.error_length = result.error.length;
+      fixed.remote_addr_offset = result.remote_addr.offset;
+      fixed.remote_addr_length = result.remote_addr.length;
+      fixed.remote_addr_ttl_s = result.remote_addr_ttl_s;
+      storage->response = std::move(response);
+
+      ShmChannel::Outgoing outgoing;
+      outgoing.parts = {
+          std::string_view(reinterpret_cast<const char *>(&fixed), sizeof(fixed)),
+          std::string_view(result.arena.data, fixed.arena_size),
+      };
+      outgoing.owner = std::move(storage);
+      channel->send(std::move(outgoing));
+    }
+
+    // The connected process went away: nobody waits for its responses any more.
+    static void closeSession(Session &session) {
+      std::vector<uint64_t> in_flight;
+      {
+        std::lock_guard<std::mutex> lock(session.mutex);
+        for (const auto &[id, request_id] : session.requests) {
+          if (request_id != 0) {
+            in_flight.push_back(request_id);
+          }
+        }
+      }
+      for (auto request_id : in_flight) {
+        tor::cancel_http_request(request_id);
+      }
+    }
+
+    int _listenFd;
+    int _wakeRead = -1;
+    int _wakeWrite = -1;
+    std::string _socketPath;
+    std::string _tempDir;
+    uint64_t _ringBytes;
+
+    std::mutex _mutex;
+    std::vector<std::shared_ptr<Session>> _sessions;
+    bool _stopped = false;
+  };
+
+  // Process side without its own Tor client: sends HTTP requests to the owner's client through
+  // a SharedTransportServer. Set as the HttpExecutor's transport, see HybridTor.
+  class SharedTransportClient : public HttpTransport,
+                                public std::enable_shared_from_this<SharedTransportClient> {
+  public:
+    // Connects and completes the handshake within `timeout_ms`, throws on failure.
+    static std::shared_ptr<SharedTransportClient> connect(const std::string &socket_path,
+                                                          uint64_t timeout_ms) {
+      sockaddr_un address = SharedTransportServer::socketAddress(socket_path);
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0 ||
+          ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        std::string error = strerror(errno);
+        if (fd >= 0) {
+          ::close(fd);
+        }
+        throw std::runtime_error("Failed to connect to " + socket_path + ": " + error);
+      }
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+      int region_fd = receiveHello(fd, timeout_ms);
+      if (region_fd < 0) {
+        ::close(fd);
+        throw std::runtime_error("No shared transport handshake from " + socket_path);
+      }
+      std::shared_ptr<ShmChannel> channel;
+      try {
+        channel = std::make_shared<ShmChannel>(fd, ShmRegion::attach(region_fd), false);
+      } catch (const std::exception &) {
+        ::close(fd);
+        throw;
+      }
+
+      auto client = std::shared_ptr<SharedTransportClient>(new SharedTransportClient(channel));
+      std::weak_ptr<SharedTransportClient> weak = client;
+      channel->start(
+          [weak](std::string_view message) {
+            if (auto client = weak.lock()) {
+              client->handleResponse(message);
+            }
+          },
+          [weak]() {
+            if (auto client = weak.lock()) {
+              client->failPending();
+            }
+          });
+      return client;
+    }
+
+    ~SharedTransportClient() override { _channel->close(); }
+
+    bool connected() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return !_closed;
+    }
+
+    void disconnect() { _channel->close(); }
+
+    uint64_t mappedBytes() const { return _channel->mappedBytes(); }
+
+    uint64_t submit(const tor::TOR_HttpRequest &request, tor::TOR_HttpCallback callback,
+                    void *context) override {
+      using namespace shared_transport;
+      // The request is only valid during this call, copy it once into storage owned by the
+      // message. The I/O thread writes it into the ring from there.
+      struct Storage {
+        RequestMessage fixed;
+        std::string strings;
+      };
+      auto storage = std::make_shared<Storage>();
+      auto &fixed = storage->fixed;
+      fixed.type = MessageType::Request;
+      fixed.timeout_ms = request.timeout_ms;
+      fixed.connect_timeout_ms = request.connect_timeout_ms;
+      fixed.first_byte_timeout_ms = request.first_byte_timeout_ms;
+      fixed.isolation_token = request.isolation_token;
+      fixed.decompress = request.decompress;
+      fixed.has_body = request.body != nullptr || request.body_source != nullptr;
+      fixed.streamed_body = request.body_source != nullptr;
+      fixed.has_resolved_addr = request.resolved_addr != nullptr;
+      std::string_view method = request.method;
+      std::string_view url = request.url;
+      std::string_view headers = request.headers_json ? request.headers_json : "";
+      std::string_view body = request.body ? request.body : "";
+      std::string_view resolved_addr = request.resolved_addr ? request.resolved_addr : "";
+      fixed.method_length = static_cast<uint32_t>(method.size());
+      fixed.url_length = static_cast<uint32_t>(url.size());
+      fixed.headers_length = static_cast<uint32_t>(headers.size());
+      fixed.body_length = static_cast<uint32_t>(body.size());
+      fixed.resolved_addr_length = static_cast<uint32_t>(resolved_addr.size());
+
+      auto &strings = storage->strings;
+      strings.reserve(method.size() + url.size() + headers.size() + body.size() +
+                      resolved_addr.size() + 5);
+      for (auto part : {method, url, headers}) {
+        strings.append(part);
+        strings.push_back('\0');
+      }
+      bool body_failed = false;
+      if (request.body_source != nullptr) {
+        // Streamed bodies travel inside the message as well, the owner streams them on.
+        auto start = strings.size();
+        body_failed = !drainBody(*request.body_source, strings);
+        fixed.body_length = static_cast<uint32_t>(strings.size() - start);
+        strings.push_back('\0');
+      } else if (request.body != nullptr) {
+        strings.append(body);
+        strings.push_back('\0');
+      }
+      if (request.resolved_addr != nullptr) {
+        strings.append(resolved_addr);
+        strings.push_back('\0');
+      }
+
+      bool closed;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        fixed.id = _nextId++;
+        closed = _closed;
+        if (!closed && !body_failed) {
+          _pending.emplace(fixed.id, Pending{callback, context});
+        }
+      }
+      auto id = fixed.id;
+      if (closed || body_failed) {
+        // The callback must not run before submit returned.
+        ThreadPool::shared().run([callback, context, closed]() {
+          callback(context, closed ? closedResponse() : bodyErrorResponse());
+        });
+        return id;
+      }
+
+      ShmChannel::Outgoing outgoing;
+      outgoing.parts = {std::string_view(reinterpret_cast<const char *>(&fixed), sizeof(fixed)),
+                        storage->strings};
+      outgoing.owner = std::move(storage);
+      if (!_channel->send(std::move(outgoing))) {
+        // Closed in between, and the close may already have failed the pending requests.
+        ThreadPool::shared().run([self = shared_from_this()]() { self->failPending(); });
+      }
+      return id;
+    }
+
+    bool cancel(uint64_t request_id) override {
+      using namespace shared_transport;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_pending.find(request_id) == _pending.end()) {
+          return false;
+        }
+      }
+      auto message = std::make_shared<CancelMessage>(
+          CancelMessage{MessageType::Cancel, 0, request_id});
+      ShmChannel::Outgoing outgoing;
+      outgoing.parts = {std::string_view(reinterpret_cast<const char *>(message.get()),
+                                         sizeof(CancelMessage))};
+      outgoing.owner = std::move(message);
+      return _channel->send(std::move(outgoing));
+    }
+
+    // Responses point into the ring and are released by the I/O thread after the callback.
+    void release(tor::TOR_CHttpResponse) override {}
+
+  private:
+    struct Pending {
+      tor::TOR_HttpCallback callback;
+      void *context;
+    };
+
+    explicit SharedTransportClient(std::shared_ptr<ShmChannel> channel)
+        : _channel(std::move(channel)) {}
+
+    static int receiveHello(int fd, uint64_t timeout_ms) {
+      pollfd readable{fd, POLLIN, 0};
+      if (poll(&readable, 1, static_cast<int>(timeout_ms)) <= 0) {
+        return -1;
+      }
+      shared_transport::Hello hello{};
+      iovec payload{&hello, sizeof(hello)};
+      alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+      msghdr message{};
+      message.msg_iov = &payload;
+      message.msg_iovlen = 1;
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      if (recvmsg(fd, &message, 0) != static_cast<ssize_t>(sizeof(hello))) {
+        return -1;
+      }
+      cmsghdr *header = CMSG_FIRSTHDR(&message);
+      if (header == nullptr || header->cmsg_level != SOL_SOCKET ||
+          header->cmsg_type != SCM_RIGHTS) {
+        return -1;
+      }
+      int region_fd;
+      std::memcpy(&region_fd, CMSG_DATA(header), sizeof(int));
+      // Not through MSG_CMSG_CLOEXEC, Darwin lacks it.
+      fcntl(region_fd, F_SETFD, FD_CLOEXEC);
+      if (hello.magic != ShmRegion::kMagic || hello.version != ShmRegion::kVersion) {
+        ::close(region_fd);
+        return -1;
+      }
+      return region_fd;
+    }
+
+    static tor::TOR_CHttpResponse bodyErrorResponse() {
+      static char kError[] = "Request body could not be read";
+      tor::TOR_CHttpResponse response{};
+      response.arena = tor::TOR_Arena{kError, sizeof(kError)};
+      response.error = tor::TOR_ArenaString{0, sizeof(kError) - 1};
+      response.error_kind = tor::TOR_HttpErrorKind::Other;
+      return response;
+    }
+
+    // Appends a streamed body to `out` and releases its source, as the FFI would. Fails for read
+    // errors, for bodies that don't match their length and for those too large for a message.
+    static bool drainBody(const tor::TOR_BodySource &source, std::string &out) {
+      auto start = out.size();
+      bool ok = source.length <= UINT32_MAX;
+      if (ok) {
+        out.resize(start + source.length);
+        auto *data = reinterpret_cast<unsigned char *>(out.data() + start);
+        uint64_t filled = 0;
+        while (ok && filled < source.length) {
+          auto n = source.read(source.context, data + filled, source.length - filled);
+          ok = n > 0;
+          filled += ok ? static_cast<uint64_t>(n) : 0;
+        }
+        unsigned char extra;
+        ok = ok && source.read(source.context, &extra, 1) == 0;
+      }
+      if (!ok) {
+        out.resize(start);
+      }
+      source.release(source.context);
+      return ok;
+    }
+
+    static tor::TOR_CHttpResponse closedResponse() {
+      static char kError[] = "Shared transport closed";
+      tor::TOR_CHttpResponse response{};
+      response.arena = tor::TOR_Arena{kError, sizeof(kError)};
+      response.error = tor::TOR_ArenaString{0, sizeof(kError) - 1};
+      response.error_kind = tor::TOR_HttpErrorKind::Connect;
+      return response;
+    }
+
+    void handleResponse(std::string_view message) {
+      using namespace shared_transport;
+      if (typeOf(message) != MessageType::Response) {
+        return;
+      }
+      ResponseMessage fixed{};
+      // Offsets are checked where they are read, see arenaString() in ResponseArena.hpp.
+      auto strings = [](const ResponseMessage &m) -> uint64_t { return m.arena_size; };
+      if (!parse<ResponseMessage>(message, fixed, strings)) {
+        return;
+      }
+
+      Pending pending{};
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _pending.find(fixed.id);
+        if (it == _pending.end()) {
+          return;
+        }
+        pending = it->second;
+        _pending.erase(it);
+      }
+      // Zero copy: the arena stays in the ring until the callback returned.
+      tor::TOR_CHttpResponse response{
+          fixed.status_code,
+          tor::TOR_Arena{const_cast<char *>(message.data()) + sizeof(fixed),
+                         static_cast<size_t>(fixed.arena_size)},
+          tor::TOR_ArenaString{static_cast<size_t>(fixed.body_offset),
+                               static_cast<size_t>(fixed.body_length)},
+          tor::TOR_ArenaString{static_cast<size_t>(fixed.error_offset),
+                               static_cast<size_t>(fixed.error_length)},
+          static_cast<tor::TOR_HttpErrorKind>(fixed.error_kind),
+          static_cast<unsigned long>(fixed.connect_ms),
+          static_cast<unsigned long>(fixed.first_byte_ms),
+          fixed.compressed_bytes,
+          fixed.decompressed_bytes,
+          static_cast<tor::TOR_HttpVersion>(fixed.http_version),
+          fixed.reused_connection != 0,
+          tor::TOR_ArenaString{static_cast<size_t>(fixed.remote_addr_offset),
+                               static_cast<size_t>(fixed.remote_addr_length)},
+          static_cast<unsigned long>(fixed.remote_addr_ttl_s),
+      };
+      pending.callback(pending.context, response);
+    }
+
+    void failPending() {
+      std::unordered_map<uint64_t, Pending> pending;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        pending.swap(_pending);
+      }
+      for (const auto &[id, entry] : pending) {
+        entry.callback(entry.context, closedResponse());
+      }
+    }
+
+    std::shared_ptr<ShmChannel> _channel;
+    std::mutex _mutex;
+    std::unordered_map<uint64_t, Pending> _pending;
+    uint64_t _nextId = 1;
+    bool _closed = false;
+  };
+} // namespace margelo::nitro::nitrotor
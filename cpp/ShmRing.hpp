@@ -0,0 +1,303 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace margelo::nitro::nitrotor {
+  // Control block of one ShmRing, shared between the two processes. The counters grow
+  // monotonically, positions are taken modulo the capacity. Producer and consumer fields sit on
+  // separate cache lines so the two sides do not contend.
+  struct ShmRingHeader {
+    // Bytes published by the producer.
+    alignas(64) std::atomic<uint64_t> head;
+    // Set by the producer before it sleeps on a full ring.
+    std::atomic<uint32_t> producer_waiting;
+    // Bytes released by the consumer.
+    alignas(64) std::atomic<uint64_t> tail;
+    // Set by the consumer before it sleeps on an empty ring.
+    std::atomic<uint32_t> consumer_waiting;
+  };
+
+  // Lock-free single producer, single consumer ring of variable sized records in shared memory.
+  // Records never wrap: when one does not fit before the end, the rest is skipped with a padding
+  // record. Writers fill a reservation in place and readers parse records in place, so payloads
+  // are copied into shared memory once and never out of it by the transport itself.
+  //
+  // The ring does not block. Sides that run out of work set their `*_waiting` flag, recheck and
+  // sleep on a doorbell, see SharedTransport; commit() and release() report whether the other
+  // side has to be woken up.
+  class ShmRing {
+  public:
+    static constexpr uint32_t kFlagPadding = 1;
+    // The record is a fragment of a message continued in the next record.
+    static constexpr uint32_t kFlagMore = 2;
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                      std::atomic<uint32_t>::is_always_lock_free,
+                  "Shared memory rings need address free atomics");
+
+    struct Record {
+      const char *data;
+      uint32_t length;
+      uint32_t flags;
+    };
+
+    ShmRing() = default;
+
+    ShmRing(ShmRingHeader *header, char *data, uint64_t capacity)
+        : _header(header), _data(data), _capacity(capacity) {}
+
+    // Largest payload of a single record. Half the capacity, so a record always fits once the
+    // consumer caught up, padding included.
+    uint32_t maxRecord() const { return static_cast<uint32_t>(_capacity / 2 - kRecordHeaderSize); }
+
+    // Space for a record of `length` payload bytes, nullptr while the ring is too full. Only one
+    // reservation may be open at a time.
+    char *reserve(uint32_t length) {
+      uint64_t head = _header->head.load(std::memory_order_relaxed);
+      uint64_t tail = _header->tail.load(std::memory_order_acquire);
+      uint64_t padding = 0;
+      if (!fits(head, tail, length, padding)) {
+        return nullptr;
+      }
+      uint64_t offset = head % _capacity;
+      if (padding > 0) {
+        writeHeader(offset, static_cast<uint32_t>(padding - kRecordHeaderSize), kFlagPadding);
+        offset = 0;
+      }
+      _reservedHead = head + padding;
+      _reservedLength = length;
+      return _data + offset + kRecordHeaderSize;
+    }
+
+    // Publishes the open reservation. Returns true if the consumer sleeps and needs a doorbell.
+    bool commit(uint32_t flags) {
+      writeHeader(_reservedHead % _capacity, _reservedLength, flags);
+      _header->head.store(_reservedHead + recordSize(_reservedLength), std::memory_order_seq_cst);
+      return _header->consumer_waiting.exchange(0, std::memory_order_seq_cst) != 0;
+    }
+
+    // Oldest unreleased record, skipping padding. Throws if the peer corrupted the ring.
+    std::optional<Record> peek() {
+      uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+      while (true) {
+        uint64_t head = _header->head.load(std::memory_order_acquire);
+        if (tail == head) {
+          return std::nullopt;
+        }
+        uint64_t offset = tail % _capacity;
+        uint32_t length;
+        uint32_t flags;
+        std::memcpy(&length, _data + offset, sizeof(length));
+        std::memcpy(&flags, _data + offset + sizeof(length), sizeof(flags));
+        if (recordSize(length) > _capacity - offset || recordSize(length) > head - tail) {
+          throw std::runtime_error("Corrupted shared memory ring");
+        }
+        if (flags & kFlagPadding) {
+          tail += recordSize(length);
+          _header->tail.store(tail, std::memory_order_release);
+          continue;
+        }
+        return Record{_data + offset + kRecordHeaderSize, length, flags};
+      }
+    }
+
+    // Releases the record returned by peek(). Returns true if the producer sleeps and needs a
+    // doorbell.
+    bool release() {
+      uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+      uint32_t length;
+      std::memcpy(&length, _data + tail % _capacity, sizeof(length));
+      _header->tail.store(tail + recordSize(length), std::memory_order_seq_cst);
+      return _header->producer_waiting.exchange(0, std::memory_order_seq_cst) != 0;
+    }
+
+    // Announce sleeping, then recheck: returns false (and withdraws) if there is work after all.
+    bool sleepAsConsumer() {
+      _header->consumer_waiting.store(1, std::memory_order_seq_cst);
+      if (_header->head.load(std::memory_order_seq_cst) !=
+          _header->tail.load(std::memory_order_relaxed)) {
+        _header->consumer_waiting.store(0, std::memory_order_relaxed);
+        return false;
+      }
+      return true;
+    }
+
+    bool sleepAsProducer(uint32_t length) {
+      _header->producer_waiting.store(1, std::memory_order_seq_cst);
+      uint64_t padding = 0;
+      if (fits(_header->head.load(std::memory_order_relaxed),
+               _header->tail.load(std::memory_order_seq_cst), length, padding)) {
+        _header->producer_waiting.store(0, std::memory_order_relaxed);
+        return false;
+      }
+      return true;
+    }
+
+  private:
+    static constexpr uint64_t kRecordHeaderSize = 8;
+
+    static uint64_t recordSize(uint32_t length) {
+      return kRecordHeaderSize + ((static_cast<uint64_t>(length) + 7) & ~uint64_t(7));
+    }
+
+    // Whether a record of `length` fits, and how much padding has to precede it.
+    bool fits(uint64_t head, uint64_t tail, uint32_t length, uint64_t &padding) const {
+      uint64_t needed = recordSize(length);
+      uint64_t to_end = _capacity - head % _capacity;
+      padding = to_end < needed ? to_end : 0;
+      return _capacity - (head - tail) >= padding + needed;
+    }
+
+    void writeHeader(uint64_t offset, uint32_t length, uint32_t flags) {
+      std::memcpy(_data + offset, &length, sizeof(length));
+      std::memcpy(_data + offset + sizeof(length), &flags, sizeof(flags));
+    }
+
+    ShmRingHeader *_header = nullptr;
+    char *_data = nullptr;
+    uint64_t _capacity = 0;
+    uint64_t _reservedHead = 0;
+    uint32_t _reservedLength = 0;
+  };
+
+  // Shared memory holding the two rings of a SharedTransport connection: requests from the
+  // client to the owner and responses back. Created by the owner and passed to the client as a
+  // file descriptor over the control socket, so it never has a name other processes could open.
+  class ShmRegion {
+  public:
+    static constexpr uint32_t kMagic = 0x4e54524d; // "NTRM"
+    // Bumped whenever the region or message layout changes, both sides must match.
+    static constexpr uint32_t kVersion = 4;
+
+    // Creates a region with two rings of `ring_bytes` each (rounded up to 4 KiB).
+    static ShmRegion create(uint64_t ring_bytes, const std::string &temp_dir) {
+      ring_bytes = (std::max<uint64_t>(ring_bytes, 64 * 1024) + 4095) & ~uint64_t(4095);
+      int fd = createFd(temp_dir);
+      if (fd < 0) {
+        throw std::runtime_error("Failed to create shared memory: " + std::string(strerror(errno)));
+      }
+      uint64_t size = kHeaderSize + 2 * ring_bytes;
+      if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to size shared memory: " + std::string(strerror(errno)));
+      }
+      ShmRegion region(fd, size);
+      auto *layout = region.layout();
+      new (&layout->requests) ShmRingHeader{};
+      new (&layout->responses) ShmRingHeader{};
+      layout->ring_bytes = ring_bytes;
+      layout->version = kVersion;
+      std::atomic_thread_fence(std::memory_order_release);
+      layout->magic = kMagic;
+      return region;
+    }
+
+    // Maps a region received from the owner, taking ownership of `fd`.
+    static ShmRegion attach(int fd) {
+      struct stat info {};
+      if (fstat(fd, &info) != 0 || static_cast<uint64_t>(info.st_size) < kHeaderSize) {
+        ::close(fd);
+        throw std::runtime_error("Invalid shared memory region");
+      }
+      ShmRegion region(fd, static_cast<uint64_t>(info.st_size));
+      auto *layout = region.layout();
+      if (layout->magic != kMagic || layout->version != kVersion ||
+          kHeaderSize + 2 * layout->ring_bytes != region._size) {
+        throw std::runtime_error("Shared memory region has an incompatible layout");
+      }
+      return region;
+    }
+
+    ShmRegion(ShmRegion &&other) noexcept
+        : _fd(std::exchange(other._fd, -1)), _base(std::exchange(other._base, nullptr)),
+          _size(other._size) {}
+
+    ShmRegion &operator=(ShmRegion &&) = delete;
+    ShmRegion(const ShmRegion &) = delete;
+
+    ~ShmRegion() {
+      if (_base != nullptr) {
+        munmap(_base, _size);
+      }
+      if (_fd >= 0) {
+        ::close(_fd);
+      }
+    }
+
+    int fd() const { return _fd; }
+
+    uint64_t size() const { return _size; }
+
+    ShmRing requests() { return ring(&layout()->requests, 0); }
+
+    ShmRing responses() { return ring(&layout()->responses, 1); }
+
+  private:
+    struct Layout {
+      uint32_t magic;
+      uint32_t version;
+      uint64_t ring_bytes;
+      alignas(64) ShmRingHeader requests;
+      alignas(64) ShmRingHeader responses;
+    };
+    static constexpr uint64_t kHeaderSize = 4096;
+    static_assert(sizeof(Layout) <= kHeaderSize);
+
+    ShmRegion(int fd, uint64_t size) : _fd(fd), _size(size) {
+      void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (base == MAP_FAILED) {
+        ::close(fd);
+        _fd = -1;
+        throw std::runtime_error("Failed to map shared memory: " + std::string(strerror(errno)));
+      }
+      _base = static_cast<char *>(base);
+    }
+
+    static int createFd(const std::string &temp_dir) {
+#if defined(__linux__) && (!defined(__ANDROID__) || __ANDROID_API__ >= 30)
+      // Linux, and Android from API 30 where bionic has memfd_create: anonymous memory that only
+      // exists through the descriptor.
+      int memfd = memfd_create("nitrotor-transport", MFD_CLOEXEC);
+      if (memfd >= 0 || errno != ENOSYS) {
+        return memfd;
+      }
+#endif
+      // Elsewhere, older Android included, an unlinked file next to the control socket, which
+      // already has to be in a directory all participating processes can reach (an app group
+      // container on iOS).
+      std::string path = temp_dir + "/nitrotor-shm-XXXXXX";
+      int fd = mkstemp(path.data());
+      if (fd >= 0) {
+        unlink(path.c_str());
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+      return fd;
+    }
+
+    Layout *layout() { return reinterpret_cast<Layout *>(_base); }
+
+    ShmRing ring(ShmRingHeader *header, int index) {
+      uint64_t ring_bytes = layout()->ring_bytes;
+      return ShmRing(header, _base + kHeaderSize + index * ring_bytes, ring_bytes);
+    }
+
+    int _fd;
+    char *_base = nullptr;
+    uint64_t _size;
+  };
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,276 @@
+#pragma once
+#include "HybridTorSpec.hpp"
+#include "Scheduler.hpp"
+#include "tor_ffi.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // Bandwidth and circuit telemetry for live dashboards.
+  //
+  // A scheduler task samples Tor's traffic counters every sample interval into a fixed-size ring,
+  // and every snapshot interval hands the samples taken since the previous snapshot together with
+  // the busiest hosts to the listener. That is one JS call per snapshot, however much traffic
+  // there is: requests and circuits only bump counters under a mutex, and not even that while
+  // telemetry is stopped.
+  class Telemetry {
+  public:
+    using Listener = std::function<void(const TelemetrySnapshot &)>;
+
+    // Process wide, like the Tor client. Leaked so in flight requests finishing during static
+    // destruction can still record into it.
+    static Telemetry &shared() {
+      static auto *instance = new Telemetry();
+      return *instance;
+    }
+
+    // Starts sampling, or restarts it with the new config. Samples of a previous run are dropped.
+    void start(const TelemetryConfig &config, Listener listener) {
+      auto counters = tor::get_traffic_counters();
+      uint64_t generation;
+      std::chrono::milliseconds interval;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto sample_ms = std::max(kMinSampleMs, config.sample_interval_ms.value_or(1000));
+        auto snapshot_ms = std::max(sample_ms, config.snapshot_interval_ms);
+        interval = std::chrono::milliseconds(static_cast<int64_t>(sample_ms));
+        // Snapshots fall on sample ticks, so the snapshot interval is rounded to a multiple of the
+        // sample interval.
+        _samplesPerSnapshot = static_cast<size_t>(snapshot_ms / sample_ms + 0.5);
+        auto ring_size = std::clamp(config.ring_size.value_or(600), 1.0, kMaxRingSize);
+        _ring.assign(static_cast<size_t>(ring_size), Sample{});
+        _next = 0;
+        _count = 0;
+        _sinceSnapshot = 0;
+        _maxHosts = static_cast<size_t>(
+            std::clamp(config.max_hosts.value_or(10), 0.0, static_cast<double>(kMaxHosts)));
+        _hosts.clear();
+        _circuitsBuilt = 0;
+        _circuitBuildMs = 0;
+        _listener = std::move(listener);
+        _last = counters;
+        _lastTick = Clock::now();
+        _snapshotStart = _lastTick;
+        _interval = interval;
+        generation = ++_generation;
+        _running = true;
+      }
+      schedule(generation, interval);
+    }
+
+    void stop() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _running = false;
+      _generation++;
+      _listener = nullptr;
+      _hosts.clear();
+    }
+
+    // The ring, oldest sample first. Kept after stop() until the next start().
+    std::vector<TelemetrySample> samples() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return collect(_count);
+    }
+
+    // Called once per finished HTTP attempt.
+    void recordTransfer(std::string_view host, uint64_t bytes_sent, uint64_t bytes_received) {
+      if (!_running) {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto it = _hosts.find(host);
+      if (it == _hosts.end()) {
+        // Past kMaxHosts distinct hosts in one snapshot interval the rest share one entry, so a
+        // crawler can't grow the map without bound.
+        it = _hosts.size() < kMaxHosts ? _hosts.emplace(std::string(host), Host{}).first
+                                       : _hosts.emplace(kOtherHosts, Host{}).first;
+      }
+      it->second.bytes_sent += bytes_sent;
+      it->second.bytes_received += bytes_received;
+      it->second.requests++;
+    }
+
+    void recordCircuit(uint64_t build_ms, bool success) {
+      if (!_running || !success) {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      _circuitsBuilt++;
+      _circuitBuildMs += build_ms;
+    }
+
+    size_t memoryBytes() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      size_t bytes = sizeof(*this) + _ring.capacity() * sizeof(Sample);
+      for (const auto &[host, counters] : _hosts) {
+        bytes += sizeof(counters) + host.capacity() + kNodeOverhead;
+      }
+      return bytes;
+    }
+
+    Telemetry(const Telemetry &) = delete;
+    Telemetry &operator=(const Telemetry &) = delete;
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr double kMinSampleMs = 100;
+    static constexpr double kMaxRingSize = 86400;
+    static constexpr size_t kMaxHosts = 256;
+    static constexpr const char *kOtherHosts = "(other)";
+    // Per entry bookkeeping of std::unordered_map, roughly.
+    static constexpr size_t kNodeOverhead = 48;
+
+    struct Sample {
+      double timestamp_ms = 0;
+      double read_bytes_per_sec = 0;
+      double written_bytes_per_sec = 0;
+      uint32_t open_circuits = 0;
+      uint32_t open_streams = 0;
+      uint32_t circuits_built = 0;
+      double circuit_build_ms = 0;
+    };
+
+    struct Host {
+      uint64_t bytes_sent = 0;
+      uint64_t bytes_received = 0;
+      uint64_t requests = 0;
+    };
+
+    // Lets the host map be searched with a string_view.
+    struct HostHash {
+      using is_transparent = void;
+      size_t operator()(std::string_view host) const { return std::hash<std::string_view>()(host); }
+    };
+
+    Telemetry() = default;
+
+    void schedule(uint64_t generation, std::chrono::milliseconds delay) {
+      Scheduler::shared().schedule(delay, [this, generation]() { tick(generation); });
+    }
+
+    void tick(uint64_t generation) {
+      // The FFI call takes Tor's locks, keep it outside ours (as in start()).
+      auto counters = tor::get_traffic_counters();
+      Listener listener;
+      std::optional<TelemetrySnapshot> snapshot;
+      std::chrono::milliseconds interval;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (generation != _generation) {
+          return;
+        }
+        auto now = Clock::now();
+        double seconds = std::chrono::duration<double>(now - _lastTick).count();
+        _lastTick = now;
+
+        Sample sample;
+        sample.timestamp_ms = static_cast<double>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count());
+        sample.read_bytes_per_sec = rate(counters.bytes_read, _last.bytes_read, seconds);
+        sample.written_bytes_per_sec = rate(counters.bytes_written, _last.bytes_written, seconds);
+        sample.open_circuits = counters.open_circuits;
+        sample.open_streams = counters.open_streams;
+        sample.circuits_built = _circuitsBuilt;
+        sample.circuit_build_ms =
+            _circuitsBuilt > 0 ? static_cast<double>(_circuitBuildMs) / _circuitsBuilt : 0;
+        _last = counters;
+        _circuitsBuilt = 0;
+        _circuitBuildMs = 0;
+
+        _ring[_next] = sample;
+        _next = (_next + 1) % _ring.size();
+        _count = std::min(_count + 1, _ring.size());
+        if (++_sinceSnapshot >= _samplesPerSnapshot) {
+          snapshot = makeSnapshot(std::chrono::duration<double>(now - _snapshotStart).count());
+          _sinceSnapshot = 0;
+          _snapshotStart = now;
+          listener = _listener;
+        }
+        interval = _interval;
+      }
+
+      if (snapshot.has_value() && listener) {
+        listener(*snapshot);
+      }
+      schedule(generation, interval);
+    }
+
+    // Counters restart from 0 with the Tor client, a drop means everything since is new traffic.
+    static double rate(uint64_t current, uint64_t previous, double seconds) {
+      auto bytes = current >= previous ? current - previous : current;
+      return seconds > 0 ? static_cast<double>(bytes) / seconds : 0;
+    }
+
+    std::vector<TelemetrySample> collect(size_t count) const {
+      std::vector<TelemetrySample> samples;
+      samples.reserve(count);
+      for (size_t i = 0; i < count; i++) {
+        const auto &sample = _ring[(_next + _ring.size() - count + i) % _ring.size()];
+        samples.emplace_back(
+            sample.timestamp_ms, sample.read_bytes_per_sec, sample.written_bytes_per_sec,
+            static_cast<double>(sample.open_circuits), static_cast<double>(sample.open_streams),
+            static_cast<double>(sample.circuits_built), sample.circuit_build_ms);
+      }
+      return samples;
+    }
+
+    // Samples since the previous snapshot and the hosts with the most traffic in that time.
+    TelemetrySnapshot makeSnapshot(double seconds) {
+      std::vector<std::pair<const std::string *, const Host *>> busiest;
+      busiest.reserve(_hosts.size());
+      for (const auto &[host, counters] : _hosts) {
+        busiest.emplace_back(&host, &counters);
+      }
+      auto count = std::min(_maxHosts, busiest.size());
+      std::partial_sort(busiest.begin(), busiest.begin() + count, busiest.end(),
+                        [](const auto &a, const auto &b) {
+                          return a.second->bytes_sent + a.second->bytes_received >
+                                 b.second->bytes_sent + b.second->bytes_received;
+                        });
+
+      std::vector<HostThroughput> hosts;
+      hosts.reserve(count);
+      for (size_t i = 0; i < count; i++) {
+        const auto &counters = *busiest[i].second;
+        auto bytes = static_cast<double>(counters.bytes_sent + counters.bytes_received);
+        hosts.emplace_back(*busiest[i].first, static_cast<double>(counters.bytes_received),
+                           static_cast<double>(counters.bytes_sent),
+                           static_cast<double>(counters.requests),
+                           seconds > 0 ? bytes / seconds : 0);
+      }
+      _hosts.clear();
+      return TelemetrySnapshot(collect(std::min(_sinceSnapshot, _count)), std::move(hosts));
+    }
+
+    // Checked before taking the mutex on the request and circuit paths.
+    std::atomic<bool> _running{false};
+    std::mutex _mutex;
+    uint64_t _generation = 0;
+    Listener _listener;
+    std::chrono::milliseconds _interval{1000};
+    std::vector<Sample> _ring;
+    size_t _next = 0;
+    size_t _count = 0;
+    size_t _samplesPerSnapshot = 1;
+    size_t _sinceSnapshot = 0;
+    size_t _maxHosts = 0;
+    std::unordered_map<std::string, Host, HostHash, std::equal_to<>> _hosts;
+    tor::TOR_TrafficCounters _last{};
+    uint32_t _circuitsBuilt = 0;
+    uint64_t _circuitBuildMs = 0;
+    Clock::time_point _lastTick;
+    Clock::time_point _snapshotStart;
+  };
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,413 @@
+#pragma once
+#include "BridgeProbe.hpp"
+#include "HybridTorSpec.hpp"
+#include "MemoryBudget.hpp"
+#include "OnionKey.hpp"
+#include "ResponseArena.hpp"
+#include "tor_ffi.h"
+#include <NitroModules/ThreadPool.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // Start, shutdown, dormant and resume transitions of the Tor client, with the timing of the
+  // most recent ones so a dormant resume can be compared against a cold start.
+  //
+  // startTorIfNotRunning and shutdownService go through a small state machine:
+  //
+  //   Stopped --start--> Starting --success--> Running --shutdown--> Stopping --> Stopped
+  //
+  // Only one bootstrap runs at a time. Callers arriving while it is in progress attach to it,
+  // callers arriving afterwards get the cached result until the next shutdown. A shutdown during
+  // Starting waits for the bootstrap and then stops, a start during Stopping runs once the stop
+  // finished.
+  //
+  // With bridges configured, Starting first probes them and bootstraps through the first one
+  // that answers, see BridgeProber.
+  class TorLifecycle : public std::enable_shared_from_this<TorLifecycle> {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    std::shared_ptr<Promise<StartTorResponse>> start(const StartTorParams &params,
+                                                     const uint8_t *key_data) {
+      auto promise = Promise<StartTorResponse>::create();
+      std::unique_lock<std::mutex> lock(_mutex);
+      switch (_state) {
+      case State::Running: {
+        auto cached = _startResult.value();
+        lock.unlock();
+        promise->resolve(std::move(cached));
+        return promise;
+      }
+      case State::Starting:
+        _startWaiters.push_back(promise);
+        return promise;
+      case State::Stopping:
+        // The JS key buffer cannot be read later from another thread, keep a copy until then.
+        _startWaiters.push_back(promise);
+        _pendingStart.emplace(params, key_data);
+        return promise;
+      case State::Stopped:
+        _state = State::Starting;
+        _startWaiters.push_back(promise);
+        break;
+      }
+      lock.unlock();
+
+      if (!configureMemoryBudget(params.memory_budget)) {
+        completeStart(StartTorResponse(false, "", "", kBudgetRejected), Clock::now());
+        return promise;
+      }
+      if (params.bridges.has_value()) {
+        // The bootstrap waits for the probes, the JS key buffer has to be copied for it.
+        startWithBridges(std::make_shared<PendingStart>(params, key_data));
+        return promise;
+      }
+      clearBridges();
+      // Rust copies the arguments (including the key, read straight out of the JS buffer) before
+      // returning and bootstraps on its own runtime.
+      submitStart(params.data_dir, key_data, static_cast<uint16_t>(params.socks_port),
+                  static_cast<uint16_t>(params.target_port),
+                  static_cast<uint64_t>(params.timeout_ms));
+      return promise;
+    }
+
+    std::shared_ptr<Promise<bool>> shutdown() {
+      auto promise = Promise<bool>::create();
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopWaiters.push_back(promise);
+        switch (_state) {
+        case State::Starting:
+          _stopRequested = true;
+          return promise;
+        case State::Stopping:
+          return promise;
+        case State::Running:
+        case State::Stopped:
+          // Stopped still reaches the FFI, initTorService starts Tor outside of this machine.
+          _state = State::Stopping;
+          _startResult.reset();
+          break;
+        }
+      }
+      runShutdown();
+      return promise;
+    }
+
+    // For initTorService, which bootstraps synchronously: probes `config` and hands the reachable
+    // bridges to Tor, or clears bridges of a previous bootstrap without one. Blocks until the
+    // first bridge answered (see BridgeProber::start), returns false if none did.
+    bool prepareBridges(const std::optional<BridgeConfig> &config) {
+      if (!config.has_value()) {
+        clearBridges();
+        return true;
+      }
+      auto prober = std::make_shared<BridgeProber>(config.value());
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _bridgeProber = prober;
+      }
+      auto configured = std::make_shared<std::promise<bool>>();
+      auto result = configured->get_future();
+      prober->start(
+          [self = shared_from_this(), weak_prober = std::weak_ptr<BridgeProber>(prober),
+           configured](std::optional<size_t> first) {
+            configured->set_value(first.has_value() && self->useBridges(weak_prober.lock()));
+          },
+          refreshBridgesWhenDone(prober));
+      return result.get();
+    }
+
+    // Results of the probes of the most recent bootstrap with bridges. Probes still running
+    // after the bootstrap started keep updating them.
+    std::vector<BridgeProbeResult> bridgeProbeResults() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _bridgeProber ? _bridgeProber->results() : std::vector<BridgeProbeResult>();
+    }
+
+    // Records a successful cold start, either from startTorIfNotRunning or initTorService.
+    void recordColdStart(Clock::time_point started_at) {
+      _coldStartMs.store(elapsedMs(started_at));
+      _dormant.store(false);
+    }
+
+    std::shared_ptr<Promise<bool>> suspend() {
+      return Promise<bool>::async([self = shared_from_this()]() {
+        auto started_at = Clock::now();
+        bool suspended = tor::enter_dormant_mode();
+        if (suspended) {
+          self->_suspendMs.store(elapsedMs(started_at));
+          self->_dormant.store(true);
+        }
+        return suspended;
+      });
+    }
+
+    std::shared_ptr<Promise<ResumeResponse>> resume(uint64_t timeout_ms) {
+      auto promise = Promise<ResumeResponse>::create();
+      tor::resume_from_dormant_async(
+          static_cast<unsigned long>(timeout_ms), &TorLifecycle::onResumed,
+          new ResumeCall{shared_from_this(), promise, Clock::now()});
+      return promise;
+    }
+
+    LifecycleTimings timings() const {
+      return LifecycleTimings(_dormant.load(), static_cast<double>(_coldStartMs.load()),
+                              static_cast<double>(_suspendMs.load()),
+                              static_cast<double>(_resumeMs.load()),
+                              static_cast<double>(_resumeCircuitReadyMs.load()));
+    }
+
+  private:
+    enum class State { Stopped, Starting, Running, Stopping };
+
+    static constexpr const char *kBudgetRejected = "Tor rejected the memory budget";
+
+    // Owned copy of a start requested while stopping.
+    struct PendingStart {
+      PendingStart(const StartTorParams &params, const uint8_t *key_data)
+          : data_dir(params.data_dir), socks_port(static_cast<uint16_t>(params.socks_port)),
+            target_port(static_cast<uint16_t>(params.target_port)),
+            timeout_ms(static_cast<uint64_t>(params.timeout_ms)), bridges(params.bridges),
+            memory_budget(params.memory_budget) {
+        if (key_data != nullptr) {
+          key.emplace();
+          std::memcpy(key->data(), key_data, key->size());
+        }
+      }
+
+      PendingStart(const PendingStart &) = default;
+
+      ~PendingStart() {
+        if (key.has_value()) {
+          secureZero(key->data(), key->size());
+        }
+      }
+
+      std::string data_dir;
+      std::optional<OnionKey> key;
+      uint16_t socks_port;
+      uint16_t target_port;
+      uint64_t timeout_ms;
+      std::optional<BridgeConfig> bridges;
+      std::optional<MemoryBudget> memory_budget;
+    };
+
+    // Contexts handed to the async FFI, owned by it until the completion callback runs.
+    struct StartCall {
+      std::shared_ptr<TorLifecycle> lifecycle;
+      Clock::time_point started_at;
+    };
+
+    struct ResumeCall {
+      std::shared_ptr<TorLifecycle> lifecycle;
+      std::shared_ptr<Promise<ResumeResponse>> promise;
+      Clock::time_point started_at;
+    };
+
+    static uint64_t elapsedMs(Clock::time_point since) {
+      return static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - since).count());
+    }
+
+    void submitStart(const std::string &data_dir, const uint8_t *key_data, uint16_t socks_port,
+                     uint16_t target_port, uint64_t timeout_ms) {
+      tor::start_tor_if_not_running_async(
+          data_dir.c_str(), key_data, key_data != nullptr, socks_port, target_port, timeout_ms,
+          &TorLifecycle::onStarted, new StartCall{shared_from_this(), Clock::now()});
+    }
+
+    void runShutdown() {
+      ThreadPool::shared().run([self = shared_from_this()]() {
+        bool stopped = tor::shutdown_service();
+
+        std::vector<std::shared_ptr<Promise<bool>>> stop_waiters;
+        std::optional<PendingStart> pending;
+        {
+          std::lock_guard<std::mutex> lock(self->_mutex);
+          stop_waiters.swap(self->_stopWaiters);
+          self->_dormant.store(false);
+          if (!self->_startWaiters.empty() && self->_pendingStart.has_value()) {
+            self->_state = State::Starting;
+            pending.swap(self->_pendingStart);
+          } else {
+            self->_state = State::Stopped;
+          }
+        }
+
+        for (const auto &waiter : stop_waiters) {
+          waiter->resolve(stopped);
+        }
+        if (pending.has_value() && !configureMemoryBudget(pending->memory_budget)) {
+          self->completeStart(StartTorResponse(false, "", "", kBudgetRejected), Clock::now());
+        } else if (pending.has_value() && pending->bridges.has_value()) {
+          self->startWithBridges(std::make_shared<PendingStart>(pending.value()));
+        } else if (pending.has_value()) {
+          self->clearBridges();
+          self->submitStart(pending->data_dir, pending->key ? pending->key->data() : nullptr,
+                            pending->socks_port, pending->target_port, pending->timeout_ms);
+        }
+      });
+    }
+
+    // Bootstraps through the first bridge that answers a probe. Probing the others continues for
+    // bridgeProbeResults() and for Tor to fall back to them.
+    void startWithBridges(std::shared_ptr<PendingStart> pending) {
+      auto prober = std::make_shared<BridgeProber>(pending->bridges.value());
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _bridgeProber = prober;
+      }
+      auto started_at = Clock::now();
+      prober->start(
+          [self = shared_from_this(), weak_prober = std::weak_ptr<BridgeProber>(prober), pending,
+           started_at](std::optional<size_t> first) {
+            // The probing thread holds the prober until it returns.
+            auto prober = weak_prober.lock();
+            if (!first.has_value()) {
+              self->completeStart(StartTorResponse(false, "", "",
+                                                   "No bridge reachable: " +
+                                                       prober->failureSummary()),
+                                  started_at);
+            } else if (!self->useBridges(prober)) {
+              self->completeStart(StartTorResponse(false, "", "", "Tor rejected the bridges"),
+                                  started_at);
+            } else {
+              self->submitStart(pending->data_dir, pending->key ? pending->key->data() : nullptr,
+                                pending->socks_port, pending->target_port, pending->timeout_ms);
+            }
+          },
+          refreshBridgesWhenDone(prober));
+    }
+
+    bool useBridges(const std::shared_ptr<BridgeProber> &prober) {
+      std::lock_guard<std::mutex> lock(_bridgeMutex);
+      auto lines = prober->reachableLines();
+      bool configured = configureBridges(lines, prober->transports());
+      _bridgeSource = configured ? prober : nullptr;
+      _bridgeLines = configured ? std::move(lines) : std::vector<std::string>();
+      return configured;
+    }
+
+    // Bridges answering after the bootstrap started are only known once every probe finished,
+    // Tor gets the complete list then. Unless a later bootstrap replaced or cleared the bridges.
+    BridgeProber::DoneCallback refreshBridgesWhenDone(const std::shared_ptr<BridgeProber> &prober) {
+      return [self = shared_from_this(), weak_prober = std::weak_ptr<BridgeProber>(prober)]() {
+        auto prober = weak_prober.lock();
+        std::lock_guard<std::mutex> lock(self->_bridgeMutex);
+        if (self->_bridgeSource != prober) {
+          return;
+        }
+        auto lines = prober->reachableLines();
+        if (lines != self->_bridgeLines && configureBridges(lines, prober->transports())) {
+          self->_bridgeLines = std::move(lines);
+        }
+      };
+    }
+
+    // Bridges stay configured on the Rust side, a bootstrap without them has to reset them.
+    void clearBridges() {
+      std::lock_guard<std::mutex> lock(_bridgeMutex);
+      if (_bridgeSource != nullptr) {
+        configureBridges({}, {});
+        _bridgeSource.reset();
+        _bridgeLines.clear();
+      }
+    }
+
+    // Completion callbacks for the async FFI. They run on a Rust runtime thread, take back
+    // ownership of the context and release what Rust allocated for the result.
+
+    static void onStarted(void *context, tor::TOR_StartTorResponse result) {
+      std::unique_ptr<StartCall> call(static_cast<StartCall *>(context));
+
+      StartTorResponse response(result.is_success,
+                                std::string(arenaString(result.arena, result.onion_address)),
+                                std::string(arenaString(result.arena, result.control)),
+                                std::string(arenaString(result.arena, result.error_message)));
+      tor::free_arena(result.arena);
+
+      call->lifecycle->completeStart(std::move(response), call->started_at);
+    }
+
+    // Settles a bootstrap, successful or not, for everyone waiting on it.
+    void completeStart(StartTorResponse response, Clock::time_point started_at) {
+      std::vector<std::shared_ptr<Promise<StartTorResponse>>> start_waiters;
+      bool stop = false;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        start_waiters.swap(_startWaiters);
+        if (_stopRequested) {
+          // Bootstrap cannot be interrupted, stop right after it finished.
+          _stopRequested = false;
+          _state = State::Stopping;
+          stop = true;
+          response = StartTorResponse(false, "", "", "Tor was shut down while starting");
+        } else if (response.is_success) {
+          _state = State::Running;
+          _startResult = response;
+        } else {
+          _state = State::Stopped;
+        }
+      }
+
+      if (response.is_success) {
+        recordColdStart(started_at);
+      }
+      for (const auto &waiter : start_waiters) {
+        waiter->resolve(response);
+      }
+      if (stop) {
+        runShutdown();
+      }
+    }
+
+    static void onResumed(void *context, tor::TOR_ResumeResponse result) {
+      std::unique_ptr<ResumeCall> call(static_cast<ResumeCall *>(context));
+
+      std::string error_message(arenaString(result.arena, result.error_message));
+      tor::free_arena(result.arena);
+
+      auto resume_ms = elapsedMs(call->started_at);
+      if (result.is_success) {
+        auto &lifecycle = *call->lifecycle;
+        lifecycle._resumeMs.store(resume_ms);
+        lifecycle._resumeCircuitReadyMs.store(result.circuit_ready_ms);
+        lifecycle._dormant.store(false);
+      }
+      call->promise->resolve(ResumeResponse(result.is_success, static_cast<double>(resume_ms),
+                                            static_cast<double>(result.circuit_ready_ms),
+                                            std::move(error_message)));
+    }
+
+    std::mutex _mutex;
+    State _state = State::Stopped;
+    std::optional<StartTorResponse> _startResult;
+    std::vector<std::shared_ptr<Promise<StartTorResponse>>> _startWaiters;
+    std::vector<std::shared_ptr<Promise<bool>>> _stopWaiters;
+    std::optional<PendingStart> _pendingStart;
+    bool _stopRequested = false;
+    std::shared_ptr<BridgeProber> _bridgeProber;
+    // Serializes configure_bridges calls. The prober whose bridges are configured and the lines
+    // handed to Tor, null and empty without bridges.
+    std::mutex _bridgeMutex;
+    std::shared_ptr<BridgeProber> _bridgeSource;
+    std::vector<std::string> _bridgeLines;
+
+    std::atomic<bool> _dormant{false};
+    // Durations of the most recent successful transitions, 0 if there was none yet.
+    std::atomic<uint64_t> _coldStartMs{0};
+    std::atomic<uint64_t> _suspendMs{0};
+    std::atomic<uint64_t> _resumeMs{0};
+    std::atomic<uint64_t> _resumeCircuitReadyMs{0};
+  };
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,309 @@
+#pragma once
+#include "HybridTorSpec.hpp"
+#include "Scheduler.hpp"
+#include <NitroModules/ThreadPool.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace margelo::nitro::nitrotor {
+  // Admission control for HTTP attempts, shared by every request of an HttpExecutor.
+  //
+  // Each priority class has its own queue and token bucket, and one more bucket covers all
+  // traffic. The bytes of a transfer only become known when it finished, so buckets work on
+  // credit: an attempt is admitted while its class and the total bucket are not in debt, and its
+  // bytes are charged afterwards. A bulk download can therefore overdraw once, after which bulk
+  // waits until the bucket refilled.
+  //
+  // Among admissible classes the next attempt is picked by stride scheduling, a weighted fair
+  // queue: with the weights below interactive gets 16 of every 21 free slots when all classes
+  // are backlogged, while bulk uses whatever capacity the others leave idle.
+  class TrafficShaper : public std::enable_shared_from_this<TrafficShaper> {
+  public:
+    using Clock = std::chrono::steady_clock;
+    using Task = std::function<void()>;
+
+    void setLimits(const BandwidthLimits &limits) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto now = Clock::now();
+        _total.configure(limits.total_bytes_per_sec, now);
+        classState(PriorityClass::INTERACTIVE)
+            .bucket.configure(limits.interactive_bytes_per_sec, now);
+        classState(PriorityClass::NORMAL).bucket.configure(limits.normal_bytes_per_sec, now);
+        classState(PriorityClass::BULK).bucket.configure(limits.bulk_bytes_per_sec, now);
+        _maxConcurrent = static_cast<uint32_t>(std::max(0.0, limits.max_concurrent_requests));
+      }
+      // Raised limits may unblock queued attempts.
+      pump();
+    }
+
+    // Runs `task` once `priority` may start another transfer, possibly right away on the calling
+    // thread. Every admitted task must be balanced by finish() or release().
+    void submit(PriorityClass priority, Task &&task) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &state = classState(priority);
+        if (state.queue.empty()) {
+          // A class coming back from idle must not cash in the turns it did not use.
+          state.pass = std::max(state.pass, _globalPass);
+        }
+        state.queue.push_back(Pending{std::move(task), Clock::now()});
+        state.queued_total++;
+      }
+      pump();
+    }
+
+    // Accounts a finished transfer and frees its slot.
+    void finish(PriorityClass priority, uint64_t bytes_sent, uint64_t bytes_received) {
+      bool backlog = false;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto now = Clock::now();
+        auto bytes = bytes_sent + bytes_received;
+        auto &state = classState(priority);
+        state.in_flight--;
+        state.completed++;
+        state.bytes_sent += bytes_sent;
+        state.bytes_received += bytes_received;
+        state.throughput.add(now, bytes);
+        state.bucket.charge(bytes, now);
+        _total.charge(bytes, now);
+        _inFlight--;
+        backlog = hasBacklog();
+      }
+      if (backlog) {
+        // Called from a transfer's completion callback, start the next one somewhere else.
+        ThreadPool::shared().run([weak = weak_from_this()]() {
+          if (auto shaper = weak.lock()) {
+            shaper->pump();
+          }
+        });
+      }
+    }
+
+    // Frees the slot of an admitted task that did not transfer anything.
+    void release(PriorityClass priority) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        classState(priority).in_flight--;
+        _inFlight--;
+      }
+      pump();
+    }
+
+    TrafficStats stats() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto now = Clock::now();
+      return TrafficStats(classStats(PriorityClass::INTERACTIVE, now),
+                          classStats(PriorityClass::NORMAL, now),
+                          classStats(PriorityClass::BULK, now));
+    }
+
+  private:
+    static constexpr size_t kClassCount = 3;
+    static constexpr std::array<uint64_t, kClassCount> kWeights{16, 4, 1};
+    // Stride = kStrideScale / weight, large enough that all weights divide it evenly.
+    static constexpr uint64_t kStrideScale = 1 << 16;
+    // Buckets hold at most one second worth of tokens.
+    static constexpr double kBurstSeconds = 1.0;
+    static constexpr size_t kThroughputWindow = 10;
+
+    // Token bucket in bytes, a rate of 0 disables it.
+    struct TokenBucket {
+      double rate = 0;
+      double tokens = 0;
+      Clock::time_point updated;
+
+      void configure(double bytes_per_sec, Clock::time_point now) {
+        rate = std::max(0.0, bytes_per_sec);
+        tokens = rate * kBurstSeconds;
+        updated = now;
+      }
+
+      void refill(Clock::time_point now) {
+        if (rate <= 0) {
+          return;
+        }
+        std::chrono::duration<double> elapsed = now - updated;
+        tokens = std::min(tokens + elapsed.count() * rate, rate * kBurstSeconds);
+        updated = now;
+      }
+
+      void charge(uint64_t bytes, Clock::time_point now) {
+        if (rate <= 0) {
+          return;
+        }
+        refill(now);
+        tokens -= static_cast<double>(bytes);
+      }
+
+      bool admits(Clock::time_point now) {
+        refill(now);
+        return rate <= 0 || tokens >= 0;
+      }
+
+      // Time until the debt is paid off.
+      std::chrono::milliseconds untilAdmits() const {
+        if (rate <= 0 || tokens >= 0) {
+          return std::chrono::milliseconds(0);
+        }
+        return std::chrono::milliseconds(static_cast<int64_t>(-tokens / rate * 1000) + 1);
+      }
+    };
+
+    // Bytes per second over the last kThroughputWindow seconds, in one second slots.
+    struct ThroughputCounter {
+      std::array<uint64_t, kThroughputWindow> bytes{};
+      std::array<int64_t, kThroughputWindow> second{};
+
+      static int64_t secondOf(Clock::time_point time) {
+        return std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count();
+      }
+
+      void add(Clock::time_point now, uint64_t amount) {
+        auto current = secondOf(now);
+        auto slot = static_cast<size_t>(current) % kThroughputWindow;
+        if (second[slot] != current) {
+          second[slot] = current;
+          bytes[slot] = 0;
+        }
+        bytes[slot] += amount;
+      }
+
+      double rate(Clock::time_point now) const {
+        auto current = secondOf(now);
+        uint64_t sum = 0;
+        for (size_t i = 0; i < kThroughputWindow; i++) {
+          if (current - second[i] < static_cast<int64_t>(kThroughputWindow)) {
+            sum += bytes[i];
+          }
+        }
+        return static_cast<double>(sum) / kThroughputWindow;
+      }
+    };
+
+    struct Pending {
+      Task task;
+      Clock::time_point enqueued_at;
+    };
+
+    struct ClassState {
+      std::deque<Pending> queue;
+      TokenBucket bucket;
+      uint64_t pass = 0;
+      uint32_t in_flight = 0;
+      uint64_t queued_total = 0;
+      uint64_t completed = 0;
+      uint64_t bytes_sent = 0;
+      uint64_t bytes_received = 0;
+      uint64_t queue_ms_total = 0;
+      uint64_t admitted = 0;
+      ThroughputCounter throughput;
+    };
+
+    ClassState &classState(PriorityClass priority) {
+      return _classes[static_cast<size_t>(priority)];
+    }
+
+    bool hasBacklog() const {
+      return std::any_of(_classes.begin(), _classes.end(),
+                         [](const ClassState &state) { return !state.queue.empty(); });
+    }
+
+    ClassTrafficStats classStats(PriorityClass priority, Clock::time_point now) {
+      auto &state = classState(priority);
+      double average_queue_ms =
+          state.admitted > 0 ? static_cast<double>(state.queue_ms_total) / state.admitted : 0;
+      return ClassTrafficStats(static_cast<double>(state.completed),
+                               static_cast<double>(state.queue.size()),
+                               static_cast<double>(state.in_flight),
+                               static_cast<double>(state.bytes_sent),
+                               static_cast<double>(state.bytes_received), average_queue_ms,
+                               state.throughput.rate(now));
+    }
+
+    // Admits as many queued tasks as the limits allow and runs them outside the lock. If the
+    // buckets hold back a backlog, a retry is scheduled for when the first of them recovers.
+    void pump() {
+      std::vector<Task> admitted;
+      std::chrono::milliseconds retry_in(0);
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto now = Clock::now();
+        while (_maxConcurrent == 0 || _inFlight < _maxConcurrent) {
+          ClassState *next = nullptr;
+          bool total_admits = _total.admits(now);
+          for (auto &state : _classes) {
+            if (state.queue.empty()) {
+              continue;
+            }
+            if (!total_admits || !state.bucket.admits(now)) {
+              auto wait = std::max(_total.untilAdmits(), state.bucket.untilAdmits());
+              retry_in = retry_in.count() == 0 ? wait : std::min(retry_in, wait);
+              continue;
+            }
+            if (next == nullptr || state.pass < next->pass) {
+              next = &state;
+            }
+          }
+          if (next == nullptr) {
+            break;
+          }
+
+          auto index = static_cast<size_t>(next - _classes.data());
+          _globalPass = next->pass;
+          next->pass += kStrideScale / kWeights[index];
+          auto &pending = next->queue.front();
+          next->queue_ms_total += static_cast<uint64_t>(
+              std::chrono::duration_cast<std::chrono::milliseconds>(now - pending.enqueued_at)
+                  .count());
+          next->admitted++;
+          next->in_flight++;
+          _inFlight++;
+          admitted.push_back(std::move(pending.task));
+          next->queue.pop_front();
+          retry_in = std::chrono::milliseconds(0);
+        }
+
+        if (retry_in.count() > 0 && !_pumpScheduled) {
+          _pumpScheduled = true;
+        } else {
+          retry_in = std::chrono::milliseconds(0);
+        }
+      }
+
+      if (retry_in.count() > 0) {
+        Scheduler::shared().schedule(retry_in, [weak = weak_from_this()]() {
+          if (auto shaper = weak.lock()) {
+            {
+              std::lock_guard<std::mutex> lock(shaper->_mutex);
+              shaper->_pumpScheduled = false;
+            }
+            shaper->pump();
+          }
+        });
+      }
+      for (auto &task : admitted) {
+        task();
+      }
+    }
+
+    std::mutex _mutex;
+    // Indexed by PriorityClass.
+    std::array<ClassState, kClassCount> _classes;
+    TokenBucket _total;
+    // Pass of the most recently admitted class, the virtual time of the fair queue.
+    uint64_t _globalPass = 0;
+    // 0 means unlimited.
+    uint32_t _maxConcurrent = 0;
+    uint32_t _inFlight = 0;
+    bool _pumpScheduled = false;
+  };
+} // namespace margelo::nitro::nitrotor
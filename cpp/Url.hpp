@@ -0,0 +1,45 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+namespace margelo::nitro::nitrotor {
+  // Minimal URL helpers for request bookkeeping, the URL itself is parsed and validated on the
+  // Rust side.
+
+  // "http://user@example.onion:8080/path" -> "example.onion:8080". Empty if there is no host.
+  inline std::string_view urlAuthority(std::string_view url) {
+    auto scheme_end = url.find("://");
+    if (scheme_end == std::string_view::npos) {
+      return {};
+    }
+    auto authority = url.substr(scheme_end + 3);
+    authority = authority.substr(0, authority.find_first_of("/?#"));
+    auto user_info_end = authority.rfind('@');
+    if (user_info_end != std::string_view::npos) {
+      authority = authority.substr(user_info_end + 1);
+    }
+    return authority;
+  }
+
+  // "http://example.onion:8080/path" -> "example.onion", IPv6 literals keep their brackets.
+  inline std::string_view urlHost(std::string_view url) {
+    auto authority = urlAuthority(url);
+    if (!authority.empty() && authority.front() == '[') {
+      return authority.substr(0, authority.find(']') + 1);
+    }
+    return authority.substr(0, authority.find(':'));
+  }
+
+  // "http://example.onion/a/b?c=1#top" -> "/a/b?c=1", the path defaults to "/".
+  inline std::string urlPathAndQuery(std::string_view url) {
+    auto scheme_end = url.find("://");
+    auto rest = scheme_end == std::string_view::npos ? url : url.substr(scheme_end + 3);
+    auto path_start = rest.find_first_of("/?#");
+    auto path = path_start == std::string_view::npos ? std::string_view() : rest.substr(path_start);
+    path = path.substr(0, path.find('#'));
+    if (path.empty() || path.front() != '/') {
+      return "/" + std::string(path);
+    }
+    return std::string(path);
+  }
+} // namespace margelo::nitro::nitrotor
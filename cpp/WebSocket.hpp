@@ -0,0 +1,1082 @@
+#pragma once
+#include "Base64.hpp"
+#include "Interceptors.hpp"
+#include "OnionCrypto.hpp"
+#include "ResponseArena.hpp"
+#include "Sha1.hpp"
+#include "Url.hpp"
+#include "tor_ffi.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+namespace margelo::nitro::nitrotor {
+  struct WebSocketOptions {
+    std::string url;
+    // Extra handshake headers as a JSON object, "" for none.
+    std::string headers;
+    std::vector<std::string> protocols;
+    bool permessage_deflate;
+    // Deadline for opening the Tor stream and completing the handshake.
+    uint64_t timeout_ms;
+    // Send a ping after this long without receiving anything, 0 disables keepalive. The
+    // connection fails if nothing arrives within pong_timeout_ms after the ping.
+    uint64_t ping_interval_ms;
+    uint64_t pong_timeout_ms;
+    // Larger incoming messages (after decompression) fail the connection with 1009.
+    size_t max_message_bytes;
+    // send() returns false once this many bytes are buffered, onDrain follows once they are out.
+    size_t high_water_mark;
+  };
+
+  // Events of a WebSocketClient. Called on the connection's I/O thread, except onConnectFailed
+  // which may also run on a Rust runtime thread.
+  class WebSocketListener {
+  public:
+    virtual ~WebSocketListener() = default;
+    virtual void onOpen(const std::string &protocol, const std::string &extensions) = 0;
+    virtual void onConnectFailed(const std::string &error) = 0;
+    virtual void onText(std::string &&message) = 0;
+    // The assembled (or inflated) buffer itself, to be handed on without a copy.
+    virtual void onBinary(std::string &&data) = 0;
+    virtual void onDrain() = 0;
+    // Once per opened connection. `clean` is false if the closing handshake did not complete.
+    virtual void onClose(uint16_t code, const std::string &reason, bool clean) = 0;
+  };
+
+  // RFC 6455 client with the permessage-deflate extension (RFC 7692) on top of a raw Tor stream
+  // from `open_stream_async`, TLS for wss:// is terminated on the Rust side.
+  //
+  // Every connection runs one I/O thread that owns the socket: it performs the handshake, parses
+  // and assembles incoming frames, answers pings, sends keepalive pings and encodes (compresses,
+  // fragments and masks) outgoing messages. send() only queues, so compression never runs on the
+  // caller's thread. Outgoing messages are split into fragments so control frames are not stuck
+  // behind a large message.
+  class WebSocketClient : public std::enable_shared_from_this<WebSocketClient> {
+  public:
+    enum class State { Connecting, Open, Closing, Closed };
+
+    WebSocketClient(WebSocketOptions options, std::shared_ptr<WebSocketListener> listener)
+        : _options(std::move(options)), _listener(std::move(listener)) {
+      parseUrl();
+      _handshakeRequest = buildHandshakeRequest();
+      int wake[2];
+      if (pipe(wake) != 0) {
+        throw std::runtime_error("Failed to create WebSocket wake pipe");
+      }
+      _wakeRead = wake[0];
+      _wakeWrite = wake[1];
+      fcntl(_wakeRead, F_SETFL, O_NONBLOCK);
+      fcntl(_wakeWrite, F_SETFL, O_NONBLOCK);
+    }
+
+    ~WebSocketClient() {
+      ::close(_wakeRead);
+      ::close(_wakeWrite);
+    }
+
+    WebSocketClient(const WebSocketClient &) = delete;
+    WebSocketClient &operator=(const WebSocketClient &) = delete;
+
+    // Opens the Tor stream, the outcome is reported through onOpen or onConnectFailed.
+    void connect() {
+      _startedAt = Clock::now();
+      tor::open_stream_async(_host.c_str(), _port, _tls, 0,
+                             static_cast<unsigned long>(_options.timeout_ms),
+                             &WebSocketClient::onStream,
+                             new std::shared_ptr<WebSocketClient>(shared_from_this()));
+    }
+
+    // Queues a message. Returns false if the caller should wait for onDrain before sending more,
+    // the message is queued either way. Throws if the connection is not open.
+    bool send(bool binary, std::string &&payload) {
+      if (_state.load() != State::Open) {
+        throw std::runtime_error("WebSocket is not open");
+      }
+      auto size = payload.size();
+      // Counted before queueing, the I/O thread subtracts once the message is written.
+      auto buffered = _buffered.fetch_add(size) + size;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(Outgoing{binary ? kOpcodeBinary : kOpcodeText, std::move(payload)});
+      }
+      bool below_limit = buffered < _options.high_water_mark;
+      if (!below_limit) {
+        _needDrain.store(true);
+      }
+      wake();
+      return below_limit;
+    }
+
+    // Starts the closing handshake after the messages queued so far. While connecting, the
+    // connection is abandoned once the stream opened.
+    void close(uint16_t code, std::string reason) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_closeRequest.has_value()) {
+          return;
+        }
+        // Control frame payloads are limited to 125 bytes, 2 of them for the code.
+        reason.resize(std::min<size_t>(reason.size(), 123));
+        _closeRequest.emplace(code, std::move(reason));
+      }
+      wake();
+    }
+
+    State state() const { return _state.load(); }
+
+    size_t bufferedAmount() const { return _buffered.load(); }
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr uint8_t kOpcodeContinuation = 0x0;
+    static constexpr uint8_t kOpcodeText = 0x1;
+    static constexpr uint8_t kOpcodeBinary = 0x2;
+    static constexpr uint8_t kOpcodeClose = 0x8;
+    static constexpr uint8_t kOpcodePing = 0x9;
+    static constexpr uint8_t kOpcodePong = 0xA;
+
+    static constexpr uint16_t kCloseNormal = 1000;
+    static constexpr uint16_t kCloseProtocolError = 1002;
+    static constexpr uint16_t kCloseAbnormal = 1006;
+    static constexpr uint16_t kCloseInvalidData = 1007;
+    static constexpr uint16_t kCloseTooBig = 1009;
+
+    static constexpr size_t kFragmentSize = 16 * 1024;
+    static constexpr size_t kReadSize = 64 * 1024;
+    static constexpr size_t kMaxHandshakeBytes = 16 * 1024;
+    // Smaller messages are not worth the deflate framing overhead.
+    static constexpr size_t kMinCompressSize = 64;
+    static constexpr std::chrono::seconds kCloseTimeout{5};
+    static constexpr const char *kAcceptGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+    struct Outgoing {
+      uint8_t opcode;
+      std::string payload;
+    };
+
+    // Message being written fragment by fragment.
+    struct Sending {
+      uint8_t opcode;
+      bool compressed;
+      std::string payload;
+      size_t offset;
+      // Size as passed to send(), for the buffered amount.
+      size_t original_size;
+    };
+
+    class ZStream {
+    public:
+      ZStream(bool deflating, int window_bits) : _deflating(deflating) {
+        std::memset(&_stream, 0, sizeof(_stream));
+        int result = deflating ? deflateInit2(&_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                              -window_bits, 8, Z_DEFAULT_STRATEGY)
+                               : inflateInit2(&_stream, -window_bits);
+        if (result != Z_OK) {
+          throw std::runtime_error("Failed to initialize zlib");
+        }
+      }
+
+      ~ZStream() { _deflating ? deflateEnd(&_stream) : inflateEnd(&_stream); }
+
+      ZStream(const ZStream &) = delete;
+      ZStream &operator=(const ZStream &) = delete;
+
+      // Compresses one message, without the trailing 00 00 ff ff (RFC 7692 section 7.2.1).
+      std::string deflateMessage(std::string_view input, bool reset) {
+        std::string output;
+        _stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+        _stream.avail_in = static_cast<uInt>(input.size());
+        do {
+          size_t used = output.size();
+          output.resize(used + std::max<size_t>(input.size() / 2, 256));
+          _stream.next_out = reinterpret_cast<Bytef *>(output.data() + used);
+          _stream.avail_out = static_cast<uInt>(output.size() - used);
+          deflate(&_stream, Z_SYNC_FLUSH);
+          output.resize(output.size() - _stream.avail_out);
+        } while (_stream.avail_out == 0 || _stream.avail_in > 0);
+        output.resize(output.size() - 4);
+        if (reset) {
+          deflateReset(&_stream);
+        }
+        return output;
+      }
+
+      // Decompresses one message. False on corrupt input or if the output exceeds `limit`.
+      bool inflateMessage(std::string &message, size_t limit, bool reset, bool &too_big) {
+        static constexpr uint8_t kTail[] = {0x00, 0x00, 0xff, 0xff};
+        message.append(reinterpret_cast<const char *>(kTail), sizeof(kTail));
+        std::string output;
+        _stream.next_in = reinterpret_cast<Bytef *>(message.data());
+        _stream.avail_in = static_cast<uInt>(message.size());
+        too_big = false;
+        do {
+          size_t used = output.size();
+          output.resize(used + std::max<size_t>(message.size() * 2, 1024));
+          _stream.next_out = reinterpret_cast<Bytef *>(output.data() + used);
+          _stream.avail_out = static_cast<uInt>(output.size() - used);
+          int result = inflate(&_stream, Z_SYNC_FLUSH);
+          output.resize(output.size() - _stream.avail_out);
+          if (output.size() > limit) {
+            too_big = true;
+            return false;
+          }
+          if (result == Z_STREAM_END) {
+            // A final deflate block ends the stream, the next message starts a new one.
+            reset = true;
+            break;
+          }
+          if (result != Z_OK && result != Z_BUF_ERROR) {
+            return false;
+          }
+          if (result == Z_BUF_ERROR && _stream.avail_out > 0) {
+            // No progress possible, all input was consumed.
+            break;
+          }
+        } while (_stream.avail_in > 0 || _stream.avail_out == 0);
+        if (reset) {
+          inflateReset(&_stream);
+        }
+        message = std::move(output);
+        return true;
+      }
+
+    private:
+      bool _deflating;
+      z_stream _stream;
+    };
+
+    void parseUrl() {
+      std::string_view url = _options.url;
+      if (url.rfind("wss://", 0) == 0) {
+        _tls = true;
+      } else if (url.rfind("ws://", 0) != 0) {
+        throw std::invalid_argument("WebSocket URL must start with ws:// or wss://");
+      }
+      _authority = std::string(urlAuthority(url));
+      auto host = urlHost(url);
+      if (host.empty()) {
+        throw std::invalid_argument("WebSocket URL has no host");
+      }
+      auto port_start = host.size();
+      if (host.front() == '[') {
+        host = host.substr(1, host.size() - 2);
+      }
+      _host = std::string(host);
+      _port = _tls ? 443 : 80;
+      if (port_start < _authority.size() && _authority[port_start] == ':') {
+        auto port = std::strtoul(_authority.c_str() + port_start + 1, nullptr, 10);
+        if (port == 0 || port > 65535) {
+          throw std::invalid_argument("WebSocket URL has an invalid port");
+        }
+        _port = static_cast<uint16_t>(port);
+      }
+      _path = urlPathAndQuery(url);
+    }
+
+    static bool isHeaderSafe(std::string_view value) {
+      return value.find_first_of("\r\n") == std::string_view::npos;
+    }
+
+    std::string buildHandshakeRequest() {
+      std::array<uint8_t, 16> nonce;
+      secureRandom(nonce.data(), nonce.size());
+      _key = base64Encode(nonce.data(), nonce.size());
+
+      std::string request = "GET " + _path + " HTTP/1.1\r\n";
+      request += "Host: " + _authority + "\r\n";
+      request += "Upgrade: websocket\r\nConnection: Upgrade\r\n";
+      request += "Sec-WebSocket-Key: " + _key + "\r\n";
+      request += "Sec-WebSocket-Version: 13\r\n";
+      if (!_options.protocols.empty()) {
+        std::string protocols;
+        for (const auto &protocol : _options.protocols) {
+          if (!isHeaderSafe(protocol)) {
+            throw std::invalid_argument("Invalid WebSocket protocol name");
+          }
+          protocols += (protocols.empty() ? "" : ", ") + protocol;
+        }
+        request += "Sec-WebSocket-Protocol: " + protocols + "\r\n";
+      }
+      if (_options.permessage_deflate) {
+        request += "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n";
+      }
+
+      std::string error;
+      auto headers = HttpHeaders::parse(_options.headers, error);
+      if (!headers.has_value()) {
+        throw std::invalid_argument(error);
+      }
+      for (const auto &[name, value] : headers->entries()) {
+        if (name.empty() || !isHeaderSafe(name) || !isHeaderSafe(value)) {
+          throw std::invalid_argument("Invalid WebSocket header \"" + name + "\"");
+        }
+        request += name + ": " + value + "\r\n";
+      }
+      request += "\r\n";
+      return request;
+    }
+
+    void wake() {
+      char byte = 1;
+      // A full pipe already guarantees a wake up.
+      (void)!write(_wakeWrite, &byte, 1);
+    }
+
+    static void onStream(void *context, tor::TOR_StreamResult result) {
+      std::unique_ptr<std::shared_ptr<WebSocketClient>> client(
+          static_cast<std::shared_ptr<WebSocketClient> *>(context));
+      auto self = *client;
+      std::string error(arenaString(result.arena, result.error));
+      tor::free_arena(result.arena);
+
+      if (result.fd < 0) {
+        self->_state.store(State::Closed);
+        self->_listener->onConnectFailed(error.empty() ? "Failed to open Tor stream" : error);
+        return;
+      }
+      std::thread([self, fd = result.fd]() { self->run(fd); }).detach();
+    }
+
+    // Remaining handshake budget in milliseconds, at least 0.
+    int handshakeTimeLeft() const {
+      auto deadline = _startedAt + std::chrono::milliseconds(_options.timeout_ms);
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+      return static_cast<int>(std::max<int64_t>(0, left.count()));
+    }
+
+    void run(int fd) {
+      _fd = fd;
+      fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+
+      std::string error;
+      if (!handshake(error)) {
+        ::close(_fd);
+        _state.store(State::Closed);
+        _listener->onConnectFailed(error);
+        return;
+      }
+      _state.store(State::Open);
+      _lastReceived = Clock::now();
+      _listener->onOpen(_protocol, _extensions);
+      // Frames that arrived together with the handshake response.
+      if (!_in.empty()) {
+        parseFrames();
+      }
+
+      while (!_terminated) {
+        drainWakePipe();
+        takeRequests();
+        fillWriteBuffer();
+
+        pollfd fds[2] = {{_fd, POLLIN, 0}, {_wakeRead, POLLIN, 0}};
+        if (_outOffset < _out.size()) {
+          fds[0].events |= POLLOUT;
+        }
+        if (poll(fds, 2, nextTimeout()) < 0 && errno != EINTR) {
+          terminate(kCloseAbnormal, "poll failed", false);
+          break;
+        }
+        if (fds[0].revents & POLLOUT) {
+          flush();
+        }
+        if (!_terminated && fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+          receive();
+        }
+        if (!_terminated) {
+          checkTimers();
+        }
+        if (!_terminated && _closeSent && _closeReceived && _outOffset == _out.size()) {
+          terminate(_closeCode, _closeReason, true);
+        }
+      }
+    }
+
+    bool handshake(std::string &error) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_closeRequest.has_value()) {
+          error = "Closed before the connection was established";
+          return false;
+        }
+      }
+
+      size_t written = 0;
+      while (written < _handshakeRequest.size()) {
+        pollfd fds{_fd, POLLOUT, 0};
+        if (poll(&fds, 1, handshakeTimeLeft()) <= 0) {
+          error = "WebSocket handshake timed out";
+          return false;
+        }
+        auto count = ::send(_fd, _handshakeRequest.data() + written,
+                            _handshakeRequest.size() - written, MSG_NOSIGNAL);
+        if (count < 0 && errno != EAGAIN && errno != EINTR) {
+          error = std::string("WebSocket handshake failed: ") + std::strerror(errno);
+          return false;
+        }
+        written += count > 0 ? static_cast<size_t>(count) : 0;
+      }
+
+      size_t header_end = std::string::npos;
+      while ((header_end = _in.find("\r\n\r\n")) == std::string::npos) {
+        if (_in.size() > kMaxHandshakeBytes) {
+          error = "WebSocket handshake response too large";
+          return false;
+        }
+        pollfd fds{_fd, POLLIN, 0};
+        if (poll(&fds, 1, handshakeTimeLeft()) <= 0) {
+          error = "WebSocket handshake timed out";
+          return false;
+        }
+        char buffer[4096];
+        auto count = ::recv(_fd, buffer, sizeof(buffer), 0);
+        if (count == 0) {
+          error = "Connection closed during WebSocket handshake";
+          return false;
+        }
+        if (count < 0) {
+          if (errno == EAGAIN || errno == EINTR) {
+            continue;
+          }
+          error = std::string("WebSocket handshake failed: ") + std::strerror(errno);
+          return false;
+        }
+        _in.append(buffer, static_cast<size_t>(count));
+      }
+
+      std::string response = _in.substr(0, header_end);
+      _in.erase(0, header_end + 4);
+      return validateHandshake(response, error);
+    }
+
+    static std::string toLower(std::string_view value) {
+      std::string lower(value);
+      for (auto &c : lower) {
+        if (c >= 'A' && c <= 'Z') {
+          c = static_cast<char>(c + 32);
+        }
+      }
+      return lower;
+    }
+
+    static std::string_view trim(std::string_view value) {
+      while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+      }
+      while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+        value.remove_suffix(1);
+      }
+      return value;
+    }
+
+    bool validateHandshake(const std::string &response, std::string &error) {
+      auto line_end = response.find("\r\n");
+      std::string_view status_line(response.data(), std::min(line_end, response.size()));
+      if (status_line.rfind("HTTP/1.1 101", 0) != 0) {
+        error = "WebSocket upgrade rejected: " + std::string(status_line);
+        return false;
+      }
+
+      std::string upgrade, connection, accept;
+      bool has_protocol = false, has_extensions = false;
+      size_t position = line_end == std::string::npos ? response.size() : line_end + 2;
+      while (position < response.size()) {
+        auto end = response.find("\r\n", position);
+        if (end == std::string::npos) {
+          end = response.size();
+        }
+        std::string_view line(response.data() + position, end - position);
+        position = end + 2;
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos) {
+          continue;
+        }
+        auto name = toLower(trim(line.substr(0, colon)));
+        auto value = trim(line.substr(colon + 1));
+        if (name == "upgrade") {
+          upgrade = toLower(value);
+        } else if (name == "connection") {
+          connection = toLower(value);
+        } else if (name == "sec-websocket-accept") {
+          accept = std::string(value);
+        } else if (name == "sec-websocket-protocol") {
+          has_protocol = true;
+          _protocol = std::string(value);
+        } else if (name == "sec-websocket-extensions") {
+          has_extensions = true;
+          _extensions = std::string(value);
+        }
+      }
+
+      auto digest = sha1(_key + kAcceptGuid);
+      if (upgrade != "websocket" || connection.find("upgrade") == std::string::npos ||
+          accept != base64Encode(digest.data(), digest.size())) {
+        error = "Invalid WebSocket upgrade response";
+        return false;
+      }
+      if (has_protocol && std::find(_options.protocols.begin(), _options.protocols.end(),
+                                    _protocol) == _options.protocols.end()) {
+        error = "Server selected a WebSocket protocol that was not offered: " + _protocol;
+        return false;
+      }
+      return !has_extensions || negotiateDeflate(error);
+    }
+
+    // Accepts a permessage-deflate response (RFC 7692 section 7.1) and sets up the zlib streams.
+    bool negotiateDeflate(std::string &error) {
+      std::string_view extensions = _extensions;
+      if (!_options.permessage_deflate || extensions.find(',') != std::string_view::npos) {
+        error = "Server selected WebSocket extensions that were not offered: " + _extensions;
+        return false;
+      }
+      int client_window_bits = 15;
+      bool first = true;
+      while (!extensions.empty()) {
+        auto end = extensions.find(';');
+        auto parameter = trim(extensions.substr(0, end));
+        extensions = end == std::string_view::npos ? "" : extensions.substr(end + 1);
+        auto name = toLower(trim(parameter.substr(0, parameter.find('='))));
+        std::string_view value;
+        if (parameter.find('=') != std::string_view::npos) {
+          value = trim(parameter.substr(parameter.find('=') + 1));
+          if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+            value = value.substr(1, value.size() - 2);
+          }
+        }
+
+        if (first) {
+          if (name != "permessage-deflate") {
+            error = "Unsupported WebSocket extension: " + name;
+            return false;
+          }
+          first = false;
+        } else if (name == "server_no_context_takeover") {
+          _serverNoContextTakeover = true;
+        } else if (name == "client_no_context_takeover") {
+          _clientNoContextTakeover = true;
+        } else if (name == "server_max_window_bits") {
+          // Inflating with the maximum window handles any smaller one.
+        } else if (name == "client_max_window_bits") {
+          client_window_bits = std::atoi(std::string(value).c_str());
+          if (client_window_bits < 8 || client_window_bits > 15) {
+            error = "Invalid client_max_window_bits";
+            return false;
+          }
+        } else {
+          error = "Unsupported permessage-deflate parameter: " + name;
+          return false;
+        }
+      }
+
+      _inflater = std::make_unique<ZStream>(false, 15);
+      // zlib cannot produce raw deflate streams with a 256 byte window, in that case only
+      // uncompressed messages are sent.
+      if (client_window_bits >= 9) {
+        _deflater = std::make_unique<ZStream>(true, client_window_bits);
+      }
+      return true;
+    }
+
+    void drainWakePipe() {
+      char buffer[64];
+      while (read(_wakeRead, buffer, sizeof(buffer)) > 0) {
+      }
+    }
+
+    void takeRequests() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      while (!_queue.empty()) {
+        _pending.push_back(std::move(_queue.front()));
+        _queue.pop_front();
+      }
+      if (_closeRequest.has_value() && !_closeQueued) {
+        _closeQueued = true;
+        _sendCloseCode = _closeRequest->first;
+        _sendCloseReason = _closeRequest->second;
+        if (!_closeReceived) {
+          _closeCode = _sendCloseCode;
+          _closeReason = _sendCloseReason;
+        }
+        _state.store(State::Closing);
+      }
+    }
+
+    void appendFrame(uint8_t first_byte, const char *data, size_t length) {
+      _out.push_back(static_cast<char>(first_byte));
+      if (length < 126) {
+        _out.push_back(static_cast<char>(0x80 | length));
+      } else if (length <= 0xffff) {
+        _out.push_back(static_cast<char>(0x80 | 126));
+        _out.push_back(static_cast<char>(length >> 8));
+        _out.push_back(static_cast<char>(length & 0xff));
+      } else {
+        _out.push_back(static_cast<char>(0x80 | 127));
+        for (int i = 7; i >= 0; i--) {
+          _out.push_back(static_cast<char>((static_cast<uint64_t>(length) >> (8 * i)) & 0xff));
+        }
+      }
+      // Client frames are always masked (RFC 6455 section 5.3), with keys from a strong source
+      // the server cannot predict. Drawn in batches to keep the syscalls off small frames.
+      if (_maskOffset == _maskPool.size()) {
+        secureRandom(_maskPool.data(), _maskPool.size());
+        _maskOffset = 0;
+      }
+      char mask[4];
+      std::memcpy(mask, _maskPool.data() + _maskOffset, sizeof(mask));
+      _maskOffset += sizeof(mask);
+      _out.append(mask, sizeof(mask));
+      size_t start = _out.size();
+      _out.append(data, length);
+      for (size_t i = 0; i < length; i++) {
+        _out[start + i] ^= mask[i & 3];
+      }
+    }
+
+    void appendControl(uint8_t opcode, std::string_view payload) {
+      _control.emplace_back(static_cast<char>(opcode), payload);
+    }
+
+    void appendClose(uint16_t code, const std::string &reason) {
+      std::string payload;
+      payload.push_back(static_cast<char>(code >> 8));
+      payload.push_back(static_cast<char>(code & 0xff));
+      payload += reason;
+      appendFrame(0x80 | kOpcodeClose, payload.data(), payload.size());
+      _closeSent = true;
+      _closeDeadline = Clock::now() + kCloseTimeout;
+    }
+
+    // Refills the write buffer once it was fully written: control frames first, then the next
+    // fragment of the current message, the next message, and finally a requested close frame.
+    void fillWriteBuffer() {
+      if (_outOffset < _out.size() || _closeSent) {
+        return;
+      }
+      _out.clear();
+      _outOffset = 0;
+      _outPayloadBytes = 0;
+
+      while (_out.size() < kReadSize) {
+        if (!_control.empty()) {
+          auto [opcode, payload] = std::move(_control.front());
+          _control.pop_front();
+          appendFrame(0x80 | static_cast<uint8_t>(opcode), payload.data(), payload.size());
+          continue;
+        }
+        if (!_sending.has_value() && !_pending.empty()) {
+          auto outgoing = std::move(_pending.front());
+          _pending.pop_front();
+          bool compress = _deflater && outgoing.payload.size() >= kMinCompressSize;
+          auto size = outgoing.payload.size();
+          _sending.emplace(Sending{
+              outgoing.opcode, compress,
+              compress ? _deflater->deflateMessage(outgoing.payload, _clientNoContextTakeover)
+                       : std::move(outgoing.payload),
+              0, size});
+        }
+        if (_sending.has_value()) {
+          auto &sending = *_sending;
+          bool first = sending.offset == 0;
+          size_t length = std::min(kFragmentSize, sending.payload.size() - sending.offset);
+          bool last = sending.offset + length == sending.payload.size();
+          uint8_t first_byte = first ? sending.opcode : kOpcodeContinuation;
+          if (first && sending.compressed) {
+            first_byte |= 0x40;
+          }
+          if (last) {
+            first_byte |= 0x80;
+          }
+          appendFrame(first_byte, sending.payload.data() + sending.offset, length);
+          sending.offset += length;
+          if (last) {
+            _outPayloadBytes += sending.original_size;
+            _sending.reset();
+          }
+          continue;
+        }
+        if (_closeQueued) {
+          appendClose(_sendCloseCode, _sendCloseReason);
+        }
+        break;
+      }
+    }
+
+    void flush() {
+      while (_outOffset < _out.size()) {
+        auto count = ::send(_fd, _out.data() + _outOffset, _out.size() - _outOffset, MSG_NOSIGNAL);
+        if (count < 0) {
+          if (errno == EAGAIN || errno == EINTR) {
+            return;
+          }
+          terminate(kCloseAbnormal, std::string("Write failed: ") + std::strerror(errno), false);
+          return;
+        }
+        _outOffset += static_cast<size_t>(count);
+      }
+
+      // Messages are accounted once the buffer holding their last fragment is out.
+      if (_outPayloadBytes > 0) {
+        _buffered.fetch_sub(_outPayloadBytes);
+        _outPayloadBytes = 0;
+        if (_buffered.load() == 0 && _needDrain.exchange(false)) {
+          _listener->onDrain();
+        }
+      }
+    }
+
+    void receive() {
+      char buffer[kReadSize];
+      while (!_terminated) {
+        auto count = ::recv(_fd, buffer, sizeof(buffer), 0);
+        if (count == 0) {
+          if (_closeSent && _closeReceived) {
+            terminate(_closeCode, _closeReason, true);
+          } else {
+            terminate(kCloseAbnormal, "Connection closed without a close frame", false);
+          }
+          return;
+        }
+        if (count < 0) {
+          if (errno != EAGAIN && errno != EINTR) {
+            terminate(kCloseAbnormal, std::string("Read failed: ") + std::strerror(errno), false);
+          }
+          break;
+        }
+        _in.append(buffer, static_cast<size_t>(count));
+        _lastReceived = Clock::now();
+        _pingOutstanding = false;
+        if (static_cast<size_t>(count) < sizeof(buffer)) {
+          break;
+        }
+      }
+      if (!_terminated) {
+        parseFrames();
+      }
+    }
+
+    void parseFrames() {
+      size_t position = 0;
+      while (!_terminated && _in.size() - position >= 2) {
+        auto *bytes = reinterpret_cast<const uint8_t *>(_in.data() + position);
+        size_t available = _in.size() - position;
+        bool fin = bytes[0] & 0x80;
+        bool rsv1 = bytes[0] & 0x40;
+        uint8_t opcode = bytes[0] & 0x0f;
+        bool control = opcode & 0x08;
+        uint64_t length = bytes[1] & 0x7f;
+        size_t header = 2;
+        if (length == 126) {
+          if (available < 4) {
+            break;
+          }
+          length = static_cast<uint64_t>(bytes[2]) << 8 | bytes[3];
+          header = 4;
+        } else if (length == 127) {
+          if (available < 10) {
+            break;
+          }
+          length = 0;
+          for (int i = 0; i < 8; i++) {
+            length = length << 8 | bytes[2 + i];
+          }
+          header = 10;
+        }
+
+        if (bytes[1] & 0x80) {
+          return fail(kCloseProtocolError, "Server frames must not be masked");
+        }
+        if ((bytes[0] & 0x30) ||
+            (rsv1 && (!_inflater || control || opcode == kOpcodeContinuation))) {
+          return fail(kCloseProtocolError, "Unexpected reserved bits");
+        }
+        if (control && (!fin || length > 125)) {
+          return fail(kCloseProtocolError, "Invalid control frame");
+        }
+        if (!control) {
+          bool continuation = opcode == kOpcodeContinuation;
+          if (!continuation && opcode != kOpcodeText && opcode != kOpcodeBinary) {
+            return fail(kCloseProtocolError, "Unknown opcode");
+          }
+          if (continuation != _inMessage) {
+            return fail(kCloseProtocolError, "Unexpected continuation frame");
+          }
+          if (length > _options.max_message_bytes - std::min(_options.max_message_bytes,
+                                                              _message.size())) {
+            return fail(kCloseTooBig, "Message too big");
+          }
+        } else if (opcode != kOpcodeClose && opcode != kOpcodePing && opcode != kOpcodePong) {
+          return fail(kCloseProtocolError, "Unknown opcode");
+        }
+        if (available - header < length) {
+          break;
+        }
+
+        std::string_view payload(_in.data() + position + header, static_cast<size_t>(length));
+        position += header + static_cast<size_t>(length);
+        if (control) {
+          onControlFrame(opcode, payload);
+          continue;
+        }
+        if (!_inMessage) {
+          _inMessage = true;
+          _messageOpcode = opcode;
+          _messageCompressed = rsv1;
+        }
+        _message.append(payload);
+        if (fin) {
+          _inMessage = false;
+          deliverMessage();
+        }
+      }
+      _in.erase(0, position);
+    }
+
+    void onControlFrame(uint8_t opcode, std::string_view payload) {
+      switch (opcode) {
+      case kOpcodePing:
+        if (!_closeSent) {
+          appendControl(kOpcodePong, payload);
+        }
+        break;
+      case kOpcodePong:
+        break;
+      case kOpcodeClose: {
+        if (payload.size() == 1) {
+          return fail(kCloseProtocolError, "Invalid close frame");
+        }
+        uint16_t code = 1005;
+        std::string reason;
+        if (payload.size() >= 2) {
+          code = static_cast<uint16_t>(static_cast<uint8_t>(payload[0]) << 8 |
+                                       static_cast<uint8_t>(payload[1]));
+          reason = std::string(payload.substr(2));
+        }
+        _closeReceived = true;
+        _closeCode = code;
+        _closeReason = std::move(reason);
+        _state.store(State::Closing);
+        if (!_closeSent) {
+          // Echo the code (RFC 6455 section 5.5.1) once the current write buffer is out, queued
+          // messages are dropped.
+          _pending.clear();
+          _sending.reset();
+          _control.clear();
+          _closeQueued = true;
+          _sendCloseCode = code == 1005 ? kCloseNormal : code;
+          _sendCloseReason.clear();
+        }
+        break;
+      }
+      }
+    }
+
+    static bool isValidUtf8(std::string_view text) {
+      size_t i = 0;
+      while (i < text.size()) {
+        auto c = static_cast<uint8_t>(text[i]);
+        size_t extra;
+        uint32_t codepoint;
+        if (c < 0x80) {
+          i++;
+          continue;
+        } else if ((c & 0xe0) == 0xc0) {
+          extra = 1;
+          codepoint = c & 0x1f;
+        } else if ((c & 0xf0) == 0xe0) {
+          extra = 2;
+          codepoint = c & 0x0f;
+        } else if ((c & 0xf8) == 0xf0) {
+          extra = 3;
+          codepoint = c & 0x07;
+        } else {
+          return false;
+        }
+        if (i + extra >= text.size()) {
+          return false;
+        }
+        for (size_t j = 1; j <= extra; j++) {
+          auto next = static_cast<uint8_t>(text[i + j]);
+          if ((next & 0xc0) != 0x80) {
+            return false;
+          }
+          codepoint = codepoint << 6 | (next & 0x3f);
+        }
+        static constexpr uint32_t kMinimum[] = {0, 0x80, 0x800, 0x10000};
+        if (codepoint < kMinimum[extra] || codepoint > 0x10ffff ||
+            (codepoint >= 0xd800 && codepoint <= 0xdfff)) {
+          return false;
+        }
+        i += extra + 1;
+      }
+      return true;
+    }
+
+    void deliverMessage() {
+      std::string message = std::move(_message);
+      _message.clear();
+      if (_messageCompressed) {
+        bool too_big = false;
+        if (!_inflater->inflateMessage(message, _options.max_message_bytes,
+                                       _serverNoContextTakeover, too_big)) {
+          return fail(too_big ? kCloseTooBig : kCloseProtocolError,
+                      too_big ? "Message too big" : "Invalid compressed message");
+        }
+      }
+      if (_messageOpcode == kOpcodeText) {
+        if (!isValidUtf8(message)) {
+          return fail(kCloseInvalidData, "Text message is not valid UTF-8");
+        }
+        _listener->onText(std::move(message));
+      } else {
+        _listener->onBinary(std::move(message));
+      }
+    }
+
+    int nextTimeout() const {
+      auto now = Clock::now();
+      std::optional<Clock::time_point> deadline;
+      auto earliest = [&](Clock::time_point time) {
+        deadline = deadline.has_value() ? std::min(*deadline, time) : time;
+      };
+      if (_closeSent) {
+        earliest(_closeDeadline);
+      }
+      if (_options.ping_interval_ms > 0) {
+        earliest(_pingOutstanding
+                     ? _pingSentAt + std::chrono::milliseconds(_options.pong_timeout_ms)
+                     : _lastReceived + std::chrono::milliseconds(_options.ping_interval_ms));
+      }
+      if (!deadline.has_value()) {
+        return -1;
+      }
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(*deadline - now).count();
+      return static_cast<int>(std::clamp<int64_t>(left + 1, 0, 60000));
+    }
+
+    void checkTimers() {
+      auto now = Clock::now();
+      if (_closeSent && now >= _closeDeadline) {
+        return terminate(_closeReceived ? _closeCode : kCloseAbnormal,
+                         "Closing handshake timed out", false);
+      }
+      if (_options.ping_interval_ms == 0 || _closeSent) {
+        return;
+      }
+      if (_pingOutstanding) {
+        if (now - _pingSentAt >= std::chrono::milliseconds(_options.pong_timeout_ms)) {
+          terminate(kCloseAbnormal, "Keepalive timeout", false);
+        }
+      } else if (now - _lastReceived >= std::chrono::milliseconds(_options.ping_interval_ms)) {
+        appendControl(kOpcodePing, "");
+        _pingOutstanding = true;
+        _pingSentAt = now;
+      }
+    }
+
+    // Fails the connection: best effort close frame, then the socket is dropped.
+    void fail(uint16_t code, const std::string &reason) {
+      // Only if no partially written frame is in the way.
+      if (!_closeSent && _outOffset == _out.size()) {
+        _out.clear();
+        _outOffset = 0;
+        appendClose(code, "");
+        (void)!::send(_fd, _out.data(), _out.size(), MSG_NOSIGNAL);
+      }
+      terminate(code, reason, false);
+    }
+
+    void terminate(uint16_t code, const std::string &reason, bool clean) {
+      _terminated = true;
+      ::close(_fd);
+      _state.store(State::Closed);
+      _buffered.store(0);
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.clear();
+      }
+      _listener->onClose(code, reason, clean);
+    }
+
+    const WebSocketOptions _options;
+    std::shared_ptr<WebSocketListener> _listener;
+    // Masking keys not used yet, only touched by the I/O thread.
+    std::array<uint8_t, 256> _maskPool;
+    size_t _maskOffset = _maskPool.size();
+
+    std::string _host;
+    std::string _authority;
+    std::string _path;
+    uint16_t _port = 80;
+    bool _tls = false;
+    std::string _key;
+    std::string _handshakeRequest;
+    Clock::time_point _startedAt;
+    int _wakeRead = -1;
+    int _wakeWrite = -1;
+
+    // Shared with the caller's thread.
+    std::atomic<State> _state{State::Connecting};
+    std::atomic<size_t> _buffered{0};
+    std::atomic<bool> _needDrain{false};
+    std::mutex _mutex;
+    std::deque<Outgoing> _queue;
+    std::optional<std::pair<uint16_t, std::string>> _closeRequest;
+
+    // Owned by the I/O thread.
+    int _fd = -1;
+    bool _terminated = false;
+    std::string _protocol;
+    std::string _extensions;
+    std::unique_ptr<ZStream> _inflater;
+    std::unique_ptr<ZStream> _deflater;
+    bool _serverNoContextTakeover = false;
+    bool _clientNoContextTakeover = false;
+
+    std::string _in;
+    std::string _message;
+    uint8_t _messageOpcode = kOpcodeText;
+    bool _messageCompressed = false;
+    bool _inMessage = false;
+
+    std::deque<Outgoing> _pending;
+    std::optional<Sending> _sending;
+    std::deque<std::pair<char, std::string>> _control;
+    std::string _out;
+    size_t _outOffset = 0;
+    // Payload bytes of the messages completed by the current write buffer.
+    size_t _outPayloadBytes = 0;
+
+    Clock::time_point _lastReceived;
+    Clock::time_point _pingSentAt;
+    bool _pingOutstanding = false;
+
+    bool _closeQueued = false;
+    uint16_t _sendCloseCode = kCloseNormal;
+    std::string _sendCloseReason;
+    bool _closeSent = false;
+    bool _closeReceived = false;
+    Clock::time_point _closeDeadline;
+    // Reported through onClose: the peer's code if it sent a close frame, else ours.
+    uint16_t _closeCode = kCloseNormal;
+    std::string _closeReason;
+  };
+} // namespace margelo::nitro::nitrotor
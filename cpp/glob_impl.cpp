@@ -1,28 +1,576 @@
 // glob_impl.cpp
-#include <cstdlib>  // for free()
+//
+// glob()/globfree() for Android API levels whose libc lacks them, used by the Tor library for
+// config %include directives and directory scans of data_dir.
+//
+// Patterns are matched one path component at a time: components without wildcards are appended
+// as is, the others are matched against the entries of one opendir()/readdir() pass. The path is
+// built up in a single buffer, so a match only allocates its result string.
+//
+// Supported: * ? [...] (ranges, ! or ^ negation), backslash escapes, and the flags GLOB_APPEND,
+// GLOB_DOOFFS, GLOB_ERR, GLOB_MARK, GLOB_NOCHECK, GLOB_NOESCAPE, GLOB_NOSORT, plus GLOB_BRACE,
+// GLOB_NOMAGIC, GLOB_ONLYDIR, GLOB_PERIOD, GLOB_TILDE and GLOB_TILDE_CHECK where glob.h defines
+// them. GLOB_ALTDIRFUNC is not supported.
+//
+// Results match glibc's, except for slashes: repeated ones are collapsed, and a pattern ending in
+// '/' only matches directories, which are returned with a single trailing '/' even with GLOB_MARK.
+// glibc keeps repeated slashes and returns files and doubled slashes for such patterns.
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <dirent.h>
 #include <glob.h>
-#include <string.h>
+#include <new>
+#include <pwd.h>
+#include <string>
+#include <string_view>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+  constexpr int kBraceFlag =
+#ifdef GLOB_BRACE
+      GLOB_BRACE;
+#else
+      0;
+#endif
+  constexpr int kNoMagicFlag =
+#ifdef GLOB_NOMAGIC
+      GLOB_NOMAGIC;
+#else
+      0;
+#endif
+  constexpr int kOnlyDirFlag =
+#ifdef GLOB_ONLYDIR
+      GLOB_ONLYDIR;
+#else
+      0;
+#endif
+  constexpr int kPeriodFlag =
+#ifdef GLOB_PERIOD
+      GLOB_PERIOD;
+#else
+      0;
+#endif
+  constexpr int kTildeFlag =
+#ifdef GLOB_TILDE
+      GLOB_TILDE;
+#else
+      0;
+#endif
+  constexpr int kTildeCheckFlag =
+#ifdef GLOB_TILDE_CHECK
+      GLOB_TILDE_CHECK;
+#else
+      0;
+#endif
+
+  using ErrorFunction = int (*)(const char *epath, int eerrno);
+
+  // Matches one path component against one pattern component. A leading period must be matched
+  // explicitly unless `period` is set.
+  class ComponentMatcher {
+  public:
+    ComponentMatcher(std::string_view pattern, bool escape, bool period)
+        : _pattern(pattern), _escape(escape), _period(period) {}
+
+    bool matches(std::string_view name) const {
+      if (!_period && !name.empty() && name[0] == '.' && !startsWithLiteralPeriod()) {
+        return false;
+      }
+      return match(0, name, 0);
+    }
+
+  private:
+    bool startsWithLiteralPeriod() const {
+      size_t i = 0;
+      if (_escape && i + 1 < _pattern.size() && _pattern[i] == '\\') {
+        i++;
+      }
+      return i < _pattern.size() && _pattern[i] == '.';
+    }
+
+    // Iterative matching with backtracking to the last '*' only, linear for typical patterns.
+    bool match(size_t p, std::string_view name, size_t n) const {
+      size_t star_p = std::string_view::npos;
+      size_t star_n = 0;
+      while (n < name.size()) {
+        if (p < _pattern.size()) {
+          char c = _pattern[p];
+          if (c == '*') {
+            star_p = ++p;
+            star_n = n;
+            continue;
+          }
+          if (c == '?') {
+            p++;
+            n++;
+            continue;
+          }
+          if (c == '[') {
+            size_t end;
+            if (matchBracket(p, name[n], end)) {
+              p = end;
+              n++;
+              continue;
+            }
+            if (end == std::string_view::npos && name[n] == '[') {
+              // Unterminated bracket, '[' is literal.
+              p++;
+              n++;
+              continue;
+            }
+          } else {
+            if (c == '\\' && _escape && p + 1 < _pattern.size()) {
+              c = _pattern[++p];
+            }
+            if (c == name[n]) {
+              p++;
+              n++;
+              continue;
+            }
+          }
+        }
+        if (star_p == std::string_view::npos) {
+          return false;
+        }
+        p = star_p;
+        n = ++star_n;
+      }
+      while (p < _pattern.size() && _pattern[p] == '*') {
+        p++;
+      }
+      return p == _pattern.size();
+    }
+
+    // Matches `c` against the bracket expression at `p`. `end` is set past the closing ']', or
+    // to npos if the bracket is not terminated.
+    bool matchBracket(size_t p, char c, size_t &end) const {
+      size_t i = p + 1;
+      bool negate = i < _pattern.size() && (_pattern[i] == '!' || _pattern[i] == '^');
+      if (negate) {
+        i++;
+      }
+      bool matched = false;
+      bool first = true;
+      while (i < _pattern.size() && (first || _pattern[i] != ']')) {
+        first = false;
+        char low = _pattern[i];
+        if (low == '\\' && _escape && i + 1 < _pattern.size()) {
+          low = _pattern[++i];
+        }
+        i++;
+        char high = low;
+        if (i + 1 < _pattern.size() && _pattern[i] == '-' && _pattern[i + 1] != ']') {
+          high = _pattern[i + 1];
+          i += 2;
+          if (high == '\\' && _escape && i < _pattern.size()) {
+            high = _pattern[i++];
+          }
+        }
+        auto value = static_cast<unsigned char>(c);
+        if (static_cast<unsigned char>(low) <= value && value <= static_cast<unsigned char>(high)) {
+          matched = true;
+        }
+      }
+      if (i >= _pattern.size()) {
+        end = std::string_view::npos;
+        return false;
+      }
+      end = i + 1;
+      // A wildcard never matches '/', which cannot occur within a component anyway.
+      return matched != negate;
+    }
+
+    std::string_view _pattern;
+    bool _escape;
+    bool _period;
+  };
+
+  bool hasMagic(std::string_view pattern, bool escape) {
+    for (size_t i = 0; i < pattern.size(); i++) {
+      char c = pattern[i];
+      if (c == '\\' && escape) {
+        i++;
+      } else if (c == '*' || c == '?') {
+        return true;
+      } else if (c == '[' && pattern.find(']', i + 2) != std::string_view::npos) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void appendUnescaped(std::string &out, std::string_view component, bool escape) {
+    for (size_t i = 0; i < component.size(); i++) {
+      if (component[i] == '\\' && escape && i + 1 < component.size()) {
+        i++;
+      }
+      out.push_back(component[i]);
+    }
+  }
+
+  // Expands the first {a,b,...} of `pattern`, recursively. Like glibc, a single alternative such
+  // as {a} expands too, and a pattern whose first brace is not closed is kept literally.
+  void expandBraces(const std::string &pattern, bool escape, std::vector<std::string> &out) {
+    size_t open = std::string::npos;
+    for (size_t i = 0; i < pattern.size(); i++) {
+      if (pattern[i] == '\\' && escape) {
+        i++;
+        continue;
+      }
+      if (pattern[i] != '{') {
+        continue;
+      }
+      // Find the matching '}' and the top level commas.
+      std::vector<size_t> commas;
+      int depth = 0;
+      size_t close = std::string::npos;
+      for (size_t j = i + 1; j < pattern.size(); j++) {
+        if (pattern[j] == '\\' && escape) {
+          j++;
+        } else if (pattern[j] == '{') {
+          depth++;
+        } else if (pattern[j] == '}') {
+          if (depth == 0) {
+            close = j;
+            break;
+          }
+          depth--;
+        } else if (pattern[j] == ',' && depth == 0) {
+          commas.push_back(j);
+        }
+      }
+      if (close == std::string::npos) {
+        break;
+      }
+      open = i;
+      commas.push_back(close);
+      auto prefix = pattern.substr(0, open);
+      auto suffix = pattern.substr(close + 1);
+      size_t start = open + 1;
+      for (auto comma : commas) {
+        expandBraces(prefix + pattern.substr(start, comma - start) + suffix, escape, out);
+        start = comma + 1;
+      }
+      return;
+    }
+    out.push_back(pattern);
+  }
+
+  // Replaces a leading ~ or ~user. Returns false if the user is unknown.
+  bool expandTilde(std::string &pattern) {
+    if (pattern.empty() || pattern[0] != '~') {
+      return true;
+    }
+    auto slash = pattern.find('/');
+    auto user = pattern.substr(1, slash == std::string::npos ? std::string::npos : slash - 1);
+    const char *home = nullptr;
+    if (user.empty()) {
+      home = std::getenv("HOME");
+      if (home == nullptr) {
+        if (auto *entry = getpwuid(getuid())) {
+          home = entry->pw_dir;
+        }
+      }
+    } else if (auto *entry = getpwnam(user.c_str())) {
+      home = entry->pw_dir;
+    }
+    if (home == nullptr) {
+      return false;
+    }
+    pattern.replace(0, slash == std::string::npos ? pattern.size() : slash, home);
+    return true;
+  }
+
+  bool isDirectory(const std::string &path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+  }
+
+  class Globber {
+  public:
+    Globber(int flags, ErrorFunction errfunc, std::vector<char *> &results)
+        : _flags(flags), _errfunc(errfunc), _results(results) {}
+
+    // Returns 0, GLOB_ABORTED or GLOB_NOSPACE.
+    int run(const std::string &pattern) {
+      _components.clear();
+      _firstMagic = std::string::npos;
+      _path.clear();
+      size_t start = 0;
+      if (!pattern.empty() && pattern[0] == '/') {
+        _path = "/";
+        start = 1;
+      }
+      while (start <= pattern.size()) {
+        auto slash = pattern.find('/', start);
+        if (slash == std::string::npos) {
+          slash = pattern.size();
+        }
+        if (slash > start) {
+          std::string_view component(pattern.data() + start, slash - start);
+          _components.push_back(Component{component, hasMagic(component, escape())});
+          if (_components.back().magic && _firstMagic == std::string::npos) {
+            _firstMagic = _components.size() - 1;
+          }
+        }
+        start = slash + 1;
+      }
+      _trailingSlash = pattern.size() > 1 && pattern.back() == '/';
+      if (_components.empty()) {
+        // "/" or "": the root exists, an empty pattern matches nothing.
+        return _path.empty() ? 0 : add(_path, true);
+      }
+      _path.reserve(PATH_MAX);
+      return walk(0);
+    }
+
+  private:
+    struct Component {
+      std::string_view pattern;
+      bool magic;
+    };
+
+    bool escape() const { return (_flags & GLOB_NOESCAPE) == 0; }
+
+    // Matches components[index...] below _path.
+    int walk(size_t index) {
+      bool last = index + 1 == _components.size();
+      const auto &component = _components[index];
+      auto base = _path.size();
+
+      if (!component.magic) {
+        if (base > 0 && _path.back() != '/') {
+          _path.push_back('/');
+        }
+        appendUnescaped(_path, component.pattern, escape());
+        int status = 0;
+        if (!last) {
+          status = walk(index + 1);
+        } else {
+          struct stat info;
+          if (lstat(_path.c_str(), &info) == 0) {
+            bool directory =
+                S_ISDIR(info.st_mode) || (S_ISLNK(info.st_mode) && isDirectory(_path));
+            if (directory || !_trailingSlash) {
+              status = add(_path, directory);
+            }
+          }
+        }
+        _path.resize(base);
+        return status;
+      }
+
+      // The directory is opened and reported without the separator that follows it.
+      DIR *dir = opendir(base == 0 ? "." : _path.c_str());
+      if (dir == nullptr) {
+        // Like glibc, a component that is not a directory goes unreported, and so does a missing
+        // one below a wildcard: that only means the wildcard matched nothing there.
+        int error = errno;
+        bool unmatched = error == ENOTDIR || (error == ENOENT && index > _firstMagic);
+        return unmatched ? 0 : reportError(error);
+      }
+      if (base > 0 && _path.back() != '/') {
+        _path.push_back('/');
+      }
+      auto prefix = _path.size();
+
+      // Like in glibc, GLOB_PERIOD only applies to the last component: wildcards in directory
+      // components never descend into "..", "." or hidden directories.
+      ComponentMatcher matcher(component.pattern, escape(), last && (_flags & kPeriodFlag) != 0);
+      int status = 0;
+      errno = 0;
+      while (auto *entry = readdir(dir)) {
+        std::string_view name(entry->d_name);
+        if (!matcher.matches(name)) {
+          continue;
+        }
+        _path.append(name);
+        bool directory = false;
+        bool known = entryIsDirectory(entry, directory);
+        if (!last) {
+          if (!known || directory) {
+            status = walk(index + 1);
+          }
+        } else if (!(_flags & kOnlyDirFlag) || !known || directory) {
+          bool need_type = (_flags & (GLOB_MARK | kOnlyDirFlag)) != 0 || _trailingSlash;
+          if (need_type && !known) {
+            directory = isDirectory(_path);
+          }
+          if ((!_trailingSlash && !(_flags & kOnlyDirFlag)) || directory) {
+            status = add(_path, directory);
+          }
+        }
+        _path.resize(prefix);
+        if (status != 0) {
+          break;
+        }
+        errno = 0;
+      }
+      int read_error = status == 0 ? errno : 0;
+      closedir(dir);
+      _path.resize(base);
+      return read_error != 0 ? reportError(read_error) : status;
+    }
+
+    // Uses d_type where the filesystem provides it, returns false if the type is unknown.
+    // Symlinks count as unknown since they may point to a directory.
+    static bool entryIsDirectory(const dirent *entry, bool &directory) {
+      if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+        return false;
+      }
+      directory = entry->d_type == DT_DIR;
+      return true;
+    }
+
+    int reportError(int error) {
+      const char *path = _path.empty() ? "." : _path.c_str();
+      if ((_errfunc != nullptr && _errfunc(path, error) != 0) || (_flags & GLOB_ERR)) {
+        return GLOB_ABORTED;
+      }
+      return 0;
+    }
+
+    int add(const std::string &path, bool directory) {
+      // A trailing slash in the pattern is kept, like GLOB_MARK for directories.
+      bool mark = ((_flags & GLOB_MARK) || _trailingSlash) && directory && path.back() != '/';
+      auto *copy = static_cast<char *>(std::malloc(path.size() + (mark ? 2 : 1)));
+      if (copy == nullptr) {
+        return GLOB_NOSPACE;
+      }
+      std::memcpy(copy, path.data(), path.size());
+      if (mark) {
+        copy[path.size()] = '/';
+      }
+      copy[path.size() + (mark ? 1 : 0)] = '\0';
+      try {
+        _results.push_back(copy);
+      } catch (const std::bad_alloc &) {
+        std::free(copy);
+        return GLOB_NOSPACE;
+      }
+      return 0;
+    }
+
+    const int _flags;
+    const ErrorFunction _errfunc;
+    std::vector<char *> &_results;
+    std::vector<Component> _components;
+    size_t _firstMagic = std::string::npos;
+    std::string _path;
+    bool _trailingSlash = false;
+  };
+
+  int runGlob(const char *pattern, int flags, ErrorFunction errfunc, glob_t *pglob) {
+    std::vector<char *> results;
+    auto release = [&results]() {
+      for (auto *path : results) {
+        std::free(path);
+      }
+    };
+
+    std::vector<std::string> patterns;
+    if (flags & kBraceFlag) {
+      expandBraces(pattern, (flags & GLOB_NOESCAPE) == 0, patterns);
+    } else {
+      patterns.emplace_back(pattern);
+    }
+
+    int status = 0;
+    for (auto &expanded : patterns) {
+      auto first = results.size();
+      if ((flags & (kTildeFlag | kTildeCheckFlag)) && !expandTilde(expanded)) {
+        if (flags & kTildeCheckFlag) {
+          release();
+          return GLOB_NOMATCH;
+        }
+      }
+      status = Globber(flags, errfunc, results).run(expanded);
+      if (status != 0) {
+        break;
+      }
+      if (!(flags & GLOB_NOSORT)) {
+        std::sort(results.begin() + static_cast<std::ptrdiff_t>(first), results.end(),
+                  [](const char *a, const char *b) { return std::strcmp(a, b) < 0; });
+      }
+    }
+    if (status != 0) {
+      release();
+      return status;
+    }
+
+    if (results.empty()) {
+      // GLOB_NOMAGIC returns the pattern if it has no special characters at all, even ones that
+      // would be taken literally like an unterminated '['.
+      bool literal = (flags & GLOB_NOCHECK) ||
+                     ((flags & kNoMagicFlag) && *pattern != '\0' && !std::strpbrk(pattern, "*?["));
+      if (!literal) {
+        return GLOB_NOMATCH;
+      }
+      auto *copy = strdup(pattern);
+      if (copy == nullptr) {
+        return GLOB_NOSPACE;
+      }
+      results.push_back(copy);
+    }
+
+    // Append to gl_pathv, which keeps gl_offs leading NULLs with GLOB_DOOFFS.
+    size_t offs = (flags & GLOB_DOOFFS) ? pglob->gl_offs : 0;
+    size_t old_count = (flags & GLOB_APPEND) ? pglob->gl_pathc : 0;
+    char **old_paths = (flags & GLOB_APPEND) ? pglob->gl_pathv : nullptr;
+    auto **paths = static_cast<char **>(
+        std::realloc(old_paths, (offs + old_count + results.size() + 1) * sizeof(char *)));
+    if (paths == nullptr) {
+      release();
+      return GLOB_NOSPACE;
+    }
+    if (old_paths == nullptr) {
+      std::fill(paths, paths + offs, nullptr);
+    }
+    std::copy(results.begin(), results.end(), paths + offs + old_count);
+    paths[offs + old_count + results.size()] = nullptr;
+    pglob->gl_pathv = paths;
+    pglob->gl_pathc = old_count + results.size();
+    return 0;
+  }
+} // namespace
+
+// The Linux host tests build this file under other names, to compare it with glibc's glob().
+#ifndef NITROTOR_GLOB
+#define NITROTOR_GLOB glob
+#define NITROTOR_GLOBFREE globfree
+#endif
 
 extern "C" {
 
-int glob(const char *pattern, int flags,
-         int (*errfunc) (const char *epath, int eerrno),
-         glob_t *pglob) {
-    // Basic implementation for the minimal case
+int NITROTOR_GLOB(const char *pattern, int flags,
+                  int (*errfunc)(const char *epath, int eerrno), glob_t *pglob) {
+  if (!(flags & GLOB_APPEND)) {
     pglob->gl_pathc = 0;
-    pglob->gl_pathv = NULL;
-    return 0;
+    pglob->gl_pathv = nullptr;
+    if (!(flags & GLOB_DOOFFS)) {
+      pglob->gl_offs = 0;
+    }
+  }
+  try {
+    return runGlob(pattern, flags, errfunc, pglob);
+  } catch (const std::bad_alloc &) {
+    return GLOB_NOSPACE;
+  }
 }
 
-void globfree(glob_t *pglob) {
-    if (pglob->gl_pathv != NULL) {
-        for (size_t i = 0; i < pglob->gl_pathc; ++i) {
-            std::free(pglob->gl_pathv[i]);  // Using std::free
-        }
-        std::free(pglob->gl_pathv);  // Using std::free
+void NITROTOR_GLOBFREE(glob_t *pglob) {
+  if (pglob->gl_pathv != nullptr) {
+    for (size_t i = 0; i < pglob->gl_pathc; ++i) {
+      std::free(pglob->gl_pathv[pglob->gl_offs + i]);
     }
+    std::free(pglob->gl_pathv);
+  }
+  pglob->gl_pathc = 0;
+  pglob->gl_pathv = nullptr;
+}
 }
-
-}
\ No newline at end of file
@@ -9,25 +9,266 @@
 
 namespace tor {
 
+  /// Every string of one response, packed by Rust into a single allocation so a response costs
+  /// one allocation and one free call regardless of its number of fields. Owned by the callee and
+  /// released with `free_arena` (`free_http_response` for HTTP responses). `data` is null for a
+  /// response without strings, such as a successful resume or stream, which costs no allocation.
+  struct TOR_Arena {
+    char *data;
+    size_t size;
+  };
+
+  /// A string inside the response's `TOR_Arena`: `length` bytes at `offset`, followed by a NUL.
+  /// Absent values have length 0.
+  struct TOR_ArenaString {
+    size_t offset;
+    size_t length;
+  };
+
   struct TOR_HiddenServiceResponse {
     bool is_success;
-    char *onion_address;
-    char *control;
+    TOR_Arena arena;
+    TOR_ArenaString onion_address;
+    TOR_ArenaString control;
   };
 
   struct TOR_StartTorResponse {
     bool is_success;
-    char *onion_address;
-    char *control;
-    char *error_message;
+    TOR_Arena arena;
+    TOR_ArenaString onion_address;
+    TOR_ArenaString control;
+    TOR_ArenaString error_message;
+  };
+
+  struct TOR_ResumeResponse {
+    bool is_success;
+    /// Time from leaving dormant mode until a circuit was usable again.
+    unsigned long circuit_ready_ms;
+    TOR_Arena arena;
+    TOR_ArenaString error_message;
+  };
+
+  /// Failure class of an HTTP request, lets callers decide whether a retry can help.
+  enum class TOR_HttpErrorKind : int {
+    None = 0,
+    /// `timeout_ms` elapsed before the response completed.
+    Timeout = 1,
+    /// The exit or onion service could not be reached.
+    Connect = 2,
+    /// Circuit construction failed or the circuit collapsed mid request.
+    Circuit = 3,
+    /// Malformed HTTP or TLS failure.
+    Protocol = 4,
+    /// Aborted through `cancel_http_request`.
+    Cancelled = 5,
+    Other = 6,
+  };
+
+  /// Protocol a response was received with, Unknown if no response arrived.
+  enum class TOR_HttpVersion : int {
+    Unknown = 0,
+    Http10 = 10,
+    Http11 = 11,
+    Http2 = 20,
   };
 
   struct TOR_CHttpResponse {
     unsigned short status_code;
-    char *body;
-    char *error;
+    TOR_Arena arena;
+    TOR_ArenaString body;
+    TOR_ArenaString error;
+    TOR_HttpErrorKind error_kind;
+    /// Time until the stream to the target was open and until the first response byte arrived
+    /// after sending the request. 0 if the phase was not reached.
+    unsigned long connect_ms;
+    unsigned long first_byte_ms;
+    /// Body size as received on the wire and after content decoding. Both are equal when the
+    /// response was not compressed.
+    unsigned long long compressed_bytes;
+    unsigned long long decompressed_bytes;
+    TOR_HttpVersion http_version;
+    /// True if the request ran on an already open connection (an HTTP/1.1 keep-alive connection
+    /// or another stream of a shared HTTP/2 connection) instead of opening a new Tor stream.
+    bool reused_connection;
+    /// Address the exit connected to and the TTL it reported in its CONNECTED cell. Absent for
+    /// onion services, IP literals, `resolved_addr`, reused connections and when the exit sent no
+    /// address.
+    TOR_ArenaString remote_addr;
+    unsigned long remote_addr_ttl_s;
+  };
+
+  /// Connection pool and protocol settings of `http_request`, see `configure_http_client`.
+  struct TOR_HttpClientConfig {
+    /// Offer h2 through ALPN on TLS connections, falling back to HTTP/1.1.
+    bool http2;
+    /// Use h2 with prior knowledge on plain http:// connections to .onion hosts. Onion services
+    /// are end-to-end encrypted by Tor and commonly served without TLS, so there is no ALPN.
+    bool http2_prior_knowledge_onion;
+    /// Concurrent h2 streams per connection, capped by the server's
+    /// SETTINGS_MAX_CONCURRENT_STREAMS. 0 uses the server's value.
+    unsigned int max_concurrent_streams;
+    /// Connections (and thus Tor streams) per host and isolation token. A new h2 connection is
+    /// only opened once every stream of the existing ones is busy.
+    unsigned int max_connections_per_host;
+    /// Idle connections are closed after this long.
+    unsigned long idle_timeout_ms;
+  };
+
+  /// Request body pulled in chunks while it is sent, for bodies that are binary or too large to
+  /// pass as one string. Rust calls `read` from its runtime whenever the stream can take more
+  /// data, never concurrently, and `release` exactly once afterwards: after the last read, or
+  /// when the request ends before the body was sent (including a failure inside `http_request`).
+  struct TOR_BodySource {
+    /// Copies up to `capacity` bytes of the body into `buffer` and returns how many, 0 at the
+    /// end of the body. A negative value aborts the request with `TOR_HttpErrorKind::Other`.
+    long long (*read)(void *context, unsigned char *buffer, size_t capacity);
+    void (*release)(void *context);
+    void *context;
+    /// Exact body size, sent as Content-Length. A body that ends early or runs longer aborts the
+    /// request like a failed read.
+    unsigned long long length;
+  };
+
+  /// Single entry point for every HTTP method, see `http_request`.
+  struct TOR_HttpRequest {
+    /// Upper case method name, e.g. "GET" or "OPTIONS".
+    const char *method;
+    const char *url;
+    const char *headers_json;
+    /// Request body, nullptr for methods without one.
+    const char *body;
+    /// Overall deadline. The per phase timeouts below are only applied when non-zero.
+    unsigned long timeout_ms;
+    unsigned long connect_timeout_ms;
+    unsigned long first_byte_timeout_ms;
+    /// Advertise `Accept-Encoding: gzip, br, zstd` (unless the caller already sent one) and decode
+    /// the body while it streams in.
+    bool decompress;
+    /// Requests with different non-zero tokens never share a circuit, 0 uses the default one.
+    unsigned long long isolation_token;
+    /// IPv4 or IPv6 address to connect to instead of having the exit resolve the URL's host,
+    /// nullptr to resolve as usual. The Host header and TLS verification still use the URL's host.
+    const char *resolved_addr;
+    /// Streamed body, replaces `body` when non-null. Only the struct is copied during the call,
+    /// its context stays in use until `release`.
+    const TOR_BodySource *body_source;
+  };
+
+  /// Pluggable transport that is already running and reachable through a local SOCKS5 proxy, the
+  /// unmanaged transport setup of Tor's `ClientTransportPlugin ... socks5 host:port`.
+  struct TOR_PluggableTransport {
+    /// Transport names handled by the proxy, e.g. "obfs4".
+    const char *const *protocols;
+    size_t protocol_count;
+    /// "host:port" of the proxy.
+    const char *proxy_addr;
+  };
+
+  /// One circuit build attempt, reported to the observer set with `set_circuit_observer`.
+  struct TOR_CircuitEvent {
+    /// Identity fingerprints (hex) of the hops, guard first. Only valid during the callback.
+    const char *const *relays;
+    size_t relay_count;
+    /// Time from the first CREATE cell until the circuit was built or failed.
+    unsigned long build_ms;
+    bool success;
+    /// Index into `relays` of the hop that failed to extend, -1 if unknown or on success.
+    int failed_hop;
+  };
+
+  /// Client side bias for path selection, see `set_relay_weights`.
+  struct TOR_RelayWeight {
+    const char *fingerprint;
+    /// Multiplier in (0, 1] applied to the relay's consensus weight.
+    double weight;
+  };
+
+  /// Memory caps of the client, see `configure_memory_limits`. 0 keeps Tor's default for a field.
+  struct TOR_MemoryLimits {
+    /// Overall quota for queued cells, stream buffers and caches. Above it Tor reclaims memory
+    /// from the oldest streams and circuits first, like relays do with MaxMemInQueues.
+    unsigned long long total_bytes;
+    /// In-memory consensus and microdescriptor caches. Entries evicted from memory are reloaded
+    /// from the cache in `data_dir` when needed.
+    unsigned long long dir_cache_bytes;
+    /// Receive and send buffer of a single stream, reads from the circuit pause when it is full.
+    unsigned long long stream_buffer_bytes;
+    /// Built but unused circuits kept for later streams, including preemptive ones.
+    unsigned int max_idle_circuits;
+    /// Channels to relays without circuits kept open.
+    unsigned int max_idle_connections;
+  };
+
+  enum class TOR_TrimLevel : int {
+    /// Close idle circuits and connections above half the limits, shrink buffers of idle streams
+    /// and evict directory cache entries not needed by open circuits.
+    Moderate = 1,
+    /// Close all idle circuits and connections and drop the in-memory directory caches.
+    Critical = 2,
+  };
+
+  /// Current memory use of the client by subsystem, in bytes.
+  struct TOR_MemoryUsage {
+    unsigned long long dir_cache_bytes;
+    /// Cell queues and crypto state of open circuits.
+    unsigned long long circuit_bytes;
+    unsigned long long stream_buffer_bytes;
+    /// TLS state and buffers of channels to relays.
+    unsigned long long connection_bytes;
+    /// Everything else Tor accounts for, e.g. guard state and the HTTP connection pool.
+    unsigned long long other_bytes;
+    unsigned int open_circuits;
+    unsigned int idle_circuits;
+    unsigned int open_connections;
   };
 
+  /// Traffic of the running client. Byte counters are cumulative since the client started and
+  /// cover all Tor traffic (cells on relay connections), not only the HTTP API's.
+  struct TOR_TrafficCounters {
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned int open_circuits;
+    unsigned int open_streams;
+  };
+
+  /// Outcome of `resolve_async`.
+  struct TOR_ResolveResult {
+    TOR_Arena arena;
+    /// Comma separated IPv4 and IPv6 addresses of the exit's RESOLVED cell, in its order.
+    TOR_ArenaString addresses;
+    TOR_ArenaString error;
+    /// Connect if the exit could not resolve the name.
+    TOR_HttpErrorKind error_kind;
+    /// Lifetime of the answer as reported (and clipped) by the exit.
+    unsigned long ttl_s;
+  };
+
+  /// Outcome of `open_stream_async`.
+  struct TOR_StreamResult {
+    /// Local end of the stream, -1 on failure. Owned by the callee, closing it closes the stream.
+    int fd;
+    TOR_Arena arena;
+    TOR_ArenaString error;
+    TOR_HttpErrorKind error_kind;
+    unsigned long connect_ms;
+  };
+
+  /// Completion callbacks for the non-blocking entry points. Rust invokes the callback exactly
+  /// once, from its own runtime, and hands ownership of the response to the callee: it must be
+  /// released with `free_arena` / `free_http_response`.
+  using TOR_HttpCallback = void (*)(void *context, TOR_CHttpResponse response);
+
+  using TOR_StartTorCallback = void (*)(void *context, TOR_StartTorResponse response);
+
+  using TOR_ResumeCallback = void (*)(void *context, TOR_ResumeResponse response);
+
+  using TOR_StreamCallback = void (*)(void *context, TOR_StreamResult result);
+
+  using TOR_ResolveCallback = void (*)(void *context, TOR_ResolveResult result);
+
+  /// Unlike the completion callbacks above this fires any number of times and owns nothing.
+  using TOR_CircuitCallback = void (*)(void *context, const TOR_CircuitEvent *event);
+
   extern "C" {
 
   bool initialize_tor_library();
@@ -50,6 +291,8 @@ namespace tor {
 
   void free_string(char *s);
 
+  void free_arena(TOR_Arena arena);
+
   TOR_CHttpResponse http_get(const char *url, const char *headers_json, unsigned long timeout_ms);
 
   TOR_CHttpResponse http_post(const char *url, const char *body, const char *headers_json,
@@ -66,8 +309,77 @@ namespace tor {
   TOR_CHttpResponse http_options(const char *url, const char *headers_json,
                                  unsigned long timeout_ms);
 
+  /// Same as `free_arena(response.arena)`.
   void free_http_response(TOR_CHttpResponse response);
 
+  // Non-blocking variants: all arguments are copied before these return, the result is
+  // delivered through `callback` together with the caller supplied `context` pointer.
+
+  void start_tor_if_not_running_async(const char *data_dir, const unsigned char *key_data,
+                                      bool has_key, unsigned short socks_port,
+                                      unsigned short target_port, unsigned long timeout_ms,
+                                      TOR_StartTorCallback callback, void *context);
+
+  /// Puts the running client into dormant mode: guard and consensus state are kept, circuit
+  /// building, preemptive circuits and padding stop until `resume_from_dormant_async`.
+  bool enter_dormant_mode();
+
+  /// Leaves dormant mode and reports once a circuit is usable or `timeout_ms` elapsed.
+  void resume_from_dormant_async(unsigned long timeout_ms, TOR_ResumeCallback callback,
+                                 void *context);
+
+  /// Returns a non-zero id that can be passed to `cancel_http_request`.
+  unsigned long long http_request(const TOR_HttpRequest *request, TOR_HttpCallback callback,
+                                  void *context);
+
+  /// Replaces the connection pool settings. Existing connections are kept until idle, new
+  /// requests use the new settings. Returns false if the configuration is invalid.
+  bool configure_http_client(const TOR_HttpClientConfig *config);
+
+  /// Aborts an in-flight request. Its callback still fires, with `TOR_HttpErrorKind::Cancelled`.
+  /// Returns false if the request already completed.
+  bool cancel_http_request(unsigned long long request_id);
+
+  /// Sets the bridges for the next bootstrap (`init_tor_service`, `start_tor_if_not_running*`).
+  /// Lines use torrc `Bridge` syntax without the keyword. Tor bootstraps through the first bridge
+  /// and only falls back to the later ones if that fails. A count of 0 connects directly again.
+  /// Called during a bootstrap or while running, the new lines are the ones Tor falls back to.
+  /// Returns false if a line is invalid or names a transport missing from `transports`.
+  bool configure_bridges(const char *const *bridge_lines, size_t bridge_count,
+                         const TOR_PluggableTransport *transports, size_t transport_count);
+
+  /// Reports every circuit build attempt (including preemptive ones) to `callback` from the Rust
+  /// runtime. Replaces the previous observer, nullptr removes it; no call to the previous one is
+  /// in progress or follows once this returns.
+  void set_circuit_observer(TOR_CircuitCallback callback, void *context);
+
+  /// Scales the consensus weights of the given relays when picking middle and exit hops. Relays
+  /// not listed keep weight 1. Guard selection is unaffected. Replaces the previous list.
+  void set_relay_weights(const TOR_RelayWeight *weights, size_t count);
+
+  /// Sets the memory caps, applied immediately and to later bootstraps. Returns false (and keeps
+  /// the previous limits) if a non-zero cap is below what Tor needs to operate.
+  bool configure_memory_limits(const TOR_MemoryLimits *limits);
+
+  /// Releases memory in response to an OS memory warning. Safe to call in any state.
+  void trim_memory(TOR_TrimLevel level);
+
+  TOR_MemoryUsage get_memory_usage();
+
+  /// Cheap enough to be polled every few hundred milliseconds. All zero while stopped.
+  TOR_TrafficCounters get_traffic_counters();
+
+  /// Resolves `hostname` at an exit with a RESOLVE cell, on the circuit of `isolation_token`.
+  void resolve_async(const char *hostname, unsigned long long isolation_token,
+                     unsigned long timeout_ms, TOR_ResolveCallback callback, void *context);
+
+  /// Opens a raw Tor stream to `host`:`port` for protocols other than HTTP. Rust relays the stream
+  /// through one end of a local socket pair and hands the other end to the callback, with TLS
+  /// (verified against `host`) terminated on the Rust side when `tls` is set.
+  void open_stream_async(const char *host, unsigned short port, bool tls,
+                         unsigned long long isolation_token, unsigned long timeout_ms,
+                         TOR_StreamCallback callback, void *context);
+
   } // extern "C"
 
 } // namespace tor
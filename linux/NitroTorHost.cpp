@@ -0,0 +1,11 @@
+#include "NitroTorHost.hpp"
+#include "HybridTor.hpp"
+#include <NitroModules/HybridObjectRegistry.hpp>
+#include <memory>
+
+namespace margelo::nitro::nitrotor {
+  void registerHybridObjects() {
+    HybridObjectRegistry::registerHybridObjectConstructor(
+        "Tor", []() -> std::shared_ptr<HybridObject> { return std::make_shared<HybridTor>(); });
+  }
+} // namespace margelo::nitro::nitrotor
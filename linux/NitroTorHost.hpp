@@ -0,0 +1,7 @@
+#pragma once
+
+namespace margelo::nitro::nitrotor {
+  // Registers the module's HybridObjects with Nitro's HybridObjectRegistry, what the generated
+  // OnLoad code does on Android and iOS. Call once before creating them by name.
+  void registerHybridObjects();
+} // namespace margelo::nitro::nitrotor
@@ -0,0 +1,20 @@
+#include <NitroModules/ThreadUtils.hpp>
+#include <pthread.h>
+#include <string>
+
+namespace margelo::nitro {
+  // Linux counterpart of the Android and iOS implementations shipped with Nitro.
+
+  std::string ThreadUtils::getThreadName() {
+    char name[16];
+    if (pthread_getname_np(pthread_self(), name, sizeof(name)) != 0) {
+      return "unknown";
+    }
+    return name;
+  }
+
+  void ThreadUtils::setThreadName(const std::string &name) {
+    // Linux limits thread names to 15 characters.
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+  }
+} // namespace margelo::nitro
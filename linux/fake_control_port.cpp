@@ -0,0 +1,356 @@
+#include "Sha256.hpp"
+#include "fake_tor_ffi.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Fake of Tor's control port for testing the ControlClient: answers the authentication
+// handshake and a few commands, and pushes scripted events to subscribed connections. One
+// thread serves every connection.
+
+namespace {
+  using margelo::nitro::nitrotor::Sha256;
+
+  constexpr char kVersion[] = "0.4.8.10-fake";
+
+  std::string toHex(std::string_view bytes) {
+    static constexpr char kDigits[] = "0123456789ABCDEF";
+    std::string hex;
+    for (unsigned char byte : bytes) {
+      hex.push_back(kDigits[byte >> 4]);
+      hex.push_back(kDigits[byte & 0x0f]);
+    }
+    return hex;
+  }
+
+  std::string upper(std::string value) {
+    std::transform(value.begin(), value.end(), value.begin(), ::toupper);
+    return value;
+  }
+
+  // Value of a QuotedString, "" if `value` is not one.
+  std::string unquote(std::string_view value) {
+    if (value.size() < 2 || value.front() != '"' || value.back() != '"') {
+      return "";
+    }
+    std::string result;
+    for (size_t i = 1; i + 1 < value.size(); i++) {
+      if (value[i] == '\\' && i + 2 < value.size()) {
+        i++;
+      }
+      result.push_back(value[i]);
+    }
+    return result;
+  }
+
+  std::string randomBytes(size_t count) {
+    static std::mt19937_64 random(std::random_device{}());
+    std::string bytes(count, '\0');
+    for (auto &byte : bytes) {
+      byte = static_cast<char>(random());
+    }
+    return bytes;
+  }
+
+  struct Connection {
+    int fd = -1;
+    std::string in;
+    bool authenticated = false;
+    // Client hash expected by AUTHENTICATE after an AUTHCHALLENGE.
+    std::string safe_cookie_hash;
+    std::set<std::string> events;
+  };
+
+  class ControlPort {
+  public:
+    ControlPort(const tor::FAKE_ControlPortConfig &config, int listen_fd)
+        : _allowNull(config.allow_null), _listenFd(listen_fd) {
+      if (config.password != nullptr) {
+        _password = config.password;
+      }
+      if (config.cookie_path != nullptr) {
+        _cookiePath = config.cookie_path;
+        _cookie = randomBytes(32);
+        std::ofstream(_cookiePath, std::ios::binary | std::ios::trunc) << _cookie;
+      }
+      int wake[2];
+      (void)!pipe(wake);
+      _wakeRead = wake[0];
+      _wakeWrite = wake[1];
+      _thread = std::thread([this]() { loop(); });
+    }
+
+    ~ControlPort() {
+      _stopped = true;
+      char byte = 1;
+      (void)!write(_wakeWrite, &byte, 1);
+      _thread.join();
+      for (auto &connection : _connections) {
+        ::close(connection->fd);
+      }
+      ::close(_listenFd);
+      ::close(_wakeRead);
+      ::close(_wakeWrite);
+    }
+
+    void emit(const std::string &line) {
+      auto type = line.substr(0, line.find(' '));
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (auto &connection : _connections) {
+        if (connection->authenticated && connection->events.count(type) > 0) {
+          send(*connection, "650 " + line + "\r\n");
+        }
+      }
+    }
+
+    tor::FAKE_ControlStats stats() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _stats;
+    }
+
+  private:
+    void loop() {
+      while (!_stopped) {
+        std::vector<pollfd> fds{{_listenFd, POLLIN, 0}, {_wakeRead, POLLIN, 0}};
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          for (auto &connection : _connections) {
+            fds.push_back({connection->fd, POLLIN, 0});
+          }
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+          continue;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (fds[0].revents & POLLIN) {
+          int fd = accept(_listenFd, nullptr, nullptr);
+          if (fd >= 0) {
+            _stats.connections++;
+            auto connection = std::make_unique<Connection>();
+            connection->fd = fd;
+            _connections.push_back(std::move(connection));
+          }
+        }
+        for (size_t i = 2; i < fds.size(); i++) {
+          if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            receive(fds[i].fd);
+          }
+        }
+      }
+    }
+
+    void receive(int fd) {
+      auto it = std::find_if(_connections.begin(), _connections.end(),
+                             [fd](const auto &connection) { return connection->fd == fd; });
+      if (it == _connections.end()) {
+        return;
+      }
+      auto &connection = **it;
+      char buffer[4096];
+      ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+      bool open = received > 0;
+      if (open) {
+        _stats.reads++;
+        connection.in.append(buffer, static_cast<size_t>(received));
+        size_t end;
+        while (open && (end = connection.in.find("\r\n")) != std::string::npos) {
+          auto line = connection.in.substr(0, end);
+          connection.in.erase(0, end + 2);
+          _stats.commands++;
+          open = handle(connection, line);
+        }
+      }
+      if (!open) {
+        ::close(fd);
+        _connections.erase(it);
+      }
+    }
+
+    static void send(Connection &connection, const std::string &data) {
+      (void)!::send(connection.fd, data.data(), data.size(), MSG_NOSIGNAL);
+    }
+
+    // Returns false if the connection has to be closed.
+    bool handle(Connection &connection, const std::string &line) {
+      std::istringstream words(line);
+      std::string command;
+      words >> command;
+      command = upper(command);
+      std::string argument;
+      std::getline(words >> std::ws, argument);
+
+      if (command == "PROTOCOLINFO") {
+        std::string methods;
+        auto add = [&methods](const char *method) {
+          methods += (methods.empty() ? "" : ",") + std::string(method);
+        };
+        if (_allowNull) {
+          add("NULL");
+        }
+        if (!_password.empty()) {
+          add("HASHEDPASSWORD");
+        }
+        if (!_cookie.empty()) {
+          add("COOKIE");
+          add("SAFECOOKIE");
+        }
+        std::string auth = "250-AUTH METHODS=" + methods;
+        if (!_cookie.empty()) {
+          auth += " COOKIEFILE=\"" + _cookiePath + "\"";
+        }
+        send(connection, "250-PROTOCOLINFO 1\r\n" + auth + "\r\n250-VERSION Tor=\"" +
+                             kVersion + "\"\r\n250 OK\r\n");
+        return true;
+      }
+      if (command == "AUTHCHALLENGE") {
+        std::istringstream parts(argument);
+        std::string type;
+        std::string client_nonce_hex;
+        parts >> type >> client_nonce_hex;
+        std::string client_nonce;
+        for (size_t i = 0; i + 1 < client_nonce_hex.size(); i += 2) {
+          client_nonce.push_back(
+              static_cast<char>(std::stoi(client_nonce_hex.substr(i, 2), nullptr, 16)));
+        }
+        if (_cookie.empty() || upper(type) != "SAFECOOKIE" || client_nonce.size() != 32) {
+          send(connection, "513 Invalid AUTHCHALLENGE request\r\n");
+          return true;
+        }
+        auto server_nonce = randomBytes(32);
+        auto message = _cookie + client_nonce + server_nonce;
+        auto server_hash =
+            Sha256::hmac("Tor safe cookie authentication server-to-controller hash", message);
+        auto client_hash =
+            Sha256::hmac("Tor safe cookie authentication controller-to-server hash", message);
+        connection.safe_cookie_hash = upper(Sha256::toHex(client_hash));
+        send(connection, "250 AUTHCHALLENGE SERVERHASH=" + upper(Sha256::toHex(server_hash)) +
+                             " SERVERNONCE=" + toHex(server_nonce) + "\r\n");
+        return true;
+      }
+      if (command == "AUTHENTICATE") {
+        bool ok = (argument.empty() && _allowNull) ||
+                  (!_password.empty() && unquote(argument) == _password) ||
+                  (!_cookie.empty() && upper(argument) == toHex(_cookie)) ||
+                  (!connection.safe_cookie_hash.empty() &&
+                   upper(argument) == connection.safe_cookie_hash);
+        if (!ok) {
+          send(connection, "515 Authentication failed: Wrong credentials\r\n");
+          return false;
+        }
+        connection.authenticated = true;
+        send(connection, "250 OK\r\n");
+        return true;
+      }
+      if (!connection.authenticated) {
+        send(connection, "514 Authentication required.\r\n");
+        return false;
+      }
+      if (command == "SETEVENTS") {
+        std::istringstream parts(argument);
+        std::set<std::string> events;
+        for (std::string event; parts >> event;) {
+          event = upper(event);
+          if (event != "CIRC" && event != "STREAM" && event != "BW" && event != "HS_DESC") {
+            send(connection, "552 Unrecognized event \"" + event + "\"\r\n");
+            return true;
+          }
+          events.insert(event);
+        }
+        connection.events = std::move(events);
+        send(connection, "250 OK\r\n");
+        return true;
+      }
+      if (command == "GETINFO" && argument == "version") {
+        send(connection, "250-version=" + std::string(kVersion) + "\r\n250 OK\r\n");
+        return true;
+      }
+      if (command == "GETINFO" && argument == "config-text") {
+        // A data reply, with a line that has to be dot-stuffed.
+        send(connection, "250+config-text=\r\nSocksPort 9050\r\n..hidden\r\n.\r\n250 OK\r\n");
+        return true;
+      }
+      if (command == "QUIT") {
+        send(connection, "250 closing connection\r\n");
+        return false;
+      }
+      send(connection, "510 Unrecognized command \"" + command + "\"\r\n");
+      return true;
+    }
+
+    bool _allowNull;
+    std::string _password;
+    std::string _cookiePath;
+    std::string _cookie;
+    int _listenFd;
+    int _wakeRead = -1;
+    int _wakeWrite = -1;
+    std::atomic<bool> _stopped{false};
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<Connection>> _connections;
+    tor::FAKE_ControlStats _stats{};
+    std::thread _thread;
+  };
+
+  std::mutex g_mutex;
+  std::unique_ptr<ControlPort> g_port;
+} // namespace
+
+namespace tor {
+  extern "C" {
+
+  unsigned short fake_tor_start_control_port(const FAKE_ControlPortConfig *config) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(fd, 16) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      return 0;
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_port.reset();
+    g_port = std::make_unique<ControlPort>(*config, fd);
+    return ntohs(address.sin_port);
+  }
+
+  void fake_tor_stop_control_port() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_port.reset();
+  }
+
+  void fake_tor_emit_control_event(const char *line) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (g_port) {
+      g_port->emit(line);
+    }
+  }
+
+  void fake_tor_control_stats(FAKE_ControlStats *stats) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    *stats = g_port ? g_port->stats() : FAKE_ControlStats{};
+  }
+
+  } // extern "C"
+} // namespace tor
@@ -0,0 +1,960 @@
+#include "OnionCrypto.hpp"
+#include "Url.hpp"
+#include "fake_tor_ffi.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+  using margelo::nitro::nitrotor::isClamped;
+  using margelo::nitro::nitrotor::onionAddress;
+  using margelo::nitro::nitrotor::onionPublicKey;
+  using margelo::nitro::nitrotor::urlHost;
+
+  std::atomic<long long> g_liveStrings{0};
+  std::atomic<unsigned long long> g_allocations{0};
+
+  // Packs `values` into one allocation like the Rust side does, writing the slice of each value
+  // to the matching entry of `slices`. Empty values stand for absent ones.
+  tor::TOR_Arena packArena(std::initializer_list<std::string_view> values,
+                           std::initializer_list<tor::TOR_ArenaString *> slices) {
+    size_t size = 0;
+    for (auto value : values) {
+      size += value.size() + 1;
+    }
+    tor::TOR_Arena arena{static_cast<char *>(std::malloc(size)), size};
+    size_t offset = 0;
+    auto slice = slices.begin();
+    for (auto value : values) {
+      std::memcpy(arena.data + offset, value.data(), value.size());
+      arena.data[offset + value.size()] = '\0';
+      **slice++ = tor::TOR_ArenaString{offset, value.size()};
+      offset += value.size() + 1;
+    }
+    g_liveStrings++;
+    g_allocations++;
+    return arena;
+  }
+
+  tor::TOR_StreamResult failedStream(std::string_view error, tor::TOR_HttpErrorKind error_kind) {
+    tor::TOR_StreamResult result{-1, {}, {}, error_kind, 0};
+    result.arena = packArena({error}, {&result.error});
+    return result;
+  }
+
+  // Reads a body source to its end in small chunks, so readers that have to resume mid-segment
+  // are exercised. Sets `error` for read failures and bodies that don't match their length.
+  std::string readBodySource(const tor::TOR_BodySource &source,
+                             std::optional<std::string> &error) {
+    std::string body;
+    unsigned char chunk[4096];
+    while (true) {
+      auto n = source.read(source.context, chunk, sizeof(chunk));
+      if (n < 0) {
+        error = "Request body could not be read";
+        return body;
+      }
+      if (n == 0) {
+        break;
+      }
+      body.append(reinterpret_cast<const char *>(chunk), static_cast<size_t>(n));
+    }
+    if (body.size() != source.length) {
+      error = "Request body has " + std::to_string(body.size()) + " bytes, announced " +
+              std::to_string(source.length);
+    }
+    return body;
+  }
+
+  // Runs delayed jobs in due order on one thread. A cancelled job runs right away with
+  // `cancelled` set.
+  class Dispatcher {
+  public:
+    using Job = std::function<void(bool cancelled)>;
+
+    // Leaked on purpose so callbacks can still fire during static destruction.
+    static Dispatcher &shared() {
+      static auto *dispatcher = new Dispatcher();
+      return *dispatcher;
+    }
+
+    uint64_t post(std::chrono::milliseconds delay, Job &&job) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto id = _nextId++;
+      auto due = Clock::now() + delay;
+      _jobs.emplace(id, Entry{due, std::move(job), false});
+      _order.emplace(due, id);
+      _wake.notify_all();
+      return id;
+    }
+
+    bool cancel(uint64_t id) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto it = _jobs.find(id);
+      if (it == _jobs.end() || it->second.cancelled) {
+        return false;
+      }
+      _order.erase({it->second.due, id});
+      it->second.due = Clock::now();
+      it->second.cancelled = true;
+      _order.emplace(it->second.due, id);
+      _wake.notify_all();
+      return true;
+    }
+
+    size_t pending() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _jobs.size() + _running;
+    }
+
+    bool waitIdle(std::chrono::milliseconds timeout) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      return _idle.wait_for(lock, timeout, [this]() { return _jobs.empty() && _running == 0; });
+    }
+
+  private:
+    struct Entry {
+      Clock::time_point due;
+      Job job;
+      bool cancelled;
+    };
+
+    Dispatcher() : _thread([this]() { loop(); }) { _thread.detach(); }
+
+    void loop() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (true) {
+        if (_order.empty()) {
+          _wake.wait(lock);
+          continue;
+        }
+        auto [due, id] = *_order.begin();
+        if (due > Clock::now()) {
+          _wake.wait_until(lock, due);
+          continue;
+        }
+        _order.erase(_order.begin());
+        auto node = _jobs.extract(id);
+        _running++;
+        lock.unlock();
+        node.mapped().job(node.mapped().cancelled);
+        lock.lock();
+        _running--;
+        if (_jobs.empty() && _running == 0) {
+          _idle.notify_all();
+        }
+      }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _idle;
+    std::map<uint64_t, Entry> _jobs;
+    std::set<std::pair<Clock::time_point, uint64_t>> _order;
+    uint64_t _nextId = 1;
+    size_t _running = 0;
+    std::thread _thread;
+  };
+
+  struct HttpRule {
+    std::string url_prefix;
+    unsigned short status_code;
+    std::optional<std::string> body;
+    unsigned long body_repeat;
+    std::optional<std::string> error;
+    tor::TOR_HttpErrorKind error_kind;
+    unsigned long latency_ms;
+    unsigned long connect_ms;
+    unsigned long first_byte_ms;
+    tor::TOR_HttpVersion http_version;
+    bool reused_connection;
+    unsigned int remaining;
+  };
+
+  struct DnsRecord {
+    std::string addresses;
+    unsigned long ttl_s;
+    unsigned long latency_ms;
+  };
+
+  struct RequestRecord {
+    std::string method;
+    std::string url;
+    std::string headers_json;
+    unsigned long long body_length;
+  };
+
+  struct StartScript {
+    bool is_success = true;
+    std::optional<std::string> onion_address;
+    std::string error_message;
+    unsigned long latency_ms = 0;
+  };
+
+  struct State {
+    std::mutex mutex;
+    std::vector<HttpRule> rules;
+    StartScript start;
+    std::optional<std::string> stream_error;
+    tor::TOR_HttpErrorKind stream_error_kind = tor::TOR_HttpErrorKind::None;
+    std::optional<tor::TOR_HttpClientConfig> client_config;
+    std::vector<std::string> bridges;
+    tor::TOR_CircuitCallback circuit_observer = nullptr;
+    void *circuit_observer_context = nullptr;
+    std::map<std::string, double> relay_weights;
+    std::optional<tor::TOR_MemoryLimits> memory_limits;
+    tor::TOR_MemoryUsage memory_usage{};
+    // Bytes of get_traffic_counters: HTTP requests and responses plus fake_tor_add_traffic.
+    unsigned long long bytes_read = 0;
+    unsigned long long bytes_written = 0;
+    std::map<std::string, DnsRecord> dns;
+    std::set<std::string> services;
+    // Values of get_service_status: 0 starting, 1 running, 2 stopped.
+    int status = 2;
+    bool dormant = false;
+    // Request id to dispatcher job, for cancel_http_request.
+    std::map<unsigned long long, uint64_t> requests;
+    unsigned long long next_request_id = 1;
+    std::optional<RequestRecord> last_request;
+    tor::FAKE_Stats stats{};
+  };
+
+  State &state() {
+    static auto *state = new State();
+    return *state;
+  }
+
+  // 56 base32 characters like a v3 address, derived from the port so tests can predict it.
+  std::string onionAddressFor(unsigned short port) {
+    static constexpr char kAlphabet[] = "abcdefghijklmnopqrstuvwxyz234567";
+    std::string address;
+    uint32_t seed = 2166136261u ^ port;
+    for (int i = 0; i < 56; i++) {
+      seed = seed * 16777619u + 0x9e3779b9u;
+      address.push_back(kAlphabet[(seed >> 27) & 31]);
+    }
+    return address + ".onion";
+  }
+
+  tor::TOR_StartTorResponse startResponse(unsigned short target_port) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.stats.starts++;
+    tor::TOR_StartTorResponse response{};
+    if (!fake.start.is_success) {
+      fake.status = 2;
+      response.arena = packArena({"", "", fake.start.error_message},
+                                 {&response.onion_address, &response.control,
+                                  &response.error_message});
+      return response;
+    }
+    fake.status = 1;
+    auto address = fake.start.onion_address.value_or(onionAddressFor(target_port));
+    fake.services.insert(address);
+    response.is_success = true;
+    response.arena = packArena({address, "127.0.0.1:9051", ""},
+                               {&response.onion_address, &response.control,
+                                &response.error_message});
+    return response;
+  }
+
+  tor::TOR_CHttpResponse syncResponse(const char *method, const char *url, const char *body,
+                                      const char *headers_json, unsigned long timeout_ms);
+} // namespace
+
+namespace tor {
+  extern "C" {
+
+  bool initialize_tor_library() { return true; }
+
+  bool init_tor_service(unsigned short, const char *data_dir, unsigned long) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    if (data_dir == nullptr || *data_dir == '\0') {
+      return false;
+    }
+    fake.status = 1;
+    return true;
+  }
+
+  TOR_HiddenServiceResponse create_hidden_service(unsigned short port, unsigned short,
+                                                  const unsigned char *key_data, bool has_key) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    TOR_HiddenServiceResponse response{};
+    if (fake.status != 1) {
+      return response;
+    }
+    auto address = onionAddressFor(port);
+    if (has_key) {
+      // Like Tor, a given key determines the address, and a key it can't use fails.
+      if (!isClamped(key_data)) {
+        return response;
+      }
+      address = onionAddress(onionPublicKey(key_data));
+    }
+    fake.services.insert(address);
+    response.is_success = true;
+    response.arena =
+        packArena({address, "127.0.0.1:9051"}, {&response.onion_address, &response.control});
+    return response;
+  }
+
+  TOR_StartTorResponse start_tor_if_not_running(const char *, const unsigned char *, bool,
+                                                unsigned short, unsigned short target_port,
+                                                unsigned long) {
+    unsigned long latency_ms;
+    {
+      auto &fake = state();
+      std::lock_guard<std::mutex> lock(fake.mutex);
+      latency_ms = fake.start.latency_ms;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(latency_ms));
+    return startResponse(target_port);
+  }
+
+  void start_tor_if_not_running_async(const char *, const unsigned char *, bool, unsigned short,
+                                      unsigned short target_port, unsigned long,
+                                      TOR_StartTorCallback callback, void *context) {
+    unsigned long latency_ms;
+    {
+      auto &fake = state();
+      std::lock_guard<std::mutex> lock(fake.mutex);
+      latency_ms = fake.start.latency_ms;
+      if (fake.status == 2) {
+        fake.status = 0;
+      }
+    }
+    Dispatcher::shared().post(std::chrono::milliseconds(latency_ms),
+                              [target_port, callback, context](bool) {
+                                callback(context, startResponse(target_port));
+                              });
+  }
+
+  int get_service_status() {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    return fake.status;
+  }
+
+  bool delete_hidden_service(const char *address) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    return address != nullptr && fake.services.erase(address) > 0;
+  }
+
+  bool shutdown_service() {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.stats.shutdowns++;
+    fake.services.clear();
+    fake.dormant = false;
+    bool was_running = fake.status != 2;
+    fake.status = 2;
+    return was_running;
+  }
+
+  void free_string(char *s) {
+    if (s != nullptr) {
+      g_liveStrings--;
+      std::free(s);
+    }
+  }
+
+  void free_arena(TOR_Arena arena) { free_string(arena.data); }
+
+  void free_http_response(TOR_CHttpResponse response) { free_arena(response.arena); }
+
+  TOR_CHttpResponse http_get(const char *url, const char *headers_json, unsigned long timeout_ms) {
+    return syncResponse("GET", url, nullptr, headers_json, timeout_ms);
+  }
+
+  TOR_CHttpResponse http_post(const char *url, const char *body, const char *headers_json,
+                              unsigned long timeout_ms) {
+    return syncResponse("POST", url, body, headers_json, timeout_ms);
+  }
+
+  TOR_CHttpResponse http_put(const char *url, const char *body, const char *headers_json,
+                             unsigned long timeout_ms) {
+    return syncResponse("PUT", url, body, headers_json, timeout_ms);
+  }
+
+  TOR_CHttpResponse http_delete(const char *url, const char *headers_json,
+                                unsigned long timeout_ms) {
+    return syncResponse("DELETE", url, nullptr, headers_json, timeout_ms);
+  }
+
+  TOR_CHttpResponse http_head(const char *url, const char *headers_json, unsigned long timeout_ms) {
+    return syncResponse("HEAD", url, nullptr, headers_json, timeout_ms);
+  }
+
+  TOR_CHttpResponse http_options(const char *url, const char *headers_json,
+                                 unsigned long timeout_ms) {
+    return syncResponse("OPTIONS", url, nullptr, headers_json, timeout_ms);
+  }
+
+  bool enter_dormant_mode() {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    if (fake.status != 1) {
+      return false;
+    }
+    fake.dormant = true;
+    return true;
+  }
+
+  void resume_from_dormant_async(unsigned long timeout_ms, TOR_ResumeCallback callback,
+                                 void *context) {
+    StartScript script;
+    {
+      auto &fake = state();
+      std::lock_guard<std::mutex> lock(fake.mutex);
+      script = fake.start;
+    }
+    bool timed_out = timeout_ms > 0 && script.latency_ms > timeout_ms;
+    auto delay = timed_out ? timeout_ms : script.latency_ms;
+    Dispatcher::shared().post(
+        std::chrono::milliseconds(delay), [script, timed_out, delay, callback, context](bool) {
+          auto &fake = state();
+          {
+            std::lock_guard<std::mutex> lock(fake.mutex);
+            if (script.is_success && !timed_out) {
+              fake.dormant = false;
+            }
+          }
+          TOR_ResumeResponse result{script.is_success && !timed_out, delay, {}, {}};
+          if (!result.is_success) {
+            result.circuit_ready_ms = 0;
+            result.arena = packArena({timed_out ? "Timed out" : script.error_message},
+                                     {&result.error_message});
+          }
+          callback(context, result);
+        });
+  }
+
+  unsigned long long http_request(const TOR_HttpRequest *request, TOR_HttpCallback callback,
+                                  void *context) {
+    auto &fake = state();
+    std::string url = request->url ? request->url : "";
+    std::string body = request->body ? request->body : "";
+    bool has_body = request->body != nullptr;
+    // Rust streams a body source while sending, the fake reads it up front. Either way it is
+    // released exactly once and has to match its length.
+    std::optional<std::string> body_error;
+    if (request->body_source != nullptr) {
+      const auto &source = *request->body_source;
+      body = readBodySource(source, body_error);
+      has_body = true;
+      source.release(source.context);
+    }
+    auto timeout_ms = request->timeout_ms;
+    std::string remote_addr;
+    unsigned long remote_addr_ttl_s = 0;
+
+    std::optional<HttpRule> rule;
+    unsigned long long request_id;
+    {
+      std::lock_guard<std::mutex> lock(fake.mutex);
+      fake.stats.http_requests++;
+      fake.last_request = RequestRecord{
+          request->method ? request->method : "", url,
+          request->headers_json ? request->headers_json : "",
+          request->body_source != nullptr ? request->body_source->length : body.size()};
+      fake.bytes_written += url.size() + body.size();
+      if (request->body_source != nullptr) {
+        fake.stats.streamed_bodies++;
+      }
+      if (request->resolved_addr != nullptr) {
+        fake.stats.preresolved_requests++;
+      } else if (auto it = fake.dns.find(std::string(urlHost(url))); it != fake.dns.end()) {
+        remote_addr = it->second.addresses.substr(0, it->second.addresses.find(','));
+        remote_addr_ttl_s = it->second.ttl_s;
+      }
+      request_id = fake.next_request_id++;
+      for (auto it = fake.rules.rbegin(); it != fake.rules.rend(); ++it) {
+        if (url.compare(0, it->url_prefix.size(), it->url_prefix) != 0) {
+          continue;
+        }
+        rule = *it;
+        if (it->remaining > 0 && --it->remaining == 0) {
+          fake.rules.erase(std::next(it).base());
+        }
+        break;
+      }
+    }
+
+    auto latency_ms = rule ? rule->latency_ms : 0;
+    bool timed_out = timeout_ms > 0 && latency_ms > timeout_ms;
+    auto delay = timed_out ? timeout_ms : latency_ms;
+    auto job = [rule = std::move(rule), body = std::move(body), has_body,
+                body_error = std::move(body_error), timed_out, delay,
+                remote_addr = std::move(remote_addr), remote_addr_ttl_s, request_id, callback,
+                context](bool cancelled) {
+      {
+        auto &fake = state();
+        std::lock_guard<std::mutex> lock(fake.mutex);
+        fake.requests.erase(request_id);
+        if (cancelled) {
+          fake.stats.http_cancelled++;
+        }
+      }
+      TOR_CHttpResponse response{};
+      response.connect_ms = rule && rule->connect_ms > 0 ? rule->connect_ms : delay / 4 + 1;
+      response.first_byte_ms =
+          rule && rule->first_byte_ms > 0 ? rule->first_byte_ms : delay / 2 + 1;
+      if (cancelled || timed_out || body_error || (rule && rule->error)) {
+        response.error_kind = cancelled    ? TOR_HttpErrorKind::Cancelled
+                              : timed_out  ? TOR_HttpErrorKind::Timeout
+                              : body_error ? TOR_HttpErrorKind::Other
+                                           : rule->error_kind;
+        std::string error = cancelled    ? "Request cancelled"
+                            : timed_out  ? "Request timed out"
+                            : body_error ? *body_error
+                                         : *rule->error;
+        response.arena = packArena({"", error}, {&response.body, &response.error});
+        response.first_byte_ms = 0;
+        callback(context, response);
+        return;
+      }
+
+      std::string payload;
+      if (!rule) {
+        payload = has_body ? body : "";
+      } else if (rule->body) {
+        payload.reserve(rule->body->size() * rule->body_repeat);
+        for (unsigned long i = 0; i < rule->body_repeat; i++) {
+          payload += *rule->body;
+        }
+      }
+      {
+        auto &fake = state();
+        std::lock_guard<std::mutex> lock(fake.mutex);
+        fake.bytes_read += payload.size();
+      }
+      response.status_code = rule ? rule->status_code : 200;
+      response.arena = packArena({payload, "", remote_addr},
+                                 {&response.body, &response.error, &response.remote_addr});
+      response.remote_addr_ttl_s = remote_addr_ttl_s;
+      response.compressed_bytes = payload.size();
+      response.decompressed_bytes = payload.size();
+      response.http_version = rule ? rule->http_version : TOR_HttpVersion::Http11;
+      response.reused_connection = rule && rule->reused_connection;
+      callback(context, response);
+    };
+
+    {
+      // Held across post() so a job that runs right away can't finish before it is registered.
+      std::lock_guard<std::mutex> lock(fake.mutex);
+      auto job_id = Dispatcher::shared().post(std::chrono::milliseconds(delay), std::move(job));
+      fake.requests.emplace(request_id, job_id);
+    }
+    return request_id;
+  }
+
+  bool configure_http_client(const TOR_HttpClientConfig *config) {
+    if (config == nullptr || config->max_connections_per_host == 0) {
+      return false;
+    }
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.client_config = *config;
+    return true;
+  }
+
+  bool configure_bridges(const char *const *bridge_lines, size_t bridge_count,
+                         const TOR_PluggableTransport *transports, size_t transport_count) {
+    std::vector<std::string> bridges;
+    for (size_t i = 0; i < bridge_count; i++) {
+      std::string_view line = bridge_lines[i];
+      if (line.empty()) {
+        return false;
+      }
+      // A line starting with a letter names a transport, which has to be configured.
+      if (std::isalpha(static_cast<unsigned char>(line[0]))) {
+        auto name = line.substr(0, line.find(' '));
+        bool known = false;
+        for (size_t t = 0; t < transport_count && !known; t++) {
+          for (size_t p = 0; p < transports[t].protocol_count && !known; p++) {
+            known = name == transports[t].protocols[p];
+          }
+        }
+        if (!known) {
+          return false;
+        }
+      }
+      bridges.emplace_back(line);
+    }
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.bridges = std::move(bridges);
+    return true;
+  }
+
+  void set_circuit_observer(TOR_CircuitCallback callback, void *context) {
+    // Observer calls are made under the state mutex, so none is in progress after this returns.
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.circuit_observer = callback;
+    fake.circuit_observer_context = context;
+  }
+
+  void set_relay_weights(const TOR_RelayWeight *weights, size_t count) {
+    std::map<std::string, double> relay_weights;
+    for (size_t i = 0; i < count; i++) {
+      relay_weights[weights[i].fingerprint] = weights[i].weight;
+    }
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.relay_weights = std::move(relay_weights);
+  }
+
+  bool configure_memory_limits(const TOR_MemoryLimits *limits) {
+    // Stand-ins for the minimums of the real client.
+    if (limits == nullptr || (limits->total_bytes != 0 && limits->total_bytes < (8ull << 20)) ||
+        (limits->stream_buffer_bytes != 0 && limits->stream_buffer_bytes < 4096)) {
+      return false;
+    }
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.memory_limits = *limits;
+    return true;
+  }
+
+  void trim_memory(TOR_TrimLevel level) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    auto &usage = fake.memory_usage;
+    bool critical = level == TOR_TrimLevel::Critical;
+    (critical ? fake.stats.critical_trims : fake.stats.moderate_trims)++;
+    auto closed = critical ? usage.idle_circuits : usage.idle_circuits / 2;
+    if (usage.open_circuits > 0) {
+      usage.circuit_bytes -= usage.circuit_bytes / usage.open_circuits * closed;
+    }
+    usage.open_circuits -= closed;
+    usage.idle_circuits -= closed;
+    usage.dir_cache_bytes = critical ? 0 : usage.dir_cache_bytes / 2;
+  }
+
+  TOR_MemoryUsage get_memory_usage() {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    return fake.memory_usage;
+  }
+
+  TOR_TrafficCounters get_traffic_counters() {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    return TOR_TrafficCounters{fake.bytes_read, fake.bytes_written,
+                               fake.memory_usage.open_circuits,
+                               static_cast<unsigned int>(fake.requests.size())};
+  }
+
+  bool cancel_http_request(unsigned long long request_id) {
+    uint64_t job_id;
+    {
+      auto &fake = state();
+      std::lock_guard<std::mutex> lock(fake.mutex);
+      auto it = fake.requests.find(request_id);
+      if (it == fake.requests.end()) {
+        return false;
+      }
+      job_id = it->second;
+    }
+    return Dispatcher::shared().cancel(job_id);
+  }
+
+  void resolve_async(const char *hostname, unsigned long long, unsigned long timeout_ms,
+                     TOR_ResolveCallback callback, void *context) {
+    auto &fake = state();
+    std::optional<DnsRecord> record;
+    {
+      std::lock_guard<std::mutex> lock(fake.mutex);
+      fake.stats.resolves++;
+      auto it = fake.dns.find(hostname);
+      if (it != fake.dns.end()) {
+        record = it->second;
+      }
+    }
+    auto latency_ms = record ? record->latency_ms : 0;
+    bool timed_out = timeout_ms > 0 && latency_ms > timeout_ms;
+    Dispatcher::shared().post(
+        std::chrono::milliseconds(timed_out ? timeout_ms : latency_ms),
+        [record = std::move(record), timed_out, callback, context](bool) {
+          TOR_ResolveResult result{};
+          if (record && !timed_out) {
+            result.arena = packArena({record->addresses, ""}, {&result.addresses, &result.error});
+            result.ttl_s = record->ttl_s;
+          } else {
+            result.error_kind = timed_out ? TOR_HttpErrorKind::Timeout : TOR_HttpErrorKind::Connect;
+            auto error = timed_out ? "Resolve timed out" : "Could not resolve host";
+            result.arena = packArena({"", error}, {&result.addresses, &result.error});
+          }
+          callback(context, result);
+        });
+  }
+
+  void open_stream_async(const char *host, unsigned short port, bool tls, unsigned long long,
+                         unsigned long timeout_ms, TOR_StreamCallback callback, void *context) {
+    auto &fake = state();
+    std::optional<std::string> error;
+    auto error_kind = TOR_HttpErrorKind::Connect;
+    {
+      std::lock_guard<std::mutex> lock(fake.mutex);
+      fake.stats.streams_opened++;
+      if (fake.stream_error) {
+        error = fake.stream_error;
+        error_kind = fake.stream_error_kind;
+      }
+    }
+    if (tls && !error) {
+      error = "The fake tor_ffi does not terminate TLS";
+      error_kind = TOR_HttpErrorKind::Protocol;
+    }
+    if (error) {
+      Dispatcher::shared().post(std::chrono::milliseconds(0),
+                                [error = std::move(*error), error_kind, callback, context](bool) {
+                                  callback(context, failedStream(error, error_kind));
+                                });
+      return;
+    }
+
+    // Plain TCP to the target stands in for the Tor stream. Connecting blocks, so it gets its
+    // own thread instead of stalling the dispatcher.
+    std::thread([host = std::string(host), port, timeout_ms, callback, context]() {
+      auto started = Clock::now();
+      addrinfo hints{};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      addrinfo *addresses = nullptr;
+      int fd = -1;
+      if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) == 0) {
+        for (auto *address = addresses; address != nullptr && fd < 0;
+             address = address->ai_next) {
+          fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+          if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+          }
+        }
+        freeaddrinfo(addresses);
+      }
+      auto connect_ms = static_cast<unsigned long>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - started).count());
+      if (fd >= 0 && timeout_ms > 0 && connect_ms > timeout_ms) {
+        close(fd);
+        callback(context, failedStream("Connect timed out", TOR_HttpErrorKind::Timeout));
+      } else if (fd < 0) {
+        callback(context,
+                 failedStream("Connection to " + host + " failed", TOR_HttpErrorKind::Connect));
+      } else {
+        callback(context, TOR_StreamResult{fd, {}, {}, TOR_HttpErrorKind::None,
+                                           std::max(connect_ms, 1ul)});
+      }
+    }).detach();
+  }
+
+  void fake_tor_reset() {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.rules.clear();
+    fake.start = StartScript();
+    fake.stream_error.reset();
+    fake.client_config.reset();
+    fake.bridges.clear();
+    fake.relay_weights.clear();
+    fake.memory_limits.reset();
+    fake.memory_usage = TOR_MemoryUsage{};
+    fake.dns.clear();
+    fake.last_request.reset();
+    fake.bytes_read = 0;
+    fake.bytes_written = 0;
+    fake.stats = FAKE_Stats{};
+    g_liveStrings = 0;
+    g_allocations = 0;
+  }
+
+  void fake_tor_add_http_rule(const FAKE_HttpRule *rule) {
+    HttpRule entry{
+        rule->url_prefix ? rule->url_prefix : "",
+        rule->status_code,
+        rule->body ? std::optional<std::string>(rule->body) : std::nullopt,
+        std::max(1ul, rule->body_repeat),
+        rule->error ? std::optional<std::string>(rule->error) : std::nullopt,
+        rule->error ? rule->error_kind : TOR_HttpErrorKind::None,
+        rule->latency_ms,
+        rule->connect_ms,
+        rule->first_byte_ms,
+        rule->http_version,
+        rule->reused_connection,
+        rule->times,
+    };
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.rules.push_back(std::move(entry));
+  }
+
+  void fake_tor_set_start_script(const FAKE_StartScript *script) {
+    StartScript entry;
+    entry.is_success = script->is_success;
+    if (script->onion_address) {
+      entry.onion_address = script->onion_address;
+    }
+    entry.error_message = script->error_message ? script->error_message : "";
+    entry.latency_ms = script->latency_ms;
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.start = std::move(entry);
+  }
+
+  void fake_tor_set_stream_error(const char *error, TOR_HttpErrorKind error_kind) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.stream_error = error ? std::optional<std::string>(error) : std::nullopt;
+    fake.stream_error_kind = error_kind;
+  }
+
+  bool fake_tor_http_client_config(TOR_HttpClientConfig *config) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    if (!fake.client_config) {
+      return false;
+    }
+    *config = *fake.client_config;
+    return true;
+  }
+
+  void fake_tor_set_memory_usage(const TOR_MemoryUsage *usage) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.memory_usage = *usage;
+  }
+
+  void fake_tor_add_dns_record(const FAKE_DnsRecord *record) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.dns[record->hostname] =
+        DnsRecord{record->addresses ? record->addresses : "", record->ttl_s, record->latency_ms};
+  }
+
+  void fake_tor_add_traffic(unsigned long long bytes_read, unsigned long long bytes_written) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    fake.bytes_read += bytes_read;
+    fake.bytes_written += bytes_written;
+  }
+
+  bool fake_tor_memory_limits(TOR_MemoryLimits *limits) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    if (!fake.memory_limits) {
+      return false;
+    }
+    *limits = *fake.memory_limits;
+    return true;
+  }
+
+  const char *fake_tor_bridge(unsigned long index) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    return index < fake.bridges.size() ? fake.bridges[index].c_str() : nullptr;
+  }
+
+  void fake_tor_emit_circuit(const TOR_CircuitEvent *event, unsigned long latency_ms) {
+    std::vector<std::string> relays(event->relays, event->relays + event->relay_count);
+    Dispatcher::shared().post(
+        std::chrono::milliseconds(latency_ms),
+        [relays = std::move(relays), event = *event](bool) mutable {
+          std::vector<const char *> pointers;
+          for (const auto &relay : relays) {
+            pointers.push_back(relay.c_str());
+          }
+          event.relays = pointers.data();
+          auto &fake = state();
+          std::lock_guard<std::mutex> lock(fake.mutex);
+          if (fake.circuit_observer != nullptr) {
+            fake.circuit_observer(fake.circuit_observer_context, &event);
+          }
+        });
+  }
+
+  double fake_tor_relay_weight(const char *fingerprint) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    auto it = fake.relay_weights.find(fingerprint);
+    return it == fake.relay_weights.end() ? 1.0 : it->second;
+  }
+
+  void fake_tor_stats(FAKE_Stats *stats) {
+    auto &fake = state();
+    {
+      std::lock_guard<std::mutex> lock(fake.mutex);
+      *stats = fake.stats;
+    }
+    stats->pending_callbacks = Dispatcher::shared().pending();
+    stats->live_strings = g_liveStrings.load();
+    stats->allocations = g_allocations.load();
+  }
+
+  bool fake_tor_last_http_request(FAKE_HttpRequestRecord *request) {
+    auto &fake = state();
+    std::lock_guard<std::mutex> lock(fake.mutex);
+    if (!fake.last_request) {
+      return false;
+    }
+    const auto &last = *fake.last_request;
+    *request = FAKE_HttpRequestRecord{last.method.c_str(), last.url.c_str(),
+                                      last.headers_json.c_str(), last.body_length};
+    return true;
+  }
+
+  bool fake_tor_wait_idle(unsigned long timeout_ms) {
+    return Dispatcher::shared().waitIdle(std::chrono::milliseconds(timeout_ms));
+  }
+
+  } // extern "C"
+} // namespace tor
+
+namespace {
+  tor::TOR_CHttpResponse syncResponse(const char *method, const char *url, const char *body,
+                                      const char *headers_json, unsigned long timeout_ms) {
+    struct Waiter {
+      std::mutex mutex;
+      std::condition_variable done;
+      std::optional<tor::TOR_CHttpResponse> response;
+    } waiter;
+    tor::TOR_HttpRequest request{method, url, headers_json, body, timeout_ms, 0, 0, false, 0,
+                                 nullptr, nullptr};
+    tor::http_request(
+        &request,
+        [](void *context, tor::TOR_CHttpResponse response) {
+          auto *waiter = static_cast<Waiter *>(context);
+          std::lock_guard<std::mutex> lock(waiter->mutex);
+          waiter->response = response;
+          waiter->done.notify_all();
+        },
+        &waiter);
+    std::unique_lock<std::mutex> lock(waiter.mutex);
+    waiter.done.wait(lock, [&waiter]() { return waiter.response.has_value(); });
+    return *waiter.response;
+  }
+} // namespace
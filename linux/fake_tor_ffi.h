@@ -0,0 +1,177 @@
+#ifndef FAKE_TOR_FFI_H
+#define FAKE_TOR_FFI_H
+
+#include "tor_ffi.h"
+
+// In-process stand-in for the Rust `tor_ffi` library, used by the Linux host build. It implements
+// every entry point of tor_ffi.h without touching the network (except `open_stream_async`, which
+// connects over plain TCP) and can be scripted from a test or benchmark harness.
+//
+// Async entry points complete on a single dispatcher thread, like callbacks from the Rust
+// runtime, in the order their latency elapses.
+
+namespace tor {
+
+  /// Scripted response of `http_request`, matched against the request URL by prefix. Rules are
+  /// tried newest first, requests matching no rule get a 200 echoing the request body.
+  struct FAKE_HttpRule {
+    /// nullptr or "" matches every URL.
+    const char *url_prefix;
+    unsigned short status_code;
+    /// nullptr for an empty body.
+    const char *body;
+    /// Repeats `body` this many times, 0 counts as 1. Lets benchmarks request large payloads.
+    unsigned long body_repeat;
+    /// Non-null fails the request with this message and `error_kind`.
+    const char *error;
+    TOR_HttpErrorKind error_kind;
+    /// Time until the callback fires. Requests whose `timeout_ms` is shorter fail with Timeout.
+    unsigned long latency_ms;
+    /// Reported phase timings, 0 derives them from `latency_ms`.
+    unsigned long connect_ms;
+    unsigned long first_byte_ms;
+    TOR_HttpVersion http_version;
+    bool reused_connection;
+    /// Number of requests the rule applies to before it is dropped, 0 for unlimited.
+    unsigned int times;
+  };
+
+  /// Answer of `resolve_async` for one host name. HTTP responses from the host also report its
+  /// first address and `ttl_s` as the address the exit connected to.
+  struct FAKE_DnsRecord {
+    const char *hostname;
+    /// Comma separated, as in `TOR_ResolveResult`.
+    const char *addresses;
+    unsigned long ttl_s;
+    unsigned long latency_ms;
+  };
+
+  /// Scripted outcome of `start_tor_if_not_running` and `resume_from_dormant_async`.
+  struct FAKE_StartScript {
+    bool is_success;
+    /// nullptr keeps the default address derived from `target_port`.
+    const char *onion_address;
+    const char *error_message;
+    unsigned long latency_ms;
+  };
+
+  /// Call and ownership counters since the last `fake_tor_reset`.
+  struct FAKE_Stats {
+    unsigned long long http_requests;
+    unsigned long long http_cancelled;
+    unsigned long long streams_opened;
+    unsigned long long starts;
+    unsigned long long shutdowns;
+    unsigned long long moderate_trims;
+    unsigned long long critical_trims;
+    unsigned long long resolves;
+    /// HTTP requests that came with a `resolved_addr`.
+    unsigned long long preresolved_requests;
+    /// HTTP requests whose body came from a `body_source`.
+    unsigned long long streamed_bodies;
+    /// Callback invocations still pending on the dispatcher thread.
+    unsigned long long pending_callbacks;
+    /// Allocations handed out in results, one per response arena, none for results without
+    /// strings. Lets benchmarks check the allocator traffic per call.
+    unsigned long long allocations;
+    /// Arenas handed out and not yet released through `free_arena` / `free_http_response`.
+    /// Non-zero after all callbacks fired means the caller leaks.
+    long long live_strings;
+  };
+
+  /// What the last `http_request` call was given, to check what reached the library.
+  struct FAKE_HttpRequestRecord {
+    const char *method;
+    const char *url;
+    const char *headers_json;
+    /// Length announced by `body_source`, or the size of `body`.
+    unsigned long long body_length;
+  };
+
+  /// Authentication offered by the fake control port of `fake_tor_start_control_port`.
+  struct FAKE_ControlPortConfig {
+    /// Offer NULL authentication.
+    bool allow_null;
+    /// Non-null offers HASHEDPASSWORD with this password.
+    const char *password;
+    /// Non-null writes a fresh cookie to this path and offers COOKIE and SAFECOOKIE.
+    const char *cookie_path;
+  };
+
+  /// Counters of the running fake control port.
+  struct FAKE_ControlStats {
+    unsigned long long connections;
+    /// Command lines received, and the reads they arrived in. Pipelined commands share reads.
+    unsigned long long commands;
+    unsigned long long reads;
+  };
+
+  extern "C" {
+
+  /// Drops every rule and script and zeroes the counters. Pending callbacks still fire.
+  void fake_tor_reset();
+
+  void fake_tor_add_http_rule(const FAKE_HttpRule *rule);
+
+  void fake_tor_set_start_script(const FAKE_StartScript *script);
+
+  /// Makes `open_stream_async` fail with `error` and `error_kind`, nullptr restores connecting.
+  void fake_tor_set_stream_error(const char *error, TOR_HttpErrorKind error_kind);
+
+  /// Last configuration passed to `configure_http_client`, false if there was none.
+  bool fake_tor_http_client_config(TOR_HttpClientConfig *config);
+
+  /// Usage reported by `get_memory_usage` until trimmed. Moderate trims halve the idle circuits
+  /// and the directory cache, critical trims clear them.
+  void fake_tor_set_memory_usage(const TOR_MemoryUsage *usage);
+
+  /// Adds or replaces the record of `record->hostname`. Names without a record fail to resolve
+  /// with `TOR_HttpErrorKind::Connect`.
+  void fake_tor_add_dns_record(const FAKE_DnsRecord *record);
+
+  /// Adds traffic outside of HTTP requests to the counters of `get_traffic_counters`, which
+  /// otherwise count request URLs and bodies as written and response bodies as read. Its open
+  /// circuits are the ones of `fake_tor_set_memory_usage`, its open streams the pending requests.
+  void fake_tor_add_traffic(unsigned long long bytes_read, unsigned long long bytes_written);
+
+  /// Last limits accepted by `configure_memory_limits`, false if there were none.
+  bool fake_tor_memory_limits(TOR_MemoryLimits *limits);
+
+  /// Bridge line `index` of the last `configure_bridges` call, nullptr past the end. Valid until
+  /// the next call.
+  const char *fake_tor_bridge(unsigned long index);
+
+  /// Reports a circuit build to the observer of `set_circuit_observer`, from the dispatcher
+  /// thread after `latency_ms`. `relays` is copied.
+  void fake_tor_emit_circuit(const TOR_CircuitEvent *event, unsigned long latency_ms);
+
+  /// Weight set for `fingerprint` by the last `set_relay_weights` call, 1 if it was not listed.
+  double fake_tor_relay_weight(const char *fingerprint);
+
+  void fake_tor_stats(FAKE_Stats *stats);
+
+  /// Last request passed to `http_request`, false if there was none since the last reset. The
+  /// strings stay valid until the next request.
+  bool fake_tor_last_http_request(FAKE_HttpRequestRecord *request);
+
+  /// Starts a fake control port on 127.0.0.1 and returns its port, 0 on failure. Replaces a
+  /// running one. It answers PROTOCOLINFO, AUTHCHALLENGE, AUTHENTICATE, SETEVENTS (CIRC, STREAM,
+  /// BW and HS_DESC), GETINFO version, GETINFO config-text (a data reply) and QUIT; other
+  /// commands get a 510 reply.
+  unsigned short fake_tor_start_control_port(const FAKE_ControlPortConfig *config);
+
+  void fake_tor_stop_control_port();
+
+  /// Sends "650 <line>" to every connection subscribed to the event type `line` starts with.
+  void fake_tor_emit_control_event(const char *line);
+
+  void fake_tor_control_stats(FAKE_ControlStats *stats);
+
+  /// Blocks until no callback is pending or `timeout_ms` elapsed, returns whether it drained.
+  bool fake_tor_wait_idle(unsigned long timeout_ms);
+
+  } // extern "C"
+
+} // namespace tor
+
+#endif // FAKE_TOR_FFI_H
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <sstream>
+#include <string>
+
+// Checks for the host tests. Every test is a plain executable run by CTest: a failed check prints
+// where and why, and the test exits non-zero once it returns from main.
+namespace margelo::nitro::nitrotor::test {
+  inline int &failures() {
+    static int count = 0;
+    return count;
+  }
+
+  template <typename T> std::string describe(const T &value) {
+    if constexpr (requires(std::ostringstream &out) { out << value; }) {
+      std::ostringstream out;
+      out << value;
+      return out.str();
+    } else {
+      return "<value>";
+    }
+  }
+
+  inline void fail(const char *file, int line, const std::string &message) {
+    std::fprintf(stderr, "%s:%d: %s\n", file, line, message.c_str());
+    failures()++;
+  }
+
+  template <typename A, typename B>
+  void checkEqual(const A &actual, const B &expected, const char *actual_text,
+                  const char *expected_text, const char *file, int line) {
+    if (!(actual == expected)) {
+      fail(file, line,
+           std::string(actual_text) + " == " + expected_text + " failed: got " +
+               describe(actual) + ", expected " + describe(expected));
+    }
+  }
+
+  // Runs a test case and reports its name, so failures can be told apart in the CTest log.
+  template <typename F> void run(const char *name, F &&test_case) {
+    int before = failures();
+    try {
+      test_case();
+    } catch (const std::exception &e) {
+      std::fprintf(stderr, "%s threw: %s\n", name, e.what());
+      failures()++;
+    }
+    std::fprintf(stderr, "%s %s\n", failures() == before ? "[ ok ]" : "[FAIL]", name);
+  }
+
+  inline int result() { return failures() == 0 ? EXIT_SUCCESS : EXIT_FAILURE; }
+} // namespace margelo::nitro::nitrotor::test
+
+#define CHECK(condition)                                                                          \
+  do {                                                                                            \
+    if (!(condition)) {                                                                           \
+      ::margelo::nitro::nitrotor::test::fail(__FILE__, __LINE__, "CHECK(" #condition ") failed"); \
+    }                                                                                             \
+  } while (false)
+
+#define CHECK_EQ(actual, expected)                                                                \
+  ::margelo::nitro::nitrotor::test::checkEqual((actual), (expected), #actual, #expected,         \
+                                               __FILE__, __LINE__)
@@ -0,0 +1,272 @@
+#include "ControlPort.hpp"
+#include "TestSupport.hpp"
+#include "fake_tor_ffi.h"
+#include <condition_variable>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Runs ControlClient against the fake control port: authentication, pipelined commands and the
+// batching of asynchronous events.
+
+using namespace margelo::nitro::nitrotor;
+using margelo::nitro::nitrotor::test::run;
+
+namespace {
+  class Recorder : public ControlListener {
+  public:
+    void onConnected() override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _connected = true;
+      _changed.notify_all();
+    }
+
+    void onConnectFailed(const std::string &error) override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _error = error;
+      _closed = true;
+      _changed.notify_all();
+    }
+
+    void onEvents(std::vector<ControlEvent> &&events) override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _batches.push_back(std::move(events));
+      _changed.notify_all();
+    }
+
+    void onClose(const std::string &error) override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _error = error;
+      _closed = true;
+      _changed.notify_all();
+    }
+
+    // Whether the connection opened, `error` is set otherwise.
+    bool waitConnected(std::string &error) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _changed.wait_for(lock, std::chrono::seconds(10), [this]() { return _connected || _closed; });
+      error = _error;
+      return _connected;
+    }
+
+    // Event batches once `count` events arrived in total.
+    std::vector<std::vector<ControlEvent>> waitEvents(size_t count) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _changed.wait_for(lock, std::chrono::seconds(10), [&]() {
+        size_t total = 0;
+        for (const auto &batch : _batches) {
+          total += batch.size();
+        }
+        return total >= count;
+      });
+      return std::exchange(_batches, {});
+    }
+
+    bool waitClosed() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      return _changed.wait_for(lock, std::chrono::seconds(10), [this]() { return _closed; });
+    }
+
+  private:
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::vector<std::vector<ControlEvent>> _batches;
+    std::string _error;
+    bool _connected = false;
+    bool _closed = false;
+  };
+
+  ControlOptions options(unsigned short port) {
+    return ControlOptions{"127.0.0.1:" + std::to_string(port), std::nullopt, std::nullopt, 5000,
+                          100, 5};
+  }
+
+  std::pair<std::shared_ptr<ControlClient>, std::shared_ptr<Recorder>>
+  connect(ControlOptions options, std::string &error) {
+    auto recorder = std::make_shared<Recorder>();
+    auto client = std::make_shared<ControlClient>(std::move(options), recorder);
+    client->connect();
+    recorder->waitConnected(error);
+    return {client, recorder};
+  }
+
+  std::vector<ControlReply> send(ControlClient &client, std::vector<std::string> commands) {
+    auto done = std::make_shared<std::promise<std::vector<ControlReply>>>();
+    client.submit(std::move(commands), [done](std::vector<ControlReply> &&replies,
+                                              const std::string &error) {
+      if (!error.empty()) {
+        done->set_exception(std::make_exception_ptr(std::runtime_error(error)));
+      } else {
+        done->set_value(std::move(replies));
+      }
+    });
+    auto future = done->get_future();
+    if (future.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+      throw std::runtime_error("no control replies");
+    }
+    return future.get();
+  }
+
+  std::string tempPath(const char *name) {
+    return "/tmp/nitrotor-control-" + std::to_string(getpid()) + "-" + name;
+  }
+
+  void testSafeCookie() {
+    auto cookie_path = tempPath("cookie");
+    tor::FAKE_ControlPortConfig config{false, nullptr, cookie_path.c_str()};
+    auto port = tor::fake_tor_start_control_port(&config);
+    CHECK(port != 0);
+
+    std::string error;
+    auto [client, recorder] = connect(options(port), error);
+    CHECK_EQ(error, std::string(""));
+    CHECK(client->state() == ControlClient::State::Open);
+    auto replies = send(*client, {"GETINFO version"});
+    CHECK_EQ(replies.size(), size_t(1));
+    CHECK_EQ(replies[0].status, 250.0);
+    client->close();
+    CHECK(recorder->waitClosed());
+
+    // A different cookie: the server hash of AUTHCHALLENGE does not match, nothing is sent.
+    auto wrong_path = tempPath("wrong-cookie");
+    std::ofstream(wrong_path, std::ios::binary) << std::string(32, 'x');
+    auto settings = options(port);
+    settings.cookie_path = wrong_path;
+    auto [rejected, rejected_recorder] = connect(settings, error);
+    CHECK(!error.empty());
+    CHECK(rejected->state() == ControlClient::State::Closed);
+
+    tor::fake_tor_stop_control_port();
+    unlink(cookie_path.c_str());
+    unlink(wrong_path.c_str());
+  }
+
+  void testPassword() {
+    tor::FAKE_ControlPortConfig config{false, "s3cret \"quoted\"", nullptr};
+    auto port = tor::fake_tor_start_control_port(&config);
+    auto settings = options(port);
+    settings.password = "s3cret \"quoted\"";
+    std::string error;
+    auto [client, recorder] = connect(settings, error);
+    CHECK_EQ(error, std::string(""));
+    client->close();
+    CHECK(recorder->waitClosed());
+
+    settings.password = "wrong";
+    auto [rejected, rejected_recorder] = connect(settings, error);
+    CHECK(error.find("authentication failed") != std::string::npos);
+    tor::fake_tor_stop_control_port();
+  }
+
+  // The fake listens on 127.0.0.1 only. Where "localhost" resolves to ::1 first, that address is
+  // refused before 127.0.0.1 connects, and its error must not fail the authentication.
+  void testLocalhost() {
+    tor::FAKE_ControlPortConfig config{true, nullptr, nullptr};
+    auto port = tor::fake_tor_start_control_port(&config);
+    auto settings = options(port);
+    settings.endpoint = "localhost:" + std::to_string(port);
+    std::string error;
+    auto [client, recorder] = connect(settings, error);
+    CHECK_EQ(error, std::string(""));
+    CHECK(client->state() == ControlClient::State::Open);
+    client->close();
+    CHECK(recorder->waitClosed());
+    tor::fake_tor_stop_control_port();
+  }
+
+  void testPipelining() {
+    tor::FAKE_ControlPortConfig config{true, nullptr, nullptr};
+    auto port = tor::fake_tor_start_control_port(&config);
+    std::string error;
+    auto [client, recorder] = connect(options(port), error);
+    CHECK_EQ(error, std::string(""));
+
+    tor::FAKE_ControlStats before;
+    tor::fake_tor_control_stats(&before);
+    std::vector<std::string> commands;
+    for (int i = 0; i < 20; i++) {
+      commands.push_back(i % 2 == 0 ? "GETINFO version" : "GETINFO config-text");
+    }
+    commands[7] = "NOSUCHCOMMAND";
+    auto replies = send(*client, commands);
+    tor::FAKE_ControlStats after;
+    tor::fake_tor_control_stats(&after);
+
+    // Replies in command order, the data reply unstuffed.
+    CHECK_EQ(replies.size(), size_t(20));
+    CHECK_EQ(replies[0].lines, (std::vector<std::string>{"version=0.4.8.10-fake", "OK"}));
+    CHECK_EQ(replies[1].lines.front(), std::string("config-text=\nSocksPort 9050\n.hidden"));
+    CHECK_EQ(replies[7].status, 510.0);
+    CHECK_EQ(replies[19].status, 250.0);
+    // One write for the whole batch.
+    CHECK_EQ(after.commands - before.commands, 20ULL);
+    CHECK(after.reads - before.reads < 5);
+
+    // Batches submitted back to back complete in order.
+    auto first = send(*client, {"GETINFO version", "GETINFO version"});
+    auto second = send(*client, {"GETINFO config-text"});
+    CHECK_EQ(first.size(), size_t(2));
+    CHECK_EQ(second.size(), size_t(1));
+    client->close();
+    CHECK(recorder->waitClosed());
+    tor::fake_tor_stop_control_port();
+  }
+
+  void testEventBatching() {
+    tor::FAKE_ControlPortConfig config{true, nullptr, nullptr};
+    auto port = tor::fake_tor_start_control_port(&config);
+    std::string error;
+    auto [client, recorder] = connect(options(port), error);
+    auto replies = send(*client, {"SETEVENTS CIRC BW"});
+    CHECK_EQ(replies[0].status, 250.0);
+
+    // Below max_event_batch: delivered together once event_batch_ms elapsed.
+    tor::fake_tor_emit_control_event("CIRC 5 BUILT $AAAA~alpha,$BBBB~beta PURPOSE=GENERAL");
+    tor::fake_tor_emit_control_event("STREAM 1 NEW 0 example.onion:80");
+    tor::fake_tor_emit_control_event("BW 100 200");
+    auto batches = recorder->waitEvents(2);
+    CHECK_EQ(batches.size(), size_t(1));
+    if (batches.size() == 1 && batches[0].size() == 2) {
+      auto &circuit = batches[0][0];
+      CHECK(circuit.type == ControlEventType::CIRC);
+      CHECK_EQ(circuit.id, std::string("5"));
+      CHECK_EQ(circuit.status, std::string("BUILT"));
+      CHECK_EQ(circuit.path, (std::vector<std::string>{"$AAAA~alpha", "$BBBB~beta"}));
+      CHECK_EQ(circuit.arguments["PURPOSE"], std::string("GENERAL"));
+      CHECK(batches[0][1].type == ControlEventType::BW);
+      CHECK_EQ(batches[0][1].bytes_read, 100.0);
+      CHECK_EQ(batches[0][1].bytes_written, 200.0);
+    }
+
+    // A burst is cut into batches of max_event_batch.
+    for (int i = 0; i < 12; i++) {
+      tor::fake_tor_emit_control_event(("BW " + std::to_string(i) + " 0").c_str());
+    }
+    batches = recorder->waitEvents(12);
+    std::vector<size_t> sizes;
+    for (const auto &batch : batches) {
+      sizes.push_back(batch.size());
+    }
+    CHECK_EQ(sizes, (std::vector<size_t>{5, 5, 2}));
+
+    // Queued events are delivered before the close is reported.
+    tor::fake_tor_emit_control_event("BW 1 1");
+    usleep(20000);
+    client->close();
+    CHECK(recorder->waitClosed());
+    CHECK_EQ(recorder->waitEvents(1).size(), size_t(1));
+    tor::fake_tor_stop_control_port();
+  }
+} // namespace
+
+int main() {
+  run("safecookie", testSafeCookie);
+  run("password", testPassword);
+  run("localhost", testLocalhost);
+  run("pipelining", testPipelining);
+  run("event batching", testEventBatching);
+  return margelo::nitro::nitrotor::test::result();
+}
@@ -0,0 +1,209 @@
+#include "Checks.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <glob.h>
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Compares cpp/glob_impl.cpp, built here as nitrotor_glob()/nitrotor_globfree(), with glibc's
+// glob() on a scratch directory tree: same return value, same paths in the same order and the
+// same calls of the error function.
+
+extern "C" {
+int nitrotor_glob(const char *pattern, int flags, int (*errfunc)(const char *epath, int eerrno),
+                  glob_t *pglob);
+void nitrotor_globfree(glob_t *pglob);
+}
+
+using margelo::nitro::nitrotor::test::run;
+
+namespace {
+  using GlobFunction = int (*)(const char *, int, int (*)(const char *, int), glob_t *);
+  using GlobFreeFunction = void (*)(glob_t *);
+
+  std::vector<std::string> g_errors;
+  bool g_abortOnError = false;
+
+  int recordError(const char *path, int error) {
+    g_errors.push_back(std::string(path) + ": " + std::to_string(error));
+    return g_abortOnError ? 1 : 0;
+  }
+
+  // Return value, paths and error calls of one glob() call, printable for failure messages.
+  std::string describe(GlobFunction glob_function, GlobFreeFunction free_function,
+                       const std::string &pattern, int flags) {
+    g_errors.clear();
+    glob_t result{};
+    int status = glob_function(pattern.c_str(), flags, &recordError, &result);
+    std::string text = "status " + std::to_string(status) + ", paths";
+    if (status == 0) {
+      std::vector<std::string> paths(result.gl_pathv, result.gl_pathv + result.gl_pathc);
+      if (flags & GLOB_NOSORT) {
+        // Only the order of readdir(), which both read alike but may split differently.
+        std::sort(paths.begin(), paths.end());
+      }
+      for (const auto &path : paths) {
+        text += " [" + path + "]";
+      }
+      free_function(&result);
+    }
+    text += ", errors";
+    for (const auto &error : g_errors) {
+      text += " [" + error + "]";
+    }
+    return text;
+  }
+
+  void compare(const std::string &pattern, int flags) {
+    auto expected = describe(&glob, &globfree, pattern, flags);
+    auto actual = describe(&nitrotor_glob, &nitrotor_globfree, pattern, flags);
+    if (actual != expected) {
+      margelo::nitro::nitrotor::test::fail(
+          __FILE__, __LINE__,
+          "glob(\"" + pattern + "\", " + std::to_string(flags) + ") returned " + actual +
+              ", glibc " + expected);
+    }
+  }
+
+  void compareAll(std::initializer_list<const char *> patterns, std::initializer_list<int> flags) {
+    for (const char *pattern : patterns) {
+      for (int flag : flags) {
+        compare(pattern, flag);
+      }
+    }
+  }
+
+  void touch(const std::string &path) { ::close(open(path.c_str(), O_CREAT | O_WRONLY, 0644)); }
+
+  // Scratch tree, made the working directory.
+  std::string makeTree() {
+    char path[] = "/tmp/nitrotor-glob-XXXXXX";
+    std::string root = mkdtemp(path) != nullptr ? path : "";
+    if (root.empty() || chdir(root.c_str()) != 0) {
+      throw std::runtime_error("Failed to create the glob test tree");
+    }
+    for (const char *directory : {"a", "a/deep", "b", "empty", ".hidden_dir"}) {
+      mkdir(directory, 0755);
+    }
+    for (const char *file : {"a/x", "a/y.txt", "a/.dot", "a/deep/z", "b/z", "c.txt", "d.log",
+                             ".profile", "lit[x", "star*", "q?", "brace{a}", "{a"}) {
+      touch(file);
+    }
+    (void)!symlink("a", "link");
+    (void)!symlink("c.txt", "flink");
+    (void)!symlink("missing", "dangling");
+    return root;
+  }
+
+  void testPatterns() {
+    compareAll({"*", "*.txt", "?.log", "[ab]", "[!ab]*", "[^ab]*", "[a-c]*", "[]a]", "[!]]*",
+                "*/*", "*/*/*", "a/*", "a/.*", ".*", "*/z", "a/deep/*", "link/*", "flink",
+                "dangling", "lit[x", "lit\\[x", "star\\*", "q\\?", "\\a", "[", "lit[", "*[",
+                "a/[xy]*", "*/*.txt", "nonexistent", "a", "./a/*", "../*/a", "", "/",
+                "/tmp", "/nonexistent*"},
+               {0, GLOB_NOSORT, GLOB_NOESCAPE, GLOB_PERIOD});
+  }
+
+  void testMark() {
+    compareAll({"*", "a", "a/*", "*/*", "link", "flink", "dangling", "a/deep/", "a/*/", "."},
+               {GLOB_MARK, GLOB_MARK | GLOB_NOCHECK});
+  }
+
+  // Results of our glob() alone, as one string like describe().
+  std::string ours(const std::string &pattern, int flags) {
+    return describe(&nitrotor_glob, &nitrotor_globfree, pattern, flags);
+  }
+
+  // Where glob_impl.cpp deliberately differs from glibc, see its header.
+  void testSlashes() {
+    CHECK_EQ(ours("a//x", 0), std::string("status 0, paths [a/x], errors"));
+    CHECK_EQ(ours("*//x", 0), std::string("status 0, paths [a/x] [link/x], errors"));
+    CHECK_EQ(ours("a/", GLOB_MARK), std::string("status 0, paths [a/], errors"));
+    CHECK_EQ(ours("*/", 0), std::string("status 0, paths [a/] [b/] [empty/] [link/], errors"));
+    CHECK_EQ(ours("*/", GLOB_MARK),
+             std::string("status 0, paths [a/] [b/] [empty/] [link/], errors"));
+    CHECK_EQ(ours("link/", GLOB_MARK), std::string("status 0, paths [link/], errors"));
+    CHECK_EQ(ours("c.txt/", 0), std::string("status 3, paths, errors"));
+    CHECK_EQ(ours("flink/", GLOB_MARK), std::string("status 3, paths, errors"));
+    CHECK_EQ(ours("dangling/", 0), std::string("status 3, paths, errors"));
+    CHECK_EQ(ours("/", GLOB_MARK), std::string("status 0, paths [/], errors"));
+  }
+
+  void testNoCheck() {
+    compareAll({"nothing*", "nothing", "a/nothing*", "[z]", "\\*z", "nothing\\*"},
+               {GLOB_NOCHECK, GLOB_NOCHECK | GLOB_NOESCAPE, GLOB_NOMAGIC});
+  }
+
+  void testBraces() {
+    compareAll({"{a,b}/*", "{a}", "{}", "a/{x}", "{c,d}.{txt,log}", "{a,{b,c.txt}}", "{a",
+                "{a}{b,c}", "brace{a}", "brace\\{a}", "{*.txt,*.log}", "{nothing,c.txt}",
+                "x{a,b", "{a,b}}", "{,a}"},
+               {GLOB_BRACE, GLOB_BRACE | GLOB_NOCHECK, GLOB_BRACE | GLOB_MARK});
+  }
+
+  void testErrors() {
+    for (bool abort_on_error : {false, true}) {
+      g_abortOnError = abort_on_error;
+      compareAll({"nonexistent/*", "a/nonexistent/*", "c.txt/*", "*/nonexistent/*",
+                  "nonexistent/x", "a/x/*", "dangling/*", "*/missing", "{a,nothing}/*"},
+                 {0, GLOB_ERR, GLOB_ERR | GLOB_NOCHECK, GLOB_ERR | GLOB_BRACE});
+    }
+    g_abortOnError = false;
+  }
+
+  void testAppendAndOffsets() {
+    for (auto [glob_function, free_function] :
+         {std::pair<GlobFunction, GlobFreeFunction>{&glob, &globfree},
+          std::pair<GlobFunction, GlobFreeFunction>{&nitrotor_glob, &nitrotor_globfree}}) {
+      glob_t result{};
+      CHECK_EQ(glob_function("*.txt", 0, nullptr, &result), 0);
+      CHECK_EQ(glob_function("nothing*", GLOB_APPEND, nullptr, &result), GLOB_NOMATCH);
+      CHECK_EQ(glob_function("*.log", GLOB_APPEND, nullptr, &result), 0);
+      CHECK_EQ(result.gl_pathc, size_t(2));
+      CHECK_EQ(std::string(result.gl_pathv[0]), std::string("c.txt"));
+      CHECK_EQ(std::string(result.gl_pathv[1]), std::string("d.log"));
+      CHECK(result.gl_pathv[2] == nullptr);
+      free_function(&result);
+    }
+
+    // Not compared: the sanitizers' glob() interceptor ignores gl_offs.
+    glob_t result{};
+    result.gl_offs = 2;
+    CHECK_EQ(nitrotor_glob("*.txt", GLOB_DOOFFS, nullptr, &result), 0);
+    CHECK_EQ(nitrotor_glob("*.log", GLOB_DOOFFS | GLOB_APPEND, nullptr, &result), 0);
+    CHECK_EQ(result.gl_pathc, size_t(2));
+    CHECK(result.gl_pathv[0] == nullptr && result.gl_pathv[1] == nullptr);
+    CHECK_EQ(std::string(result.gl_pathv[2]), std::string("c.txt"));
+    CHECK_EQ(std::string(result.gl_pathv[3]), std::string("d.log"));
+    CHECK(result.gl_pathv[4] == nullptr);
+    nitrotor_globfree(&result);
+  }
+
+  void testTilde() {
+    std::string home = getenv("HOME") != nullptr ? getenv("HOME") : "";
+    char cwd[4096];
+    setenv("HOME", getcwd(cwd, sizeof(cwd)), 1);
+    compareAll({"~", "~/a/*", "~/nothing", "~nosuchuser/x"},
+               {GLOB_TILDE, GLOB_TILDE_CHECK, GLOB_TILDE | GLOB_MARK});
+    setenv("HOME", home.c_str(), 1);
+  }
+} // namespace
+
+int main() {
+  makeTree();
+  run("patterns", testPatterns);
+  run("GLOB_MARK", testMark);
+  run("slashes", testSlashes);
+  run("GLOB_NOCHECK", testNoCheck);
+  run("GLOB_BRACE", testBraces);
+  run("errors", testErrors);
+  run("GLOB_APPEND and GLOB_DOOFFS", testAppendAndOffsets);
+  run("GLOB_TILDE", testTilde);
+  return margelo::nitro::nitrotor::test::result();
+}
@@ -0,0 +1,527 @@
+#include "HybridTor.hpp"
+#include "TestSupport.hpp"
+#include "fake_tor_ffi.h"
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+// Drives HybridTor through its Nitro interface against the fake tor_ffi, the way JS calls it.
+
+using namespace margelo::nitro::nitrotor;
+using margelo::nitro::nitrotor::test::run;
+
+namespace {
+  std::string tempDir() {
+    char path[] = "/tmp/nitrotor-test-XXXXXX";
+    return mkdtemp(path) != nullptr ? path : "/tmp";
+  }
+
+  tor::FAKE_HttpRule rule(const char *url_prefix) {
+    tor::FAKE_HttpRule rule{};
+    rule.url_prefix = url_prefix;
+    rule.status_code = 200;
+    rule.http_version = tor::TOR_HttpVersion::Http11;
+    return rule;
+  }
+
+  HttpGetParams get(const std::string &url, double timeout_ms = 5000) {
+    HttpGetParams params;
+    params.url = url;
+    params.headers = "{}";
+    params.timeout_ms = timeout_ms;
+    return params;
+  }
+
+  HttpPostParams post(const std::string &url, std::optional<std::string> body) {
+    HttpPostParams params;
+    params.url = url;
+    params.body = std::move(body);
+    params.headers = "{}";
+    params.timeout_ms = 5000;
+    return params;
+  }
+
+  // Every result the fake handed out has to be freed once its callback fired.
+  void checkNoLeaks() {
+    CHECK(tor::fake_tor_wait_idle(5000));
+    tor::FAKE_Stats stats;
+    tor::fake_tor_stats(&stats);
+    CHECK_EQ(stats.live_strings, 0LL);
+  }
+
+  std::shared_ptr<HybridTor> startedTor() {
+    auto tor = std::make_shared<HybridTor>();
+    StartTorParams params;
+    params.data_dir = tempDir();
+    params.socks_port = 9050;
+    params.target_port = 8080;
+    params.timeout_ms = 5000;
+    auto response = AWAIT(tor->startTorIfNotRunning(params));
+    CHECK(response.is_success);
+    return tor;
+  }
+
+  // A socket on 127.0.0.1 listening if `listening`, only bound (connects are refused) otherwise.
+  int localSocket(bool listening, unsigned short &port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    bind(fd, reinterpret_cast<sockaddr *>(&address), length);
+    if (listening) {
+      listen(fd, 4);
+    }
+    getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length);
+    port = ntohs(address.sin_port);
+    return fd;
+  }
+
+  // A pluggable transport's SOCKS5 proxy that reaches its one bridge only after `delay_ms`.
+  std::thread slowTransport(int listener, int delay_ms) {
+    return std::thread([listener, delay_ms]() {
+      int fd = accept(listener, nullptr, nullptr);
+      char request[10];
+      // Greeting without authentication, then CONNECT to an IPv4 address.
+      if (fd < 0 || recv(fd, request, 3, MSG_WAITALL) != 3 || send(fd, "\x05\x00", 2, 0) != 2 ||
+          recv(fd, request, 10, MSG_WAITALL) != 10) {
+        ::close(fd);
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+      send(fd, "\x05\x00\x00\x01\x00\x00\x00\x00\x00\x00", 10, 0);
+      ::close(fd);
+    });
+  }
+
+  std::string bridge(unsigned long index) {
+    const char *line = tor::fake_tor_bridge(index);
+    return line != nullptr ? line : "<none>";
+  }
+
+  void testStart() {
+    tor::fake_tor_reset();
+    auto tor = std::make_shared<HybridTor>();
+    StartTorParams params;
+    params.data_dir = tempDir();
+    params.socks_port = 9050;
+    params.target_port = 8080;
+    params.timeout_ms = 5000;
+    auto response = AWAIT(tor->startTorIfNotRunning(params));
+    CHECK(response.is_success);
+    CHECK_EQ(response.onion_address.size(), size_t(62));
+    CHECK_EQ(AWAIT(tor->getServiceStatus()), 1.0);
+
+    tor::FAKE_StartScript failing{false, nullptr, "bootstrap failed", 0};
+    tor::fake_tor_set_start_script(&failing);
+    CHECK(AWAIT(tor->shutdownService()));
+    response = AWAIT(tor->startTorIfNotRunning(params));
+    CHECK(!response.is_success);
+    CHECK_EQ(response.error_message, std::string("bootstrap failed"));
+    checkNoLeaks();
+  }
+
+  // Tor starts with every bridge that answered within the grace period, the ones answering later
+  // are added once all probes finished.
+  void testBridges() {
+    tor::fake_tor_reset();
+    unsigned short first_port, second_port, refused_port, proxy_port;
+    int first = localSocket(true, first_port);
+    int second = localSocket(true, second_port);
+    int refused = localSocket(false, refused_port);
+    int proxy = localSocket(true, proxy_port);
+    auto transport = slowTransport(proxy, 1500);
+
+    auto tor = std::make_shared<HybridTor>();
+    StartTorParams params;
+    params.data_dir = tempDir();
+    params.socks_port = 9050;
+    params.target_port = 8080;
+    params.timeout_ms = 5000;
+    BridgeConfig config;
+    config.bridges = {"Bridge 127.0.0.1:" + std::to_string(first_port) + " 0123ABCD",
+                      "127.0.0.1:" + std::to_string(refused_port),
+                      "slow 127.0.0.1:9",
+                      "127.0.0.1:" + std::to_string(second_port)};
+    config.transports = std::vector<PluggableTransport>{
+        PluggableTransport{{"slow"}, "127.0.0.1:" + std::to_string(proxy_port)}};
+    params.bridges = config;
+    CHECK(AWAIT(tor->startTorIfNotRunning(params)).is_success);
+    CHECK_EQ(bridge(0), "127.0.0.1:" + std::to_string(first_port) + " 0123ABCD");
+    CHECK_EQ(bridge(1), "127.0.0.1:" + std::to_string(second_port));
+    CHECK_EQ(bridge(2), std::string("<none>"));
+
+    for (int i = 0; i < 500 && tor::fake_tor_bridge(2) == nullptr; i++) {
+      usleep(10000);
+    }
+    CHECK_EQ(bridge(2), std::string("slow 127.0.0.1:9"));
+    CHECK_EQ(bridge(3), std::string("<none>"));
+    auto results = tor->getBridgeProbeResults();
+    CHECK_EQ(results.size(), size_t(4));
+    CHECK(results.size() == 4 && results[1].status == BridgeProbeStatus::UNREACHABLE);
+    CHECK(results.size() == 4 && results[2].status == BridgeProbeStatus::REACHABLE);
+
+    // A start without bridges connects directly again.
+    CHECK(AWAIT(tor->shutdownService()));
+    params.bridges = std::nullopt;
+    CHECK(AWAIT(tor->startTorIfNotRunning(params)).is_success);
+    CHECK_EQ(bridge(0), std::string("<none>"));
+
+    transport.join();
+    for (int fd : {first, second, refused, proxy}) {
+      ::close(fd);
+    }
+    checkNoLeaks();
+  }
+
+  unsigned long long allocations() {
+    CHECK(tor::fake_tor_wait_idle(5000));
+    tor::FAKE_Stats stats;
+    tor::fake_tor_stats(&stats);
+    return stats.allocations;
+  }
+
+  // A resume result is one arena with the error, or no allocation at all on success.
+  void testResumeAllocations() {
+    tor::fake_tor_reset();
+    auto tor = startedTor();
+    auto before = allocations();
+    CHECK(AWAIT(tor->suspend()));
+    auto resumed = AWAIT(tor->resume(5000));
+    CHECK(resumed.is_success);
+    CHECK_EQ(resumed.error_message, std::string(""));
+    CHECK_EQ(allocations() - before, 0ULL);
+
+    tor::FAKE_StartScript failing{false, nullptr, "circuit failed", 0};
+    tor::fake_tor_set_start_script(&failing);
+    CHECK(AWAIT(tor->suspend()));
+    resumed = AWAIT(tor->resume(5000));
+    CHECK(!resumed.is_success);
+    CHECK_EQ(resumed.error_message, std::string("circuit failed"));
+    CHECK_EQ(allocations() - before, 1ULL);
+    checkNoLeaks();
+  }
+
+  void testGet() {
+    tor::fake_tor_reset();
+    auto tor = std::make_shared<HybridTor>();
+    auto hello = rule("http://hello.onion/");
+    hello.status_code = 201;
+    hello.body = "hello";
+    hello.http_version = tor::TOR_HttpVersion::Http2;
+    tor::fake_tor_add_http_rule(&hello);
+
+    auto response = AWAIT(tor->httpGet(get("http://hello.onion/path")));
+    CHECK_EQ(response.status_code, 201.0);
+    CHECK_EQ(response.body, std::string("hello"));
+    CHECK_EQ(response.error, std::string(""));
+    CHECK_EQ(response.http_version, std::string("2"));
+    CHECK_EQ(response.attempts, 1.0);
+    checkNoLeaks();
+  }
+
+  void testPostEcho() {
+    tor::fake_tor_reset();
+    auto tor = std::make_shared<HybridTor>();
+    auto response = AWAIT(tor->httpPost(post("http://echo.onion/", "ping")));
+    CHECK_EQ(response.status_code, 200.0);
+    CHECK_EQ(response.body, std::string("ping"));
+    checkNoLeaks();
+  }
+
+  void testErrorsAndRetries() {
+    tor::fake_tor_reset();
+    auto tor = std::make_shared<HybridTor>();
+    auto refused = rule("http://flaky.onion/");
+    refused.error = "connection refused";
+    refused.error_kind = tor::TOR_HttpErrorKind::Connect;
+    refused.times = 1;
+    tor::fake_tor_add_http_rule(&refused);
+
+    auto params = get("http://flaky.onion/");
+    params.retry = RetryPolicy();
+    params.retry->max_attempts = 3;
+    params.retry->backoff_ms = 10;
+    auto response = AWAIT(tor->httpGet(params));
+    CHECK_EQ(response.status_code, 200.0);
+    CHECK_EQ(response.attempts, 2.0);
+
+    tor::fake_tor_add_http_rule(&refused);
+    response = AWAIT(tor->httpGet(get("http://flaky.onion/")));
+    CHECK_EQ(response.status_code, 0.0);
+    CHECK_EQ(response.error, std::string("connection refused"));
+
+    auto slow = rule("http://slow.onion/");
+    slow.latency_ms = 500;
+    tor::fake_tor_add_http_rule(&slow);
+    response = AWAIT(tor->httpGet(get("http://slow.onion/", 50)));
+    CHECK_EQ(response.status_code, 0.0);
+    CHECK(!response.error.empty());
+    checkNoLeaks();
+  }
+
+  unsigned long long preresolved() {
+    tor::FAKE_Stats stats;
+    tor::fake_tor_stats(&stats);
+    return stats.preresolved_requests;
+  }
+
+  // Only attempts on the default isolation token read and fill the DNS cache, the retry's
+  // address stays on its own circuit.
+  void testDnsCacheIsolation() {
+    tor::fake_tor_reset();
+    auto tor = std::make_shared<HybridTor>();
+    tor::FAKE_DnsRecord record{"api.example.com", "192.0.2.7", 300, 0};
+    tor::fake_tor_add_dns_record(&record);
+    auto refused = rule("http://api.example.com/");
+    refused.error = "connection refused";
+    refused.error_kind = tor::TOR_HttpErrorKind::Connect;
+    refused.times = 1;
+    tor::fake_tor_add_http_rule(&refused);
+
+    auto params = get("http://api.example.com/");
+    params.retry = RetryPolicy();
+    params.retry->max_attempts = 2;
+    params.retry->backoff_ms = 10;
+    CHECK_EQ(AWAIT(tor->httpGet(params)).attempts, 2.0);
+    CHECK_EQ(AWAIT(tor->httpGet(get("http://api.example.com/"))).status_code, 200.0);
+    CHECK_EQ(preresolved(), 0ULL);
+    CHECK_EQ(AWAIT(tor->httpGet(get("http://api.example.com/"))).status_code, 200.0);
+    CHECK_EQ(preresolved(), 1ULL);
+    checkNoLeaks();
+  }
+
+  void testJson() {
+    tor::fake_tor_reset();
+    auto tor = std::make_shared<HybridTor>();
+    auto json = rule("http://api.onion/");
+    json.body = R"({"name":"tor","count":3,"pi":3.14159265358979323846,"huge":-1e400})";
+    tor::fake_tor_add_http_rule(&json);
+
+    auto params = get("http://api.onion/");
+    params.response_type = ResponseType::JSON;
+    auto response = AWAIT(tor->httpGet(params));
+    CHECK(response.json.has_value());
+    if (response.json.has_value()) {
+      CHECK_EQ(response.json.value()->getString("name"), std::string("tor"));
+      CHECK_EQ(response.json.value()->getDouble("count"), 3.0);
+      // Too long for the exact fast path.
+      CHECK_EQ(response.json.value()->getDouble("pi"), 3.141592653589793);
+      CHECK_EQ(response.json.value()->getDouble("huge"), -std::numeric_limits<double>::infinity());
+    }
+    CHECK_EQ(response.body, std::string(""));
+    checkNoLeaks();
+  }
+
+  void testUrlencodedForm() {
+    tor::fake_tor_reset();
+    auto tor = std::make_shared<HybridTor>();
+    FormField field;
+    field.name = "q";
+    field.value = "onion routing";
+    auto params = post("http://echo.onion/", std::nullopt);
+    params.form = FormBody(FormEncoding::URLENCODED, {field});
+    auto response = AWAIT(tor->httpPost(params));
+    CHECK_EQ(response.body, std::string("q=onion+routing"));
+    checkNoLeaks();
+  }
+
+  tor::FAKE_HttpRequestRecord lastRequest() {
+    tor::FAKE_HttpRequestRecord request{};
+    CHECK(tor::fake_tor_last_http_request(&request));
+    return request;
+  }
+
+  std::string writeFile(const std::string &dir, const std::string &name,
+                        const std::string &contents) {
+    auto path = dir + "/" + name;
+    std::ofstream(path, std::ios::binary) << contents;
+    return path;
+  }
+
+  FormField formField(const std::string &name) {
+    FormField field;
+    field.name = name;
+    return field;
+  }
+
+  // The body reaches the library as a source of exactly the announced length, framed by the
+  // boundary named in Content-Type.
+  void testMultipartForm() {
+    tor::fake_tor_reset();
+    auto tor = std::make_shared<HybridTor>();
+    auto dir = tempDir();
+    auto value = formField("say \"hi\"");
+    value.value = "hello";
+    auto buffer = formField("blob");
+    const uint8_t bytes[] = {'a', 0, 'b'};
+    buffer.data = ArrayBuffer::copy(bytes, sizeof(bytes));
+    buffer.content_type = "image/png";
+    auto file = formField("upload");
+    file.file_path = writeFile(dir, "notes.txt", "file contents\n");
+    auto params = post("http://echo.onion/upload", std::nullopt);
+    params.form = FormBody(FormEncoding::MULTIPART, {value, buffer, file});
+    auto response = AWAIT(tor->httpPost(params));
+    CHECK_EQ(response.status_code, 200.0);
+
+    auto request = lastRequest();
+    std::string headers = request.headers_json ? request.headers_json : "";
+    std::string prefix = "multipart/form-data; boundary=";
+    auto start = headers.find(prefix);
+    CHECK(start != std::string::npos);
+    start = start == std::string::npos ? 0 : start + prefix.size();
+    auto boundary = headers.substr(start, headers.find('"', start) - start);
+    CHECK_EQ(boundary.rfind("----NitroTorFormBoundary", 0), size_t(0));
+
+    auto expected = "--" + boundary +
+                    "\r\nContent-Disposition: form-data; name=\"say %22hi%22\"\r\n\r\nhello\r\n"
+                    "--" +
+                    boundary +
+                    "\r\nContent-Disposition: form-data; name=\"blob\"; filename=\"blob\"\r\n"
+                    "Content-Type: image/png\r\n\r\n" +
+                    std::string("a\0b", 3) + "\r\n--" + boundary +
+                    "\r\nContent-Disposition: form-data; name=\"upload\"; filename=\"notes.txt\""
+                    "\r\nContent-Type: application/octet-stream\r\n\r\nfile contents\n\r\n--" +
+                    boundary + "--\r\n";
+    CHECK_EQ(response.body, expected);
+    CHECK_EQ(request.body_length, static_cast<unsigned long long>(expected.size()));
+    tor::FAKE_Stats stats;
+    tor::fake_tor_stats(&stats);
+    CHECK_EQ(stats.streamed_bodies, 1ULL);
+
+    // Files are sized when the form is built. One that shrinks before it is sent fails the
+    // request instead of sending fewer bytes than Content-Length announced.
+    BandwidthLimits limits{};
+    limits.max_concurrent_requests = 1;
+    tor->setBandwidthLimits(limits);
+    auto slow = rule("http://slow.onion/");
+    slow.latency_ms = 200;
+    tor::fake_tor_add_http_rule(&slow);
+    auto blocker = tor->httpGet(get("http://slow.onion/"));
+    auto shrinking = formField("upload");
+    shrinking.file_path = writeFile(dir, "shrinking.txt", "0123456789");
+    params.form = FormBody(FormEncoding::MULTIPART, {shrinking});
+    auto queued = tor->httpPost(params);
+    CHECK_EQ(truncate(shrinking.file_path->c_str(), 4), 0);
+    CHECK_EQ(AWAIT(blocker).status_code, 200.0);
+    response = AWAIT(queued);
+    CHECK_EQ(response.status_code, 0.0);
+    CHECK_EQ(response.error, std::string("Request body could not be read"));
+
+    std::string error;
+    auto body = RequestBody::multipart({shrinking});
+    CHECK_EQ(truncate(shrinking.file_path->c_str(), 2), 0);
+    CHECK(!body->forEach([](std::string_view) {}, error));
+    CHECK_EQ(error, *shrinking.file_path + " got shorter while it was sent");
+    checkNoLeaks();
+  }
+
+  InterceptorConfig interceptor(InterceptorKind kind) {
+    InterceptorConfig config;
+    config.kind = kind;
+    return config;
+  }
+
+  class FailingInterceptor : public RequestInterceptor {
+  public:
+    void intercept(HttpRequest &, HttpHeaders &) override {
+      throw std::runtime_error("no session token");
+    }
+  };
+
+  // Checks what the interceptors handed to the library, recomputing the signature from the
+  // request as it arrived there.
+  void testInterceptors() {
+    tor::fake_tor_reset();
+    auto tor = std::make_shared<HybridTor>();
+    auto headers = interceptor(InterceptorKind::HEADERS);
+    headers.headers = R"({"User-Agent":"nitrotor","X-Api-Key":"k1"})";
+    tor->addInterceptor(headers);
+    auto rewrite = interceptor(InterceptorKind::REWRITE_URL);
+    rewrite.from_prefix = "https://api.example.com/";
+    rewrite.to_prefix = "http://api.onion/";
+    tor->addInterceptor(rewrite);
+    auto hmac = interceptor(InterceptorKind::HMAC_SIGNATURE);
+    hmac.secret = "s3cret";
+    tor->addInterceptor(hmac);
+
+    auto params = post("https://api.example.com/v1/items?id=7", "payload");
+    params.headers = R"({"user-agent":"app","Accept":"*/*"})";
+    auto response = AWAIT(tor->httpPost(params));
+    CHECK_EQ(response.status_code, 200.0);
+    CHECK_EQ(response.body, std::string("payload"));
+
+    auto request = lastRequest();
+    CHECK_EQ(std::string(request.method), std::string("POST"));
+    CHECK_EQ(std::string(request.url), std::string("http://api.onion/v1/items?id=7"));
+    std::string error;
+    auto sent = HttpHeaders::parse(request.headers_json, error);
+    CHECK(sent.has_value());
+    if (!sent.has_value()) {
+      return;
+    }
+    auto header = [&](const char *name) {
+      const auto *value = sent->get(name);
+      return value != nullptr ? *value : "<missing>";
+    };
+    CHECK_EQ(sent->entries().size(), size_t(5));
+    CHECK_EQ(header("User-Agent"), std::string("nitrotor"));
+    CHECK_EQ(header("Accept"), std::string("*/*"));
+    CHECK_EQ(header("X-Api-Key"), std::string("k1"));
+    auto timestamp = header("X-Timestamp");
+    auto canonical = "POST\n/v1/items?id=7\n" + timestamp + "\n" +
+                     Sha256::toHex(Sha256::hash("payload"));
+    CHECK_EQ(header("X-Signature"), Sha256::toHex(Sha256::hmac("s3cret", canonical)));
+
+    tor::FAKE_Stats stats;
+    tor::fake_tor_stats(&stats);
+    tor->addNativeInterceptor(std::make_shared<FailingInterceptor>());
+    response = AWAIT(tor->httpPost(params));
+    CHECK_EQ(response.status_code, 0.0);
+    CHECK_EQ(response.error, std::string("Interceptor failed: no session token"));
+    auto requests = stats.http_requests;
+    tor::fake_tor_stats(&stats);
+    CHECK_EQ(stats.http_requests, requests);
+    checkNoLeaks();
+  }
+
+  void testGeneratedKeyRoundTrip() {
+    tor::fake_tor_reset();
+    auto tor = startedTor();
+    auto pairs = AWAIT(tor->generateKeys(1));
+    CHECK_EQ(pairs.size(), size_t(1));
+    CHECK_EQ(tor->deriveOnionAddress(pairs[0].key_data), pairs[0].onion_address);
+
+    HiddenServiceParams params;
+    params.port = 80;
+    params.target_port = 8080;
+    params.key_data = pairs[0].key_data;
+    auto service = AWAIT(tor->createHiddenService(params));
+    CHECK(service.is_success);
+    CHECK_EQ(service.onion_address, pairs[0].onion_address);
+    checkNoLeaks();
+  }
+} // namespace
+
+int main() {
+  run("start", testStart);
+  run("bridges", testBridges);
+  run("resume allocations", testResumeAllocations);
+  run("get", testGet);
+  run("post echo", testPostEcho);
+  run("errors and retries", testErrorsAndRetries);
+  run("dns cache isolation", testDnsCacheIsolation);
+  run("json", testJson);
+  run("urlencoded form", testUrlencodedForm);
+  run("multipart form", testMultipartForm);
+  run("interceptors", testInterceptors);
+  run("generated key round trip", testGeneratedKeyRoundTrip);
+  return margelo::nitro::nitrotor::test::result();
+}
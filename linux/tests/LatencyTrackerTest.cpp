@@ -0,0 +1,104 @@
+#include "LatencyTracker.hpp"
+#include "TestSupport.hpp"
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+
+using namespace margelo::nitro::nitrotor;
+using margelo::nitro::nitrotor::test::run;
+
+namespace {
+  using Phase = LatencyTracker::Phase;
+
+  std::string tempDir() {
+    char path[] = "/tmp/nitrotor-latency-XXXXXX";
+    return mkdtemp(path) != nullptr ? path : "/tmp";
+  }
+
+  std::string readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), {});
+  }
+
+  void testTimeouts() {
+    auto tracker = std::make_shared<LatencyTracker>();
+    auto unknown = tracker->timeoutsFor("a.example", 20000);
+    CHECK_EQ(unknown.connect_ms, uint64_t(20000));
+    CHECK_EQ(unknown.first_byte_ms, uint64_t(20000));
+
+    // Below kMinSamples the caller's bound is kept.
+    for (int i = 0; i < 4; i++) {
+      tracker->record("a.example", Phase::Connect, 3000);
+    }
+    CHECK_EQ(tracker->timeoutsFor("a.example", 20000).connect_ms, uint64_t(20000));
+
+    // p95 of 5 samples is the largest one, doubled.
+    tracker->record("a.example", Phase::Connect, 4000);
+    auto timeouts = tracker->timeoutsFor("a.example", 20000);
+    CHECK_EQ(timeouts.connect_ms, uint64_t(8000));
+    CHECK_EQ(timeouts.first_byte_ms, uint64_t(20000));
+    CHECK_EQ(tracker->timeoutsFor("a.example", 5000).connect_ms, uint64_t(5000));
+
+    // 19 fast samples and one slow one: p95 (index 19 of 20) is the slow one.
+    for (int i = 0; i < 19; i++) {
+      tracker->record("b.example", Phase::FirstByte, 100);
+    }
+    tracker->record("b.example", Phase::FirstByte, 900);
+    CHECK_EQ(tracker->timeoutsFor("b.example", 20000).first_byte_ms, uint64_t(1800));
+
+    // Fast hosts are clamped to the 1500 ms floor.
+    for (int i = 0; i < 5; i++) {
+      tracker->record("c.example", Phase::FirstByte, 50);
+    }
+    CHECK_EQ(tracker->timeoutsFor("c.example", 20000).first_byte_ms, uint64_t(1500));
+    CHECK_EQ(tracker->timeoutsFor("a.example", 20000).connect_ms, uint64_t(8000));
+  }
+
+  void testRoundTrip() {
+    auto dir = tempDir();
+    {
+      auto tracker = std::make_shared<LatencyTracker>();
+      tracker->load(dir);
+      for (int i = 0; i < 5; i++) {
+        tracker->record("visited.example", Phase::Connect, 1000 + i * 500);
+        tracker->record("visited.example", Phase::FirstByte, 2000);
+      }
+      tracker->save();
+    }
+
+    auto saved = readFile(dir + "/nitrotor-latency.txt");
+    CHECK(!saved.empty());
+    CHECK_EQ(saved.find("visited"), std::string::npos);
+    struct stat key_stat {};
+    CHECK_EQ(stat((dir + "/nitrotor-latency.key").c_str(), &key_stat), 0);
+    CHECK_EQ(key_stat.st_mode & 0777, mode_t(0600));
+    CHECK_EQ(key_stat.st_size, off_t(32));
+
+    auto reloaded = std::make_shared<LatencyTracker>();
+    reloaded->load(dir);
+    auto timeouts = reloaded->timeoutsFor("visited.example", 20000);
+    CHECK_EQ(timeouts.connect_ms, uint64_t(6000));
+    CHECK_EQ(timeouts.first_byte_ms, uint64_t(4000));
+    CHECK_EQ(reloaded->timeoutsFor("other.example", 20000).connect_ms, uint64_t(20000));
+
+    // Without the secret the file cannot be matched to hosts, and is not used.
+    std::remove((dir + "/nitrotor-latency.key").c_str());
+    auto rekeyed = std::make_shared<LatencyTracker>();
+    rekeyed->load(dir);
+    CHECK_EQ(rekeyed->timeoutsFor("visited.example", 20000).connect_ms, uint64_t(20000));
+    rekeyed->save();
+    CHECK(readFile(dir + "/nitrotor-latency.txt").empty());
+
+    std::remove((dir + "/nitrotor-latency.txt").c_str());
+    std::remove((dir + "/nitrotor-latency.key").c_str());
+    rmdir(dir.c_str());
+  }
+} // namespace
+
+int main() {
+  run("timeouts", testTimeouts);
+  run("save and load", testRoundTrip);
+  return margelo::nitro::nitrotor::test::result();
+}
@@ -0,0 +1,116 @@
+#include "OnionKeyGenerator.hpp"
+#include "TestSupport.hpp"
+#include <future>
+#include <string>
+#include <vector>
+
+// Checks the ed25519 and onion address code against values computed independently of it. The
+// fake tor_ffi derives addresses with the same code, so round trips through it prove nothing.
+
+using namespace margelo::nitro::nitrotor;
+using margelo::nitro::nitrotor::test::run;
+
+namespace {
+  std::string toHex(const uint8_t *data, size_t size) {
+    static constexpr char kDigits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < size; i++) {
+      hex.push_back(kDigits[data[i] >> 4]);
+      hex.push_back(kDigits[data[i] & 15]);
+    }
+    return hex;
+  }
+
+  std::string toHex(const Ed25519::PublicKey &key) { return toHex(key.data(), key.size()); }
+
+  OnionKey fromHex(const std::string &hex) {
+    OnionKey key{};
+    for (size_t i = 0; i < key.size() && 2 * i + 1 < hex.size(); i++) {
+      key[i] = static_cast<uint8_t>(std::stoi(hex.substr(2 * i, 2), nullptr, 16));
+    }
+    return key;
+  }
+
+  // RFC 8032 section 7.1, test 1: the expanded form (clamped SHA-512) of secret key 9d61b19d...
+  const OnionKey kRfcKey =
+      fromHex("307c83864f2833cb427a2ef1c00a013cfdff2768d980c0a3a520f006904de94f"
+              "9b4f0afe280b746a778684e75442502057b7473a03f08f96f5a38e9287e01f8f");
+  const std::string kRfcPublicKey =
+      "d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a";
+
+  void testPublicKey() {
+    CHECK_EQ(toHex(Ed25519::publicKey(kRfcKey.data())), kRfcPublicKey);
+    CHECK_EQ(toHex(onionPublicKey(kRfcKey.data())), kRfcPublicKey);
+    CHECK_EQ(onionAddress(onionPublicKey(kRfcKey.data())),
+             std::string("25njqamcweflpvkl73j4szahhihoc4xt3ktcgjnpaingr5yhkenl5sid.onion"));
+
+    auto unclamped = kRfcKey;
+    unclamped[0] |= 1;
+    bool threw = false;
+    try {
+      onionPublicKey(unclamped.data());
+    } catch (const std::invalid_argument &) {
+      threw = true;
+    }
+    CHECK(threw);
+  }
+
+  // (s + 8k) * B for the scalar s of the RFC key, computed with textbook affine arithmetic.
+  void testPointWalk() {
+    Ed25519::PointWalk walk(kRfcKey.data(), 256);
+    auto first = walk.next();
+    CHECK_EQ(toHex(first[0]), kRfcPublicKey);
+    CHECK_EQ(toHex(first[1]),
+             std::string("de9b48dd25f66fd0268352df84ab61bb9e3685a09f71f1a6821d75ed2f9d70b3"));
+    CHECK_EQ(toHex(first[2]),
+             std::string("4896c0ccb4b2a8520217320fd291d8ee240f6c03ac4e631e6ebfc4cd78b3e5a4"));
+    CHECK_EQ(toHex(first[255]),
+             std::string("81317dcc54bf7f1daf446a27322b3ee177d0e2aeeb610684288570629b77181b"));
+    CHECK_EQ(toHex(walk.next()[0]),
+             std::string("2e05b069894a54f60fcd83d2f20ef6aafc4640abe48bad83fccf7343e285373a"));
+    walk.next();
+    CHECK_EQ(toHex(walk.next()[1000 - 3 * 256]),
+             std::string("d8fdc11c2a9b24b6b8d657f34465308edd087904960711fee80292c7d72e110f"));
+  }
+
+  // Found keys are rebuilt from the walk's start scalar and step, each one has to derive the
+  // address it was reported with.
+  void testVanitySearch() {
+    VanitySearchParams params;
+    params.prefix = "ab";
+    params.count = 3;
+    params.threads = 2;
+    auto search = std::make_shared<VanitySearch>(params);
+    auto done = std::make_shared<std::promise<std::vector<OnionKeyPair>>>();
+    search->start(nullptr, [done](std::vector<OnionKeyPair> &&pairs) {
+      done->set_value(std::move(pairs));
+    });
+    auto future = done->get_future();
+    CHECK(future.wait_for(std::chrono::seconds(60)) == std::future_status::ready);
+    auto pairs = future.get();
+    CHECK_EQ(pairs.size(), size_t(3));
+    for (const auto &pair : pairs) {
+      CHECK_EQ(pair.onion_address.rfind("ab", 0), size_t(0));
+      const auto *key = pair.key_data->data();
+      auto public_key = onionPublicKey(key);
+      CHECK_EQ(onionAddress(public_key), pair.onion_address);
+      CHECK_EQ(toHex(pair.public_key->data(), pair.public_key->size()), toHex(public_key));
+    }
+
+    bool threw = false;
+    try {
+      params.prefix = "ab1";
+      VanitySearch invalid(params);
+    } catch (const std::invalid_argument &) {
+      threw = true;
+    }
+    CHECK(threw);
+  }
+} // namespace
+
+int main() {
+  run("public key", testPublicKey);
+  run("point walk", testPointWalk);
+  run("vanity search", testVanitySearch);
+  return margelo::nitro::nitrotor::test::result();
+}
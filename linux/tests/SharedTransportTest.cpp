@@ -0,0 +1,288 @@
+#include "ResponseArena.hpp"
+#include "SharedTransport.hpp"
+#include "TestSupport.hpp"
+#include "fake_tor_ffi.h"
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Exercises the shared memory rings directly, then ShmChannel and the transport between two
+// processes. Forked children report through their exit status: the number of failed checks.
+
+using namespace margelo::nitro::nitrotor;
+using margelo::nitro::nitrotor::test::run;
+
+namespace {
+  std::string pattern(size_t size, size_t seed) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+      data[i] = static_cast<char>((i * 31 + seed * 7 + i / 257) & 0xff);
+    }
+    return data;
+  }
+
+  bool publish(ShmRing &ring, const std::string &payload) {
+    char *out = ring.reserve(static_cast<uint32_t>(payload.size()));
+    if (out == nullptr) {
+      return false;
+    }
+    std::memcpy(out, payload.data(), payload.size());
+    ring.commit(0);
+    return true;
+  }
+
+  std::string consume(ShmRing &ring, const char **data = nullptr) {
+    auto record = ring.peek();
+    if (!record.has_value()) {
+      return "<empty>";
+    }
+    if (data != nullptr) {
+      *data = record->data;
+    }
+    std::string payload(record->data, record->length);
+    ring.release();
+    return payload;
+  }
+
+  // Runs `child` in a forked process, which exits with its result.
+  pid_t spawn(const std::function<int()> &child) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      _exit(child());
+    }
+    return pid;
+  }
+
+  // Exit status of a spawned child, -1 if it did not exit normally.
+  int reap(pid_t pid) {
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+      return -1;
+    }
+    return WEXITSTATUS(status);
+  }
+
+  // Messages received by a channel, waited for by the test.
+  struct Inbox {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::string> messages;
+    bool closed = false;
+
+    bool waitFor(size_t count) {
+      std::unique_lock<std::mutex> lock(mutex);
+      return changed.wait_for(lock, std::chrono::seconds(20),
+                              [&]() { return messages.size() >= count || closed; }) &&
+             messages.size() >= count;
+    }
+  };
+
+  void startChannel(ShmChannel &channel, const std::shared_ptr<Inbox> &inbox) {
+    channel.start(
+        [inbox](std::string_view message) {
+          std::lock_guard<std::mutex> lock(inbox->mutex);
+          inbox->messages.emplace_back(message);
+          inbox->changed.notify_all();
+        },
+        [inbox]() {
+          std::lock_guard<std::mutex> lock(inbox->mutex);
+          inbox->closed = true;
+          inbox->changed.notify_all();
+        });
+  }
+
+  ShmChannel::Outgoing outgoing(std::string message) {
+    auto owner = std::make_shared<std::string>(std::move(message));
+    return ShmChannel::Outgoing{{*owner}, owner};
+  }
+
+  void testRingWrapAndPadding() {
+    auto region = ShmRegion::create(64 * 1024, "/tmp");
+    // Two views of the same ring, one per side.
+    auto producer = region.requests();
+    auto consumer = region.requests();
+    CHECK_EQ(producer.maxRecord(), uint32_t(32 * 1024 - 8));
+
+    const char *start = nullptr;
+    CHECK(publish(producer, pattern(20000, 0)));
+    CHECK(publish(producer, pattern(20000, 1)));
+    CHECK(publish(producer, pattern(20000, 2)));
+    // 5512 bytes are left before the end: the fourth record only fits at the start, once the
+    // first one was released.
+    CHECK(!publish(producer, pattern(20000, 3)));
+    CHECK(consume(consumer, &start) == pattern(20000, 0));
+    CHECK(publish(producer, pattern(20000, 3)));
+    CHECK(!publish(producer, pattern(8, 4)));
+
+    CHECK(consume(consumer) == pattern(20000, 1));
+    CHECK(consume(consumer) == pattern(20000, 2));
+    const char *wrapped = nullptr;
+    CHECK(consume(consumer, &wrapped) == pattern(20000, 3));
+    CHECK(wrapped == start);
+    CHECK_EQ(consume(consumer), std::string("<empty>"));
+
+    // Many wraps with odd sizes, records of the largest size included.
+    for (size_t i = 0; i < 500; i++) {
+      size_t size = i % 7 == 0 ? producer.maxRecord() : (i * 997) % 30000;
+      CHECK(publish(producer, pattern(size, i)));
+      CHECK(consume(consumer) == pattern(size, i));
+    }
+  }
+
+  void testRingDoorbells() {
+    auto region = ShmRegion::create(64 * 1024, "/tmp");
+    auto producer = region.requests();
+    auto consumer = region.requests();
+
+    // A consumer announcing sleep on an empty ring needs exactly one doorbell.
+    CHECK(consumer.sleepAsConsumer());
+    char *out = producer.reserve(16);
+    CHECK(out != nullptr);
+    CHECK(producer.commit(0));
+    producer.reserve(16);
+    CHECK(!producer.commit(0));
+    // With records pending it withdraws instead of sleeping.
+    CHECK(!consumer.sleepAsConsumer());
+    consume(consumer);
+    consume(consumer);
+
+    // A producer sleeping on a full ring is rung by the release that makes room.
+    while (publish(producer, pattern(10000, 0))) {
+    }
+    CHECK(producer.sleepAsProducer(10000));
+    CHECK(consumer.peek().has_value());
+    CHECK(consumer.release());
+    CHECK(consumer.peek().has_value());
+    CHECK(!consumer.release());
+    CHECK(!producer.sleepAsProducer(10000));
+  }
+
+  void testCorruptedRing() {
+    auto region = ShmRegion::create(64 * 1024, "/tmp");
+    auto producer = region.requests();
+    auto consumer = region.requests();
+    char *out = producer.reserve(8);
+    producer.commit(0);
+    uint32_t length = 1 << 30;
+    std::memcpy(out - 8, &length, sizeof(length));
+    bool threw = false;
+    try {
+      consumer.peek();
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    CHECK(threw);
+  }
+
+  // An echo peer in a child process: round trips make both sides sleep between messages, so
+  // every message depends on doorbells crossing the process boundary, and messages larger than
+  // a record wrap the 64 KiB rings as fragments.
+  void testChannelAcrossFork() {
+    auto region = ShmRegion::create(64 * 1024, "/tmp");
+    int sockets[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+    pid_t child = spawn([&]() {
+      ::close(sockets[0]);
+      auto channel =
+          std::make_shared<ShmChannel>(sockets[1], ShmRegion::attach(dup(region.fd())), false);
+      auto closed = std::make_shared<std::promise<void>>();
+      std::weak_ptr<ShmChannel> weak = channel;
+      channel->start(
+          [weak](std::string_view message) {
+            if (auto channel = weak.lock()) {
+              channel->send(outgoing(std::string(message)));
+            }
+          },
+          [closed]() { closed->set_value(); });
+      closed->get_future().wait();
+      return 0;
+    });
+    ::close(sockets[1]);
+
+    auto channel = std::make_shared<ShmChannel>(sockets[0], std::move(region), true);
+    auto inbox = std::make_shared<Inbox>();
+    startChannel(*channel, inbox);
+    std::vector<std::string> sent;
+    for (size_t i = 0; i < 60; i++) {
+      sent.push_back(pattern(i % 3 == 0 ? 100000 + i : i * 101, i));
+      CHECK(channel->send(outgoing(sent.back())));
+      CHECK(inbox->waitFor(sent.size()));
+    }
+    // A burst that fills the rings, with both sides waiting for room.
+    for (size_t i = 60; i < 160; i++) {
+      sent.push_back(pattern((i * 7919) % 50000, i));
+      channel->send(outgoing(sent.back()));
+    }
+    CHECK(inbox->waitFor(sent.size()));
+    {
+      std::lock_guard<std::mutex> lock(inbox->mutex);
+      CHECK(inbox->messages == sent);
+    }
+
+    channel->close();
+    CHECK_EQ(reap(child), 0);
+  }
+
+  void onResponse(void *context, tor::TOR_CHttpResponse response) {
+    auto *result = static_cast<std::promise<std::string> *>(context);
+    result->set_value(std::to_string(response.status_code) + " " +
+                      std::string(arenaString(response.arena, response.body)) +
+                      std::string(arenaString(response.arena, response.error)));
+  }
+
+  // Requests from a client process, executed by the fake in the owner process. Bodies larger
+  // than the rings are fragmented in both directions.
+  void testTransportAcrossFork() {
+    tor::fake_tor_reset();
+    std::string path = "/tmp/nitrotor-transport-" + std::to_string(getpid()) + ".sock";
+    auto server = SharedTransportServer::listen(path, 64 * 1024);
+
+    pid_t child = spawn([&]() {
+      int failed = 0;
+      auto client = SharedTransportClient::connect(path, 5000);
+      for (size_t round = 0; round < 3; round++) {
+        std::vector<std::string> bodies;
+        std::vector<std::promise<std::string>> results(8);
+        for (size_t i = 0; i < results.size(); i++) {
+          bodies.push_back(pattern(i * 30011 % 200000, round * 8 + i));
+          for (auto &byte : bodies.back()) {
+            byte = static_cast<char>('a' + static_cast<uint8_t>(byte) % 26);
+          }
+          tor::TOR_HttpRequest request{"POST", "http://echo.onion/", "{}",
+                                       bodies.back().c_str(), 5000, 0, 0, false, 0, nullptr,
+                                       nullptr};
+          client->submit(request, &onResponse, &results[i]);
+        }
+        for (size_t i = 0; i < results.size(); i++) {
+          failed += results[i].get_future().get() == "200 " + bodies[i] ? 0 : 1;
+        }
+      }
+      client->disconnect();
+      return failed;
+    });
+
+    CHECK_EQ(reap(child), 0);
+    server->stop();
+    CHECK(tor::fake_tor_wait_idle(5000));
+    tor::FAKE_Stats stats;
+    tor::fake_tor_stats(&stats);
+    CHECK_EQ(stats.http_requests, 24ULL);
+    CHECK_EQ(stats.live_strings, 0LL);
+  }
+} // namespace
+
+int main() {
+  run("ring wrap and padding", testRingWrapAndPadding);
+  run("ring doorbells", testRingDoorbells);
+  run("corrupted ring", testCorruptedRing);
+  run("channel across fork", testChannelAcrossFork);
+  run("transport across fork", testTransportAcrossFork);
+  return margelo::nitro::nitrotor::test::result();
+}
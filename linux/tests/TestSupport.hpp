@@ -0,0 +1,78 @@
+#pragma once
+#include "Checks.hpp"
+#include <NitroModules/Promise.hpp>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// Promise helpers for the tests of Nitro objects, on top of Checks.hpp.
+namespace margelo::nitro::nitrotor::test {
+  // Waits for `promise` to settle. Returns its value, or nullopt with `error` set when it was
+  // rejected or did not settle within `timeout`.
+  template <typename T>
+  std::optional<T> settle(const std::shared_ptr<Promise<T>> &promise, std::string &error,
+                          std::chrono::milliseconds timeout = std::chrono::seconds(10)) {
+    auto done = std::make_shared<std::promise<std::optional<T>>>();
+    auto message = std::make_shared<std::string>();
+    promise->addOnResolvedListener([done](const T &value) { done->set_value(value); });
+    promise->addOnRejectedListener([done, message](const std::exception_ptr &exception) {
+      try {
+        std::rethrow_exception(exception);
+      } catch (const std::exception &e) {
+        *message = e.what();
+      } catch (...) {
+        *message = "unknown exception";
+      }
+      done->set_value(std::nullopt);
+    });
+    auto future = done->get_future();
+    if (future.wait_for(timeout) != std::future_status::ready) {
+      error = "timed out";
+      return std::nullopt;
+    }
+    auto value = future.get();
+    error = *message;
+    return value;
+  }
+
+  inline bool settle(const std::shared_ptr<Promise<void>> &promise, std::string &error,
+                     std::chrono::milliseconds timeout = std::chrono::seconds(10)) {
+    auto done = std::make_shared<std::promise<bool>>();
+    auto message = std::make_shared<std::string>();
+    promise->addOnResolvedListener([done]() { done->set_value(true); });
+    promise->addOnRejectedListener([done, message](const std::exception_ptr &exception) {
+      try {
+        std::rethrow_exception(exception);
+      } catch (const std::exception &e) {
+        *message = e.what();
+      } catch (...) {
+        *message = "unknown exception";
+      }
+      done->set_value(false);
+    });
+    auto future = done->get_future();
+    if (future.wait_for(timeout) != std::future_status::ready) {
+      error = "timed out";
+      return false;
+    }
+    error = *message;
+    return future.get();
+  }
+} // namespace margelo::nitro::nitrotor::test
+
+// Settles a promise and fails the test case on rejection. Evaluates to the resolved value.
+#define AWAIT(promise)                                                                            \
+  ([&]() {                                                                                        \
+    std::string await_error;                                                                      \
+    auto await_value = ::margelo::nitro::nitrotor::test::settle((promise), await_error);          \
+    if (!await_value) {                                                                           \
+      ::margelo::nitro::nitrotor::test::fail(__FILE__, __LINE__,                                 \
+                                             "AWAIT(" #promise ") failed: " + await_error);     \
+      throw std::runtime_error("promise did not resolve");                                        \
+    }                                                                                             \
+    return std::move(*await_value);                                                               \
+  }())
@@ -0,0 +1,83 @@
+#include "TestSupport.hpp"
+#include "TrafficShaper.hpp"
+#include <future>
+#include <memory>
+#include <string>
+
+using namespace margelo::nitro::nitrotor;
+using margelo::nitro::nitrotor::test::run;
+
+namespace {
+  // One slot, interactive and bulk backlogged: stride scheduling admits 16 interactive attempts
+  // per bulk one. Each admission is released right away, which admits the next.
+  void testWeightedAdmission() {
+    auto shaper = std::make_shared<TrafficShaper>();
+    BandwidthLimits one_slot{};
+    one_slot.max_concurrent_requests = 1;
+    shaper->setLimits(one_slot);
+
+    std::string order;
+    shaper->submit(PriorityClass::NORMAL, [&order]() { order += 'N'; });
+    CHECK_EQ(order, std::string("N"));
+    for (int i = 0; i < 40; i++) {
+      shaper->submit(PriorityClass::INTERACTIVE, [&order]() { order += 'I'; });
+    }
+    for (int i = 0; i < 10; i++) {
+      shaper->submit(PriorityClass::BULK, [&order]() { order += 'B'; });
+    }
+    CHECK_EQ(order, std::string("N"));
+
+    shaper->release(PriorityClass::NORMAL);
+    while (order.size() < 37) {
+      shaper->release(order.back() == 'I' ? PriorityClass::INTERACTIVE : PriorityClass::BULK);
+    }
+    auto cycle = std::string(16, 'I') + "B";
+    CHECK_EQ(order, "NIB" + cycle + cycle);
+
+    auto stats = shaper->stats();
+    CHECK_EQ(stats.interactive.queued, 40.0 - 33);
+    CHECK_EQ(stats.bulk.queued, 10.0 - 3);
+  }
+
+  // A class in debt is held back without blocking the others, and pumped again by itself once
+  // its bucket recovered.
+  void testDebtRepump() {
+    auto shaper = std::make_shared<TrafficShaper>();
+    BandwidthLimits rates{};
+    rates.bulk_bytes_per_sec = 10000;
+    shaper->setLimits(rates);
+
+    bool first = false;
+    shaper->submit(PriorityClass::BULK, [&first]() { first = true; });
+    CHECK(first);
+    // 2000 bytes over the one second burst: 200 ms until bulk admits again.
+    shaper->finish(PriorityClass::BULK, 2000, 10000);
+
+    auto admitted = std::make_shared<std::promise<TrafficShaper::Clock::time_point>>();
+    auto queued_at = TrafficShaper::Clock::now();
+    shaper->submit(PriorityClass::BULK,
+                   [admitted]() { admitted->set_value(TrafficShaper::Clock::now()); });
+    CHECK_EQ(shaper->stats().bulk.queued, 1.0);
+
+    bool interactive = false;
+    shaper->submit(PriorityClass::INTERACTIVE, [&interactive]() { interactive = true; });
+    CHECK(interactive);
+    shaper->finish(PriorityClass::INTERACTIVE, 0, 0);
+
+    auto future = admitted->get_future();
+    bool ready = future.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+    CHECK(ready);
+    if (ready) {
+      auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(future.get() - queued_at);
+      CHECK(waited.count() >= 150);
+    }
+    CHECK_EQ(shaper->stats().bulk.queued, 0.0);
+    shaper->finish(PriorityClass::BULK, 0, 0);
+  }
+} // namespace
+
+int main() {
+  run("weighted admission", testWeightedAdmission);
+  run("debt repump", testDebtRepump);
+  return margelo::nitro::nitrotor::test::result();
+}
@@ -0,0 +1,530 @@
+#include "Base64.hpp"
+#include "Sha1.hpp"
+#include "TestSupport.hpp"
+#include "WebSocket.hpp"
+#include "fake_tor_ffi.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+// Runs WebSocketClient against an echo server on 127.0.0.1, reached through the fake's plain TCP
+// `open_stream_async`. The server checks what the client puts on the wire: the handshake, masked
+// and fragmented frames and compressed messages.
+
+using namespace margelo::nitro::nitrotor;
+using margelo::nitro::nitrotor::test::run;
+
+namespace {
+  constexpr size_t kServerFragment = 5000;
+
+  // What the server saw, read by the test once the connection closed.
+  struct ServerLog {
+    std::string request_line;
+    std::string test_header;
+    bool deflate = false;
+    int client_frames = 0;
+    int compressed_frames = 0;
+    bool unmasked_frame = false;
+    int close_code = 0;
+    std::string close_reason;
+  };
+
+  std::string rawDeflate(const std::string &message) {
+    z_stream stream{};
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&stream, message.size()) + 16, '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(message.data()));
+    stream.avail_in = static_cast<uInt>(message.size());
+    stream.next_out = reinterpret_cast<Bytef *>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    deflate(&stream, Z_SYNC_FLUSH);
+    out.resize(out.size() - stream.avail_out);
+    deflateEnd(&stream);
+    // RFC 7692 section 7.2.1: the trailing empty block is left out.
+    out.resize(out.size() - 4);
+    return out;
+  }
+
+  std::string rawInflate(std::string message) {
+    message.append("\x00\x00\xff\xff", 4);
+    z_stream stream{};
+    inflateInit2(&stream, -15);
+    stream.next_in = reinterpret_cast<Bytef *>(message.data());
+    stream.avail_in = static_cast<uInt>(message.size());
+    std::string out;
+    char buffer[16384];
+    int status = Z_OK;
+    while (status == Z_OK && (stream.avail_in > 0 || stream.avail_out == 0)) {
+      stream.next_out = reinterpret_cast<Bytef *>(buffer);
+      stream.avail_out = sizeof(buffer);
+      status = inflate(&stream, Z_SYNC_FLUSH);
+      out.append(buffer, sizeof(buffer) - stream.avail_out);
+    }
+    inflateEnd(&stream);
+    return out;
+  }
+
+  class EchoServer {
+  public:
+    EchoServer() {
+      _listen = socket(AF_INET, SOCK_STREAM, 0);
+      sockaddr_in address{};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t length = sizeof(address);
+      if (bind(_listen, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+          listen(_listen, 8) != 0 ||
+          getsockname(_listen, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+        throw std::runtime_error("Failed to start the echo server");
+      }
+      _port = ntohs(address.sin_port);
+      _thread = std::thread([this]() { serve(); });
+    }
+
+    ~EchoServer() {
+      shutdown(_listen, SHUT_RDWR);
+      ::close(_listen);
+      _thread.join();
+    }
+
+    std::string url(const std::string &path) const {
+      return "ws://127.0.0.1:" + std::to_string(_port) + path;
+    }
+
+    // Log of the last connection, once the server closed it.
+    ServerLog waitForLog() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _done.wait_for(lock, std::chrono::seconds(10), [this]() { return _finished; });
+      _finished = false;
+      return _log;
+    }
+
+  private:
+    void serve() {
+      while (true) {
+        int fd = accept(_listen, nullptr, nullptr);
+        if (fd < 0) {
+          return;
+        }
+        ServerLog log;
+        handle(fd, log);
+        ::close(fd);
+        std::lock_guard<std::mutex> lock(_mutex);
+        _log = log;
+        _finished = true;
+        _done.notify_all();
+      }
+    }
+
+    static bool readExactly(int fd, std::string &buffer, size_t size) {
+      char chunk[16384];
+      while (buffer.size() < size) {
+        auto count = recv(fd, chunk, sizeof(chunk), 0);
+        if (count <= 0) {
+          return false;
+        }
+        buffer.append(chunk, static_cast<size_t>(count));
+      }
+      return true;
+    }
+
+    static void writeFrame(int fd, uint8_t first_byte, const std::string &payload) {
+      std::string frame(1, static_cast<char>(first_byte));
+      if (payload.size() < 126) {
+        frame.push_back(static_cast<char>(payload.size()));
+      } else {
+        frame.push_back(126);
+        frame.push_back(static_cast<char>(payload.size() >> 8));
+        frame.push_back(static_cast<char>(payload.size() & 0xff));
+      }
+      frame += payload;
+      (void)!send(fd, frame.data(), frame.size(), MSG_NOSIGNAL);
+    }
+
+    // Echoes `message` in fragments of kServerFragment bytes.
+    static void echo(int fd, uint8_t opcode, std::string message, bool compress) {
+      if (compress) {
+        message = rawDeflate(message);
+      }
+      size_t offset = 0;
+      do {
+        size_t length = std::min(kServerFragment, message.size() - offset);
+        bool last = offset + length == message.size();
+        uint8_t first_byte = offset == 0 ? opcode : 0;
+        if (offset == 0 && compress) {
+          first_byte |= 0x40;
+        }
+        writeFrame(fd, static_cast<uint8_t>(first_byte | (last ? 0x80 : 0)),
+                   message.substr(offset, length));
+        offset += length;
+      } while (offset < message.size());
+    }
+
+    void handle(int fd, ServerLog &log) {
+      std::string in;
+      size_t header_end;
+      while ((header_end = in.find("\r\n\r\n")) == std::string::npos) {
+        if (!readExactly(fd, in, in.size() + 1)) {
+          return;
+        }
+      }
+      std::string request = in.substr(0, header_end + 2);
+      in.erase(0, header_end + 4);
+      log.request_line = request.substr(0, request.find("\r\n"));
+
+      std::string key, protocols, extensions;
+      for (size_t position = request.find("\r\n") + 2; position < request.size();) {
+        auto end = request.find("\r\n", position);
+        auto line = request.substr(position, end - position);
+        position = end + 2;
+        auto colon = line.find(": ");
+        auto name = line.substr(0, colon), value = line.substr(colon + 2);
+        if (name == "Sec-WebSocket-Key") {
+          key = value;
+        } else if (name == "Sec-WebSocket-Protocol") {
+          protocols = value;
+        } else if (name == "Sec-WebSocket-Extensions") {
+          extensions = value;
+        } else if (name == "X-Test") {
+          log.test_header = value;
+        }
+      }
+      auto digest = sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+      std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                             "Connection: Upgrade\r\nSec-WebSocket-Accept: " +
+                             base64Encode(digest.data(), digest.size()) + "\r\n";
+      if (protocols.find("chat") != std::string::npos) {
+        response += "Sec-WebSocket-Protocol: chat\r\n";
+      }
+      log.deflate = extensions.rfind("permessage-deflate", 0) == 0;
+      if (log.deflate) {
+        response += "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; "
+                    "client_no_context_takeover\r\n";
+      }
+      response += "\r\n";
+      (void)!send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+
+      std::string message;
+      uint8_t message_opcode = 0;
+      bool compressed = false;
+      while (true) {
+        if (!readExactly(fd, in, 2)) {
+          return;
+        }
+        auto *bytes = reinterpret_cast<const uint8_t *>(in.data());
+        bool fin = bytes[0] & 0x80;
+        uint8_t opcode = bytes[0] & 0x0f;
+        log.unmasked_frame |= (bytes[1] & 0x80) == 0;
+        size_t length = bytes[1] & 0x7f, header = 2;
+        if (length == 126) {
+          if (!readExactly(fd, in, 4)) {
+            return;
+          }
+          length = static_cast<size_t>(static_cast<uint8_t>(in[2])) << 8 |
+                   static_cast<uint8_t>(in[3]);
+          header = 4;
+        } else if (length == 127) {
+          if (!readExactly(fd, in, 10)) {
+            return;
+          }
+          length = 0;
+          for (int i = 0; i < 8; i++) {
+            length = length << 8 | static_cast<uint8_t>(in[2 + i]);
+          }
+          header = 10;
+        }
+        if (!readExactly(fd, in, header + 4 + length)) {
+          return;
+        }
+        const char *mask = in.data() + header;
+        std::string payload = in.substr(header + 4, length);
+        for (size_t i = 0; i < payload.size(); i++) {
+          payload[i] ^= mask[i & 3];
+        }
+        bool rsv1 = in[0] & 0x40;
+        in.erase(0, header + 4 + length);
+
+        if (opcode == 0x8) {
+          log.close_code = payload.size() >= 2 ? static_cast<uint8_t>(payload[0]) << 8 |
+                                                     static_cast<uint8_t>(payload[1])
+                                               : 1005;
+          log.close_reason = payload.size() > 2 ? payload.substr(2) : "";
+          writeFrame(fd, 0x88, payload.substr(0, 2));
+          return;
+        }
+        log.client_frames++;
+        log.compressed_frames += rsv1 ? 1 : 0;
+        if (opcode != 0) {
+          message_opcode = opcode;
+          compressed = rsv1;
+        }
+        message += payload;
+        if (!fin) {
+          continue;
+        }
+        if (compressed) {
+          message = rawInflate(std::move(message));
+        }
+        if (message == "close-me") {
+          writeFrame(fd, 0x88, std::string("\x0f\xa0", 2) + "bye");
+        } else {
+          echo(fd, message_opcode, std::move(message), log.deflate);
+        }
+        message.clear();
+      }
+    }
+
+    int _listen = -1;
+    uint16_t _port = 0;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _done;
+    bool _finished = false;
+    ServerLog _log;
+  };
+
+  // Records the listener events and lets the test wait for them.
+  class Recorder : public WebSocketListener {
+  public:
+    void onOpen(const std::string &protocol, const std::string &extensions) override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _protocol = protocol;
+      _extensions = extensions;
+      _opened = true;
+      _changed.notify_all();
+    }
+
+    void onConnectFailed(const std::string &error) override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _error = error;
+      _closed = true;
+      _changed.notify_all();
+    }
+
+    void onText(std::string &&message) override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _messages.push_back(std::move(message));
+      _changed.notify_all();
+    }
+
+    void onBinary(std::string &&data) override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _messages.push_back(std::move(data));
+      _changed.notify_all();
+    }
+
+    void onDrain() override {}
+
+    void onClose(uint16_t code, const std::string &reason, bool clean) override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closeCode = code;
+      _closeReason = reason;
+      _clean = clean;
+      _closed = true;
+      _changed.notify_all();
+    }
+
+    bool waitOpen() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      return _changed.wait_for(lock, std::chrono::seconds(10),
+                               [this]() { return _opened || _closed; }) &&
+             _opened;
+    }
+
+    std::string nextMessage() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      if (!_changed.wait_for(lock, std::chrono::seconds(10),
+                             [this]() { return !_messages.empty() || _closed; }) ||
+          _messages.empty()) {
+        throw std::runtime_error("no message arrived");
+      }
+      auto message = std::move(_messages.front());
+      _messages.erase(_messages.begin());
+      return message;
+    }
+
+    bool waitClosed() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      return _changed.wait_for(lock, std::chrono::seconds(10), [this]() { return _closed; });
+    }
+
+    std::string _protocol, _extensions, _error, _closeReason;
+    uint16_t _closeCode = 0;
+    bool _clean = false;
+
+  private:
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::vector<std::string> _messages;
+    bool _opened = false;
+    bool _closed = false;
+  };
+
+  WebSocketOptions options(const std::string &url, bool deflate = false) {
+    return WebSocketOptions{url, "", {}, deflate, 5000, 0, 0, 16 * 1024 * 1024, 1024 * 1024};
+  }
+
+  std::pair<std::shared_ptr<WebSocketClient>, std::shared_ptr<Recorder>>
+  open(WebSocketOptions options) {
+    auto recorder = std::make_shared<Recorder>();
+    auto client = std::make_shared<WebSocketClient>(std::move(options), recorder);
+    client->connect();
+    if (!recorder->waitOpen()) {
+      throw std::runtime_error("WebSocket did not open: " + recorder->_error);
+    }
+    return {client, recorder};
+  }
+
+  std::string pattern(size_t size) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+      data[i] = static_cast<char>((i * 7 + i / 251) & 0xff);
+    }
+    return data;
+  }
+
+  unsigned long long allocations() {
+    tor::fake_tor_wait_idle(5000);
+    tor::FAKE_Stats stats;
+    tor::fake_tor_stats(&stats);
+    return stats.allocations;
+  }
+
+  // A successful stream costs no allocation for its result.
+  void testHandshake() {
+    auto before = allocations();
+    EchoServer server;
+    auto settings = options(server.url("/socket?room=1"));
+    settings.headers = R"({"X-Test":"yes"})";
+    settings.protocols = {"superchat", "chat"};
+    auto [client, recorder] = open(settings);
+    CHECK_EQ(recorder->_protocol, std::string("chat"));
+    CHECK_EQ(recorder->_extensions, std::string(""));
+    client->send(false, "hello");
+    CHECK_EQ(recorder->nextMessage(), std::string("hello"));
+    client->close(1000, "done");
+    CHECK(recorder->waitClosed());
+
+    auto log = server.waitForLog();
+    CHECK_EQ(log.request_line, std::string("GET /socket?room=1 HTTP/1.1"));
+    CHECK_EQ(log.test_header, std::string("yes"));
+    CHECK(!log.unmasked_frame);
+    CHECK_EQ(allocations() - before, 0ULL);
+  }
+
+  // The failed stream's error costs one arena.
+  void testStreamFailure() {
+    auto before = allocations();
+    tor::fake_tor_set_stream_error("stream refused", tor::TOR_HttpErrorKind::Connect);
+    auto recorder = std::make_shared<Recorder>();
+    auto client = std::make_shared<WebSocketClient>(options("ws://example.onion/"), recorder);
+    client->connect();
+    CHECK(recorder->waitClosed());
+    CHECK_EQ(recorder->_error, std::string("stream refused"));
+    CHECK(client->state() == WebSocketClient::State::Closed);
+    CHECK_EQ(allocations() - before, 1ULL);
+    tor::fake_tor_set_stream_error(nullptr, tor::TOR_HttpErrorKind::None);
+  }
+
+  void testFragmentation() {
+    EchoServer server;
+    auto [client, recorder] = open(options(server.url("/")));
+    auto payload = pattern(100 * 1024);
+    client->send(true, std::string(payload));
+    CHECK(recorder->nextMessage() == payload);
+    client->close(1000, "");
+    CHECK(recorder->waitClosed());
+
+    // 16 KiB client fragments, the echo arrived in 5000 byte server fragments.
+    auto log = server.waitForLog();
+    CHECK_EQ(log.client_frames, 7);
+    CHECK_EQ(log.compressed_frames, 0);
+    CHECK(!log.unmasked_frame);
+  }
+
+  void testPermessageDeflate() {
+    EchoServer server;
+    auto [client, recorder] = open(options(server.url("/"), true));
+    CHECK(recorder->_extensions.rfind("permessage-deflate", 0) == 0);
+    std::string text;
+    while (text.size() < 200 * 1024) {
+      text += "onion routing over tor, ";
+    }
+    client->send(false, std::string(text));
+    CHECK(recorder->nextMessage() == text);
+    // Below the compression threshold, and incompressible data larger than a fragment.
+    client->send(false, "short");
+    CHECK_EQ(recorder->nextMessage(), std::string("short"));
+    auto noise = pattern(40 * 1024);
+    client->send(true, std::string(noise));
+    CHECK(recorder->nextMessage() == noise);
+    client->close(1000, "");
+    CHECK(recorder->waitClosed());
+
+    auto log = server.waitForLog();
+    CHECK(log.deflate);
+    CHECK_EQ(log.compressed_frames, 2);
+  }
+
+  void testClose() {
+    EchoServer server;
+    auto [client, recorder] = open(options(server.url("/")));
+    client->send(false, "close-me");
+    CHECK(recorder->waitClosed());
+    CHECK_EQ(recorder->_closeCode, uint16_t(4000));
+    CHECK_EQ(recorder->_closeReason, std::string("bye"));
+    CHECK(recorder->_clean);
+    CHECK_EQ(server.waitForLog().close_code, 4000);
+
+    auto [second, second_recorder] = open(options(server.url("/")));
+    second->close(4001, "done");
+    CHECK(second_recorder->waitClosed());
+    CHECK_EQ(second_recorder->_closeCode, uint16_t(4001));
+    CHECK(second_recorder->_clean);
+    CHECK(second->state() == WebSocketClient::State::Closed);
+    auto log = server.waitForLog();
+    CHECK_EQ(log.close_code, 4001);
+    CHECK_EQ(log.close_reason, std::string("done"));
+    bool threw = false;
+    try {
+      second->send(false, "late");
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    CHECK(threw);
+  }
+
+  void testMessageTooBig() {
+    EchoServer server;
+    auto settings = options(server.url("/"));
+    settings.max_message_bytes = 1000;
+    auto [client, recorder] = open(settings);
+    client->send(true, pattern(2000));
+    CHECK(recorder->waitClosed());
+    CHECK_EQ(recorder->_closeCode, uint16_t(1009));
+    CHECK(!recorder->_clean);
+  }
+} // namespace
+
+int main() {
+  run("handshake", testHandshake);
+  run("stream failure", testStreamFailure);
+  run("fragmentation", testFragmentation);
+  run("permessage-deflate", testPermessageDeflate);
+  run("close", testClose);
+  run("message too big", testMessageTooBig);
+  tor::fake_tor_wait_idle(5000);
+  tor::FAKE_Stats stats;
+  tor::fake_tor_stats(&stats);
+  CHECK_EQ(stats.live_strings, 0LL);
+  return margelo::nitro::nitrotor::test::result();
+}
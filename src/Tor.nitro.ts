@@ -1,26 +1,259 @@
-import type { HybridObject } from 'react-native-nitro-modules';
+import type { AnyMap, HybridObject } from 'react-native-nitro-modules';
 
-// Define a fixed-size byte array type that Nitro can understand
-type ByteArray64 = number[]; // This will be represented as std::array<uint8_t, 64> in C++
+// Expanded ed25519 secret key, must be exactly 64 bytes long
+type KeyData64 = ArrayBuffer;
+
+// 'json' parses the body natively into HttpResponse.json instead of returning it as a string
+export type ResponseType = 'text' | 'json';
+
+export type HttpMethod = 'GET' | 'POST' | 'PUT' | 'DELETE' | 'HEAD' | 'OPTIONS';
+
+// Failure classes a RetryPolicy can retry on
+export type RetryErrorClass = 'timeout' | 'connect' | 'circuit' | 'protocol';
+
+export interface RetryPolicy {
+  max_attempts: number; // Including the first attempt
+  backoff_ms: number; // Doubled after every retry, with jitter
+  max_backoff_ms?: number;
+  retry_on_status?: number[];
+  retry_on_errors?: RetryErrorClass[]; // Defaults to timeout, connect and circuit
+}
+
+// Requests are scheduled weighted-fair across classes, interactive first and bulk last
+export type PriorityClass = 'interactive' | 'normal' | 'bulk';
+
+// Byte rates are in bytes per second, 0 disables the respective limit
+export interface BandwidthLimits {
+  total_bytes_per_sec: number;
+  interactive_bytes_per_sec: number;
+  normal_bytes_per_sec: number;
+  bulk_bytes_per_sec: number;
+  max_concurrent_requests: number;
+}
+
+export interface ClassTrafficStats {
+  requests: number; // Completed attempts
+  queued: number;
+  in_flight: number;
+  bytes_sent: number;
+  bytes_received: number;
+  average_queue_ms: number;
+  throughput_bytes_per_sec: number; // Average over the last 10 seconds
+}
+
+export interface TrafficStats {
+  interactive: ClassTrafficStats;
+  normal: ClassTrafficStats;
+  bulk: ClassTrafficStats;
+}
+
+// Built-in request interceptors, run natively before a request is sent
+export type InterceptorKind = 'headers' | 'hmac_signature' | 'rewrite_url';
+
+export interface InterceptorConfig {
+  kind: InterceptorKind;
+  host?: string; // Only intercept requests to this host
+  headers?: string; // 'headers': JSON object of headers to set
+  secret?: string; // 'hmac_signature': HMAC-SHA256 key
+  signature_header?: string; // Defaults to 'X-Signature'
+  timestamp_header?: string; // Defaults to 'X-Timestamp'
+  from_prefix?: string; // 'rewrite_url': URL prefix to replace
+  to_prefix?: string;
+}
+
+export interface HttpClientConfig {
+  http2: boolean; // Offer h2 via ALPN on TLS connections
+  http2_prior_knowledge_onion: boolean; // Use h2 directly on plain http:// onion connections
+  max_concurrent_streams: number; // Per connection, 0 uses the server's limit
+  max_connections_per_host: number;
+  idle_timeout_ms: number;
+}
+
+export type WebSocketState = 'connecting' | 'open' | 'closing' | 'closed';
+
+export interface WebSocketParams {
+  url: string; // ws:// or wss://
+  headers: string; // Extra handshake headers as a JSON object
+  protocols?: string[];
+  permessage_deflate?: boolean; // Defaults to true
+  timeout_ms: number; // Stream setup and handshake
+  ping_interval_ms?: number; // Keepalive after this long without traffic, 0 disables it
+  pong_timeout_ms?: number;
+  max_message_bytes?: number; // Larger incoming messages close the socket with 1009
+  high_water_mark?: number; // send* returns false above this many buffered bytes
+}
+
+export interface WebSocketOpenInfo {
+  protocol: string;
+  extensions: string;
+}
+
+export interface ControlConnectParams {
+  control: string; // StartTorResponse.control: 'host:port' or 'unix:/path'
+  password?: string; // For HASHEDPASSWORD, otherwise NULL, SAFECOOKIE or COOKIE are used
+  cookie_path?: string; // Overrides the cookie file announced by Tor
+  timeout_ms: number; // Connect and authenticate
+  event_batch_ms?: number; // Coalesce events for this long before onEvents, defaults to 100
+  max_event_batch?: number; // Deliver earlier once this many events are queued, defaults to 256
+}
+
+export interface ControlReply {
+  status: number; // e.g. 250 for success
+  lines: string[]; // Reply lines without the status, data blocks joined with '\n'
+}
+
+export type ControlEventType = 'circ' | 'stream' | 'bw' | 'hs_desc';
+
+export interface ControlEvent {
+  type: ControlEventType;
+  id: string; // Circuit or stream id
+  status: string; // Circuit or stream status, HS_DESC action
+  circuit_id: string; // Circuit of a stream, the id itself for circuits
+  target: string; // Stream target, onion address of HS_DESC
+  path: string[]; // Circuit relays as $fingerprint~nickname, the HSDir of HS_DESC
+  bytes_read: number; // BW
+  bytes_written: number; // BW
+  arguments: Record<string, string>; // Remaining KEY=value pairs, e.g. PURPOSE or REASON
+}
+
+export type BridgeProbeStatus = 'pending' | 'reachable' | 'unreachable';
+
+// Unmanaged pluggable transport, reachable as a SOCKS5 proxy (obfs4proxy, snowflake-client, ...)
+export interface PluggableTransport {
+  protocols: string[]; // Transport names it serves, e.g. ['obfs4']
+  proxy_addr: string; // 'ip:port' of its SOCKS5 listener
+}
+
+export interface BridgeConfig {
+  bridges: string[]; // Bridge lines, with or without the leading 'Bridge' keyword
+  transports?: PluggableTransport[];
+  probe_timeout_ms?: number; // Per bridge, defaults to 10000
+  max_parallel_probes?: number; // Defaults to 16
+}
+
+export interface BridgeProbeResult {
+  bridge: string;
+  status: BridgeProbeStatus;
+  connect_ms: number; // Time to a TCP (or PT handshake) connection, 0 unless reachable
+  error: string;
+}
+
+// Caps on the memory of the Tor client, unset fields keep Tor's defaults
+export interface MemoryBudget {
+  total_bytes?: number; // Queued cells, stream buffers and caches together
+  dir_cache_bytes?: number; // In-memory consensus and microdescriptor caches
+  stream_buffer_bytes?: number; // Per stream
+  max_idle_circuits?: number;
+  max_idle_connections?: number;
+}
+
+// 'moderate' for Android's TRIM_MEMORY_RUNNING_LOW, 'critical' for RUNNING_CRITICAL and iOS
+// memory warnings
+export type TrimLevel = 'moderate' | 'critical';
+
+export interface MemoryUsage {
+  dir_cache_bytes: number;
+  circuit_bytes: number;
+  stream_buffer_bytes: number;
+  connection_bytes: number;
+  other_bytes: number;
+  native_bytes: number; // Held by the native module outside of Tor, e.g. shared transport rings
+  total_bytes: number;
+  open_circuits: number;
+  idle_circuits: number;
+  open_connections: number;
+}
+
+export interface ResolveResult {
+  hostname: string; // Normalized: lower case, no trailing dot
+  addresses: string[]; // IPv4 and IPv6, in the exit's order
+  ttl_s: number; // Remaining lifetime of the answer
+  cached: boolean;
+  error: string; // Empty on success
+}
+
+export interface TelemetryConfig {
+  sample_interval_ms?: number; // Defaults to 1000, at least 100
+  snapshot_interval_ms: number; // Rounded to a multiple of sample_interval_ms
+  ring_size?: number; // Samples kept for getTelemetrySamples, defaults to 600
+  max_hosts?: number; // Busiest hosts per snapshot, defaults to 10
+}
+
+// Rates over one sample interval. Bytes count all Tor traffic, not only httpRequest's
+export interface TelemetrySample {
+  timestamp_ms: number; // Unix time
+  read_bytes_per_sec: number;
+  written_bytes_per_sec: number;
+  open_circuits: number;
+  open_streams: number;
+  circuits_built: number; // Successful builds during the interval
+  circuit_build_ms: number; // Their mean build time, 0 without builds
+}
+
+// HTTP traffic to one host during a snapshot interval. Past 256 hosts per interval the rest are
+// summed up as '(other)'
+export interface HostThroughput {
+  host: string;
+  bytes_received: number;
+  bytes_sent: number;
+  requests: number;
+  bytes_per_sec: number; // Both directions
+}
+
+export interface TelemetrySnapshot {
+  samples: TelemetrySample[]; // Taken since the previous snapshot, oldest first
+  hosts: HostThroughput[]; // Most bytes first
+}
+
+export interface OnionKeyPair {
+  key_data: KeyData64; // Pass as HiddenServiceParams.key_data or StartTorParams.key_data
+  public_key: ArrayBuffer; // 32 bytes
+  onion_address: string; // With the '.onion' suffix
+}
+
+export interface VanitySearchParams {
+  prefix: string; // Start of the address, a-z and 2-7
+  count?: number; // Keys to find, defaults to 1
+  threads?: number; // Defaults to the number of cores minus one
+  progress_interval_ms?: number; // Defaults to 1000
+}
+
+export interface VanityProgress {
+  attempts: number;
+  attempts_per_sec: number;
+  elapsed_ms: number;
+  found: number;
+  expected_attempts: number; // On average, for all count keys: count * 32^prefix.length
+}
+
+export interface SharedTransportConfig {
+  socket_path: string; // Unix socket in a directory all processes can reach, e.g. an app group
+  ring_bytes?: number; // Shared memory per direction and connection, defaults to 4 MiB
+  connect_timeout_ms?: number; // connectSharedTransport only, defaults to 5000
+}
 
 export interface TorConfig {
   socks_port: number;
   data_dir: string;
   timeout_ms: number;
+  bridges?: BridgeConfig; // Probe bridges and bootstrap through the fastest reachable one
+  memory_budget?: MemoryBudget;
 }
 
 export interface HiddenServiceParams {
   port: number;
   target_port: number;
-  key_data?: ByteArray64; // Optional key data
+  key_data?: KeyData64; // Optional key data
 }
 
 export interface StartTorParams {
   data_dir: string;
-  key_data?: ByteArray64;
+  key_data?: KeyData64;
   socks_port: number;
   target_port: number;
   timeout_ms: number;
+  bridges?: BridgeConfig;
+  memory_budget?: MemoryBudget;
 }
 
 export interface StartTorResponse {
@@ -30,42 +263,179 @@ export interface StartTorResponse {
   error_message: string;
 }
 
+export interface ResumeResponse {
+  is_success: boolean;
+  resume_ms: number; // Total time spent in resume()
+  circuit_ready_ms: number; // Time until a circuit was usable again
+  error_message: string;
+}
+
+// Durations of the most recent successful transitions, 0 if there was none yet
+export interface LifecycleTimings {
+  is_dormant: boolean;
+  cold_start_ms: number;
+  suspend_ms: number;
+  resume_ms: number;
+  resume_circuit_ready_ms: number;
+}
+
+export interface CircuitBuildBucket {
+  lower_ms: number; // Builds taking at least this long, up to the next bucket's lower_ms
+  count: number;
+}
+
+// Build times are taken from the last 1000 successful circuits, counters since app start
+export interface CircuitBuildStats {
+  circuits: number;
+  failures: number;
+  p50_ms: number;
+  p80_ms: number;
+  p95_ms: number;
+  histogram: CircuitBuildBucket[];
+  tracked_relays: number; // Relays in the on-disk store
+  penalized_relays: number; // Relays currently weighted down for path selection
+}
+
 export interface HiddenServiceResponse {
   is_success: boolean;
   onion_address: string;
   control: string;
 }
 
+// 'multipart' is multipart/form-data, 'urlencoded' application/x-www-form-urlencoded
+export type FormEncoding = 'multipart' | 'urlencoded';
+
+// Exactly one of value, data and file_path
+export interface FormField {
+  name: string;
+  value?: string;
+  data?: ArrayBuffer;
+  file_path?: string; // Read while the request is sent, multipart only
+  filename?: string; // Defaults to the name of file_path, or 'blob' for data
+  content_type?: string; // Defaults to application/octet-stream for data and files
+}
+
+export interface FormBody {
+  encoding: FormEncoding;
+  fields: FormField[];
+}
+
+export interface HttpRequestParams {
+  method: HttpMethod;
+  url: string;
+  headers: string;
+  body?: string;
+  form?: FormBody; // Replaces body and sets Content-Type
+  timeout_ms: number;
+  decompress?: boolean;
+  response_type?: ResponseType;
+  retry?: RetryPolicy; // Every retry runs on a fresh circuit
+  hedge_after_ms?: number; // Race a duplicate on a second circuit after this long
+  adaptive_timeout?: boolean; // Learn per host timeouts, timeout_ms becomes the upper bound
+  priority?: PriorityClass; // Defaults to 'normal'
+}
+
 export interface HttpGetParams {
   url: string;
   headers: string;
   timeout_ms: number;
+  decompress?: boolean; // Negotiate gzip/br/zstd and decode natively
+  response_type?: ResponseType;
+  retry?: RetryPolicy;
+  hedge_after_ms?: number;
+  adaptive_timeout?: boolean;
+  priority?: PriorityClass;
 }
 
 export interface HttpPostParams {
   url: string;
-  body: string;
+  body?: string;
+  form?: FormBody; // Replaces body and sets Content-Type
   headers: string;
   timeout_ms: number;
+  decompress?: boolean;
+  response_type?: ResponseType;
+  retry?: RetryPolicy;
+  hedge_after_ms?: number;
+  adaptive_timeout?: boolean;
+  priority?: PriorityClass;
 }
 
 export interface HttpPutParams {
   url: string;
-  body: string;
+  body?: string;
+  form?: FormBody; // Replaces body and sets Content-Type
   headers: string;
   timeout_ms: number;
+  decompress?: boolean;
+  response_type?: ResponseType;
+  retry?: RetryPolicy;
+  hedge_after_ms?: number;
+  adaptive_timeout?: boolean;
+  priority?: PriorityClass;
 }
 
 export interface HttpDeleteParams {
   url: string;
   headers: string;
   timeout_ms: number;
+  decompress?: boolean;
+  response_type?: ResponseType;
+  retry?: RetryPolicy;
+  hedge_after_ms?: number;
+  adaptive_timeout?: boolean;
+  priority?: PriorityClass;
 }
 
 export interface HttpResponse {
   status_code: number;
   body: string;
   error: string;
+  compressed_bytes: number; // Body size on the wire
+  decompressed_bytes: number; // Body size after content decoding
+  json?: AnyMap; // Parsed body when response_type is 'json'
+  attempts: number; // Attempts started, including retries and hedges
+  http_version: string; // '1.0', '1.1' or '2', empty if no response arrived
+  reused_connection: boolean; // Ran on an already open connection, no new Tor stream
+}
+
+export interface TorWebSocket
+  extends HybridObject<{ ios: 'c++'; android: 'c++' }> {
+  readonly state: WebSocketState;
+  readonly bufferedAmount: number; // Bytes queued by send* and not yet written
+
+  onText: (message: string) => void;
+  onBinary: (data: ArrayBuffer) => void;
+  onDrain: () => void; // All buffered data was written
+  onClose: (code: number, reason: string) => void;
+
+  // Open the connection, callbacks should be set before
+  connect(params: WebSocketParams): Promise<WebSocketOpenInfo>;
+
+  // Queue a message, returns false once bufferedAmount exceeds high_water_mark
+  sendText(message: string): boolean;
+  sendBinary(data: ArrayBuffer): boolean;
+
+  close(code: number, reason: string): void;
+}
+
+export interface TorControl
+  extends HybridObject<{ ios: 'c++'; android: 'c++' }> {
+  readonly connected: boolean;
+
+  onEvents: (events: ControlEvent[]) => void; // Subscribed events in batches
+  onClose: (error: string) => void; // Empty after close()
+
+  // Connect and authenticate, callbacks should be set before
+  connect(params: ControlConnectParams): Promise<void>;
+
+  // Write all commands at once, resolves with their replies in order
+  sendCommands(commands: string[]): Promise<ControlReply[]>;
+
+  // Replace the event subscription, an empty list ends it
+  subscribe(events: ControlEventType[]): Promise<void>;
+
+  close(): void;
 }
 
 export interface Tor extends HybridObject<{ ios: 'c++'; android: 'c++' }> {
@@ -80,6 +450,12 @@ export interface Tor extends HybridObject<{ ios: 'c++'; android: 'c++' }> {
   // Start the Tor daemon with hidden service and control port
   startTorIfNotRunning(params: StartTorParams): Promise<StartTorResponse>;
 
+  // Probe bridges concurrently without changing the Tor configuration
+  probeBridges(config: BridgeConfig): Promise<BridgeProbeResult[]>;
+
+  // Results of the last bridge probe, including one still running
+  getBridgeProbeResults(): BridgeProbeResult[];
+
   // Get the current service status
   getServiceStatus(): Promise<number>;
 
@@ -89,6 +465,104 @@ export interface Tor extends HybridObject<{ ios: 'c++'; android: 'c++' }> {
   // Shutdown the Tor service
   shutdownService(): Promise<boolean>;
 
+  // Enter dormant mode: keep guard and consensus state, stop building circuits and padding
+  suspend(): Promise<boolean>;
+
+  // Leave dormant mode, resolves once a circuit is usable again
+  resume(timeout_ms: number): Promise<ResumeResponse>;
+
+  // Timings of the last cold start, suspend and resume
+  getLifecycleTimings(): LifecycleTimings;
+
+  // Release memory on an OS memory warning, resolves with the usage afterwards
+  trimMemory(level: TrimLevel): Promise<MemoryUsage>;
+
+  // Current memory use by subsystem
+  getMemoryUsage(): MemoryUsage;
+
+  // Circuit build time distribution and the state of the relay performance store
+  getCircuitBuildStats(): CircuitBuildStats;
+
+  // Resolve a clearnet host name at an exit, answers are cached for their TTL and shared with the
+  // HTTP calls
+  resolve(hostname: string, timeout_ms: number): Promise<ResolveResult>;
+
+  // Resolve several host names concurrently, results are in the order of hostnames
+  resolveBatch(
+    hostnames: string[],
+    timeout_ms: number
+  ): Promise<ResolveResult[]>;
+
+  // Forget all cached DNS answers
+  clearDnsCache(): void;
+
+  // Sample bandwidth, circuits and streams on a background thread, onSnapshot is called once per
+  // snapshot interval. Calling it again restarts sampling with the new config
+  startTelemetry(
+    config: TelemetryConfig,
+    onSnapshot: (snapshot: TelemetrySnapshot) => void
+  ): void;
+
+  // Stop sampling, the samples taken so far stay available
+  stopTelemetry(): void;
+
+  // Samples in the ring, oldest first
+  getTelemetrySamples(): TelemetrySample[];
+
+  // Generate random onion service keys on a background thread
+  generateKeys(count: number): Promise<OnionKeyPair[]>;
+
+  // Onion address of a 64 byte expanded key, throws for anything else
+  deriveOnionAddress(key_data: KeyData64): string;
+
+  // Search for keys whose address starts with params.prefix on several threads. Every character
+  // multiplies the expected time by 32
+  findVanityKeys(
+    params: VanitySearchParams,
+    onProgress: (progress: VanityProgress) => void
+  ): Promise<OnionKeyPair[]>;
+
+  // Stop the running search, findVanityKeys resolves with the keys found so far
+  cancelVanitySearch(): void;
+
+  // Generic HTTP request, the method specific calls below are shorthands for it
+  httpRequest(params: HttpRequestParams): Promise<HttpResponse>;
+
+  // Limit bandwidth and concurrency of HTTP traffic, per priority class and in total
+  setBandwidthLimits(limits: BandwidthLimits): void;
+
+  // Per priority class traffic counters
+  getTrafficStats(): TrafficStats;
+
+  // Add a request interceptor, returns an id for removeInterceptor
+  addInterceptor(config: InterceptorConfig): number;
+
+  // Remove a previously added interceptor
+  removeInterceptor(id: number): boolean;
+
+  // Remove all interceptors
+  clearInterceptors(): void;
+
+  // Configure HTTP/2 and the connection pool used by all HTTP requests
+  configureHttpClient(config: HttpClientConfig): boolean;
+
+  // Let other processes of the app use this process's Tor client for HTTP
+  startSharedTransport(config: SharedTransportConfig): void;
+
+  stopSharedTransport(): void;
+
+  // Send HTTP requests through the Tor client of the process that called startSharedTransport
+  connectSharedTransport(config: SharedTransportConfig): Promise<void>;
+
+  // Send HTTP requests through this process's own Tor client again
+  disconnectSharedTransport(): void;
+
+  // Create a WebSocket client that connects through Tor
+  createWebSocket(): TorWebSocket;
+
+  // Create a client for the control port of StartTorResponse.control
+  createControlClient(): TorControl;
+
   // Http GET
   httpGet(params: HttpGetParams): Promise<HttpResponse>;
 